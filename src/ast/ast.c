@@ -1,4 +1,81 @@
 #include "ast.h"
+#include "astparse.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_BLOCK_SIZE (32 * 1024)
+#define ARENA_ALIGN 8
+#define ARENA_ROUND(size) (((size) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+
+_Thread_local bool quietCompile = false;
+
+// Arrays in the tree are grown within the current parse's arena, the old
+// buffer is left behind and goes when the arena does
+#define GROW_NODE_ARRAY(type, pointer, oldCount, newCount) \
+    (type*)arenaReallocate(&parser.arena, pointer, sizeof(type) * (oldCount), \
+        sizeof(type) * (newCount))
+
+static ArenaBlock *newArenaBlock(size_t size) {
+    ArenaBlock *block = reallocate(NULL, 0, sizeof(ArenaBlock) + size);
+    block->size = size;
+    block->used = 0;
+    block->next = NULL;
+    return block;
+}
+
+void *arenaAllocate(Arena *arena, size_t size) {
+    size = ARENA_ROUND(size);
+    ArenaBlock *block = arena->blocks;
+    if (block == NULL || block->used + size > block->size) {
+        // Big allocations get a block of their own, slotted in behind the
+        // current one so the space left in it isn't wasted
+        if (block != NULL && size > ARENA_BLOCK_SIZE / 4) {
+            ArenaBlock *big = newArenaBlock(size);
+            big->used = size;
+            big->next = block->next;
+            block->next = big;
+            return big->data;
+        }
+
+        block = newArenaBlock(size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE);
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+
+    void *result = block->data + block->used;
+    block->used += size;
+    return result;
+}
+
+void *arenaReallocate(Arena *arena, void *pointer, size_t oldSize, size_t newSize) {
+    if (newSize <= oldSize) return newSize == 0 ? NULL : pointer;
+
+    // The most recent allocation can be grown in place
+    ArenaBlock *block = arena->blocks;
+    size_t oldRounded = ARENA_ROUND(oldSize);
+    size_t newRounded = ARENA_ROUND(newSize);
+    if (pointer != NULL && block != NULL &&
+        (char *) pointer + oldRounded == block->data + block->used &&
+        block->used - oldRounded + newRounded <= block->size) {
+        block->used += newRounded - oldRounded;
+        return pointer;
+    }
+
+    void *result = arenaAllocate(arena, newSize);
+    if (oldSize > 0) memcpy(result, pointer, oldSize);
+    return result;
+}
+
+void freeArena(Arena *arena) {
+    ArenaBlock *block = arena->blocks;
+    while (block != NULL) {
+        ArenaBlock *next = block->next;
+        reallocate(block, sizeof(ArenaBlock) + block->size, 0);
+        block = next;
+    }
+    arena->blocks = NULL;
+}
 
 
 void initTypeNodeArray(TypeNodeArray* typeNodeArray) {
@@ -11,7 +88,7 @@ void writeTypeNodeArray(TypeNodeArray * typeNodeArray, TypeNode* typeNode) {
     if (typeNodeArray->capacity < typeNodeArray->count + 1) {
         int oldCapacity = typeNodeArray->capacity;
         typeNodeArray->capacity = GROW_CAPACITY(oldCapacity);
-        typeNodeArray->typeNodes = GROW_ARRAY(TypeNode*, typeNodeArray->typeNodes,
+        typeNodeArray->typeNodes = GROW_NODE_ARRAY(TypeNode*, typeNodeArray->typeNodes,
                                        oldCapacity, typeNodeArray->capacity);
     }
 
@@ -20,7 +97,6 @@ void writeTypeNodeArray(TypeNodeArray * typeNodeArray, TypeNode* typeNode) {
 }
 
 void freeTypeNodeArray(TypeNodeArray * typeNodeArray) {
-    FREE_ARRAY(TypeNode*, typeNodeArray->typeNodes, typeNodeArray->capacity);
     initTypeNodeArray(typeNodeArray);
 }
 
@@ -35,7 +111,7 @@ void writeExprArray(ExprArray * exprArray, Expr* expr) {
     if (exprArray->capacity < exprArray->count + 1) {
         int oldCapacity = exprArray->capacity;
         exprArray->capacity = GROW_CAPACITY(oldCapacity);
-        exprArray->exprs = GROW_ARRAY(Expr*, exprArray->exprs,
+        exprArray->exprs = GROW_NODE_ARRAY(Expr*, exprArray->exprs,
                                        oldCapacity, exprArray->capacity);
     }
 
@@ -44,7 +120,6 @@ void writeExprArray(ExprArray * exprArray, Expr* expr) {
 }
 
 void freeExprArray(ExprArray * exprArray) {
-    FREE_ARRAY(Expr*, exprArray->exprs, exprArray->capacity);
     initExprArray(exprArray);
 }
 
@@ -59,7 +134,7 @@ void writeStmtArray(StmtArray * stmtArray, Stmt* stmt) {
     if (stmtArray->capacity < stmtArray->count + 1) {
         int oldCapacity = stmtArray->capacity;
         stmtArray->capacity = GROW_CAPACITY(oldCapacity);
-        stmtArray->stmts = GROW_ARRAY(Stmt*, stmtArray->stmts,
+        stmtArray->stmts = GROW_NODE_ARRAY(Stmt*, stmtArray->stmts,
                                        oldCapacity, stmtArray->capacity);
     }
 
@@ -68,7 +143,6 @@ void writeStmtArray(StmtArray * stmtArray, Stmt* stmt) {
 }
 
 void freeStmtArray(StmtArray * stmtArray) {
-    FREE_ARRAY(Stmt*, stmtArray->stmts, stmtArray->capacity);
     initStmtArray(stmtArray);
 }
 
@@ -83,7 +157,7 @@ void writeParameterArray(ParameterArray * parameterArray, Parameter* parameter)
     if (parameterArray->capacity < parameterArray->count + 1) {
         int oldCapacity = parameterArray->capacity;
         parameterArray->capacity = GROW_CAPACITY(oldCapacity);
-        parameterArray->parameters = GROW_ARRAY(Parameter*, parameterArray->parameters,
+        parameterArray->parameters = GROW_NODE_ARRAY(Parameter*, parameterArray->parameters,
                                        oldCapacity, parameterArray->capacity);
     }
 
@@ -92,7 +166,6 @@ void writeParameterArray(ParameterArray * parameterArray, Parameter* parameter)
 }
 
 void freeParameterArray(ParameterArray * parameterArray) {
-    FREE_ARRAY(Parameter*, parameterArray->parameters, parameterArray->capacity);
     initParameterArray(parameterArray);
 }
 
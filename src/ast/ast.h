@@ -34,6 +34,7 @@ typedef enum {
     NODE_LOGICAL,
     NODE_CALL,
     NODE_GETITEM,
+    NODE_SETITEM,
     NODE_GET,
     NODE_SET,
     NODE_SUPER,
@@ -50,8 +51,11 @@ typedef enum {
     NODE_IF,
     NODE_WHILE,
     NODE_FOR,
+    NODE_FOR_IN,
     NODE_BREAK,
     NODE_RETURN,
+    NODE_TRY,
+    NODE_THROW,
     NODE_IMPORT,
     NODE_ENUM,
     NODE_ENUMITEM,
@@ -64,12 +68,32 @@ typedef enum {
 typedef struct {
     NodeType type;
     int lineno;
-    bool isMarked;
-    struct Node *next;
 } Node;
 
 Node *allocateNode(size_t size, NodeType type);
 
+// A tree is only needed until its module is compiled, so its nodes and the
+// arrays hanging off them are bump allocated and released in one go
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *blocks;
+} Arena;
+
+void *arenaAllocate(Arena *arena, size_t size);
+void *arenaReallocate(Arena *arena, void *pointer, size_t oldSize, size_t newSize);
+void freeArena(Arena *arena);
+
+// Set on threads compiling modules ahead of time, the parser and compiler
+// then keep errors and listings to themselves. The import that runs the
+// module compiles it again and reports them.
+extern _Thread_local bool quietCompile;
+
 typedef struct {
     Node self;
 } TypeNode;
@@ -231,6 +255,14 @@ struct Get {
     Token name;
 };
 
+struct SetItem {
+    Expr self;
+    Expr* object;
+    Token bracket;
+    Expr* index;
+    Expr* value;
+};
+
 struct Set {
     Expr self;
     Expr* object;
@@ -332,6 +364,13 @@ struct For {
     Stmt* body;
 };
 
+struct ForIn {
+    Stmt self;
+    Token name;
+    Expr* iterable;
+    Stmt* body;
+};
+
 struct Break {
     Stmt self;
     Token keyword;
@@ -343,6 +382,21 @@ struct Return {
     Expr* value;
 };
 
+// The catch block runs with name bound to what try's body threw
+struct Try {
+    Stmt self;
+    Stmt* body;
+    Token name;
+    TypeNode *type;
+    Stmt* handler;
+};
+
+struct Throw {
+    Stmt self;
+    Token keyword;
+    Expr* value;
+};
+
 struct Import {
     Stmt self;
     Expr* expression;
@@ -1,17 +1,37 @@
 #include "astcompile.h"
 
+#include <stdio.h>
+
 #include <printf.h>
 #include "astprint.h"
+#include "astoptimize.h"
 #include "../debug.h"
+#include "../memory.h"
+#include "../output.h"
+#include "../peephole.h"
+#include "../libc/module.h"
+
+// What a value is known to be before the program runs
+typedef enum {
+    KIND_UNKNOWN,
+    KIND_NUMBER,
+    KIND_STRING,
+    KIND_BOOL,
+    KIND_LIST,
+} ValueKind;
 
 typedef struct {
     Token name;
     int depth;
     bool isCaptured;
+    // Holds this kind for its whole life, see declaredKind()
+    ValueKind kind;
+    // Holds a lambda that reads this frame's locals, see callsInPlace()
+    bool inPlace;
 } Local;
 
 typedef struct {
-    uint8_t index;
+    uint16_t index;
     bool isLocal;
 } Upvalue;
 
@@ -20,10 +40,17 @@ typedef struct Compiler {
     struct Compiler *enclosing;
     ObjFunction *function;
     FunctionType type;
-    Local locals[UINT8_COUNT];
+    Local *locals;
     int localCount;
+    int localCapacity;
     Upvalue upvalues[UINT8_COUNT];
     int scopeDepth;
+    // Only ever called by the enclosing function's own frame, so it reads
+    // that frame's locals in place instead of capturing them, see
+    // callsInPlace()
+    bool calledInPlace;
+    // How many try blocks the code being compiled is in
+    int tryDepth;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -31,17 +58,26 @@ typedef struct ClassCompiler {
     bool hasSuperclass;
 } ClassCompiler;
 
-ClassCompiler *currentClass = NULL;
-Compiler *current = NULL;
-bool exprContext = false;
-bool lastInBody = false;
+_Thread_local ClassCompiler *currentClass = NULL;
+_Thread_local Compiler *current = NULL;
+// The module whose global slots the script is compiled against
+_Thread_local ObjModule *compilingModule = NULL;
+_Thread_local bool exprContext = false;
+_Thread_local bool lastInBody = false;
+// The rest of the scope a local declared by laterOwner lives in
+_Thread_local Node *laterOwner = NULL;
+_Thread_local Node **laterNodes = NULL;
+_Thread_local int laterCount = 0;
+// The lambda the local being declared is initialized with, when that
+// local is only ever called
+_Thread_local Node *inPlaceLambda = NULL;
 
 static Chunk *currentChunk() {
     return &current->function->chunk;
 }
 
-bool panicMode = false;
-bool hadError = false;
+_Thread_local bool panicMode = false;
+_Thread_local bool hadError = false;
 
 static Token syntheticToken(const char *text) {
     Token token;
@@ -53,6 +89,8 @@ static Token syntheticToken(const char *text) {
 static void errorAt(Token *token, const char *message) {
     if (panicMode) return;
     panicMode = true;
+    hadError = true;
+    if (quietCompile) return;
     fprintf(stderr, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF) {
@@ -64,7 +102,6 @@ static void errorAt(Token *token, const char *message) {
     }
 
     fprintf(stderr, ": %s\n", message);
-    hadError = true;
 }
 
 static void error(const char *message) {
@@ -73,8 +110,11 @@ static void error(const char *message) {
 }
 
 
-static void emitByte(uint8_t byte) { // TODO: Real lineno
-    writeChunk(currentChunk(), byte, 1);
+// The line of the innermost node being compiled
+static _Thread_local int currentLine = 1;
+
+static void emitByte(uint8_t byte) {
+    writeChunk(currentChunk(), byte, currentLine);
 }
 
 static void emitBytes(uint8_t byte1, uint8_t byte2) {
@@ -82,6 +122,25 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
     emitByte(byte2);
 }
 
+static void emitShort(int value) {
+    emitBytes((value >> 8) & 0xff, value & 0xff);
+}
+
+// For the instructions whose operand is a constant, always two bytes wide
+static void emitConstantOp(uint8_t op, int constant) {
+    emitByte(op);
+    emitShort(constant);
+}
+
+// Gives the property instruction just emitted its own inline cache
+static void emitCache() {
+    int cache = addInlineCache(currentChunk());
+    if (cache > UINT16_MAX) {
+        error("Too many property accesses in one chunk.");
+    }
+    emitShort(cache);
+}
+
 static void emitReturn() {
     if (current->type == TYPE_INITIALIZER) {
         emitBytes(OP_GET_LOCAL, 0);
@@ -106,8 +165,10 @@ static void emitLoop(int loopStart) {
 static ObjFunction *endCompiler() {
     emitReturn();
     ObjFunction *function = current->function;
+    if (!hadError) optimizeChunk(currentChunk());
+    FREE_ARRAY(Local, current->locals, current->localCapacity);
 #ifdef DEBUG_PRINT_CODE
-    if (!hadError) {
+    if (!hadError && !quietCompile) {
         disassembleChunk(currentChunk(), function->name != NULL
                                          ? function->name->chars : "<script>");
     }
@@ -118,18 +179,23 @@ static ObjFunction *endCompiler() {
 }
 
 
-static uint8_t makeConstant(Value value) {
+static int makeConstant(Value value) {
     int constant = addConstant(currentChunk(), value);
-    if (constant > UINT8_MAX) {
+    if (constant > UINT16_MAX) {
         error("Too many constants in one chunk.");
         return 0;
     }
 
-    return (uint8_t) constant;
+    return constant;
 }
 
 static void emitConstant(Value value) {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    int constant = makeConstant(value);
+    if (constant <= UINT8_MAX) {
+        emitBytes(OP_CONSTANT, constant);
+    } else {
+        emitConstantOp(OP_CONSTANT_LONG, constant);
+    }
 }
 
 static int emitJump(uint8_t instruction) {
@@ -151,22 +217,44 @@ static void patchJump(int offset) {
     currentChunk()->code[offset + 1] = jump & 0xff;
 }
 
+// Makes room for one more local in compiler, counting it towards the slots
+// its function's frames need
+static Local *pushLocal(Compiler *compiler) {
+    if (compiler->localCount == compiler->localCapacity) {
+        int oldCapacity = compiler->localCapacity;
+        compiler->localCapacity = GROW_CAPACITY(oldCapacity);
+        compiler->locals = GROW_ARRAY(Local, compiler->locals, oldCapacity, compiler->localCapacity);
+    }
+    Local *local = &compiler->locals[compiler->localCount++];
+    if (compiler->localCount > compiler->function->maxSlots) {
+        compiler->function->maxSlots = compiler->localCount;
+    }
+    return local;
+}
+
 static void initCompiler(Compiler *compiler, FunctionType type, Token *name) {
     compiler->enclosing = current;
     compiler->function = NULL;
     compiler->type = type;
+    compiler->locals = NULL;
     compiler->localCount = 0;
+    compiler->localCapacity = 0;
     compiler->function = newFunction();
+    compiler->function->module = compilingModule;
     compiler->scopeDepth = 0;
+    compiler->calledInPlace = false;
+    compiler->tryDepth = 0;
     current = compiler;
     if (type != TYPE_SCRIPT) {
         current->function->name = copyString(name->start,
                                              name->length);
     }
 
-    Local *local = &current->locals[current->localCount++];
+    Local *local = pushLocal(current);
     local->depth = 0;
     local->isCaptured = false;
+    local->kind = KIND_UNKNOWN;
+    local->inPlace = false;
     if (type != TYPE_FUNCTION) {
         local->name.start = "this";
         local->name.length = 4;
@@ -195,7 +283,7 @@ static int resolveLocal(Compiler *compiler, Token *name) {
     return -1;
 }
 
-static int addUpvalue(Compiler *compiler, uint8_t index,
+static int addUpvalue(Compiler *compiler, uint16_t index,
                       bool isLocal) {
     int upvalueCount = compiler->function->upvalueCount;
 
@@ -222,29 +310,37 @@ static int resolveUpvalue(Compiler *compiler, Token *name) {
     int local = resolveLocal(compiler->enclosing, name);
     if (local != -1) {
         compiler->enclosing->locals[local].isCaptured = true;
-        return addUpvalue(compiler, (uint8_t) local, true);
+        return addUpvalue(compiler, (uint16_t) local, true);
     }
 
     int upvalue = resolveUpvalue(compiler->enclosing, name);
     if (upvalue != -1) {
-        return addUpvalue(compiler, (uint8_t) upvalue, false);
+        return addUpvalue(compiler, (uint16_t) upvalue, false);
     }
 
 
     return -1;
 }
 
+// A local of the enclosing function that compiler's body can read from
+// its caller's frame
+static int resolveEnclosing(Compiler *compiler, Token *name) {
+    if (!compiler->calledInPlace) return -1;
+    return resolveLocal(compiler->enclosing, name);
+}
 
 static void addLocal(Token name) {
-    if (current->localCount == UINT8_COUNT) {
+    if (current->localCount == UINT16_COUNT) {
         error("Too many local variables in function.");
         return;
     }
 
-    Local *local = &current->locals[current->localCount++];
+    Local *local = pushLocal(current);
     local->name = name;
     local->depth = -1;
     local->isCaptured = false;
+    local->kind = KIND_UNKNOWN;
+    local->inPlace = false;
 }
 
 static void declareVariable(Token *name) {
@@ -270,16 +366,25 @@ static void markInitialized() {
             current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
+static void emitGlobal(OpCode op, ObjString *name) {
+    int slot = moduleGlobalSlot(compilingModule, name);
+    if (slot > UINT16_MAX) {
+        error("Too many global variables in one module.");
+    }
+    emitByte(op);
+    emitShort(slot);
+}
+
+static void defineVariable(int global) {
     if (current->scopeDepth > 0) {
         markInitialized();
         return;
     }
 
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitGlobal(OP_DEFINE_GLOBAL_SLOT, AS_STRING(currentChunk()->constants.values[global]));
 }
 
-uint8_t identifierConstant(Token *name) {
+int identifierConstant(Token *name) {
     return makeConstant(OBJ_VAL(copyString(name->start,
                                            name->length)));
 }
@@ -289,13 +394,22 @@ static void getVariable(Token name) {
     int arg = resolveLocal(current, &name);
     if (arg != -1) {
         getOp = OP_GET_LOCAL;
+    } else if ((arg = resolveEnclosing(current, &name)) != -1) {
+        emitByte(OP_GET_ENCLOSING);
+        emitShort(arg);
+        return;
     } else if ((arg = resolveUpvalue(current, &name)) != -1) {
         getOp = OP_GET_UPVALUE;
     } else {
-        arg = identifierConstant(&name);
-        getOp = OP_GET_GLOBAL;
+        emitGlobal(OP_GET_GLOBAL_SLOT, copyString(name.start, name.length));
+        return;
     }
 
+    if (getOp == OP_GET_LOCAL && arg > UINT8_MAX) {
+        emitByte(OP_GET_LOCAL_LONG);
+        emitShort(arg);
+        return;
+    }
     emitBytes(getOp, (uint8_t) arg);
 }
 
@@ -304,16 +418,410 @@ static void setVariable(Token name, bool canAssign) {
     int arg = resolveLocal(current, &name);
     if (arg != -1) {
         setOp = OP_SET_LOCAL;
+    } else if ((arg = resolveEnclosing(current, &name)) != -1) {
+        emitByte(OP_SET_ENCLOSING);
+        emitShort(arg);
+        return;
     } else if ((arg = resolveUpvalue(current, &name)) != -1) {
         setOp = OP_SET_UPVALUE;
     } else {
-        arg = identifierConstant(&name);
-        setOp = OP_SET_GLOBAL;
+        emitGlobal(OP_SET_GLOBAL_SLOT, copyString(name.start, name.length));
+        return;
     }
 
+    if (setOp == OP_SET_LOCAL && arg > UINT8_MAX) {
+        emitByte(OP_SET_LOCAL_LONG);
+        emitShort(arg);
+        return;
+    }
     emitBytes(setOp, (uint8_t) arg);
 }
 
+static ValueKind localKind(Token *name) {
+    for (int i = current->localCount - 1; i >= 0; i--) {
+        Local *local = &current->locals[i];
+        if (identifiersEqual(name, &local->name)) {
+            return local->depth == -1 ? KIND_UNKNOWN : local->kind;
+        }
+    }
+    return KIND_UNKNOWN;
+}
+
+// The kind expr always evaluates to, if it doesn't fail. With a name, the
+// variable called that is assumed to hold assumed and every other variable is
+// unknown, otherwise locals are looked up in the current scope.
+static ValueKind kindOf(Expr *expr, Token *name, ValueKind assumed) {
+    if (expr == NULL) return KIND_UNKNOWN;
+
+    switch (expr->self.type) {
+        case NODE_LITERAL: {
+            Value value = ((struct Literal *) expr)->value;
+            if (IS_NUMBER(value)) return KIND_NUMBER;
+            if (IS_STRING(value)) return KIND_STRING;
+            if (IS_BOOL(value)) return KIND_BOOL;
+            return KIND_UNKNOWN;
+        }
+        case NODE_GROUPING:
+            return kindOf(((struct Grouping *) expr)->expression, name, assumed);
+        case NODE_UNARY:
+            return ((struct Unary *) expr)->operator.type == TOKEN_MINUS ? KIND_NUMBER : KIND_BOOL;
+        case NODE_BINARY: {
+            struct Binary *casted = (struct Binary *) expr;
+            switch (casted->operator.type) {
+                case TOKEN_PLUS: {
+                    ValueKind left = kindOf(casted->left, name, assumed);
+                    ValueKind right = kindOf(casted->right, name, assumed);
+                    return left == right && (left == KIND_NUMBER || left == KIND_STRING) ? left : KIND_UNKNOWN;
+                }
+                case TOKEN_MINUS:
+                case TOKEN_STAR:
+                case TOKEN_SLASH:
+                case TOKEN_MODULO:
+                    return KIND_NUMBER;
+                case TOKEN_EQUAL_EQUAL:
+                case TOKEN_BANG_EQUAL:
+                case TOKEN_GREATER:
+                case TOKEN_GREATER_EQUAL:
+                case TOKEN_LESS:
+                case TOKEN_LESS_EQUAL:
+                    return KIND_BOOL;
+                default:
+                    return KIND_UNKNOWN;
+            }
+        }
+        case NODE_VARIABLE: {
+            Token *variable = &((struct Variable *) expr)->name;
+            if (name == NULL) return localKind(variable);
+            return identifiersEqual(variable, name) ? assumed : KIND_UNKNOWN;
+        }
+        case NODE_ASSIGN:
+            return kindOf(((struct Assign *) expr)->value, name, assumed);
+        case NODE_ALTASSIGN:
+            return KIND_NUMBER;
+        case NODE_LIST:
+            return KIND_LIST;
+        default:
+            return KIND_UNKNOWN;
+    }
+}
+
+static bool keepsKind(Node *node, Token *name, ValueKind kind);
+
+static bool stmtsKeepKind(StmtArray *stmts, Token *name, ValueKind kind) {
+    for (int i = 0; i < stmts->count; i++) {
+        if (!keepsKind((Node *) stmts->stmts[i], name, kind)) return false;
+    }
+    return true;
+}
+
+static bool exprsKeepKind(ExprArray *exprs, Token *name, ValueKind kind) {
+    for (int i = 0; i < exprs->count; i++) {
+        if (!keepsKind((Node *) exprs->exprs[i], name, kind)) return false;
+    }
+    return true;
+}
+
+// False if anything under node may store a value of another kind in a
+// variable called name. Shadowing variables count too, which only makes the
+// answer more cautious.
+static bool keepsKind(Node *node, Token *name, ValueKind kind) {
+    if (node == NULL) return true;
+
+    switch (node->type) {
+        case NODE_BINARY:
+        case NODE_LOGICAL: {
+            struct Binary *casted = (struct Binary *) node;
+            return keepsKind((Node *) casted->left, name, kind) &&
+                   keepsKind((Node *) casted->right, name, kind);
+        }
+        case NODE_GROUPING:
+            return keepsKind((Node *) ((struct Grouping *) node)->expression, name, kind);
+        case NODE_UNARY:
+            return keepsKind((Node *) ((struct Unary *) node)->right, name, kind);
+        case NODE_ASSIGN: {
+            struct Assign *casted = (struct Assign *) node;
+            if (identifiersEqual(&casted->name, name) && kindOf(casted->value, name, kind) != kind) {
+                return false;
+            }
+            return keepsKind((Node *) casted->value, name, kind);
+        }
+        case NODE_ALTASSIGN: {
+            struct AltAssign *casted = (struct AltAssign *) node;
+            if (identifiersEqual(&casted->name, name) && kind != KIND_NUMBER) return false;
+            return keepsKind((Node *) casted->value, name, kind);
+        }
+        case NODE_CALL: {
+            struct Call *casted = (struct Call *) node;
+            return keepsKind((Node *) casted->callee, name, kind) &&
+                   exprsKeepKind(&casted->arguments, name, kind);
+        }
+        case NODE_GETITEM: {
+            struct GetItem *casted = (struct GetItem *) node;
+            return keepsKind((Node *) casted->object, name, kind) &&
+                   keepsKind((Node *) casted->index, name, kind);
+        }
+        case NODE_SETITEM: {
+            struct SetItem *casted = (struct SetItem *) node;
+            return keepsKind((Node *) casted->object, name, kind) &&
+                   keepsKind((Node *) casted->index, name, kind) &&
+                   keepsKind((Node *) casted->value, name, kind);
+        }
+        case NODE_GET:
+            return keepsKind((Node *) ((struct Get *) node)->object, name, kind);
+        case NODE_SET: {
+            struct Set *casted = (struct Set *) node;
+            return keepsKind((Node *) casted->object, name, kind) &&
+                   keepsKind((Node *) casted->value, name, kind);
+        }
+        case NODE_YIELD:
+            return keepsKind((Node *) ((struct Yield *) node)->expression, name, kind);
+        case NODE_LAMBDA:
+            return stmtsKeepKind(&((struct Lambda *) node)->body, name, kind);
+        case NODE_LIST:
+            return exprsKeepKind(&((struct List *) node)->items, name, kind);
+        case NODE_MAP: {
+            struct Map *casted = (struct Map *) node;
+            return exprsKeepKind(&casted->keys, name, kind) &&
+                   exprsKeepKind(&casted->values, name, kind);
+        }
+        case NODE_EXPRESSION:
+            return keepsKind((Node *) ((struct Expression *) node)->expression, name, kind);
+        case NODE_VAR:
+            return keepsKind((Node *) ((struct Var *) node)->initializer, name, kind);
+        case NODE_BLOCK:
+            return stmtsKeepKind(&((struct Block *) node)->statements, name, kind);
+        case NODE_FUNCTION:
+            return stmtsKeepKind(&((struct Function *) node)->body, name, kind);
+        case NODE_CLASS:
+            return stmtsKeepKind(&((struct Class *) node)->body, name, kind);
+        case NODE_IF: {
+            struct If *casted = (struct If *) node;
+            return keepsKind((Node *) casted->condition, name, kind) &&
+                   keepsKind((Node *) casted->thenBranch, name, kind) &&
+                   keepsKind((Node *) casted->elseBranch, name, kind);
+        }
+        case NODE_WHILE: {
+            struct While *casted = (struct While *) node;
+            return keepsKind((Node *) casted->condition, name, kind) &&
+                   keepsKind((Node *) casted->body, name, kind);
+        }
+        case NODE_FOR: {
+            struct For *casted = (struct For *) node;
+            return keepsKind((Node *) casted->initializer, name, kind) &&
+                   keepsKind((Node *) casted->condition, name, kind) &&
+                   keepsKind((Node *) casted->increment, name, kind) &&
+                   keepsKind((Node *) casted->body, name, kind);
+        }
+        case NODE_FOR_IN: {
+            struct ForIn *casted = (struct ForIn *) node;
+            return keepsKind((Node *) casted->iterable, name, kind) &&
+                   keepsKind((Node *) casted->body, name, kind);
+        }
+        case NODE_RETURN:
+            return keepsKind((Node *) ((struct Return *) node)->value, name, kind);
+        case NODE_TRY: {
+            struct Try *casted = (struct Try *) node;
+            return keepsKind((Node *) casted->body, name, kind) &&
+                   keepsKind((Node *) casted->handler, name, kind);
+        }
+        case NODE_THROW:
+            return keepsKind((Node *) ((struct Throw *) node)->value, name, kind);
+        case NODE_IMPORT:
+            return keepsKind((Node *) ((struct Import *) node)->expression, name, kind);
+        default:
+            return true;
+    }
+}
+
+// A local is given its initializer's kind when nothing in the rest of its
+// scope can store anything else in it
+static ValueKind declaredKind(struct Var *var) {
+    if (laterOwner != (Node *) var || current->scopeDepth == 0) return KIND_UNKNOWN;
+    laterOwner = NULL;
+
+    ValueKind kind = kindOf(var->initializer, NULL, KIND_UNKNOWN);
+    if (kind == KIND_UNKNOWN) return KIND_UNKNOWN;
+    for (int i = 0; i < laterCount; i++) {
+        if (!keepsKind(laterNodes[i], &var->name, kind)) return KIND_UNKNOWN;
+    }
+    return kind;
+}
+
+static bool onlyCalled(Node *node, Token *name, bool nested);
+
+static bool stmtsOnlyCall(StmtArray *stmts, Token *name, bool nested) {
+    for (int i = 0; i < stmts->count; i++) {
+        if (!onlyCalled((Node *) stmts->stmts[i], name, nested)) return false;
+    }
+    return true;
+}
+
+static bool exprsOnlyCall(ExprArray *exprs, Token *name, bool nested) {
+    for (int i = 0; i < exprs->count; i++) {
+        if (!onlyCalled((Node *) exprs->exprs[i], name, nested)) return false;
+    }
+    return true;
+}
+
+// False if anything under node may use the variable called name as
+// anything but the callee of a call made by the function node is in, so
+// its value could reach another frame. Nested bodies are nested, where any
+// use counts. Unlike keepsKind(), nodes it doesn't know about count too.
+static bool onlyCalled(Node *node, Token *name, bool nested) {
+    if (node == NULL) return true;
+
+    switch (node->type) {
+        case NODE_LITERAL:
+        case NODE_THIS:
+        case NODE_SUPER:
+        case NODE_BREAK:
+            return true;
+        case NODE_VARIABLE:
+            return !identifiersEqual(&((struct Variable *) node)->name, name);
+        case NODE_BINARY:
+        case NODE_LOGICAL: {
+            struct Binary *casted = (struct Binary *) node;
+            return onlyCalled((Node *) casted->left, name, nested) &&
+                   onlyCalled((Node *) casted->right, name, nested);
+        }
+        case NODE_GROUPING:
+            return onlyCalled((Node *) ((struct Grouping *) node)->expression, name, nested);
+        case NODE_UNARY:
+            return onlyCalled((Node *) ((struct Unary *) node)->right, name, nested);
+        case NODE_ASSIGN: {
+            struct Assign *casted = (struct Assign *) node;
+            return !identifiersEqual(&casted->name, name) &&
+                   onlyCalled((Node *) casted->value, name, nested);
+        }
+        case NODE_ALTASSIGN: {
+            struct AltAssign *casted = (struct AltAssign *) node;
+            return !identifiersEqual(&casted->name, name) &&
+                   onlyCalled((Node *) casted->value, name, nested);
+        }
+        case NODE_CALL: {
+            struct Call *casted = (struct Call *) node;
+            bool direct = !nested && casted->callee->self.type == NODE_VARIABLE;
+            return (direct || onlyCalled((Node *) casted->callee, name, nested)) &&
+                   exprsOnlyCall(&casted->arguments, name, nested);
+        }
+        case NODE_GETITEM: {
+            struct GetItem *casted = (struct GetItem *) node;
+            return onlyCalled((Node *) casted->object, name, nested) &&
+                   onlyCalled((Node *) casted->index, name, nested);
+        }
+        case NODE_SETITEM: {
+            struct SetItem *casted = (struct SetItem *) node;
+            return onlyCalled((Node *) casted->object, name, nested) &&
+                   onlyCalled((Node *) casted->index, name, nested) &&
+                   onlyCalled((Node *) casted->value, name, nested);
+        }
+        case NODE_GET:
+            return onlyCalled((Node *) ((struct Get *) node)->object, name, nested);
+        case NODE_SET: {
+            struct Set *casted = (struct Set *) node;
+            return onlyCalled((Node *) casted->object, name, nested) &&
+                   onlyCalled((Node *) casted->value, name, nested);
+        }
+        case NODE_YIELD:
+            return onlyCalled((Node *) ((struct Yield *) node)->expression, name, nested);
+        case NODE_LAMBDA:
+            return stmtsOnlyCall(&((struct Lambda *) node)->body, name, true);
+        case NODE_LIST:
+            return exprsOnlyCall(&((struct List *) node)->items, name, nested);
+        case NODE_MAP: {
+            struct Map *casted = (struct Map *) node;
+            return exprsOnlyCall(&casted->keys, name, nested) &&
+                   exprsOnlyCall(&casted->values, name, nested);
+        }
+        case NODE_EXPRESSION:
+            return onlyCalled((Node *) ((struct Expression *) node)->expression, name, nested);
+        case NODE_VAR: {
+            struct Var *casted = (struct Var *) node;
+            return !identifiersEqual(&casted->name, name) &&
+                   onlyCalled((Node *) casted->initializer, name, nested);
+        }
+        case NODE_BLOCK:
+            return stmtsOnlyCall(&((struct Block *) node)->statements, name, nested);
+        case NODE_FUNCTION: {
+            struct Function *casted = (struct Function *) node;
+            return !identifiersEqual(&casted->name, name) &&
+                   stmtsOnlyCall(&casted->body, name, true);
+        }
+        case NODE_IF: {
+            struct If *casted = (struct If *) node;
+            return onlyCalled((Node *) casted->condition, name, nested) &&
+                   onlyCalled((Node *) casted->thenBranch, name, nested) &&
+                   onlyCalled((Node *) casted->elseBranch, name, nested);
+        }
+        case NODE_WHILE: {
+            struct While *casted = (struct While *) node;
+            return onlyCalled((Node *) casted->condition, name, nested) &&
+                   onlyCalled((Node *) casted->body, name, nested);
+        }
+        case NODE_FOR: {
+            struct For *casted = (struct For *) node;
+            return onlyCalled((Node *) casted->initializer, name, nested) &&
+                   onlyCalled((Node *) casted->condition, name, nested) &&
+                   onlyCalled((Node *) casted->increment, name, nested) &&
+                   onlyCalled((Node *) casted->body, name, nested);
+        }
+        case NODE_FOR_IN: {
+            struct ForIn *casted = (struct ForIn *) node;
+            return !identifiersEqual(&casted->name, name) &&
+                   onlyCalled((Node *) casted->iterable, name, nested) &&
+                   onlyCalled((Node *) casted->body, name, nested);
+        }
+        case NODE_RETURN:
+            return onlyCalled((Node *) ((struct Return *) node)->value, name, nested);
+        case NODE_TRY: {
+            struct Try *casted = (struct Try *) node;
+            return !identifiersEqual(&casted->name, name) &&
+                   onlyCalled((Node *) casted->body, name, nested) &&
+                   onlyCalled((Node *) casted->handler, name, nested);
+        }
+        case NODE_THROW:
+            return onlyCalled((Node *) ((struct Throw *) node)->value, name, nested);
+        default:
+            return false;
+    }
+}
+
+// Whether the local var declares is a lambda that's only ever called by
+// this function for the rest of its scope. Nothing but that frame can
+// call it then, so the lambda reads and writes this frame's locals
+// directly and needs no upvalues for them.
+static bool callsInPlace(struct Var *var) {
+    if (laterOwner != (Node *) var || current->scopeDepth == 0) return false;
+    if (var->initializer == NULL || var->initializer->self.type != NODE_LAMBDA) return false;
+    for (int i = 0; i < laterCount; i++) {
+        if (!onlyCalled(laterNodes[i], &var->name, false)) return false;
+    }
+    return true;
+}
+
+// Whether value is a call the returning frame can hand itself over to.
+// Calls of methods go through OP_INVOKE and keep their own frame, and so do
+// lambdas that read this frame's locals. Inside a try block the frame has
+// to stay for its catch block.
+static bool isTailCall(Expr *value) {
+    if (value->self.type != NODE_CALL || current->type == TYPE_INITIALIZER) return false;
+    if (current->tryDepth > 0) return false;
+
+    Expr *callee = ((struct Call *) value)->callee;
+    if (callee->self.type == NODE_GET || callee->self.type == NODE_SUPER) return false;
+    if (callee->self.type == NODE_VARIABLE) {
+        int local = resolveLocal(current, &((struct Variable *) callee)->name);
+        if (local != -1 && current->locals[local].inPlace) return false;
+    }
+    return true;
+}
+
+static void setLaterNodes(Node *owner, Node **nodes, int count) {
+    laterOwner = owner;
+    laterNodes = nodes;
+    laterCount = count;
+}
+
 static void beginScope() {
     current->scopeDepth++;
 }
@@ -341,6 +849,8 @@ void compileTree(StmtArray *statements) {
     }
 
     for (int i = 0; i < statements->count; i++) {
+        setLaterNodes((Node *) statements->stmts[i], (Node **) statements->stmts + i + 1,
+                      statements->count - i - 1);
         compileNode((Node *) statements->stmts[i]);
     }
 }
@@ -361,22 +871,27 @@ void compileBlock(StmtArray *statements) {
 }
 
 
-ObjFunction *compile(StmtArray *body) {
+ObjFunction *compile(StmtArray *body, ObjModule *module) {
+    ObjModule *enclosingModule = compilingModule;
+    compilingModule = module;
+
     Compiler compiler;
     initCompiler(&compiler, TYPE_SCRIPT, NULL);
 
     hadError = false;
     panicMode = false;
 
+    optimizeTree(body);
     compileTree(body);
 
     ObjFunction *function = endCompiler();
+    compilingModule = enclosingModule;
     return hadError ? NULL : function;
 }
 
 static void printToken(Token token) {
     for (int i = 0; i < token.length; i++) {
-        printf("%c", token.start[i]);
+        printOutput("%c", token.start[i]);
     }
 }
 
@@ -386,7 +901,16 @@ static void compileExprArray(ExprArray exprArray) {
     }
 }
 
+static void compileNodeBody(Node *node);
+
 void compileNode(Node *node) {
+    int outerLine = currentLine;
+    if (node->lineno > 0) currentLine = node->lineno;
+    compileNodeBody(node);
+    currentLine = outerLine;
+}
+
+static void compileNodeBody(Node *node) {
     switch (node->type) {
         case NODE_LOGICAL:
         case NODE_BINARY: {
@@ -395,39 +919,49 @@ void compileNode(Node *node) {
             compileNode((Node *) casted->left);
             compileNode((Node *) casted->right);
 
+            // Operands whose kind is known skip the checks at runtime
+            ValueKind left = kindOf(casted->left, NULL, KIND_UNKNOWN);
+            ValueKind right = kindOf(casted->right, NULL, KIND_UNKNOWN);
+            bool numbers = left == KIND_NUMBER && right == KIND_NUMBER;
             switch (operatorType) {
                 case TOKEN_PLUS:
-                    emitByte(OP_ADD);
+                    if (numbers) {
+                        emitByte(OP_ADD_NUM);
+                    } else if (left == KIND_STRING && right == KIND_STRING) {
+                        emitByte(OP_CONCAT_STR);
+                    } else {
+                        emitByte(OP_ADD);
+                    }
                     break;
                 case TOKEN_MINUS:
-                    emitByte(OP_SUBTRACT);
+                    emitByte(numbers ? OP_SUBTRACT_NUM : OP_SUBTRACT);
                     break;
                 case TOKEN_MODULO:
                     emitByte(OP_MODULO);
                     break;
                 case TOKEN_STAR:
-                    emitByte(OP_MULTIPLY);
+                    emitByte(numbers ? OP_MULTIPLY_NUM : OP_MULTIPLY);
                     break;
                 case TOKEN_SLASH:
-                    emitByte(OP_DIVIDE);
+                    emitByte(numbers ? OP_DIVIDE_NUM : OP_DIVIDE);
                     break;
                 case TOKEN_BANG_EQUAL:
-                    emitBytes(OP_EQUAL, OP_NOT);
+                    emitByte(OP_NOT_EQUAL);
                     break;
                 case TOKEN_EQUAL_EQUAL:
                     emitByte(OP_EQUAL);
                     break;
                 case TOKEN_GREATER:
-                    emitByte(OP_GREATER);
+                    emitByte(numbers ? OP_GREATER_NUM : OP_GREATER);
                     break;
                 case TOKEN_GREATER_EQUAL:
-                    emitBytes(OP_LESS, OP_NOT);
+                    emitByte(OP_GREATER_EQUAL);
                     break;
                 case TOKEN_LESS:
-                    emitByte(OP_LESS);
+                    emitByte(numbers ? OP_LESS_NUM : OP_LESS);
                     break;
                 case TOKEN_LESS_EQUAL:
-                    emitBytes(OP_GREATER, OP_NOT);
+                    emitByte(OP_LESS_EQUAL);
                     break;
             }
             break;
@@ -439,16 +973,12 @@ void compileNode(Node *node) {
         }
         case NODE_LITERAL: {
             struct Literal *casted = (struct Literal *) node;
-            switch (casted->value.type) {
-                case VAL_BOOL:
-                    emitByte(casted->value.as.boolean ? OP_TRUE : OP_FALSE);
-                    break;
-                case VAL_NIL:
-                    emitByte(OP_NIL);
-                    break;
-                default:
-                    emitConstant(casted->value);
-                    break;
+            if (IS_BOOL(casted->value)) {
+                emitByte(AS_BOOL(casted->value) ? OP_TRUE : OP_FALSE);
+            } else if (IS_NIL(casted->value)) {
+                emitByte(OP_NIL);
+            } else {
+                emitConstant(casted->value);
             }
             break;
         }
@@ -507,17 +1037,18 @@ void compileNode(Node *node) {
             if (casted->callee->self.type == NODE_GET) {
                 struct Get *callee = (struct Get *) casted->callee;
                 compileNode((Node *) callee->object);
-                uint8_t name = identifierConstant(&callee->name);
+                int name = identifierConstant(&callee->name);
                 compileExprArray(casted->arguments);
-                emitBytes(OP_INVOKE, name);
+                emitConstantOp(OP_INVOKE, name);
                 emitByte(casted->arguments.count);
+                emitCache();
             } else if (casted->callee->self.type == NODE_SUPER) {
                 struct Super *callee = (struct Super *) casted->callee;
                 getVariable(syntheticToken("this"));
-                uint8_t name = identifierConstant(&callee->method);
+                int name = identifierConstant(&callee->method);
                 compileExprArray(casted->arguments);
                 getVariable(syntheticToken("super"));
-                emitBytes(OP_SUPER_INVOKE, name);
+                emitConstantOp(OP_SUPER_INVOKE, name);
                 emitByte(casted->arguments.count);
             } else {
                 compileNode((Node *) casted->callee);
@@ -530,22 +1061,37 @@ void compileNode(Node *node) {
             struct GetItem *casted = (struct GetItem *) node;
             compileNode(casted->object);
             compileNode(casted->index);
-            emitByte(OP_GETITEM);
+            if (kindOf((Expr *) casted->object, NULL, KIND_UNKNOWN) == KIND_LIST &&
+                kindOf((Expr *) casted->index, NULL, KIND_UNKNOWN) == KIND_NUMBER) {
+                emitByte(OP_GETITEM_LIST_NUM);
+            } else {
+                emitByte(OP_GETITEM);
+            }
+            break;
+        }
+        case NODE_SETITEM: {
+            struct SetItem *casted = (struct SetItem *) node;
+            compileNode((Node *) casted->object);
+            compileNode((Node *) casted->index);
+            compileNode((Node *) casted->value);
+            emitByte(OP_SETITEM);
             break;
         }
         case NODE_GET: {
             struct Get *casted = (struct Get *) node;
             compileNode((Node *) casted->object);
-            uint8_t name = identifierConstant(&casted->name);
-            emitBytes(OP_GET_PROPERTY, name);
+            int name = identifierConstant(&casted->name);
+            emitConstantOp(OP_GET_PROPERTY, name);
+            emitCache();
             break;
         }
         case NODE_SET: {
             struct Set *casted = (struct Set *) node;
             compileNode((Node *) casted->object);
             compileNode((Node *) casted->value);
-            uint8_t name = identifierConstant(&casted->name);
-            emitBytes(OP_SET_PROPERTY, name);
+            int name = identifierConstant(&casted->name);
+            emitConstantOp(OP_SET_PROPERTY, name);
+            emitCache();
             break;
         }
         case NODE_SUPER: {
@@ -556,10 +1102,10 @@ void compileNode(Node *node) {
                 errorAt(&casted->keyword, "Can't use 'super' in a class with no superclass.");
             }
 
-            uint8_t name = identifierConstant(&casted->method);
+            int name = identifierConstant(&casted->method);
             getVariable(syntheticToken("this"));
             getVariable(syntheticToken("super"));
-            emitBytes(OP_GET_SUPER, name);
+            emitConstantOp(OP_GET_SUPER, name);
             break;
         }
         case NODE_THIS: {
@@ -587,6 +1133,8 @@ void compileNode(Node *node) {
             Compiler compiler;
             Token name = syntheticToken("<anon function>");
             initCompiler(&compiler, TYPE_FUNCTION, &name);
+            compiler.calledInPlace = inPlaceLambda == node;
+            inPlaceLambda = NULL;
             beginScope();
 
             for (int i = 0; i < casted->params.count; i++) {
@@ -602,27 +1150,37 @@ void compileNode(Node *node) {
 
             ObjFunction *function = endCompiler();
             function->arity = casted->params.count;
-            emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+            emitConstantOp(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
 
             for (int i = 0; i < function->upvalueCount; i++) {
                 emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-                emitByte(compiler.upvalues[i].index);
+                emitShort(compiler.upvalues[i].index);
             }
             break;
         }
         case NODE_LIST: {
             struct List *casted = (struct List *) node;
-            compileExprArray(casted->items);
-            emitBytes(OP_LIST, casted->items.count);
+            // Long literals are built a batch at a time so the stack never
+            // holds more than UINT8_MAX of their items
+            for (int start = 0; start == 0 || start < casted->items.count; start += UINT8_MAX) {
+                int count = casted->items.count - start < UINT8_MAX ? casted->items.count - start : UINT8_MAX;
+                for (int i = start; i < start + count; i++) {
+                    compileNode((Node *) casted->items.exprs[i]);
+                }
+                emitBytes(start == 0 ? OP_LIST : OP_LIST_EXTEND, count);
+            }
             break;
         }
         case NODE_MAP: {
             struct Map *casted = (struct Map *) node;
-            for (int i = 0; i < casted->keys.count; i++) {
-                compileNode((Node *) casted->keys.exprs[i]);
-                compileNode((Node *) casted->values.exprs[i]);
+            for (int start = 0; start == 0 || start < casted->keys.count; start += UINT8_MAX) {
+                int count = casted->keys.count - start < UINT8_MAX ? casted->keys.count - start : UINT8_MAX;
+                for (int i = start; i < start + count; i++) {
+                    compileNode((Node *) casted->keys.exprs[i]);
+                    compileNode((Node *) casted->values.exprs[i]);
+                }
+                emitBytes(start == 0 ? OP_MAP : OP_MAP_EXTEND, count);
             }
-            emitBytes(OP_MAP, casted->keys.count);
             break;
         }
         case NODE_EXPRESSION: {
@@ -641,7 +1199,11 @@ void compileNode(Node *node) {
             struct Var *casted = (struct Var *) node;
 
             declareVariable(&casted->name);
-            uint8_t nameConstant = identifierConstant(&casted->name);
+            int nameConstant = identifierConstant(&casted->name);
+            // Worked out before the initializer compiles nested bodies
+            bool inPlace = callsInPlace(casted);
+            if (inPlace) inPlaceLambda = (Node *) casted->initializer;
+            ValueKind kind = declaredKind(casted);
 
             if (casted->initializer) {
                 compileNode((Node *) casted->initializer);
@@ -650,6 +1212,10 @@ void compileNode(Node *node) {
             }
 
             if (casted->assignmentType != TYPE_FIELD) {
+                if (current->scopeDepth > 0) {
+                    current->locals[current->localCount - 1].kind = kind;
+                    current->locals[current->localCount - 1].inPlace = inPlace;
+                }
                 defineVariable(nameConstant);
             }
             break;
@@ -669,7 +1235,7 @@ void compileNode(Node *node) {
 
             for (int i = 0; i < casted->params.count; i++) {
                 declareVariable(&casted->params.parameters[i]->name);
-                uint8_t constant = identifierConstant(&casted->params.parameters[i]->name);
+                int constant = identifierConstant(&casted->params.parameters[i]->name);
                 defineVariable(constant);
             }
 
@@ -678,24 +1244,24 @@ void compileNode(Node *node) {
             ObjFunction *function = endCompiler();
             function->arity = casted->params.count;
 
-            emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+            emitConstantOp(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
             if (casted->functionType == TYPE_FUNCTION) {
-                uint8_t global = identifierConstant(&casted->name);
+                int global = identifierConstant(&casted->name);
                 defineVariable(global);
             }
 
             for (int i = 0; i < function->upvalueCount; i++) {
                 emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-                emitByte(compiler.upvalues[i].index);
+                emitShort(compiler.upvalues[i].index);
             }
             break;
         }
         case NODE_CLASS: {
             struct Class *casted = (struct Class *) node;
             Token className = casted->name;
-            uint8_t nameConstant = identifierConstant(&casted->name);
+            int nameConstant = identifierConstant(&casted->name);
             declareVariable(&casted->name);
-            emitBytes(OP_CLASS, nameConstant);
+            emitConstantOp(OP_CLASS, nameConstant);
             defineVariable(nameConstant);
 
             ClassCompiler classCompiler;
@@ -720,13 +1286,13 @@ void compileNode(Node *node) {
 
             for (int i = 0; i < casted->body.count; i++) {
                 if (casted->body.stmts[i]->self.type == NODE_FUNCTION) {
-                    uint8_t constant = identifierConstant(&((struct Function *) casted->body.stmts[i])->name);
+                    int constant = identifierConstant(&((struct Function *) casted->body.stmts[i])->name);
                     compileNode((Node *) casted->body.stmts[i]);
-                    emitBytes(OP_METHOD, constant);
+                    emitConstantOp(OP_METHOD, constant);
                 } else {
-                    uint8_t constant = identifierConstant(&((struct Var *) casted->body.stmts[i])->name);
+                    int constant = identifierConstant(&((struct Var *) casted->body.stmts[i])->name);
                     compileNode((Node *) casted->body.stmts[i]);
-                    emitBytes(OP_FIELD, constant);
+                    emitConstantOp(OP_FIELD, constant);
                 }
             }
 
@@ -741,6 +1307,22 @@ void compileNode(Node *node) {
         }
         case NODE_IF: {
             struct If *casted = (struct If *) node;
+            if (casted->condition->self.type == NODE_LITERAL) {
+                // Only the branch that's taken is emitted
+                Value condition = ((struct Literal *) casted->condition)->value;
+                bool taken = !IS_NIL(condition) && !(IS_BOOL(condition) && !AS_BOOL(condition));
+                Stmt *branch = taken ? casted->thenBranch : casted->elseBranch;
+                bool oldLast = lastInBody;
+                lastInBody = true;
+                if (branch != NULL) {
+                    compileNode((Node *) branch);
+                } else if (exprContext) {
+                    emitByte(OP_NIL);
+                }
+                lastInBody = oldLast;
+                break;
+            }
+
             compileNode((Node *) casted->condition);
 
             int thenJump = emitJump(OP_JUMP_IF_FALSE);
@@ -786,6 +1368,8 @@ void compileNode(Node *node) {
             struct For *casted = (struct For *) node;
             beginScope();
             if (casted->initializer) {
+                Node *scope[] = {(Node *) casted->condition, (Node *) casted->increment, (Node *) casted->body};
+                setLaterNodes((Node *) casted->initializer, scope, 3);
                 compileNode((Node *) casted->initializer);
             }
 
@@ -821,6 +1405,42 @@ void compileNode(Node *node) {
             endScope();
             break;
         }
+        case NODE_FOR_IN: {
+            struct ForIn *casted = (struct ForIn *) node;
+            beginScope();
+            // Hidden locals for where the loop is and what it walks, the
+            // spaces keep their names out of reach of the program
+            emitConstant(INT_VAL(0));
+            addLocal(syntheticToken(" state"));
+            markInitialized();
+            int stateSlot = current->localCount - 1;
+            compileNode((Node *) casted->iterable);
+            addLocal(syntheticToken(" iterable"));
+            markInitialized();
+            emitByte(OP_ITER_INIT);
+            emitCache();
+
+            int loopStart = currentChunk()->count;
+            int exitJump = emitJump(OP_ITER_NEXT);
+            emitShort(stateSlot);
+            // One cache for next?() and the one after it for next()
+            emitCache();
+            if (addInlineCache(currentChunk()) > UINT16_MAX) {
+                error("Too many property accesses in one chunk.");
+            }
+
+            // Each item gets a fresh local, so closures capture their own
+            beginScope();
+            addLocal(casted->name);
+            markInitialized();
+            compileNode((Node *) casted->body);
+            endScope();
+            emitLoop(loopStart);
+
+            patchJump(exitJump);
+            endScope();
+            break;
+        }
         case NODE_BREAK:
             // TODO
             break;
@@ -837,16 +1457,50 @@ void compileNode(Node *node) {
                     errorAt(&casted->keyword, "Can't return a value from an initializer.");
                 }
 
-                compileNode((Node *) casted->value);
+                if (isTailCall(casted->value)) {
+                    struct Call *call = (struct Call *) casted->value;
+                    compileNode((Node *) call->callee);
+                    compileExprArray(call->arguments);
+                    emitBytes(OP_TAIL_CALL, call->arguments.count);
+                } else {
+                    compileNode((Node *) casted->value);
+                }
                 emitByte(OP_RETURN);
             }
             break;
         }
+        case NODE_TRY: {
+            struct Try *casted = (struct Try *) node;
+            int depth = current->localCount;
+            int start = currentChunk()->count;
+            current->tryDepth++;
+            compileNode((Node *) casted->body);
+            current->tryDepth--;
+            int end = currentChunk()->count;
+            int skipJump = emitJump(OP_JUMP);
+
+            // Entered with the error on top of the locals in scope here
+            int handler = currentChunk()->count;
+            beginScope();
+            addLocal(casted->name);
+            markInitialized();
+            compileNode((Node *) casted->handler);
+            endScope();
+            patchJump(skipJump);
+            addHandler(currentChunk(), start, end, handler, depth);
+            break;
+        }
+        case NODE_THROW: {
+            struct Throw *casted = (struct Throw *) node;
+            compileNode((Node *) casted->value);
+            emitByte(OP_THROW);
+            break;
+        }
         case NODE_IMPORT: {
             struct Import *casted = (struct Import *) node;
             compileNode((Node *) casted->expression);
             emitByte(OP_IMPORT);
-            uint8_t global = identifierConstant(&casted->name);
+            int global = identifierConstant(&casted->name);
             defineVariable(global);
             break;
         }
@@ -859,4 +1513,5 @@ void markCompilerRoots() {
         markObject((Obj *) compiler->function);
         compiler = compiler->enclosing;
     }
+    markObject((Obj *) compilingModule);
 }
\ No newline at end of file
@@ -3,8 +3,9 @@
 
 #include "ast.h"
 #include "../object.h"
+#include "../vm.h"
 
 void markCompilerRoots();
-ObjFunction *compile(StmtArray *body);
+ObjFunction *compile(StmtArray *body, ObjModule *module);
 
 #endif //SAFFRON_ASTCOMPILE_H
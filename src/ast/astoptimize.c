@@ -0,0 +1,350 @@
+#include <math.h>
+#include <string.h>
+
+#include "astoptimize.h"
+#include "../object.h"
+#include "../vm.h"
+
+// Above zero inside the branches of an if, where the last expression of a
+// block is its value and has to stay
+static _Thread_local int branchDepth = 0;
+
+static Expr *optimizeExpr(Expr *expr);
+static void optimizeStmt(Stmt *stmt);
+static void optimizeStmts(StmtArray *statements);
+
+static bool isLiteral(Expr *expr) {
+    return expr != NULL && expr->self.type == NODE_LITERAL;
+}
+
+static Value literalValue(Expr *expr) {
+    return ((struct Literal *) expr)->value;
+}
+
+static bool isFalsey(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// Reuses the left operand's node for the result
+static Expr *replaceWith(Expr *literal, Value value) {
+    ((struct Literal *) literal)->value = value;
+    return literal;
+}
+
+static Expr *concatenateLiterals(struct Binary *binary) {
+    ObjString *a = AS_STRING(literalValue(binary->left));
+    ObjString *b = AS_STRING(literalValue(binary->right));
+    push(OBJ_VAL(a));
+    push(OBJ_VAL(b));
+
+    int length = a->length + b->length;
+    char *chars = ALLOCATE(char, length + 1);
+    memcpy(chars, a->chars, a->length);
+    memcpy(chars + a->length, b->chars, b->length);
+    chars[length] = '\0';
+    ObjString *result = takeString(chars, length);
+
+    pop();
+    pop();
+    return replaceWith(binary->left, OBJ_VAL(result));
+}
+
+// Operands that would be a runtime error are left for the VM to report
+// What the VM gives for the two, an Int for two Ints with a whole result
+static Value foldedNumber(Value a, Value b, double result) {
+    return IS_INT(a) && IS_INT(b) ? wholeNumberValue(result) : NUMBER_VAL(result);
+}
+
+static Expr *foldBinary(struct Binary *binary) {
+    binary->left = optimizeExpr(binary->left);
+    binary->right = optimizeExpr(binary->right);
+    if (!isLiteral(binary->left) || !isLiteral(binary->right)) return (Expr *) binary;
+
+    Value a = literalValue(binary->left);
+    Value b = literalValue(binary->right);
+    switch (binary->operator.type) {
+        case TOKEN_EQUAL_EQUAL:
+            return replaceWith(binary->left, BOOL_VAL(valuesEqual(a, b)));
+        case TOKEN_BANG_EQUAL:
+            return replaceWith(binary->left, BOOL_VAL(!valuesEqual(a, b)));
+        case TOKEN_PLUS:
+            if (IS_STRING(a) && IS_STRING(b)) return concatenateLiterals(binary);
+            break;
+        default:
+            break;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return (Expr *) binary;
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (binary->operator.type) {
+        // Whole results are the Ints the VM would give, within INT_LIMIT the
+        // doubles are exact
+        case TOKEN_PLUS: return replaceWith(binary->left, foldedNumber(a, b, x + y));
+        case TOKEN_MINUS: return replaceWith(binary->left, foldedNumber(a, b, x - y));
+        case TOKEN_STAR: return replaceWith(binary->left, foldedNumber(a, b, x * y));
+        case TOKEN_SLASH: return replaceWith(binary->left, NUMBER_VAL(x / y));
+        case TOKEN_MODULO: return replaceWith(binary->left, foldedNumber(a, b, fmod(x, y)));
+        case TOKEN_GREATER: return replaceWith(binary->left, BOOL_VAL(x > y));
+        case TOKEN_LESS: return replaceWith(binary->left, BOOL_VAL(x < y));
+        // Same as the VM, which treats these as negations for NaN's sake
+        case TOKEN_GREATER_EQUAL: return replaceWith(binary->left, BOOL_VAL(!(x < y)));
+        case TOKEN_LESS_EQUAL: return replaceWith(binary->left, BOOL_VAL(!(x > y)));
+        default: return (Expr *) binary;
+    }
+}
+
+static Expr *foldUnary(struct Unary *unary) {
+    unary->right = optimizeExpr(unary->right);
+    if (!isLiteral(unary->right)) return (Expr *) unary;
+
+    Value value = literalValue(unary->right);
+    switch (unary->operator.type) {
+        case TOKEN_BANG:
+            return replaceWith(unary->right, BOOL_VAL(isFalsey(value)));
+        case TOKEN_MINUS:
+            if (IS_INT(value)) return replaceWith(unary->right, wholeNumberValue(-AS_NUMBER(value)));
+            if (IS_NUMBER(value)) return replaceWith(unary->right, NUMBER_VAL(-AS_NUMBER(value)));
+            return (Expr *) unary;
+        default:
+            return (Expr *) unary;
+    }
+}
+
+static void optimizeExprs(ExprArray *exprs) {
+    for (int i = 0; i < exprs->count; i++) {
+        exprs->exprs[i] = optimizeExpr(exprs->exprs[i]);
+    }
+}
+
+static void optimizeBranch(Stmt *branch) {
+    if (branch == NULL) return;
+    branchDepth++;
+    optimizeStmt(branch);
+    branchDepth--;
+}
+
+static Expr *optimizeExpr(Expr *expr) {
+    if (expr == NULL) return NULL;
+
+    switch (expr->self.type) {
+        case NODE_BINARY:
+            return foldBinary((struct Binary *) expr);
+        case NODE_UNARY:
+            return foldUnary((struct Unary *) expr);
+        case NODE_GROUPING: {
+            struct Grouping *casted = (struct Grouping *) expr;
+            casted->expression = optimizeExpr(casted->expression);
+            return isLiteral(casted->expression) ? casted->expression : expr;
+        }
+        case NODE_LOGICAL: {
+            struct Logical *casted = (struct Logical *) expr;
+            casted->left = optimizeExpr(casted->left);
+            casted->right = optimizeExpr(casted->right);
+            return expr;
+        }
+        case NODE_ASSIGN: {
+            struct Assign *casted = (struct Assign *) expr;
+            casted->value = optimizeExpr(casted->value);
+            return expr;
+        }
+        case NODE_ALTASSIGN: {
+            struct AltAssign *casted = (struct AltAssign *) expr;
+            casted->value = optimizeExpr(casted->value);
+            return expr;
+        }
+        case NODE_CALL: {
+            struct Call *casted = (struct Call *) expr;
+            casted->callee = optimizeExpr(casted->callee);
+            optimizeExprs(&casted->arguments);
+            return expr;
+        }
+        case NODE_GETITEM: {
+            struct GetItem *casted = (struct GetItem *) expr;
+            casted->object = optimizeExpr(casted->object);
+            casted->index = optimizeExpr(casted->index);
+            return expr;
+        }
+        case NODE_SETITEM: {
+            struct SetItem *casted = (struct SetItem *) expr;
+            casted->object = optimizeExpr(casted->object);
+            casted->index = optimizeExpr(casted->index);
+            casted->value = optimizeExpr(casted->value);
+            return expr;
+        }
+        case NODE_GET: {
+            struct Get *casted = (struct Get *) expr;
+            casted->object = optimizeExpr(casted->object);
+            return expr;
+        }
+        case NODE_SET: {
+            struct Set *casted = (struct Set *) expr;
+            casted->object = optimizeExpr(casted->object);
+            casted->value = optimizeExpr(casted->value);
+            return expr;
+        }
+        case NODE_YIELD: {
+            struct Yield *casted = (struct Yield *) expr;
+            casted->expression = optimizeExpr(casted->expression);
+            return expr;
+        }
+        case NODE_LAMBDA: {
+            struct Lambda *casted = (struct Lambda *) expr;
+            optimizeStmts(&casted->body);
+            return expr;
+        }
+        case NODE_LIST: {
+            struct List *casted = (struct List *) expr;
+            optimizeExprs(&casted->items);
+            return expr;
+        }
+        case NODE_MAP: {
+            struct Map *casted = (struct Map *) expr;
+            optimizeExprs(&casted->keys);
+            optimizeExprs(&casted->values);
+            return expr;
+        }
+        case NODE_IF: {
+            // Parsed as an expression, the compiler only emits the taken
+            // branch once the condition is a literal
+            struct If *casted = (struct If *) expr;
+            casted->condition = optimizeExpr(casted->condition);
+            if (isLiteral(casted->condition)) {
+                if (isFalsey(literalValue(casted->condition))) {
+                    casted->thenBranch = NULL;
+                } else {
+                    casted->elseBranch = NULL;
+                }
+            }
+            optimizeBranch(casted->thenBranch);
+            optimizeBranch(casted->elseBranch);
+            return expr;
+        }
+        default:
+            return expr;
+    }
+}
+
+// Evaluating it can't fail or be observed
+static bool isPure(Expr *expr) {
+    switch (expr->self.type) {
+        case NODE_LITERAL:
+        case NODE_LAMBDA:
+            return true;
+        case NODE_GROUPING:
+            return isPure(((struct Grouping *) expr)->expression);
+        case NODE_LIST: {
+            ExprArray *items = &((struct List *) expr)->items;
+            for (int i = 0; i < items->count; i++) {
+                if (!isPure(items->exprs[i])) return false;
+            }
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+// Returns false for statements that can be removed
+static bool isNeeded(Stmt *stmt) {
+    switch (stmt->self.type) {
+        case NODE_EXPRESSION:
+            return branchDepth > 0 || !isPure(((struct Expression *) stmt)->expression);
+        case NODE_WHILE: {
+            struct While *casted = (struct While *) stmt;
+            return !isLiteral(casted->condition) || !isFalsey(literalValue(casted->condition));
+        }
+        default:
+            return true;
+    }
+}
+
+static void optimizeStmt(Stmt *stmt) {
+    if (stmt == NULL) return;
+
+    switch (stmt->self.type) {
+        case NODE_EXPRESSION: {
+            struct Expression *casted = (struct Expression *) stmt;
+            casted->expression = optimizeExpr(casted->expression);
+            break;
+        }
+        case NODE_VAR: {
+            struct Var *casted = (struct Var *) stmt;
+            casted->initializer = optimizeExpr(casted->initializer);
+            break;
+        }
+        case NODE_BLOCK:
+            optimizeStmts(&((struct Block *) stmt)->statements);
+            break;
+        case NODE_FUNCTION:
+            optimizeStmts(&((struct Function *) stmt)->body);
+            break;
+        case NODE_CLASS: {
+            struct Class *casted = (struct Class *) stmt;
+            for (int i = 0; i < casted->body.count; i++) optimizeStmt(casted->body.stmts[i]);
+            break;
+        }
+        case NODE_IF:
+            optimizeExpr((Expr *) stmt);
+            break;
+        case NODE_WHILE: {
+            struct While *casted = (struct While *) stmt;
+            casted->condition = optimizeExpr(casted->condition);
+            optimizeStmt(casted->body);
+            break;
+        }
+        case NODE_FOR: {
+            struct For *casted = (struct For *) stmt;
+            optimizeStmt(casted->initializer);
+            casted->condition = optimizeExpr(casted->condition);
+            casted->increment = optimizeExpr(casted->increment);
+            optimizeStmt(casted->body);
+            break;
+        }
+        case NODE_FOR_IN: {
+            struct ForIn *casted = (struct ForIn *) stmt;
+            casted->iterable = optimizeExpr(casted->iterable);
+            optimizeStmt(casted->body);
+            break;
+        }
+        case NODE_RETURN: {
+            struct Return *casted = (struct Return *) stmt;
+            casted->value = optimizeExpr(casted->value);
+            break;
+        }
+        case NODE_TRY: {
+            struct Try *casted = (struct Try *) stmt;
+            optimizeStmt(casted->body);
+            optimizeStmt(casted->handler);
+            break;
+        }
+        case NODE_THROW: {
+            struct Throw *casted = (struct Throw *) stmt;
+            casted->value = optimizeExpr(casted->value);
+            break;
+        }
+        case NODE_IMPORT: {
+            struct Import *casted = (struct Import *) stmt;
+            casted->expression = optimizeExpr(casted->expression);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+static void optimizeStmts(StmtArray *statements) {
+    int kept = 0;
+    for (int i = 0; i < statements->count; i++) {
+        Stmt *stmt = statements->stmts[i];
+        optimizeStmt(stmt);
+        if (isNeeded(stmt)) statements->stmts[kept++] = stmt;
+    }
+    statements->count = kept;
+}
+
+void optimizeTree(StmtArray *statements) {
+    if (statements == NULL) return;
+    branchDepth = 0;
+    optimizeStmts(statements);
+}
@@ -0,0 +1,11 @@
+#ifndef SAFFRON_ASTOPTIMIZE_H
+#define SAFFRON_ASTOPTIMIZE_H
+
+#include "ast.h"
+
+// Folds constant expressions, cuts the untaken side of branches on a constant
+// and drops expression statements without effects. Nodes are rewritten in
+// place, what remains compiles to the same result.
+void optimizeTree(StmtArray *statements);
+
+#endif //SAFFRON_ASTOPTIMIZE_H
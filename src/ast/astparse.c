@@ -8,6 +8,7 @@
 #include "../scanner.h"
 #include "../object.h"
 #include "../memory.h"
+#include "../output.h"
 #include "../types.h"
 
 #ifdef DEBUG_PRINT_CODE
@@ -19,7 +20,7 @@
 #include <stdlib.h>
 #include <string.h>
 
-bool beginBody = false;
+_Thread_local bool beginBody = false;
 
 typedef enum {
     PREC_NONE,
@@ -51,17 +52,16 @@ typedef struct ClassCompiler {
     bool hasSuperclass;
 } ClassCompiler;
 
-Parser parser;
+_Thread_local Parser parser;
 
 Node *allocateNode(size_t size, NodeType type) {
-    Node *node = (Node *) reallocate(NULL, 0, size);
+    Node *node = (Node *) arenaAllocate(&parser.arena, size);
     node->type = type;
-    node->isMarked = false;
-    node->next = parser.nodes;
-    parser.nodes = node;
+    // Nodes are allocated once their first token is consumed
+    node->lineno = parser.previous.line;
 
 #ifdef DEBUG_LOG_GC
-    printf("%p allocate %zu for node %d\n", (void *) node, size, type);
+    printOutput("%p allocate %zu for node %d\n", (void *) node, size, type);
 #endif
 
     return node;
@@ -70,6 +70,8 @@ Node *allocateNode(size_t size, NodeType type) {
 static void errorAt(Token *token, const char *message) {
     if (parser.panicMode) return;
     parser.panicMode = true;
+    parser.hadError = true;
+    if (quietCompile) return;
     fprintf(stderr, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF) {
@@ -81,7 +83,6 @@ static void errorAt(Token *token, const char *message) {
     }
 
     fprintf(stderr, ": %s\n", message);
-    parser.hadError = true;
 }
 
 static void error(const char *message) {
@@ -141,7 +142,8 @@ static Expr *parsePrecedence(Precedence precedence);
 static Expr *number(bool canAssign) {
     double value = strtod(parser.previous.start, NULL);
     struct Literal *result = ALLOCATE_NODE(struct Literal, NODE_LITERAL);
-    result->value = NUMBER_VAL(value);
+    // Whole literals are Ints, 1.0 included
+    result->value = wholeNumberValue(value);
     return result;
 }
 
@@ -251,7 +253,7 @@ static Expr *variable(bool canAssign) {
     } else if (canAssign && (match(TOKEN_PLUS_PLUS) || match(TOKEN_MINUS_MINUS))) {
         struct AltAssign *var = ALLOCATE_NODE(struct AltAssign, NODE_ALTASSIGN);
         struct Literal *amount = ALLOCATE_NODE(struct Literal, NODE_LITERAL);
-        amount->value = NUMBER_VAL(1);
+        amount->value = INT_VAL(1);
         var->name = name;
         var->value = (Expr *) amount;
         var->operator = parser.previous;
@@ -339,10 +341,19 @@ static Expr *call(Expr *left, bool canAssign) {
 
 static Expr *getItem(Expr *left, bool canAssign) {
     Expr *expr = expression();
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+    if (canAssign && match(TOKEN_EQUAL)) {
+        struct SetItem *result = ALLOCATE_NODE(struct SetItem, NODE_SETITEM);
+        result->object = left;
+        result->index = expr;
+        result->value = expression();
+        return (Expr *) result;
+    }
+
     struct GetItem *result = ALLOCATE_NODE(struct GetItem, NODE_GETITEM);
     result->object = left;
     result->index = expr;
-    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
     return (Expr *) result;
 }
 
@@ -409,6 +420,8 @@ static Expr *yield(bool canAssign) {
     struct Yield *result = ALLOCATE_NODE(struct Yield, NODE_YIELD);
     if (!check(TOKEN_SEMICOLON)) {
         result->expression = parsePrecedence(PREC_YIELD);
+    } else {
+        result->expression = NULL;
     }
     return result;
 }
@@ -462,6 +475,9 @@ ParseRule parseRules[] = {
         [TOKEN_WHILE]         = {NULL, NULL, PREC_NONE},
         [TOKEN_YIELD]         = {yield, NULL, PREC_NONE},
         [TOKEN_AWAIT]         = {NULL, NULL, PREC_NONE},
+        [TOKEN_TRY]           = {NULL, NULL, PREC_NONE},
+        [TOKEN_CATCH]         = {NULL, NULL, PREC_NONE},
+        [TOKEN_THROW]         = {NULL, NULL, PREC_NONE},
         [TOKEN_ERROR]         = {NULL, NULL, PREC_NONE},
         [TOKEN_EOF]           = {NULL, NULL, PREC_NONE},
 };
@@ -856,14 +872,31 @@ static Stmt *typeDeclaration() {
     return typeDecl;
 }
 
+static Stmt *forInStatement() {
+    Token name = parseVariable("Expect variable name.");
+    consume(TOKEN_IN, "Expect 'in' after loop variable.");
+    Expr *iterable = expression();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+
+    Stmt *body = statement();
+    struct ForIn *result = ALLOCATE_NODE(struct ForIn, NODE_FOR_IN);
+    result->name = name;
+    result->iterable = iterable;
+    result->body = body;
+    return result;
+}
+
 static Stmt *forStatement() {
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+    // for (item in iterable) and for (var item in iterable)
+    if (check(TOKEN_IDENTIFIER) && peekToken().type == TOKEN_IN) return forInStatement();
     Stmt *initializer = NULL;
     Expr *condition = NULL;
     Expr *increment = NULL;
     if (match(TOKEN_SEMICOLON)) {
         // No initializer.
     } else if (match(TOKEN_VAR)) {
+        if (check(TOKEN_IDENTIFIER) && peekToken().type == TOKEN_IN) return forInStatement();
         initializer = varDeclaration(TYPE_VARIABLE);
     } else {
         initializer = expressionStatement();
@@ -916,7 +949,47 @@ static Stmt *returnStatement() {
     }
 }
 
+static Stmt *tryStatement() {
+    consume(TOKEN_LEFT_BRACE, "Expect '{' after try.");
+    Stmt *body = block();
+    consume(TOKEN_CATCH, "Expect 'catch' after try block.");
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after catch.");
+    Token name = parseVariable("Expect error name.");
+    TypeNode *type = NULL;
+    if (match(TOKEN_COLON)) {
+        type = typeAnnotation();
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after error name.");
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before catch block.");
+    Stmt *handler = block();
+
+    struct Try *result = ALLOCATE_NODE(struct Try, NODE_TRY);
+    result->body = body;
+    result->name = name;
+    result->type = type;
+    result->handler = handler;
+    return (Stmt *) result;
+}
+
+static Stmt *throwStatement() {
+    Token keyword = parser.previous;
+    Expr *value = expression();
+    match(TOKEN_SEMICOLON);
+    struct Throw *result = ALLOCATE_NODE(struct Throw, NODE_THROW);
+    result->keyword = keyword;
+    result->value = value;
+    return (Stmt *) result;
+}
+
+// Statements are mostly built once their last token is parsed, so they are
+// given the line they start on afterwards
+static Stmt *startingAt(int line, Stmt *stmt) {
+    if (stmt != NULL) ((Node *) stmt)->lineno = line;
+    return stmt;
+}
+
 static Stmt *statement() {
+    int line = parser.current.line;
     Stmt *result;
     // if (match(TOKEN_IF)) {
     //        result = ifStatement();
@@ -931,13 +1004,17 @@ static Stmt *statement() {
         result = block();
     } else if (match(TOKEN_IMPORT)) {
         result = importStatement();
+    } else if (match(TOKEN_TRY)) {
+        result = tryStatement();
+    } else if (match(TOKEN_THROW)) {
+        result = throwStatement();
     } else {
         result = expressionStatement();
     }
 
     while (match(TOKEN_SEMICOLON));
 
-    return result;
+    return startingAt(line, result);
 }
 
 static void synchronize() {
@@ -953,6 +1030,8 @@ static void synchronize() {
             case TOKEN_IF:
             case TOKEN_WHILE:
             case TOKEN_RETURN:
+            case TOKEN_TRY:
+            case TOKEN_THROW:
                 return;
 
             default:; // Do nothing.
@@ -1135,16 +1214,17 @@ static Stmt *interfaceDeclaration() {
 }
 
 static Stmt *declaration() {
+    int line = parser.current.line;
     if (match(TOKEN_CLASS)) {
-        return classDeclaration();
+        return startingAt(line, classDeclaration());
     } else if (match(TOKEN_FUN)) {
-        return funDeclaration();
+        return startingAt(line, funDeclaration());
     } else if (match(TOKEN_VAR)) {
-        return varDeclaration(TYPE_VARIABLE);
+        return startingAt(line, varDeclaration(TYPE_VARIABLE));
     } else if (match(TOKEN_INTERFACE)) {
-        return interfaceDeclaration();
+        return startingAt(line, interfaceDeclaration());
     } else if (match(TOKEN_TYPE)) {
-        return typeDeclaration();
+        return startingAt(line, typeDeclaration());
     } else {
         return statement();
     }
@@ -1160,7 +1240,7 @@ StmtArray *parseAST(const char *source) {
 
     advance();
 
-    StmtArray *statements = ALLOCATE(StmtArray, 1);
+    StmtArray *statements = arenaAllocate(&parser.arena, sizeof(StmtArray));
     initStmtArray(statements);
 
     while (!match(TOKEN_EOF)) {
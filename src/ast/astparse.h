@@ -8,10 +8,11 @@ typedef struct {
     Token previous;
     bool hadError;
     bool panicMode;
-    Node *nodes;
+    // Owns the tree being parsed until freeNodes()
+    Arena arena;
 } Parser;
 
 StmtArray *parseAST(const char *source);
-extern Parser parser;
+extern _Thread_local Parser parser;
 
 #endif //SAFFRON_ASTPARSE_H
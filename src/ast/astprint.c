@@ -1,12 +1,13 @@
 #include <printf.h>
 #include "astprint.h"
 #include "../object.h"
+#include "../output.h"
 
-int indent = 0;
+_Thread_local int indent = 0;
 
 void printIndent() {
     for (int i = 0; i < indent; i++) {
-        printf("    ");
+        printOutput("    ");
     }
 }
 
@@ -16,29 +17,29 @@ void astUnparse(StmtArray *statements) {
     }
     for (int i = 0; i < statements->count; i++) {
         unparseNode((Node *) statements->stmts[i]);
-        printf("\n");
+        printOutput("\n");
     }
 }
 
 static void unparseToken(Token token) {
     for (int i = 0; i < token.length; i++) {
-        printf("%c", token.start[i]);
+        printOutput("%c", token.start[i]);
     }
 }
 
 static void printToken(Token token) {
-    printf("Token(\"");
+    printOutput("Token(\"");
     for (int i = 0; i < token.length; i++) {
-        printf("%c", token.start[i]);
+        printOutput("%c", token.start[i]);
     }
-    printf("\")");
+    printOutput("\")");
 }
 
 static void unparseExprArray(ExprArray exprArray) {
     for (int i = 0; i < exprArray.count; i++) {
         unparseNode((Node *) exprArray.exprs[i]);
         if (i != exprArray.count - 1) {
-            printf(", ");
+            printOutput(", ");
         }
     }
 }
@@ -46,10 +47,10 @@ static void unparseExprArray(ExprArray exprArray) {
 static void unparseMapEntries(ExprArray keys, ExprArray values) {
     for (int i = 0; i < keys.count; i++) {
         unparseNode((Node *) keys.exprs[0]);
-        printf(": ");
+        printOutput(": ");
         unparseNode((Node *) values.exprs[0]);
         if (i != keys.count - 1) {
-            printf(", ");
+            printOutput(", ");
         }
     }
 }
@@ -58,115 +59,115 @@ static void unparseParamArray(ParameterArray parameterArray) {
     for (int i = 0; i < parameterArray.count; i++) {
         unparseNode((Node *) parameterArray.parameters[i]);
         if (i != parameterArray.count - 1) {
-            printf(", ");
+            printOutput(", ");
         }
     }
 }
 
 static void printExprArray(ExprArray exprArray) {
     if (exprArray.count == 0) {
-        printf("[]");
+        printOutput("[]");
         return;
     }
-    printf("[\n");
+    printOutput("[\n");
     indent++;
     for (int i = 0; i < exprArray.count; i++) {
         printIndent();
         printNode((Node *) exprArray.exprs[i]);
         if (i != exprArray.count - 1) {
-            printf(",\n");
+            printOutput(",\n");
         }
     }
 
     indent--;
-    printf("\n");
+    printOutput("\n");
     printIndent();
-    printf("]");
+    printOutput("]");
 }
 
 static void printExprPairs(ExprArray keys, ExprArray values) {
     if (keys.count == 0) {
-        printf("()");
+        printOutput("()");
         return;
     }
-    printf("(\n");
+    printOutput("(\n");
     indent++;
     for(int i = 0; i < keys.count; i++) {
         printIndent();
-        printf("MapEntry(\n");
+        printOutput("MapEntry(\n");
         indent++;
         printIndent();
         printNode((Node *) keys.exprs[i]);
-        printf(",\n");
+        printOutput(",\n");
         printIndent();
         printNode((Node *) values.exprs[i]);
-        printf("\n");
+        printOutput("\n");
         indent--;
         printIndent();
-        printf(")");
+        printOutput(")");
         if (i != keys.count - 1) {
-            printf(",\n");
+            printOutput(",\n");
         }
 
     }
     indent--;
-    printf("\n");
+    printOutput("\n");
     printIndent();
-    printf(")");
+    printOutput(")");
 }
 
 static void printTypeArray(TypeNodeArray typeArray) {
     if (typeArray.count == 0) {
-        printf("[]");
+        printOutput("[]");
         return;
     }
-    printf("[\n");
+    printOutput("[\n");
     indent++;
     for (int i = 0; i < typeArray.count; i++) {
         printIndent();
         printNode((Node *) typeArray.typeNodes[i]);
         if (i != typeArray.count - 1) {
-            printf(",\n");
+            printOutput(",\n");
         }
     }
 
     indent--;
-    printf("\n");
+    printOutput("\n");
     printIndent();
-    printf("]");
+    printOutput("]");
 }
 
 static void unparseTokenArray(TokenArray tokenArray) {
     for (int i = 0; i < tokenArray.count; i++) {
         unparseToken(tokenArray.tokens[i]);
         if (i != tokenArray.count - 1) {
-            printf(", ");
+            printOutput(", ");
         }
     }
 }
 
 static void printTokenArray(TokenArray tokenArray) {
     if (tokenArray.count == 0) {
-        printf("[]");
+        printOutput("[]");
         return;
     }
-    printf("[\n");
+    printOutput("[\n");
     indent++;
     for (int i = 0; i < tokenArray.count; i++) {
         printIndent();
         printToken(tokenArray.tokens[i]);
         if (i != tokenArray.count - 1) {
-            printf(",\n");
+            printOutput(",\n");
         }
     }
     indent--;
-    printf("\n");
+    printOutput("\n");
     printIndent();
-    printf("]");
+    printOutput("]");
 }
 
 static void printFunctionType(FunctionType type) {
-    printf("%d", type);
+    printOutput("%d", type);
 }
 
 void printTree(StmtArray *statements) {
@@ -174,54 +175,54 @@ void printTree(StmtArray *statements) {
         return;
     }
     if (statements->count == 0) {
-        printf("[]");
+        printOutput("[]");
         return;
     }
-    printf("[\n");
+    printOutput("[\n");
     indent++;
     for (int i = 0; i < statements->count; i++) {
         printIndent();
         printNode((Node *) statements->stmts[i]);
         if (i != statements->count - 1) {
-            printf(",\n");
+            printOutput(",\n");
         }
     }
 
     indent--;
-    printf("\n");
+    printOutput("\n");
     printIndent();
-    printf("]");
-    printf("\n");
+    printOutput("]");
+    printOutput("\n");
 }
 
 void unparseNode(Node *node) {
     if (node == NULL) {
-        printf("NULL");
+        printOutput("NULL");
         return;
     }
     switch (node->type) {
         case NODE_BINARY: {
             struct Binary *casted = (struct Binary *) node;
             unparseNode((Node *) casted->left);
-            printf(" ");
+            printOutput(" ");
             unparseToken(casted->operator);
-            printf(" ");
+            printOutput(" ");
             unparseNode((Node *) casted->right);
             break;
         }
         case NODE_GROUPING: {
             struct Grouping *casted = (struct Grouping *) node;
-            printf("(");
+            printOutput("(");
             unparseNode((Node *) casted->expression);
-            printf(")");
+            printOutput(")");
             break;
         }
         case NODE_LITERAL: {
             struct Literal *casted = (struct Literal *) node;
-            if (casted->value.type == VAL_OBJ) {
-                printf("\"");
+            if (IS_OBJ(casted->value)) {
+                printOutput("\"");
                 printValue(casted->value);
-                printf("\"");
+                printOutput("\"");
             } else {
                 printValue(casted->value);
             }
@@ -242,176 +243,176 @@ void unparseNode(Node *node) {
             struct Assign *casted = (struct Assign *) node;
             printIndent();
             unparseToken(casted->name);
-            printf(" = ");
+            printOutput(" = ");
             unparseNode((Node *) casted->value);
             break;
         }
         case NODE_LOGICAL: {
             struct Logical *casted = (struct Logical *) node;
             unparseNode((Node *) casted->left);
-            printf(" ");
+            printOutput(" ");
             unparseToken(casted->operator);
-            printf(" ");
+            printOutput(" ");
             unparseNode((Node *) casted->right);
             break;
         }
         case NODE_CALL: {
             struct Call *casted = (struct Call *) node;
             unparseNode((Node *) casted->callee);
-            printf("(");
+            printOutput("(");
             unparseExprArray(casted->arguments);
-            printf(")");
+            printOutput(")");
             break;
         }
         case NODE_GET: {
             struct Get *casted = (struct Get *) node;
             unparseNode((Node *) casted->object);
-            printf(".");
+            printOutput(".");
             unparseToken(casted->name);
             break;
         }
         case NODE_SET: {
             struct Set *casted = (struct Set *) node;
             unparseNode((Node *) casted->object);
-            printf(".");
+            printOutput(".");
             unparseToken(casted->name);
-            printf(" = ");
+            printOutput(" = ");
             unparseNode((Node *) casted->value);
-            printf(";");
+            printOutput(";");
             break;
         }
         case NODE_SUPER: {
             struct Super *casted = (struct Super *) node;
-            printf("super.");
+            printOutput("super.");
             unparseToken(casted->method);
             break;
         }
         case NODE_THIS:
-            printf("this");
+            printOutput("this");
             break;
         case NODE_YIELD: {
             struct Yield *casted = (struct Yield *) node;
-            printf("yield");
+            printOutput("yield");
             if (casted->expression) {
-                printf(" ");
+                printOutput(" ");
                 unparseNode((Node *) casted->expression);
             }
             break;
         }
         case NODE_LAMBDA: {
             struct Lambda *casted = (struct Lambda *) node;
-            printf("fun (");
+            printOutput("fun (");
             unparseParamArray(casted->params);
-            printf(") => {\n");
+            printOutput(") => {\n");
             indent++;
             astUnparse(&casted->body);
             indent--;
-            printf("}");
+            printOutput("}");
             break;
         }
         case NODE_LIST: {
             struct List *casted = (struct List *) node;
-            printf("[");
+            printOutput("[");
             unparseExprArray(casted->items);
-            printf("]");
+            printOutput("]");
             break;
         }
         case NODE_MAP: {
             struct Map *casted = (struct Map *) node;
-            printf("{");
+            printOutput("{");
             unparseMapEntries(casted->keys, casted->values);
-            printf("}");
+            printOutput("}");
             break;
         }
         case NODE_EXPRESSION: {
             struct Expression *casted = (struct Expression *) node;
             printIndent();
             unparseNode((Node *) casted->expression);
-            printf(";");
+            printOutput(";");
             break;
         }
         case NODE_VAR: {
             struct Var *casted = (struct Var *) node;
             printIndent();
-            printf("var ");
+            printOutput("var ");
             unparseToken(casted->name);
             if (casted->type) {
-                printf(": ");
+                printOutput(": ");
                 unparseNode((Node *) casted->type);
             }
             if (casted->initializer) {
-                printf(" = ");
+                printOutput(" = ");
                 unparseNode((Node *) casted->initializer);
             }
-            printf(";");
+            printOutput(";");
             break;
         }
         case NODE_BLOCK: {
             struct Block *casted = (struct Block *) node;
             printIndent();
-            printf("{\n");
+            printOutput("{\n");
             indent++;
             astUnparse(&casted->statements);
             indent--;
             printIndent();
-            printf("}");
+            printOutput("}");
             break;
         }
         case NODE_FUNCTION: {
             struct Function *casted = (struct Function *) node;
             printIndent();
             if (casted->functionType == TYPE_FUNCTION) {
-                printf("fun ");
+                printOutput("fun ");
             }
 
             unparseToken(casted->name);
-            printf("(");
+            printOutput("(");
             unparseParamArray(casted->params);
-            printf(") {\n");
+            printOutput(") {\n");
             indent++;
             astUnparse(&casted->body);
             indent--;
             printIndent();
-            printf("}");
+            printOutput("}");
             break;
         }
         case NODE_CLASS: {
             struct Class *casted = (struct Class *) node;
             printIndent();
-            printf("class ");
+            printOutput("class ");
             unparseToken(casted->name);
             if (casted->superclass) {
-                printf("< ");
+                printOutput("< ");
                 unparseNode((Node *) casted->superclass);
             }
 
-            printf(" {\n");
+            printOutput(" {\n");
             indent++;
             for (int i = 0; i < casted->body.count; i++) {
                 unparseNode((Node *) casted->body.stmts[i]);
                 if (i != casted->body.count - 1) {
-                    printf("\n\n");
+                    printOutput("\n\n");
                 }
             }
             indent--;
-            printf("\n");
+            printOutput("\n");
             printIndent();
-            printf("}");
+            printOutput("}");
             break;
         }
         case NODE_IF: {
             struct If *casted = (struct If *) node;
             printIndent();
-            printf("if (");
+            printOutput("if (");
             unparseNode((Node *) casted->condition);
-            printf(")\n");
+            printOutput(")\n");
             indent++;
             unparseNode((Node *) casted->thenBranch);
             indent--;
 
             if (casted->elseBranch) {
                 printIndent();
-                printf("else ");
+                printOutput("else ");
                 indent++;
                 unparseNode((Node *) casted->elseBranch);
                 indent--;
@@ -421,9 +422,9 @@ void unparseNode(Node *node) {
         case NODE_WHILE: {
             struct While *casted = (struct While *) node;
             printIndent();
-            printf("while (");
+            printOutput("while (");
             unparseNode((Node *) casted->condition);
-            printf(")\n");
+            printOutput(")\n");
             indent++;
             unparseNode((Node *) casted->body);
             indent--;
@@ -432,12 +433,25 @@ void unparseNode(Node *node) {
         case NODE_FOR: {
             struct For *casted = (struct For *) node;
             printIndent();
-            printf("for (");
+            printOutput("for (");
             unparseNode((Node *) casted->initializer);
             unparseNode((Node *) casted->condition);
-            printf(";");
+            printOutput(";");
             unparseNode((Node *) casted->increment);
-            printf(")\n");
+            printOutput(")\n");
+            indent++;
+            unparseNode((Node *) casted->body);
+            indent--;
+            break;
+        }
+        case NODE_FOR_IN: {
+            struct ForIn *casted = (struct ForIn *) node;
+            printIndent();
+            printOutput("for (");
+            unparseToken(casted->name);
+            printOutput(" in ");
+            unparseNode((Node *) casted->iterable);
+            printOutput(")\n");
             indent++;
             unparseNode((Node *) casted->body);
             indent--;
@@ -445,34 +459,62 @@ void unparseNode(Node *node) {
         }
         case NODE_BREAK:
             printIndent();
-            printf("break;");
+            printOutput("break;");
             break;
         case NODE_RETURN: {
             struct Return *casted = (struct Return *) node;
             printIndent();
-            printf("return ");
+            printOutput("return ");
             unparseNode((Node *) casted->value);
-            printf(";");
+            printOutput(";");
+            break;
+        }
+        case NODE_TRY: {
+            struct Try *casted = (struct Try *) node;
+            printIndent();
+            printOutput("try\n");
+            indent++;
+            unparseNode((Node *) casted->body);
+            indent--;
+            printIndent();
+            printOutput("catch (");
+            unparseToken(casted->name);
+            if (casted->type) {
+                printOutput(": ");
+                unparseNode((Node *) casted->type);
+            }
+            printOutput(")\n");
+            indent++;
+            unparseNode((Node *) casted->handler);
+            indent--;
+            break;
+        }
+        case NODE_THROW: {
+            struct Throw *casted = (struct Throw *) node;
+            printIndent();
+            printOutput("throw ");
+            unparseNode((Node *) casted->value);
+            printOutput(";");
             break;
         }
         case NODE_IMPORT: {
             struct Import *casted = (struct Import *) node;
             printIndent();
-            printf("import ");
+            printOutput("import ");
             unparseNode((Node *) casted->expression);
-            printf(";");
+            printOutput(";");
             break;
         }
         case NODE_FUNCTOR: {
             struct Functor *casted = (struct Functor *) node;
-            printf("(");
+            printOutput("(");
             for (int i = 0; i < casted->arguments.count; i++) {
                 unparseNode((Node *) casted->arguments.typeNodes[i]);
                 if (i != casted->arguments.count-  1) {
-                    printf(", ");
+                    printOutput(", ");
                 }
             }
-            printf(") => ");
+            printOutput(") => ");
             unparseNode((Node *) casted->returnType);
             break;
         }
@@ -488,481 +530,540 @@ void unparseNode(Node *node) {
 
 void printNode(Node *node) {
     if (node==NULL) {
-        printf("NULL");
+        printOutput("NULL");
         return;
     }
 
     switch (node->type) {
         case NODE_BINARY: {
             struct Binary *casted = (struct Binary *) node;
-            printf("Binary(\n");
+            printOutput("Binary(\n");
             indent++;
             printIndent();
-            printf("left=");
+            printOutput("left=");
             printNode((Node *) casted->left);
-            printf(",\n");
+            printOutput(",\n");
             printIndent();
-            printf("right=");
+            printOutput("right=");
             printNode((Node *) casted->right);
-            printf(",\n");
+            printOutput(",\n");
             printIndent();
-            printf("op=");
+            printOutput("op=");
             printToken(casted->operator);
             indent--;
-            printf("\n");
+            printOutput("\n");
             printIndent();
-            printf(")");
+            printOutput(")");
             break;
         }
         case NODE_GROUPING: {
             struct Grouping *casted = (struct Grouping *) node;
-            printf("Grouping(\n");
+            printOutput("Grouping(\n");
             indent++;
             printIndent();
-            printf("expression=");
+            printOutput("expression=");
             printNode((Node *) casted->expression);
             indent--;
-            printf("\n");
+            printOutput("\n");
             printIndent();
-            printf(")");
+            printOutput(")");
             break;
         }
         case NODE_LITERAL: {
             struct Literal *casted = (struct Literal *) node;
-            printf("Literal(\n");
+            printOutput("Literal(\n");
             indent++;
             printIndent();
-            printf("value=");
-            if (casted->value.type == VAL_OBJ) {
-                printf("\"");
+            printOutput("value=");
+            if (IS_OBJ(casted->value)) {
+                printOutput("\"");
                 printValue(casted->value);
-                printf("\"");
+                printOutput("\"");
             } else {
                 printValue(casted->value);
             }
             indent--;
-            printf("\n");
+            printOutput("\n");
             printIndent();
-            printf(")");
+            printOutput(")");
             break;
         }
         case NODE_UNARY: {
             struct Unary *casted = (struct Unary *) node;
-            printf("Unary(\n");
+            printOutput("Unary(\n");
             indent++;
             printIndent();
-            printf("right=");
+            printOutput("right=");
             printNode((Node *) casted->right);
             printIndent();
-            printf("operator=");
+            printOutput("operator=");
             printToken(casted->operator);
             indent--;
-            printf("\n");
+            printOutput("\n");
             printIndent();
-            printf(")");
+            printOutput(")");
             break;
         }
         case NODE_VARIABLE: {
             struct Variable *casted = (struct Variable *) node;
-            printf("Variable(\n");
+            printOutput("Variable(\n");
             indent++;
             printIndent();
-            printf("name=");
+            printOutput("name=");
             printToken(casted->name);
             indent--;
-            printf("\n");
+            printOutput("\n");
             printIndent();
-            printf(")");
+            printOutput(")");
             break;
         }
         case NODE_ASSIGN: {
             struct Assign *casted = (struct Assign *) node;
-            printf("Unary(\n");
+            printOutput("Unary(\n");
             indent++;
             printIndent();
-            printf("value=");
+            printOutput("value=");
             printNode((Node *) casted->value);
             indent--;
-            printf("\n");
+            printOutput("\n");
             printIndent();
-            printf(")");
+            printOutput(")");
             break;
         }
         case NODE_LOGICAL: {
             struct Logical *casted = (struct Logical *) node;
-            printf("Logical(\n");
+            printOutput("Logical(\n");
             indent++;
             printIndent();
-            printf("left=");
+            printOutput("left=");
             printNode((Node *) casted->left);
-            printf(",\n");
+            printOutput(",\n");
             printIndent();
-            printf("right=");
+            printOutput("right=");
             printNode((Node *) casted->right);
-            printf(",\n");
+            printOutput(",\n");
             printIndent();
-            printf("op=");
+            printOutput("op=");
             printToken(casted->operator);
             indent--;
-            printf("\n");
+            printOutput("\n");
             printIndent();
-            printf(")");
+            printOutput(")");
             break;
         }
         case NODE_CALL: {
             struct Call *casted = (struct Call *) node;
-            printf("Call(\n");
+            printOutput("Call(\n");
             indent++;
             printIndent();
-            printf("callee=");
+            printOutput("callee=");
             printNode((Node *) casted->callee);
-            printf(",\n");
+            printOutput(",\n");
             printIndent();
-            printf("arguments=");
+            printOutput("arguments=");
             printExprArray(casted->arguments);
             indent--;
-            printf("\n");
+            printOutput("\n");
             printIndent();
-            printf(")");
+            printOutput(")");
             break;
         }
         case NODE_GET: {
             struct Get *casted = (struct Get *) node;
-            printf("Get(\n");
+            printOutput("Get(\n");
             indent++;
             printIndent();
-            printf("object=");
+            printOutput("object=");
             printNode((Node *) casted->object);
-            printf(",\n");
+            printOutput(",\n");
             printIndent();
-            printf("name=");
+            printOutput("name=");
             printToken(casted->name);
             indent--;
-            printf("\n");
+            printOutput("\n");
             printIndent();
-            printf(")");
+            printOutput(")");
             break;
         }
         case NODE_SET: {
             struct Set *casted = (struct Set *) node;
-            printf("Set(\n");
+            printOutput("Set(\n");
             indent++;
             printIndent();
-            printf("object=");
+            printOutput("object=");
             printNode((Node *) casted->object);
-            printf(",\n");
+            printOutput(",\n");
             printIndent();
-            printf("value=");
+            printOutput("value=");
             printNode((Node *) casted->value);
-            printf(",\n");
+            printOutput(",\n");
             printIndent();
-            printf("name=");
+            printOutput("name=");
             printToken(casted->name);
             indent--;
-            printf("\n");
+            printOutput("\n");
             printIndent();
-            printf(")");
+            printOutput(")");
             break;
         }
         case NODE_SUPER: {
             struct Super *casted = (struct Super *) node;
-            printf("Super(\n");
+            printOutput("Super(\n");
             indent++;
             printIndent();
-            printf("keyword=");
+            printOutput("keyword=");
             printToken(casted->keyword);
-            printf(",\n");
+            printOutput(",\n");
             printIndent();
-            printf("method=");
+            printOutput("method=");
             printToken(casted->method);
             indent--;
-            printf("\n");
+            printOutput("\n");
             printIndent();
-            printf(")");
+            printOutput(")");
             break;
         }
         case NODE_THIS: {
             struct This *casted = (struct This *) node;
-            printf("This(\n");
+            printOutput("This(\n");
             indent++;
             printIndent();
-            printf("keyword=");
+            printOutput("keyword=");
             printToken(casted->keyword);
             indent--;
-            printf("\n");
+            printOutput("\n");
             printIndent();
-            printf(")");
+            printOutput(")");
             break;
         }
         case NODE_YIELD: {
             struct Yield *casted = (struct Yield *) node;
-            printf("Yield(\n");
+            printOutput("Yield(\n");
             indent++;
             printIndent();
-            printf("expression=");
+            printOutput("expression=");
             printNode((Node *) casted->expression);
             indent--;
-            printf("\n");
+            printOutput("\n");
             printIndent();
-            printf(")");
+            printOutput(")");
             break;
         }
         case NODE_LAMBDA: {
             struct Lambda *casted = (struct Lambda *) node;
-            printf("Lambda(\n");
+            printOutput("Lambda(\n");
             indent++;
             printIndent();
-            printf("params=");
+            printOutput("params=");
             unparseParamArray(casted->params);
-            printf(",\n");
+            printOutput(",\n");
             printIndent();
-            printf("body=");
+            printOutput("body=");
             printTree(&casted->body);
             indent--;
-            printf("\n");
+            printOutput("\n");
             printIndent();
-            printf(")");
+            printOutput(")");
             break;
         }
         case NODE_LIST: {
             struct List *casted = (struct List *) node;
-            printf("List(\n");
+            printOutput("List(\n");
             indent++;
             printIndent();
-            printf("items=");
+            printOutput("items=");
             printExprArray(casted->items);
             indent--;
-            printf("\n");
+            printOutput("\n");
             printIndent();
-            printf(")");
+            printOutput(")");
             break;
         }
         case NODE_MAP: {
             struct Map *casted = (struct Map *) node;
-            printf("Map(\n");
+            printOutput("Map(\n");
             indent++;
             printIndent();
-            printf("entries=");
+            printOutput("entries=");
             printExprPairs(casted->keys, casted->values);
             indent--;
-            printf("\n");
+            printOutput("\n");
             printIndent();
-            printf(")");
+            printOutput(")");
             break;
         }
         case NODE_EXPRESSION: {
             struct Expression *casted = (struct Expression *) node;
-            printf("Expression(\n");
+            printOutput("Expression(\n");
             indent++;
             printIndent();
-            printf("expression=");
+            printOutput("expression=");
             printNode((Node *) casted->expression);
             indent--;
-            printf("\n");
+            printOutput("\n");
             printIndent();
-            printf(")");
+            printOutput(")");
             break;
         }
         case NODE_VAR: {
             struct Var *casted = (struct Var *) node;
-            printf("Var(\n");
+            printOutput("Var(\n");
             indent++;
             printIndent();
-            printf("name=");
+            printOutput("name=");
             printToken(casted->name);
-            printf(",\n");
+            printOutput(",\n");
             printIndent();
-            printf("initializer=");
+            printOutput("initializer=");
             printNode((Node *) casted->initializer);
-            printf(",\n");
+            printOutput(",\n");
             printIndent();
-            printf("type=");
+            printOutput("type=");
             printNode((Node *) casted->type);
             indent--;
-            printf("\n");
+            printOutput("\n");
             printIndent();
-            printf(")");
+            printOutput(")");
             break;
         }
         case NODE_BLOCK: {
             struct Block *casted = (struct Block *) node;
-            printf("Block(\n");
+            printOutput("Block(\n");
             indent++;
             printIndent();
-            printf("statements=");
+            printOutput("statements=");
             printTree(&casted->statements);
             indent--;
-            printf("\n");
+            printOutput("\n");
             printIndent();
-            printf(")");
+            printOutput(")");
             break;
         }
         case NODE_FUNCTION: {
             struct Function *casted = (struct Function *) node;
-            printf("Function(\n");
+            printOutput("Function(\n");
             indent++;
             printIndent();
-            printf("params=");
+            printOutput("params=");
             unparseParamArray(casted->params);
-            printf(",\n");
+            printOutput(",\n");
             printIndent();
-            printf("name=");
+            printOutput("name=");
             printToken(casted->name);
-            printf(",\n");
+            printOutput(",\n");
             printIndent();
-            printf("functionType=");
+            printOutput("functionType=");
             printFunctionType(casted->functionType);
-            printf(",\n");
+            printOutput(",\n");
             printIndent();
-            printf("body=");
+            printOutput("body=");
             printTree(&casted->body);
             indent--;
-            printf("\n");
+            printOutput("\n");
             printIndent();
-            printf(")");
+            printOutput(")");
             break;
         }
         case NODE_CLASS: {
             struct Class *casted = (struct Class *) node;
-            printf("Class(\n");
+            printOutput("Class(\n");
             indent++;
             printIndent();
-            printf("name=");
+            printOutput("name=");
             printToken(casted->name);
-            printf(",\n");
+            printOutput(",\n");
             printIndent();
-            printf("superclass=");
+            printOutput("superclass=");
             printNode((Node *) casted->superclass);
-            printf(",\n");
+            printOutput(",\n");
             printIndent();
-            printf("body=");
+            printOutput("body=");
             printTree(&casted->body);
             indent--;
-            printf("\n");
+            printOutput("\n");
             printIndent();
-            printf(")");
+            printOutput(")");
             break;
         }
         case NODE_IF: {
             struct If *casted = (struct If *) node;
-            printf("If(\n");
+            printOutput("If(\n");
             indent++;
             printIndent();
-            printf("condition=");
+            printOutput("condition=");
             printNode((Node *) casted->condition);
-            printf(",\n");
+            printOutput(",\n");
             printIndent();
-            printf("thenBranch=");
+            printOutput("thenBranch=");
             printNode(casted->thenBranch);
-            printf(",\n");
+            printOutput(",\n");
             printIndent();
-            printf("elseBranch=");
+            printOutput("elseBranch=");
             printNode(casted->elseBranch);
             indent--;
-            printf("\n");
+            printOutput("\n");
             printIndent();
-            printf(")");
+            printOutput(")");
             break;
         }
         case NODE_WHILE: {
             struct While *casted = (struct While *) node;
-            printf("While(\n");
+            printOutput("While(\n");
             indent++;
             printIndent();
-            printf("condition=");
+            printOutput("condition=");
             printNode((Node *) casted->condition);
-            printf(",\n");
+            printOutput(",\n");
             printIndent();
-            printf("body=");
+            printOutput("body=");
             printNode((Node *) casted->body);
             indent--;
-            printf("\n");
+            printOutput("\n");
             printIndent();
-            printf(")");
+            printOutput(")");
             break;
         }
         case NODE_FOR: {
             struct For *casted = (struct For *) node;
-            printf("For(\n");
+            printOutput("For(\n");
             indent++;
             printIndent();
-            printf("initializer=");
+            printOutput("initializer=");
             printNode((Node *) casted->initializer);
-            printf(",\n");
+            printOutput(",\n");
             printIndent();
-            printf("condition=");
+            printOutput("condition=");
             printNode((Node *) casted->condition);
-            printf(",\n");
+            printOutput(",\n");
             printIndent();
-            printf("increment=");
+            printOutput("increment=");
             printNode((Node *) casted->increment);
-            printf(",\n");
+            printOutput(",\n");
             printIndent();
-            printf("body=");
+            printOutput("body=");
             printNode((Node *) casted->body);
             indent--;
-            printf("\n");
+            printOutput("\n");
             printIndent();
-            printf(")");
+            printOutput(")");
+            break;
+        }
+        case NODE_FOR_IN: {
+            struct ForIn *casted = (struct ForIn *) node;
+            printOutput("ForIn(\n");
+            indent++;
+            printIndent();
+            printOutput("name=");
+            printToken(casted->name);
+            printOutput(",\n");
+            printIndent();
+            printOutput("iterable=");
+            printNode((Node *) casted->iterable);
+            printOutput(",\n");
+            printIndent();
+            printOutput("body=");
+            printNode((Node *) casted->body);
+            indent--;
+            printOutput("\n");
+            printIndent();
+            printOutput(")");
             break;
         }
         case NODE_BREAK:
-            printf("Break()");
+            printOutput("Break()");
             break;
         case NODE_RETURN: {
             struct Return *casted = (struct Return *) node;
-            printf("Return(\n");
+            printOutput("Return(\n");
+            indent++;
+            printIndent();
+            printOutput("value=");
+            printNode((Node *) casted->value);
+            indent--;
+            printOutput("\n");
+            printIndent();
+            printOutput(")");
+            break;
+        }
+        case NODE_TRY: {
+            struct Try *casted = (struct Try *) node;
+            printOutput("Try(\n");
+            indent++;
+            printIndent();
+            printOutput("body=");
+            printNode((Node *) casted->body);
+            printOutput(",\n");
+            printIndent();
+            printOutput("name=");
+            printToken(casted->name);
+            printOutput(",\n");
+            printIndent();
+            printOutput("type=");
+            printNode((Node *) casted->type);
+            printOutput(",\n");
+            printIndent();
+            printOutput("handler=");
+            printNode((Node *) casted->handler);
+            indent--;
+            printOutput("\n");
+            printIndent();
+            printOutput(")");
+            break;
+        }
+        case NODE_THROW: {
+            struct Throw *casted = (struct Throw *) node;
+            printOutput("Throw(\n");
             indent++;
             printIndent();
-            printf("value=");
+            printOutput("value=");
             printNode((Node *) casted->value);
             indent--;
-            printf("\n");
+            printOutput("\n");
             printIndent();
-            printf(")");
+            printOutput(")");
             break;
         }
         case NODE_IMPORT: {
             struct Import *casted = (struct Import *) node;
-            printf("Import(\n");
+            printOutput("Import(\n");
             indent++;
             printIndent();
-            printf("expression=");
+            printOutput("expression=");
             printNode((Node *) casted->expression);
             indent--;
-            printf("\n");
+            printOutput("\n");
             printIndent();
-            printf(")");
+            printOutput(")");
             break;
         }
         case NODE_FUNCTOR: {
             struct Functor *casted = (struct Functor *) node;
-            printf("Functor(\n");
+            printOutput("Functor(\n");
             indent++;
             printIndent();
-            printf("arguments=");
+            printOutput("arguments=");
             printTypeArray(casted->arguments);
-            printf("\n");
+            printOutput("\n");
             printIndent();
-            printf("returnType=");
+            printOutput("returnType=");
             printNode((Node *) casted->returnType);
             indent--;
-            printf("\n");
+            printOutput("\n");
             printIndent();
-            printf(")");
+            printOutput(")");
             break;
         }
         case NODE_SIMPLE: {
             struct Simple *casted = (struct Simple *) node;
-            printf("Simple(\n");
+            printOutput("Simple(\n");
             indent++;
             printIndent();
-            printf("name=");
+            printOutput("name=");
             printToken(casted->name);
             indent--;
-            printf("\n");
+            printOutput("\n");
             printIndent();
-            printf(")");
+            printOutput(")");
             break;
         }
     }
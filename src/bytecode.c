@@ -0,0 +1,779 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bytecode.h"
+#include "files.h"
+#include "memory.h"
+#include "libc/builtins.h"
+#include "libc/module.h"
+#include "ast/astcompile.h"
+#include "ast/astparse.h"
+#include "scanner.h"
+
+// Bump whenever the layout below changes
+#define BYTECODE_VERSION 11
+// Functions nest one level per enclosing function in the source
+#define BYTECODE_MAX_DEPTH 256
+
+// Caches written by another build of the VM are ignored, it may number its
+// instructions differently
+static const char buildStamp[] = __DATE__ " " __TIME__;
+static const char magic[4] = {'S', 'F', 'C', '\0'};
+static const char bundleMagic[4] = {'S', 'F', 'B', '\0'};
+
+typedef struct {
+    char *bytes;
+    int length;
+    int capacity;
+} Buffer;
+
+static void writeBytes(Buffer *buffer, const void *bytes, int length) {
+    if (buffer->capacity < buffer->length + length) {
+        int oldCapacity = buffer->capacity;
+        int capacity = GROW_CAPACITY(oldCapacity);
+        while (capacity < buffer->length + length) capacity = GROW_CAPACITY(capacity);
+        buffer->bytes = GROW_ARRAY(char, buffer->bytes, oldCapacity, capacity);
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->bytes + buffer->length, bytes, length);
+    buffer->length += length;
+}
+
+static void writeTag(Buffer *buffer, char tag) {
+    writeBytes(buffer, &tag, 1);
+}
+
+static void writeCount(Buffer *buffer, uint32_t count) {
+    writeBytes(buffer, &count, sizeof(count));
+}
+
+// Pads to a multiple of alignment from the start of the file, so a mapped
+// bundle can use what follows in place
+static void writeAlign(Buffer *buffer, int alignment) {
+    static const char padding[8] = {0};
+    writeBytes(buffer, padding, (alignment - buffer->length % alignment) % alignment);
+}
+
+static void writeString(Buffer *buffer, ObjString *string) {
+    writeCount(buffer, string->length);
+    writeBytes(buffer, string->chars, string->length);
+}
+
+static uint32_t hashSource(const char *source, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t) source[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static void writeHeader(Buffer *buffer, const char *source) {
+    size_t length = strlen(source);
+    writeBytes(buffer, magic, sizeof(magic));
+    writeCount(buffer, BYTECODE_VERSION);
+    writeBytes(buffer, buildStamp, sizeof(buildStamp));
+    writeCount(buffer, (uint32_t) length);
+    writeCount(buffer, hashSource(source, length));
+}
+
+// Returns false for constants that can't be written, which the compiler
+// doesn't currently produce
+static bool writeFunction(Buffer *buffer, ObjFunction *function) {
+    Chunk *chunk = &function->chunk;
+    writeCount(buffer, function->arity);
+    writeCount(buffer, function->upvalueCount);
+    writeCount(buffer, function->maxSlots);
+    if (function->name == NULL) {
+        writeTag(buffer, 'n');
+    } else {
+        writeTag(buffer, 's');
+        writeString(buffer, function->name);
+    }
+
+    writeCount(buffer, chunk->count);
+    writeBytes(buffer, chunk->code, chunk->count);
+    writeCount(buffer, chunk->lineCount);
+    writeAlign(buffer, _Alignof(LineStart));
+    writeBytes(buffer, chunk->lines, (int) sizeof(LineStart) * chunk->lineCount);
+    writeCount(buffer, chunk->handlerCount);
+    writeAlign(buffer, _Alignof(ExceptionHandler));
+    if (chunk->handlerCount > 0) {
+        writeBytes(buffer, chunk->handlers, (int) sizeof(ExceptionHandler) * chunk->handlerCount);
+    }
+    writeCount(buffer, chunk->cacheCount);
+
+    writeCount(buffer, chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value value = chunk->constants.values[i];
+        if (IS_NIL(value)) {
+            writeTag(buffer, 'n');
+        } else if (IS_BOOL(value)) {
+            writeTag(buffer, AS_BOOL(value) ? 't' : 'f');
+        } else if (IS_INT(value)) {
+            int64_t integer = AS_INT(value);
+            writeTag(buffer, 'i');
+            writeBytes(buffer, &integer, sizeof(integer));
+        } else if (IS_NUMBER(value)) {
+            double number = AS_NUMBER(value);
+            writeTag(buffer, 'd');
+            writeBytes(buffer, &number, sizeof(number));
+        } else if (IS_STRING(value) || isObjType(value, OBJ_ATOM)) {
+            writeTag(buffer, IS_STRING(value) ? 's' : 'a');
+            writeString(buffer, AS_STRING(value));
+        } else if (IS_FUNCTION(value)) {
+            writeTag(buffer, 'F');
+            if (!writeFunction(buffer, AS_FUNCTION(value))) return false;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Writes the path of each import in function and the functions nested in
+// it, the ones that compile to a constant right before OP_IMPORT
+static uint32_t writeImportPaths(Buffer *buffer, ObjFunction *function) {
+    Chunk *chunk = &function->chunk;
+    uint32_t count = 0;
+    int previous = -1;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        if (chunk->code[offset] == OP_IMPORT && previous >= 0 &&
+            (chunk->code[previous] == OP_CONSTANT || chunk->code[previous] == OP_CONSTANT_LONG)) {
+            int index = chunk->code[previous] == OP_CONSTANT
+                        ? chunk->code[previous + 1]
+                        : (chunk->code[previous + 1] << 8) | chunk->code[previous + 2];
+            Value path = chunk->constants.values[index];
+            if (IS_STRING(path)) {
+                writeString(buffer, AS_STRING(path));
+                count++;
+            }
+        }
+        previous = offset;
+    }
+
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value constant = chunk->constants.values[i];
+        if (IS_FUNCTION(constant)) count += writeImportPaths(buffer, AS_FUNCTION(constant));
+    }
+    return count;
+}
+
+// What the module imports, so precompileImports() can follow it from the
+// cache without scanning the source
+static void writeImports(Buffer *buffer, ObjFunction *function) {
+    int countOffset = buffer->length;
+    writeCount(buffer, 0);
+    uint32_t count = writeImportPaths(buffer, function);
+    memcpy(buffer->bytes + countOffset, &count, sizeof(count));
+}
+
+static char *cachePath(const char *path) {
+    size_t length = strlen(path);
+    char *cache = malloc(length + 2);
+    if (cache == NULL) return NULL;
+    memcpy(cache, path, length);
+    cache[length] = 'c';
+    cache[length + 1] = '\0';
+    return cache;
+}
+
+// The module's global slot names in the order the compiler handed them out,
+// followed by its top level function
+static bool writeModule(Buffer *buffer, ObjFunction *function, ObjModule *module) {
+    writeCount(buffer, module->globalNames.count);
+    for (int i = 0; i < module->globalNames.count; i++) {
+        writeString(buffer, AS_STRING(module->globalNames.values[i]));
+    }
+    return writeFunction(buffer, function);
+}
+
+// Written under a temporary name and renamed into place, so other processes
+// loading the file never see half of it. The name is unique to this write,
+// isolates in one process may be writing the same module's cache at once.
+static bool writeFileAtomically(const char *path, Buffer *buffer) {
+    char temp[4096];
+    if (snprintf(temp, sizeof(temp), "%s.XXXXXX", path) >= (int) sizeof(temp)) return false;
+    int fd = mkstemp(temp);
+    if (fd < 0) return false;
+    // mkstemp() makes it private to the owner
+    fchmod(fd, 0644);
+    FILE *file = fdopen(fd, "wb");
+    if (file == NULL) {
+        close(fd);
+        remove(temp);
+        return false;
+    }
+
+    bool written = fwrite(buffer->bytes, 1, buffer->length, file) == (size_t) buffer->length;
+    written &= fclose(file) == 0;
+    if (!written || rename(temp, path) != 0) {
+        remove(temp);
+        return false;
+    }
+    return true;
+}
+
+void saveBytecode(const char *path, const char *source, ObjFunction *function, ObjModule *module) {
+    Buffer buffer = {NULL, 0, 0};
+    writeHeader(&buffer, source);
+    writeImports(&buffer, function);
+
+    char *cache = cachePath(path);
+    if (cache != NULL && writeModule(&buffer, function, module)) {
+        writeFileAtomically(cache, &buffer);
+    }
+
+    free(cache);
+    FREE_ARRAY(char, buffer.bytes, buffer.capacity);
+}
+
+typedef struct {
+    const char *bytes;
+    size_t length;
+    size_t offset;
+    // Chunks point into bytes instead of copying, for mapped bundles
+    bool borrow;
+} Reader;
+
+static bool readAlign(Reader *reader, size_t alignment) {
+    reader->offset += (alignment - reader->offset % alignment) % alignment;
+    return reader->offset <= reader->length;
+}
+
+static bool readBytes(Reader *reader, void *bytes, size_t length) {
+    if (reader->offset + length > reader->length) return false;
+    memcpy(bytes, reader->bytes + reader->offset, length);
+    reader->offset += length;
+    return true;
+}
+
+static bool readCount(Reader *reader, uint32_t *count) {
+    return readBytes(reader, count, sizeof(*count));
+}
+
+static ObjString *readString(Reader *reader, bool atom) {
+    uint32_t length;
+    if (!readCount(reader, &length) || reader->offset + length > reader->length) return NULL;
+
+    const char *chars = reader->bytes + reader->offset;
+    reader->offset += length;
+    return atom ? (ObjString *) copyAtom(chars, (int) length) : copyString(chars, (int) length);
+}
+
+static bool readHeader(Reader *reader, const char *source) {
+    char fileMagic[sizeof(magic)];
+    char fileStamp[sizeof(buildStamp)];
+    uint32_t version, length, hash;
+    if (!readBytes(reader, fileMagic, sizeof(fileMagic)) ||
+        !readCount(reader, &version) ||
+        !readBytes(reader, fileStamp, sizeof(fileStamp)) ||
+        !readCount(reader, &length) ||
+        !readCount(reader, &hash)) {
+        return false;
+    }
+
+    size_t sourceLength = strlen(source);
+    return memcmp(fileMagic, magic, sizeof(magic)) == 0 &&
+           version == BYTECODE_VERSION &&
+           memcmp(fileStamp, buildStamp, sizeof(buildStamp)) == 0 &&
+           length == sourceLength &&
+           hash == hashSource(source, sourceLength);
+}
+
+typedef struct ImportGraph ImportGraph;
+static void addImport(ImportGraph *graph, const char *chars, int length);
+
+// Adds the cached import paths to graph, or just skips them without one
+static bool readImports(Reader *reader, ImportGraph *graph) {
+    uint32_t count;
+    if (!readCount(reader, &count)) return false;
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t length;
+        if (!readCount(reader, &length) || reader->offset + length > reader->length) return false;
+        if (graph != NULL) addImport(graph, reader->bytes + reader->offset, (int) length);
+        reader->offset += length;
+    }
+    return true;
+}
+
+static ObjFunction *readFunction(Reader *reader, ObjModule *module, int depth);
+
+static bool readConstant(Reader *reader, ObjModule *module, int depth, Value *value) {
+    char tag;
+    if (!readBytes(reader, &tag, 1)) return false;
+
+    switch (tag) {
+        case 'n':
+            *value = NIL_VAL;
+            return true;
+        case 't':
+        case 'f':
+            *value = BOOL_VAL(tag == 't');
+            return true;
+        case 'i': {
+            int64_t integer;
+            if (!readBytes(reader, &integer, sizeof(integer)) || !fitsInt(integer)) return false;
+            *value = INT_VAL(integer);
+            return true;
+        }
+        case 'd': {
+            double number;
+            if (!readBytes(reader, &number, sizeof(number))) return false;
+            *value = NUMBER_VAL(number);
+            return true;
+        }
+        case 's':
+        case 'a': {
+            ObjString *string = readString(reader, tag == 'a');
+            if (string == NULL) return false;
+            *value = OBJ_VAL(string);
+            return true;
+        }
+        case 'F': {
+            ObjFunction *function = readFunction(reader, module, depth + 1);
+            if (function == NULL) return false;
+            *value = OBJ_VAL(function);
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+// The function stays on the stack while its constants are read
+static bool readFunctionBody(Reader *reader, ObjFunction *function, ObjModule *module, int depth) {
+    Chunk *chunk = &function->chunk;
+    uint32_t arity, upvalueCount, maxSlots, count;
+    char nameTag;
+    if (!readCount(reader, &arity) ||
+        !readCount(reader, &upvalueCount) ||
+        !readCount(reader, &maxSlots) ||
+        !readBytes(reader, &nameTag, 1)) {
+        return false;
+    }
+    function->arity = (int) arity;
+    function->upvalueCount = (int) upvalueCount;
+    function->maxSlots = (int) maxSlots;
+    function->module = module;
+    if (nameTag == 's') {
+        function->name = readString(reader, false);
+        if (function->name == NULL) return false;
+    }
+
+    // Borrowed arrays are left with no capacity, so freeChunk() skips them
+    if (!readCount(reader, &count) || reader->offset + count > reader->length) return false;
+    chunk->count = (int) count;
+    if (reader->borrow) {
+        chunk->code = (uint8_t *) (reader->bytes + reader->offset);
+        reader->offset += count;
+    } else {
+        chunk->code = GROW_ARRAY(uint8_t, NULL, 0, count);
+        chunk->capacity = (int) count;
+        readBytes(reader, chunk->code, count);
+    }
+
+    if (!readCount(reader, &count) || !readAlign(reader, _Alignof(LineStart)) ||
+        reader->offset + sizeof(LineStart) * count > reader->length) {
+        return false;
+    }
+    chunk->lineCount = (int) count;
+    if (reader->borrow) {
+        chunk->lines = (LineStart *) (reader->bytes + reader->offset);
+        reader->offset += sizeof(LineStart) * count;
+    } else {
+        chunk->lines = GROW_ARRAY(LineStart, NULL, 0, count);
+        chunk->lineCapacity = (int) count;
+        readBytes(reader, chunk->lines, sizeof(LineStart) * count);
+    }
+
+    if (!readCount(reader, &count) || !readAlign(reader, _Alignof(ExceptionHandler)) ||
+        reader->offset + sizeof(ExceptionHandler) * count > reader->length) {
+        return false;
+    }
+    chunk->handlerCount = (int) count;
+    if (reader->borrow) {
+        chunk->handlers = (ExceptionHandler *) (reader->bytes + reader->offset);
+        reader->offset += sizeof(ExceptionHandler) * count;
+    } else if (count > 0) {
+        chunk->handlers = GROW_ARRAY(ExceptionHandler, NULL, 0, count);
+        chunk->handlerCapacity = (int) count;
+        readBytes(reader, chunk->handlers, sizeof(ExceptionHandler) * count);
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        ExceptionHandler *handler = &chunk->handlers[i];
+        if (handler->start < 0 || handler->end > chunk->count || handler->handler < 0 ||
+            handler->handler >= chunk->count) {
+            return false;
+        }
+    }
+
+    if (!readCount(reader, &count) || count > (uint32_t) chunk->count) return false;
+    for (uint32_t i = 0; i < count; i++) {
+        addInlineCache(chunk);
+    }
+
+    if (!readCount(reader, &count)) return false;
+    for (uint32_t i = 0; i < count; i++) {
+        Value value;
+        if (!readConstant(reader, module, depth, &value)) return false;
+        addConstant(chunk, value);
+    }
+    return true;
+}
+
+static ObjFunction *readFunction(Reader *reader, ObjModule *module, int depth) {
+    if (depth > BYTECODE_MAX_DEPTH) return NULL;
+
+    ObjFunction *function = newFunction();
+    push(OBJ_VAL(function));
+    bool read = readFunctionBody(reader, function, module, depth);
+    pop();
+    return read ? function : NULL;
+}
+
+static char *readCache(const char *path, size_t *length) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    fseek(file, 0L, SEEK_END);
+    long fileSize = ftell(file);
+    rewind(file);
+
+    char *buffer = fileSize > 0 ? malloc(fileSize) : NULL;
+    if (buffer != NULL && fread(buffer, 1, fileSize, file) != (size_t) fileSize) {
+        free(buffer);
+        buffer = NULL;
+    }
+    fclose(file);
+
+    *length = (size_t) fileSize;
+    return buffer;
+}
+
+static ObjFunction *readModule(Reader *reader, ObjModule *module) {
+    uint32_t globalCount;
+    if (!readCount(reader, &globalCount)) return NULL;
+
+    // The chunk refers to globals by slot, so they are recreated in the
+    // order the compiler handed them out
+    for (uint32_t i = 0; i < globalCount; i++) {
+        ObjString *name = readString(reader, false);
+        if (name == NULL || moduleGlobalSlot(module, name) != (int) i) return NULL;
+    }
+    return readFunction(reader, module, 0);
+}
+
+ObjFunction *loadBytecode(const char *path, const char *source, ObjModule *module) {
+    char *cache = cachePath(path);
+    if (cache == NULL) return NULL;
+
+    size_t length;
+    char *bytes = readCache(cache, &length);
+    free(cache);
+    if (bytes == NULL) return NULL;
+
+    Reader reader = {bytes, length, 0, false};
+    ObjFunction *function = readHeader(&reader, source) && readImports(&reader, NULL)
+                            ? readModule(&reader, module) : NULL;
+
+    free(bytes);
+    return function;
+}
+
+typedef struct {
+    const char *path;
+    uint32_t pathLength;
+    uint32_t offset;
+    uint32_t length;
+} BundleEntry;
+
+// The mapped bundle is never unmapped, loaded chunks point into it
+static struct {
+    const char *bytes;
+    size_t length;
+    BundleEntry *entries;
+    int count;
+} bundle = {NULL, 0, NULL, 0};
+
+static bool readBundleHeader(Reader *reader) {
+    char fileMagic[sizeof(bundleMagic)];
+    char fileStamp[sizeof(buildStamp)];
+    uint32_t version;
+    return readBytes(reader, fileMagic, sizeof(fileMagic)) &&
+           readCount(reader, &version) &&
+           readBytes(reader, fileStamp, sizeof(fileStamp)) &&
+           memcmp(fileMagic, bundleMagic, sizeof(bundleMagic)) == 0 &&
+           version == BYTECODE_VERSION &&
+           memcmp(fileStamp, buildStamp, sizeof(buildStamp)) == 0;
+}
+
+bool openBundle(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    void *bytes = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (bytes == MAP_FAILED) return false;
+
+    Reader reader = {bytes, info.st_size, 0, true};
+    uint32_t count;
+    if (!readBundleHeader(&reader) || !readCount(&reader, &count)) {
+        munmap(bytes, info.st_size);
+        return false;
+    }
+
+    BundleEntry *entries = malloc(sizeof(BundleEntry) * (count ? count : 1));
+    for (uint32_t i = 0; i < count; i++) {
+        BundleEntry *entry = &entries[i];
+        if (!readCount(&reader, &entry->pathLength) ||
+            reader.offset + entry->pathLength > reader.length) {
+            free(entries);
+            munmap(bytes, info.st_size);
+            return false;
+        }
+        entry->path = reader.bytes + reader.offset;
+        reader.offset += entry->pathLength;
+        if (!readCount(&reader, &entry->offset) || !readCount(&reader, &entry->length) ||
+            (size_t) entry->offset + entry->length > reader.length) {
+            free(entries);
+            munmap(bytes, info.st_size);
+            return false;
+        }
+    }
+
+    bundle.bytes = bytes;
+    bundle.length = info.st_size;
+    bundle.entries = entries;
+    bundle.count = (int) count;
+    return true;
+}
+
+static BundleEntry *findBundleEntry(const char *path) {
+    size_t length = strlen(path);
+    for (int i = 0; i < bundle.count; i++) {
+        BundleEntry *entry = &bundle.entries[i];
+        if (entry->pathLength == length && memcmp(entry->path, path, length) == 0) return entry;
+    }
+    return NULL;
+}
+
+ObjFunction *loadBundledModule(const char *path, ObjModule *module) {
+    BundleEntry *entry = findBundleEntry(path);
+    if (entry == NULL) return NULL;
+
+    Reader reader = {bundle.bytes, entry->offset + entry->length, entry->offset, true};
+    return readModule(&reader, module);
+}
+
+bool writeBundle(const char *output, const char **paths, int count) {
+    // The index comes first, its offsets are patched once the modules are in
+    Buffer buffer = {NULL, 0, 0};
+    writeBytes(&buffer, bundleMagic, sizeof(bundleMagic));
+    writeCount(&buffer, BYTECODE_VERSION);
+    writeBytes(&buffer, buildStamp, sizeof(buildStamp));
+    writeCount(&buffer, count);
+
+    int *offsets = malloc(sizeof(int) * (count ? count : 1));
+    for (int i = 0; i < count; i++) {
+        writeCount(&buffer, (uint32_t) strlen(paths[i]));
+        writeBytes(&buffer, paths[i], (int) strlen(paths[i]));
+        offsets[i] = buffer.length;
+        writeCount(&buffer, 0);
+        writeCount(&buffer, 0);
+    }
+
+    bool written = true;
+    for (int i = 0; i < count && written; i++) {
+        char *source = readFile(paths[i]);
+        ObjModule *module = newModule(paths[i], paths[i], true);
+        push(OBJ_VAL(module));
+        StmtArray *body = parseAST(source);
+        ObjFunction *function = body == NULL ? NULL : compile(body, module);
+        freeNodes();
+        freeFile(source);
+
+        if (function == NULL) {
+            fprintf(stderr, "Could not compile \"%s\".\n", paths[i]);
+            written = false;
+        } else {
+            push(OBJ_VAL(function));
+            writeAlign(&buffer, 8);
+            uint32_t start = buffer.length;
+            written = writeModule(&buffer, function, module);
+            uint32_t length = buffer.length - start;
+            memcpy(buffer.bytes + offsets[i], &start, sizeof(start));
+            memcpy(buffer.bytes + offsets[i] + sizeof(start), &length, sizeof(length));
+            pop();
+        }
+        pop();
+    }
+
+    written = written && writeFileAtomically(output, &buffer);
+    free(offsets);
+    FREE_ARRAY(char, buffer.bytes, buffer.capacity);
+    return written;
+}
+
+// The import graph precompileImports() works through. Paths from next on
+// are still to be compiled, busy counts the workers compiling one.
+struct ImportGraph {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    char **paths;
+    int count;
+    int capacity;
+    int next;
+    int busy;
+};
+
+// Imports that have to be read from a file, each one only once. The
+// registry's modules, bundled ones and missing files are left to the import.
+static void addImport(ImportGraph *graph, const char *chars, int length) {
+    char *path = strndup(chars, length);
+    if (path == NULL) exit(1);
+    if (isBuiltinModule(path, length) || findBundleEntry(path) != NULL || access(path, R_OK) != 0) {
+        free(path);
+        return;
+    }
+
+    pthread_mutex_lock(&graph->lock);
+    bool seen = false;
+    for (int i = 0; i < graph->count && !seen; i++) seen = strcmp(graph->paths[i], path) == 0;
+    if (seen) {
+        free(path);
+    } else {
+        if (graph->count == graph->capacity) {
+            graph->capacity = graph->capacity < 8 ? 8 : graph->capacity * 2;
+            graph->paths = realloc(graph->paths, sizeof(char *) * graph->capacity);
+            if (graph->paths == NULL) exit(1);
+        }
+        graph->paths[graph->count++] = path;
+        pthread_cond_signal(&graph->changed);
+    }
+    pthread_mutex_unlock(&graph->lock);
+}
+
+// Steps the scanner on to the path of the next import, false at the end
+static bool nextImport(Token *path) {
+    for (Token token = scanToken(); token.type != TOKEN_EOF; token = scanToken()) {
+        if (token.type != TOKEN_IMPORT) continue;
+
+        *path = scanToken();
+        if (path->type == TOKEN_STRING) return true;
+        if (path->type == TOKEN_EOF) return false;
+    }
+    return false;
+}
+
+static void scanImports(ImportGraph *graph, const char *source) {
+    Token path;
+    initScanner(source);
+    while (nextImport(&path)) addImport(graph, path.start + 1, path.length - 2);
+}
+
+// An up to date cache lists the module's imports, it isn't compiled again
+static bool followCachedImports(ImportGraph *graph, const char *path, const char *source) {
+    char *cache = cachePath(path);
+    if (cache == NULL) return false;
+
+    size_t length;
+    char *bytes = readCache(cache, &length);
+    free(cache);
+    if (bytes == NULL) return false;
+
+    Reader reader = {bytes, length, 0, false};
+    bool fresh = readHeader(&reader, source) && readImports(&reader, graph);
+    free(bytes);
+    return fresh;
+}
+
+// Modules are compiled on the worker's own VM and handed over through their
+// cache files, objects can't move from one heap to another
+static void precompileModule(ImportGraph *graph, const char *path) {
+    char *source = readFile(path);
+    if (!followCachedImports(graph, path, source)) {
+        scanImports(graph, source);
+        ObjModule *module = newModule(path, path, true);
+        push(OBJ_VAL(module));
+        StmtArray *body = parseAST(source);
+        ObjFunction *function = body == NULL ? NULL : compile(body, module);
+        freeNodes();
+        if (function != NULL) {
+            push(OBJ_VAL(function));
+            saveBytecode(path, source, function, module);
+            pop();
+        }
+        pop();
+    }
+    freeFile(source);
+}
+
+static void *runPrecompiler(void *argument) {
+    ImportGraph *graph = argument;
+    initVM();
+    quietCompile = true;
+
+    pthread_mutex_lock(&graph->lock);
+    for (;;) {
+        // Done once nothing is left and nobody is compiling something that
+        // may still import more
+        while (graph->next == graph->count && graph->busy > 0) {
+            pthread_cond_wait(&graph->changed, &graph->lock);
+        }
+        if (graph->next == graph->count) break;
+
+        const char *path = graph->paths[graph->next++];
+        graph->busy++;
+        pthread_mutex_unlock(&graph->lock);
+        precompileModule(graph, path);
+        pthread_mutex_lock(&graph->lock);
+        graph->busy--;
+        pthread_cond_broadcast(&graph->changed);
+    }
+    pthread_mutex_unlock(&graph->lock);
+
+    freeVM();
+    return NULL;
+}
+
+// One per core unless SAFFRON_COMPILE_THREADS says otherwise. A single
+// thread would only do what the imports do anyway, ahead of them.
+static long compileThreads() {
+    const char *threads = getenv("SAFFRON_COMPILE_THREADS");
+    return threads != NULL ? strtol(threads, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+void precompileImports(const char *source) {
+    long threads = compileThreads();
+    if (threads < 2) return;
+
+    ImportGraph graph = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0, 0, 0};
+    scanImports(&graph, source);
+    if (graph.count == 0) return;
+
+    pthread_t *workers = malloc(sizeof(pthread_t) * threads);
+    if (workers == NULL) exit(1);
+
+    int started = 0;
+    while (started < threads && pthread_create(&workers[started], NULL, runPrecompiler, &graph) == 0) {
+        started++;
+    }
+    for (int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+
+    for (int i = 0; i < graph.count; i++) free(graph.paths[i]);
+    free(graph.paths);
+    free(workers);
+}
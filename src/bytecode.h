@@ -0,0 +1,36 @@
+#ifndef SAFFRON_BYTECODE_H
+#define SAFFRON_BYTECODE_H
+
+#include "object.h"
+#include "vm.h"
+
+// Compiled modules are cached next to their source as <path>c, e.g. iter.sfc
+// for iter.sf, and reused for as long as the source doesn't change.
+
+// Loads the cached top level function for module, NULL if there is no
+// usable cache for this exact source
+ObjFunction *loadBytecode(const char *path, const char *source, ObjModule *module);
+
+// Writes function and the global slots it uses, failures are ignored
+void saveBytecode(const char *path, const char *source, ObjFunction *function, ObjModule *module);
+
+// A bundle packs several compiled modules into one file with an index of
+// import path to offset. It is mapped read only, so the code of its modules
+// is used in place and shared between every process that maps it.
+
+// Compiles the modules at paths into a bundle at output
+bool writeBundle(const char *output, const char **paths, int count);
+
+// Maps the bundle at path for loadBundledModule(), false if it can't be used
+bool openBundle(const char *path);
+
+// Loads the top level function for the module imported as path from the open
+// bundle, NULL if it isn't there
+ObjFunction *loadBundledModule(const char *path, ObjModule *module);
+
+// Reads, parses and compiles the files source imports, and the ones they
+// import in turn, on a thread per core with a VM of its own. Their caches
+// are written as usual, so the imports only have to load them.
+void precompileImports(const char *source);
+
+#endif //SAFFRON_BYTECODE_H
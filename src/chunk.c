@@ -11,6 +11,12 @@ void initChunk(Chunk* chunk) {
     chunk->lineCount = 0;
     chunk->lineCapacity = 0;
     chunk->lines = NULL;
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
+    chunk->caches = NULL;
+    chunk->handlerCount = 0;
+    chunk->handlerCapacity = 0;
+    chunk->handlers = NULL;
     initValueArray(&chunk->constants);
 }
 
@@ -43,12 +49,53 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
 }
 
 void freeChunk(Chunk* chunk) {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+    // Chunks loaded from a mapped bundle borrow their code, lines and
+    // handlers from it, leaving no capacity to free
+    if (chunk->capacity > 0) FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    if (chunk->lineCapacity > 0) FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+    if (chunk->handlerCapacity > 0) {
+        FREE_ARRAY(ExceptionHandler, chunk->handlers, chunk->handlerCapacity);
+    }
+    FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
     freeValueArray(&chunk->constants);
     initChunk(chunk);
 }
 
+int addInlineCache(Chunk* chunk) {
+    if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+        int oldCapacity = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->caches = GROW_ARRAY(InlineCache, chunk->caches,
+                                   oldCapacity, chunk->cacheCapacity);
+    }
+
+    InlineCache* cache = &chunk->caches[chunk->cacheCount];
+    cache->version = 0;
+    cache->slot = -1;
+    cache->method = NIL_VAL;
+    cache->tableSlot = -1;
+#ifdef DEBUG_OPCODE_STATS
+    cache->hits = 0;
+    cache->misses = 0;
+#endif
+    return chunk->cacheCount++;
+}
+
+void addHandler(Chunk* chunk, int start, int end, int handler, int depth) {
+    if (chunk->handlerCapacity < chunk->handlerCount + 1) {
+        int oldCapacity = chunk->handlerCapacity;
+        chunk->handlerCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->handlers = GROW_ARRAY(ExceptionHandler, chunk->handlers,
+                                     oldCapacity, chunk->handlerCapacity);
+    }
+
+    ExceptionHandler* entry = &chunk->handlers[chunk->handlerCount++];
+    entry->start = start;
+    entry->end = end;
+    entry->handler = handler;
+    entry->depth = depth;
+}
+
 int addConstant(Chunk* chunk, Value value) {
     push(value);
     writeValueArray(&chunk->constants, value);
@@ -72,4 +119,68 @@ int getLine(Chunk* chunk, int instruction) {
             start = mid + 1;
         }
     }
-}
\ No newline at end of file
+}
+// Size of the instruction at offset, operands included
+int instructionLength(Chunk* chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_LIST:
+        case OP_LIST_EXTEND:
+        case OP_MAP:
+        case OP_MAP_EXTEND:
+            return 2;
+        case OP_CONSTANT_LONG:
+        case OP_GET_LOCAL_LONG:
+        case OP_SET_LOCAL_LONG:
+        case OP_GET_ENCLOSING:
+        case OP_SET_ENCLOSING:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_FIELD:
+        case OP_GET_SUPER:
+        case OP_DEFINE_GLOBAL_SLOT:
+        case OP_GET_GLOBAL_SLOT:
+        case OP_SET_GLOBAL_SLOT:
+        case OP_IN_PLACE_ADD:
+        case OP_IN_PLACE_SUBTRACT:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_JUMP_UNLESS_EQUAL:
+        case OP_JUMP_UNLESS_NOT_EQUAL:
+        case OP_JUMP_UNLESS_GREATER:
+        case OP_JUMP_UNLESS_GREATER_EQUAL:
+        case OP_JUMP_UNLESS_LESS:
+        case OP_JUMP_UNLESS_LESS_EQUAL:
+        case OP_LOOP:
+        case OP_ITER_INIT:
+            return 3;
+        case OP_SUPER_INVOKE:
+        case OP_ADD_LOCALS:
+        case OP_SUBTRACT_LOCALS:
+        case OP_MULTIPLY_LOCALS:
+        case OP_DIVIDE_LOCALS:
+            return 4;
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+            return 5;
+        case OP_INVOKE:
+        case OP_GET_LOCAL_PROPERTY:
+            return 6;
+        case OP_ITER_NEXT:
+            return 7;
+        case OP_CLOSURE: {
+            int constant = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+            ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+            return 3 + 3 * function->upvalueCount;
+        }
+        default:
+            return 1;
+    }
+}
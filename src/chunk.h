@@ -6,8 +6,14 @@
 
 typedef enum {
     OP_LIST,
+    // Append more items, or entries, to the list or map below them, for
+    // literals too long to build with one instruction
+    OP_LIST_EXTEND,
     OP_MAP,
+    OP_MAP_EXTEND,
     OP_CONSTANT,
+    // OP_CONSTANT with a two byte index, like every other constant operand
+    OP_CONSTANT_LONG,
     OP_CLOSURE,
     OP_NEGATE,
     OP_NIL,
@@ -18,28 +24,73 @@ typedef enum {
     OP_MODULO,
     OP_MULTIPLY,
     OP_DIVIDE,
+    // Emitted when the compiler has proven both operands are numbers, or
+    // strings for OP_CONCAT_STR, so they skip the checks
+    OP_ADD_NUM,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_GREATER_NUM,
+    OP_LESS_NUM,
+    OP_CONCAT_STR,
     OP_NOT,
     OP_EQUAL,
+    OP_NOT_EQUAL,
     OP_GREATER,
+    OP_GREATER_EQUAL,
     OP_LESS,
+    OP_LESS_EQUAL,
     OP_POP,
     OP_CLOSE_UPVALUE,
+    // Add a number constant to a local without touching the stack
     OP_IN_PLACE_ADD,
     OP_IN_PLACE_SUBTRACT,
-    OP_DEFINE_GLOBAL,
-    OP_GET_GLOBAL,
-    OP_SET_GLOBAL,
+    // Arithmetic between locals in three-address form, slots[dst] =
+    // slots[a] op slots[b], so a = b + c doesn't go through the stack
+    OP_ADD_LOCALS,
+    OP_SUBTRACT_LOCALS,
+    OP_MULTIPLY_LOCALS,
+    OP_DIVIDE_LOCALS,
+    OP_DEFINE_GLOBAL_SLOT,
+    OP_GET_GLOBAL_SLOT,
+    OP_SET_GLOBAL_SLOT,
     OP_GET_LOCAL,
     OP_SET_LOCAL,
+    // For slots past UINT8_MAX
+    OP_GET_LOCAL_LONG,
+    OP_SET_LOCAL_LONG,
     OP_JUMP,
     OP_JUMP_IF_FALSE,
+    OP_POP_JUMP_IF_FALSE,
+    // Compare the top two numbers (or values, for the equality tests), pop
+    // them and jump if the comparison is false
+    OP_JUMP_UNLESS_EQUAL,
+    OP_JUMP_UNLESS_NOT_EQUAL,
+    OP_JUMP_UNLESS_GREATER,
+    OP_JUMP_UNLESS_GREATER_EQUAL,
+    OP_JUMP_UNLESS_LESS,
+    OP_JUMP_UNLESS_LESS_EQUAL,
     OP_LOOP,
+    // for-in: the hidden state local sits under the iterable, OP_ITER_NEXT
+    // pushes the next item or jumps out of the loop once there isn't one
+    OP_ITER_INIT,
+    OP_ITER_NEXT,
     OP_CALL,
+    // A call in tail position, which reuses the calling frame for closures
+    OP_TAIL_CALL,
     OP_GETITEM,
+    // A list known to be indexed by a number
+    OP_GETITEM_LIST_NUM,
+    OP_SETITEM,
     OP_PIPE,
     OP_GET_UPVALUE,
     OP_SET_UPVALUE,
+    // A local of the frame a closure was called from, for closures that
+    // can only be called there
+    OP_GET_ENCLOSING,
+    OP_SET_ENCLOSING,
     OP_GET_PROPERTY,
+    OP_GET_LOCAL_PROPERTY,
     OP_SET_PROPERTY,
     OP_INVOKE,
     OP_GET_SUPER,
@@ -50,6 +101,8 @@ typedef enum {
     OP_INHERIT,
     OP_YIELD,
     OP_RESUME,
+    // Raises the value on top, see catchError()
+    OP_THROW,
     OP_RETURN,
     OP_IMPORT,
 } OpCode;
@@ -59,6 +112,34 @@ typedef struct {
     int line;
 } LineStart;
 
+// Remembers what the last receiver of a property instruction resolved to.
+// Class versions are unique across all classes, so a matching version means
+// the same class with the same fields and methods.
+typedef struct {
+    uint32_t version;
+    // The declared field the name maps to, -1 if it isn't one
+    int slot;
+    // What the name resolves to on the class, nil if it has no such method
+    Value method;
+    // Where a field added at runtime was last found in the instance's table
+    int tableSlot;
+#ifdef DEBUG_OPCODE_STATS
+    uint64_t hits;
+    uint64_t misses;
+#endif
+} InlineCache;
+
+// A try block: an error raised by the code in [start, end) unwinds the frame
+// to depth locals and jumps to handler with the error pushed on top. Nothing
+// runs on entering or leaving the block, handlers are only looked up once
+// something is thrown.
+typedef struct {
+    int start;
+    int end;
+    int handler;
+    int depth;
+} ExceptionHandler;
+
 typedef struct {
     int count;
     int capacity;
@@ -67,12 +148,22 @@ typedef struct {
     int lineCount;
     int lineCapacity;
     LineStart* lines;
+    int cacheCount;
+    int cacheCapacity;
+    InlineCache* caches;
+    // Innermost try blocks first
+    int handlerCount;
+    int handlerCapacity;
+    ExceptionHandler* handlers;
 } Chunk;
 
 void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 int addConstant(Chunk* chunk, Value value);
+int addInlineCache(Chunk* chunk);
+void addHandler(Chunk* chunk, int start, int end, int handler, int depth);
 int getLine(Chunk* chunk, int instruction);
+int instructionLength(Chunk* chunk, int offset);
 
 #endif
\ No newline at end of file
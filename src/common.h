@@ -10,7 +10,17 @@
 #define DEBUG_PRINT_CODE
 //#define DEBUG_STRESS_GC
 //#define DEBUG_LOG_GC
+// Counts instructions, instruction pairs and inline cache hits, reported by
+// freeVM(), see the SAFFRON_OPCODE_STATS build option
+//#define DEBUG_OPCODE_STATS
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
+
+// Threaded dispatch through a table of label addresses (a GNU extension).
+// Tracing needs the plain switch so that it sees every instruction.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(DEBUG_TRACE_EXECUTION) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
 
 #endif
\ No newline at end of file
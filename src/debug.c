@@ -2,14 +2,108 @@
 
 #include "debug.h"
 #include "object.h"
+#include "output.h"
+
+#define OPCODE_NAME(op) case op: return #op;
+
+const char *opcodeName(uint8_t instruction) {
+    switch (instruction) {
+        OPCODE_NAME(OP_LIST)
+        OPCODE_NAME(OP_LIST_EXTEND)
+        OPCODE_NAME(OP_MAP)
+        OPCODE_NAME(OP_MAP_EXTEND)
+        OPCODE_NAME(OP_CONSTANT)
+        OPCODE_NAME(OP_CONSTANT_LONG)
+        OPCODE_NAME(OP_CLOSURE)
+        OPCODE_NAME(OP_NEGATE)
+        OPCODE_NAME(OP_NIL)
+        OPCODE_NAME(OP_TRUE)
+        OPCODE_NAME(OP_FALSE)
+        OPCODE_NAME(OP_ADD)
+        OPCODE_NAME(OP_SUBTRACT)
+        OPCODE_NAME(OP_MODULO)
+        OPCODE_NAME(OP_MULTIPLY)
+        OPCODE_NAME(OP_DIVIDE)
+        OPCODE_NAME(OP_ADD_NUM)
+        OPCODE_NAME(OP_SUBTRACT_NUM)
+        OPCODE_NAME(OP_MULTIPLY_NUM)
+        OPCODE_NAME(OP_DIVIDE_NUM)
+        OPCODE_NAME(OP_GREATER_NUM)
+        OPCODE_NAME(OP_LESS_NUM)
+        OPCODE_NAME(OP_CONCAT_STR)
+        OPCODE_NAME(OP_NOT)
+        OPCODE_NAME(OP_EQUAL)
+        OPCODE_NAME(OP_NOT_EQUAL)
+        OPCODE_NAME(OP_GREATER)
+        OPCODE_NAME(OP_GREATER_EQUAL)
+        OPCODE_NAME(OP_LESS)
+        OPCODE_NAME(OP_LESS_EQUAL)
+        OPCODE_NAME(OP_POP)
+        OPCODE_NAME(OP_CLOSE_UPVALUE)
+        OPCODE_NAME(OP_IN_PLACE_ADD)
+        OPCODE_NAME(OP_IN_PLACE_SUBTRACT)
+        OPCODE_NAME(OP_ADD_LOCALS)
+        OPCODE_NAME(OP_SUBTRACT_LOCALS)
+        OPCODE_NAME(OP_MULTIPLY_LOCALS)
+        OPCODE_NAME(OP_DIVIDE_LOCALS)
+        OPCODE_NAME(OP_DEFINE_GLOBAL_SLOT)
+        OPCODE_NAME(OP_GET_GLOBAL_SLOT)
+        OPCODE_NAME(OP_SET_GLOBAL_SLOT)
+        OPCODE_NAME(OP_GET_LOCAL)
+        OPCODE_NAME(OP_SET_LOCAL)
+        OPCODE_NAME(OP_GET_LOCAL_LONG)
+        OPCODE_NAME(OP_SET_LOCAL_LONG)
+        OPCODE_NAME(OP_JUMP)
+        OPCODE_NAME(OP_JUMP_IF_FALSE)
+        OPCODE_NAME(OP_POP_JUMP_IF_FALSE)
+        OPCODE_NAME(OP_JUMP_UNLESS_EQUAL)
+        OPCODE_NAME(OP_JUMP_UNLESS_NOT_EQUAL)
+        OPCODE_NAME(OP_JUMP_UNLESS_GREATER)
+        OPCODE_NAME(OP_JUMP_UNLESS_GREATER_EQUAL)
+        OPCODE_NAME(OP_JUMP_UNLESS_LESS)
+        OPCODE_NAME(OP_JUMP_UNLESS_LESS_EQUAL)
+        OPCODE_NAME(OP_LOOP)
+        OPCODE_NAME(OP_ITER_INIT)
+        OPCODE_NAME(OP_ITER_NEXT)
+        OPCODE_NAME(OP_CALL)
+        OPCODE_NAME(OP_TAIL_CALL)
+        OPCODE_NAME(OP_GETITEM)
+        OPCODE_NAME(OP_GETITEM_LIST_NUM)
+        OPCODE_NAME(OP_SETITEM)
+        OPCODE_NAME(OP_PIPE)
+        OPCODE_NAME(OP_GET_UPVALUE)
+        OPCODE_NAME(OP_SET_UPVALUE)
+        OPCODE_NAME(OP_GET_ENCLOSING)
+        OPCODE_NAME(OP_SET_ENCLOSING)
+        OPCODE_NAME(OP_GET_PROPERTY)
+        OPCODE_NAME(OP_GET_LOCAL_PROPERTY)
+        OPCODE_NAME(OP_SET_PROPERTY)
+        OPCODE_NAME(OP_INVOKE)
+        OPCODE_NAME(OP_GET_SUPER)
+        OPCODE_NAME(OP_SUPER_INVOKE)
+        OPCODE_NAME(OP_METHOD)
+        OPCODE_NAME(OP_FIELD)
+        OPCODE_NAME(OP_CLASS)
+        OPCODE_NAME(OP_INHERIT)
+        OPCODE_NAME(OP_YIELD)
+        OPCODE_NAME(OP_RESUME)
+        OPCODE_NAME(OP_THROW)
+        OPCODE_NAME(OP_RETURN)
+        OPCODE_NAME(OP_IMPORT)
+        default:
+            return "OP_UNKNOWN";
+    }
+}
+
+#undef OPCODE_NAME
 
 static int simpleInstruction(const char *name, int offset) {
-    printf("%s\n", name);
+    printOutput("%s\n", name);
     return offset + 1;
 }
 
 void disassembleChunk(Chunk *chunk, const char *name) {
-    printf("== %s ==\n", name);
+    printOutput("== %s ==\n", name);
 
     for (int offset = 0; offset < chunk->count;) {
         offset = disassembleInstruction(chunk, offset);
@@ -19,45 +113,137 @@ void disassembleChunk(Chunk *chunk, const char *name) {
 static int constantInstruction(const char *name, Chunk *chunk,
                                int offset) {
     uint8_t constant = chunk->code[offset + 1];
-    printf("%-16s %4d '", name, constant);
+    printOutput("%-16s %4d '", name, constant);
     printValue(chunk->constants.values[constant]);
-    printf("'\n");
+    printOutput("'\n");
     return offset + 2;
 }
 
+static int constantLongInstruction(const char *name, Chunk *chunk,
+                                   int offset) {
+    uint16_t constant = (uint16_t) (chunk->code[offset + 1] << 8);
+    constant |= chunk->code[offset + 2];
+    printOutput("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printOutput("'\n");
+    return offset + 3;
+}
+
 static int byteInstruction(const char *name, Chunk *chunk,
                            int offset) {
     uint8_t slot = chunk->code[offset + 1];
-    printf("%-16s %4d\n", name, slot);
+    printOutput("%-16s %4d\n", name, slot);
     return offset + 2;
 }
 
+static int slotInstruction(const char *name, Chunk *chunk,
+                           int offset) {
+    uint16_t slot = (uint16_t) (chunk->code[offset + 1] << 8);
+    slot |= chunk->code[offset + 2];
+    printOutput("%-16s %4d\n", name, slot);
+    return offset + 3;
+}
+
 static int jumpInstruction(const char *name, int sign,
                            Chunk *chunk, int offset) {
     uint16_t jump = (uint16_t) (chunk->code[offset + 1] << 8);
     jump |= chunk->code[offset + 2];
-    printf("%-16s %4d -> %d\n", name, offset,
+    printOutput("%-16s %4d -> %d\n", name, offset,
            offset + 3 + sign * jump);
     return offset + 3;
 }
 
+static int iterInitInstruction(Chunk *chunk, int offset) {
+    uint16_t cache = (uint16_t) (chunk->code[offset + 1] << 8);
+    cache |= chunk->code[offset + 2];
+    printOutput("%-16s (cache %d)\n", "OP_ITER_INIT", cache);
+    return offset + 3;
+}
+
+static int iterNextInstruction(Chunk *chunk, int offset) {
+    uint16_t jump = (uint16_t) (chunk->code[offset + 1] << 8);
+    jump |= chunk->code[offset + 2];
+    uint16_t slot = (uint16_t) (chunk->code[offset + 3] << 8);
+    slot |= chunk->code[offset + 4];
+    uint16_t cache = (uint16_t) (chunk->code[offset + 5] << 8);
+    cache |= chunk->code[offset + 6];
+    printOutput("%-16s %4d -> %d slot %d (cache %d)\n", "OP_ITER_NEXT", offset,
+           offset + 3 + jump, slot, cache);
+    return offset + 7;
+}
+
+static int localConstantInstruction(const char *name, Chunk *chunk,
+                                    int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    printOutput("%-16s %4d '", name, slot);
+    printValue(chunk->constants.values[constant]);
+    printOutput("'\n");
+    return offset + 3;
+}
+
+static int localsInstruction(const char *name, Chunk *chunk, int offset) {
+    uint8_t *operands = &chunk->code[offset + 1];
+    printOutput("%-16s %4d %4d %4d\n", name, operands[0], operands[1], operands[2]);
+    return offset + 4;
+}
+
 static int invokeInstruction(const char* name, Chunk* chunk,
                              int offset) {
-    uint8_t constant = chunk->code[offset + 1];
-    uint8_t argCount = chunk->code[offset + 2];
-    printf("%-16s (%d args) %4d '", name, argCount, constant);
+    uint16_t constant = (uint16_t) (chunk->code[offset + 1] << 8);
+    constant |= chunk->code[offset + 2];
+    uint8_t argCount = chunk->code[offset + 3];
+    printOutput("%-16s (%d args) %4d '", name, argCount, constant);
     printValue(chunk->constants.values[constant]);
-    printf("'\n");
-    return offset + 3;
+    printOutput("'\n");
+    return offset + 4;
+}
+
+static int propertyInstruction(const char *name, Chunk *chunk,
+                               int offset) {
+    uint16_t constant = (uint16_t) (chunk->code[offset + 1] << 8);
+    constant |= chunk->code[offset + 2];
+    uint16_t cache = (uint16_t) (chunk->code[offset + 3] << 8);
+    cache |= chunk->code[offset + 4];
+    printOutput("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printOutput("' (cache %d)\n", cache);
+    return offset + 5;
+}
+
+static int localPropertyInstruction(const char *name, Chunk *chunk,
+                                    int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint16_t constant = (uint16_t) (chunk->code[offset + 2] << 8);
+    constant |= chunk->code[offset + 3];
+    uint16_t cache = (uint16_t) (chunk->code[offset + 4] << 8);
+    cache |= chunk->code[offset + 5];
+    printOutput("%-16s %4d %4d '", name, slot, constant);
+    printValue(chunk->constants.values[constant]);
+    printOutput("' (cache %d)\n", cache);
+    return offset + 6;
+}
+
+static int cachedInvokeInstruction(const char* name, Chunk* chunk,
+                                   int offset) {
+    uint16_t constant = (uint16_t) (chunk->code[offset + 1] << 8);
+    constant |= chunk->code[offset + 2];
+    uint8_t argCount = chunk->code[offset + 3];
+    uint16_t cache = (uint16_t) (chunk->code[offset + 4] << 8);
+    cache |= chunk->code[offset + 5];
+    printOutput("%-16s (%d args) %4d '", name, argCount, constant);
+    printValue(chunk->constants.values[constant]);
+    printOutput("' (cache %d)\n", cache);
+    return offset + 6;
 }
 
 int disassembleInstruction(Chunk *chunk, int offset) {
-    printf("%04d ", offset);
+    printOutput("%04d ", offset);
     int line = getLine(chunk, offset);
     if (offset > 0 && line == getLine(chunk, offset - 1)) {
-        printf("   | ");
+        printOutput("   | ");
     } else {
-        printf("%4d ", line);
+        printOutput("%4d ", line);
     }
 
     uint8_t instruction = chunk->code[offset];
@@ -66,6 +252,8 @@ int disassembleInstruction(Chunk *chunk, int offset) {
             return simpleInstruction("OP_NOT", offset);
         case OP_CONSTANT:
             return constantInstruction("OP_CONSTANT", chunk, offset);
+        case OP_CONSTANT_LONG:
+            return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
         case OP_NEGATE:
             return simpleInstruction("OP_NEGATE", offset);
         case OP_RETURN:
@@ -74,6 +262,8 @@ int disassembleInstruction(Chunk *chunk, int offset) {
             return simpleInstruction("OP_RESUME", offset);
         case OP_YIELD:
             return simpleInstruction("OP_YIELD", offset);
+        case OP_THROW:
+            return simpleInstruction("OP_THROW", offset);
         case OP_ADD:
             return simpleInstruction("OP_ADD", offset);
         case OP_MODULO:
@@ -84,6 +274,20 @@ int disassembleInstruction(Chunk *chunk, int offset) {
             return simpleInstruction("OP_MULTIPLY", offset);
         case OP_DIVIDE:
             return simpleInstruction("OP_DIVIDE", offset);
+        case OP_ADD_NUM:
+            return simpleInstruction("OP_ADD_NUM", offset);
+        case OP_SUBTRACT_NUM:
+            return simpleInstruction("OP_SUBTRACT_NUM", offset);
+        case OP_MULTIPLY_NUM:
+            return simpleInstruction("OP_MULTIPLY_NUM", offset);
+        case OP_DIVIDE_NUM:
+            return simpleInstruction("OP_DIVIDE_NUM", offset);
+        case OP_GREATER_NUM:
+            return simpleInstruction("OP_GREATER_NUM", offset);
+        case OP_LESS_NUM:
+            return simpleInstruction("OP_LESS_NUM", offset);
+        case OP_CONCAT_STR:
+            return simpleInstruction("OP_CONCAT_STR", offset);
         case OP_NIL:
             return simpleInstruction("OP_NIL", offset);
         case OP_TRUE:
@@ -92,51 +296,99 @@ int disassembleInstruction(Chunk *chunk, int offset) {
             return simpleInstruction("OP_FALSE", offset);
         case OP_EQUAL:
             return simpleInstruction("OP_EQUAL", offset);
+        case OP_NOT_EQUAL:
+            return simpleInstruction("OP_NOT_EQUAL", offset);
         case OP_GREATER:
             return simpleInstruction("OP_GREATER", offset);
+        case OP_GREATER_EQUAL:
+            return simpleInstruction("OP_GREATER_EQUAL", offset);
         case OP_LESS:
             return simpleInstruction("OP_LESS", offset);
+        case OP_LESS_EQUAL:
+            return simpleInstruction("OP_LESS_EQUAL", offset);
         case OP_POP:
             return simpleInstruction("OP_POP", offset);
-        case OP_DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", chunk,
-                                       offset);
-        case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", chunk, offset);
-        case OP_SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+        case OP_DEFINE_GLOBAL_SLOT:
+            return slotInstruction("OP_DEFINE_GLOBAL_SLOT", chunk, offset);
+        case OP_GET_GLOBAL_SLOT:
+            return slotInstruction("OP_GET_GLOBAL_SLOT", chunk, offset);
+        case OP_SET_GLOBAL_SLOT:
+            return slotInstruction("OP_SET_GLOBAL_SLOT", chunk, offset);
         case OP_GET_LOCAL:
             return byteInstruction("OP_GET_LOCAL", chunk, offset);
         case OP_SET_LOCAL:
             return byteInstruction("OP_SET_LOCAL", chunk, offset);
+        case OP_GET_LOCAL_LONG:
+            return slotInstruction("OP_GET_LOCAL_LONG", chunk, offset);
+        case OP_SET_LOCAL_LONG:
+            return slotInstruction("OP_SET_LOCAL_LONG", chunk, offset);
+        case OP_IN_PLACE_ADD:
+            return localConstantInstruction("OP_IN_PLACE_ADD", chunk, offset);
+        case OP_IN_PLACE_SUBTRACT:
+            return localConstantInstruction("OP_IN_PLACE_SUBTRACT", chunk, offset);
+        case OP_ADD_LOCALS:
+            return localsInstruction("OP_ADD_LOCALS", chunk, offset);
+        case OP_SUBTRACT_LOCALS:
+            return localsInstruction("OP_SUBTRACT_LOCALS", chunk, offset);
+        case OP_MULTIPLY_LOCALS:
+            return localsInstruction("OP_MULTIPLY_LOCALS", chunk, offset);
+        case OP_DIVIDE_LOCALS:
+            return localsInstruction("OP_DIVIDE_LOCALS", chunk, offset);
         case OP_JUMP:
             return jumpInstruction("OP_JUMP", 1, chunk, offset);
         case OP_JUMP_IF_FALSE:
             return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_POP_JUMP_IF_FALSE:
+            return jumpInstruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_JUMP_UNLESS_EQUAL:
+            return jumpInstruction("OP_JUMP_UNLESS_EQUAL", 1, chunk, offset);
+        case OP_JUMP_UNLESS_NOT_EQUAL:
+            return jumpInstruction("OP_JUMP_UNLESS_NOT_EQUAL", 1, chunk, offset);
+        case OP_JUMP_UNLESS_GREATER:
+            return jumpInstruction("OP_JUMP_UNLESS_GREATER", 1, chunk, offset);
+        case OP_JUMP_UNLESS_GREATER_EQUAL:
+            return jumpInstruction("OP_JUMP_UNLESS_GREATER_EQUAL", 1, chunk, offset);
+        case OP_JUMP_UNLESS_LESS:
+            return jumpInstruction("OP_JUMP_UNLESS_LESS", 1, chunk, offset);
+        case OP_JUMP_UNLESS_LESS_EQUAL:
+            return jumpInstruction("OP_JUMP_UNLESS_LESS_EQUAL", 1, chunk, offset);
         case OP_LOOP:
             return jumpInstruction("OP_LOOP", -1, chunk, offset);
+        case OP_ITER_INIT:
+            return iterInitInstruction(chunk, offset);
+        case OP_ITER_NEXT:
+            return iterNextInstruction(chunk, offset);
         case OP_CALL:
             return byteInstruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return byteInstruction("OP_TAIL_CALL", chunk, offset);
         case OP_GETITEM:
             return simpleInstruction("OP_GETITEM", offset);
+        case OP_GETITEM_LIST_NUM:
+            return simpleInstruction("OP_GETITEM_LIST_NUM", offset);
+        case OP_SETITEM:
+            return simpleInstruction("OP_SETITEM", offset);
         case OP_PIPE:
             return simpleInstruction("OP_PIPE", offset);
         case OP_CLOSE_UPVALUE:
             return simpleInstruction("OP_CLOSE_UPVALUE", offset);
         case OP_CLOSURE: {
             offset++;
-            uint8_t constant = chunk->code[offset++];
-            printf("%-16s %4d ", "OP_CLOSURE", constant);
+            uint16_t constant = (uint16_t) (chunk->code[offset] << 8);
+            constant |= chunk->code[offset + 1];
+            offset += 2;
+            printOutput("%-16s %4d ", "OP_CLOSURE", constant);
             printValue(chunk->constants.values[constant]);
-            printf("\n");
+            printOutput("\n");
 
             ObjFunction *function = AS_FUNCTION(
                     chunk->constants.values[constant]);
             for (int j = 0; j < function->upvalueCount; j++) {
-                int isLocal = chunk->code[offset++];
-                int index = chunk->code[offset++];
-                printf("%04d    |                     %s %d\n",
-                       offset - 2, isLocal ? "local" : "upvalue", index);
+                int isLocal = chunk->code[offset];
+                int index = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+                printOutput("%04d    |                     %s %d\n",
+                       offset, isLocal ? "local" : "upvalue", index);
+                offset += 3;
             }
 
             return offset;
@@ -145,33 +397,203 @@ int disassembleInstruction(Chunk *chunk, int offset) {
             return byteInstruction("OP_GET_UPVALUE", chunk, offset);
         case OP_SET_UPVALUE:
             return byteInstruction("OP_SET_UPVALUE", chunk, offset);
+        case OP_GET_ENCLOSING:
+            return slotInstruction("OP_GET_ENCLOSING", chunk, offset);
+        case OP_SET_ENCLOSING:
+            return slotInstruction("OP_SET_ENCLOSING", chunk, offset);
         case OP_GET_PROPERTY:
-            return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
+        case OP_GET_LOCAL_PROPERTY:
+            return localPropertyInstruction("OP_GET_LOCAL_PROPERTY", chunk, offset);
         case OP_SET_PROPERTY:
-            return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
         case OP_INVOKE:
-            return invokeInstruction("OP_INVOKE", chunk, offset);
+            return cachedInvokeInstruction("OP_INVOKE", chunk, offset);
         case OP_CLASS:
-            return constantInstruction("OP_CLASS", chunk, offset);
+            return constantLongInstruction("OP_CLASS", chunk, offset);
         case OP_METHOD:
-            return constantInstruction("OP_METHOD", chunk, offset);
+            return constantLongInstruction("OP_METHOD", chunk, offset);
         case OP_FIELD:
-            return constantInstruction("OP_FIELD", chunk, offset);
+            return constantLongInstruction("OP_FIELD", chunk, offset);
         case OP_INHERIT:
             return simpleInstruction("OP_INHERIT", offset);
         case OP_GET_SUPER:
-            return constantInstruction("OP_GET_SUPER", chunk, offset);
+            return constantLongInstruction("OP_GET_SUPER", chunk, offset);
         case OP_SUPER_INVOKE:
             return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
         case OP_LIST:
             return byteInstruction("OP_LIST", chunk, offset);
+        case OP_LIST_EXTEND:
+            return byteInstruction("OP_LIST_EXTEND", chunk, offset);
         case OP_MAP:
             return byteInstruction("OP_MAP", chunk, offset);
+        case OP_MAP_EXTEND:
+            return byteInstruction("OP_MAP_EXTEND", chunk, offset);
         case OP_IMPORT:
             return simpleInstruction("OP_IMPORT", offset);
         default:
-            printf("Unknown opcode %d\n", instruction);
+            printOutput("Unknown opcode %d\n", instruction);
             return offset + 1;
     }
 }
 
+
+#ifdef DEBUG_OPCODE_STATS
+#include <stdlib.h>
+
+#include "vm.h"
+
+// How many rows each section of the report lists
+#define STATS_ROWS 30
+
+static _Thread_local uint64_t instructionCounts[UINT8_COUNT];
+static _Thread_local uint64_t pairCounts[UINT8_COUNT][UINT8_COUNT];
+static _Thread_local uint8_t previousInstruction = OP_RETURN;
+
+void countInstruction(uint8_t instruction) {
+    instructionCounts[instruction]++;
+    pairCounts[previousInstruction][instruction]++;
+    previousInstruction = instruction;
+}
+
+typedef struct {
+    uint64_t count;
+    const char *name;
+    const char *second;
+} CountRow;
+
+typedef struct {
+    uint64_t uses;
+    ObjFunction *function;
+    int offset;
+    InlineCache *cache;
+} CacheRow;
+
+static int compareCountRows(const void *a, const void *b) {
+    uint64_t left = ((const CountRow *) a)->count;
+    uint64_t right = ((const CountRow *) b)->count;
+    return (left < right) - (left > right);
+}
+
+static int compareCacheRows(const void *a, const void *b) {
+    uint64_t left = ((const CacheRow *) a)->uses;
+    uint64_t right = ((const CacheRow *) b)->uses;
+    return (left < right) - (left > right);
+}
+
+static double percentOf(uint64_t count, uint64_t total) {
+    return total == 0 ? 0 : 100.0 * (double) count / (double) total;
+}
+
+static void printInstructionCounts(uint64_t total) {
+    CountRow rows[UINT8_COUNT];
+    int count = 0;
+    for (int i = 0; i < UINT8_COUNT; i++) {
+        if (instructionCounts[i] > 0) rows[count++] = (CountRow) {instructionCounts[i], opcodeName(i), NULL};
+    }
+    qsort(rows, count, sizeof(CountRow), compareCountRows);
+
+    fprintf(stderr, "== instructions (%llu run) ==\n", (unsigned long long) total);
+    for (int i = 0; i < count; i++) {
+        fprintf(stderr, "%-28s %14llu %6.2f%%\n", rows[i].name,
+                (unsigned long long) rows[i].count, percentOf(rows[i].count, total));
+    }
+}
+
+static void printPairCounts(uint64_t total) {
+    CountRow *rows = malloc(sizeof(CountRow) * UINT8_COUNT * UINT8_COUNT);
+    if (rows == NULL) return;
+
+    int count = 0;
+    for (int first = 0; first < UINT8_COUNT; first++) {
+        for (int second = 0; second < UINT8_COUNT; second++) {
+            if (pairCounts[first][second] == 0) continue;
+            rows[count++] = (CountRow) {pairCounts[first][second], opcodeName(first), opcodeName(second)};
+        }
+    }
+    qsort(rows, count, sizeof(CountRow), compareCountRows);
+
+    fprintf(stderr, "== instruction pairs ==\n");
+    for (int i = 0; i < count && i < STATS_ROWS; i++) {
+        fprintf(stderr, "%-28s %-28s %14llu %6.2f%%\n", rows[i].name, rows[i].second,
+                (unsigned long long) rows[i].count, percentOf(rows[i].count, total));
+    }
+    free(rows);
+}
+
+static bool hasCache(uint8_t instruction) {
+    switch (instruction) {
+        case OP_GET_PROPERTY:
+        case OP_GET_LOCAL_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_INVOKE:
+        case OP_ITER_INIT:
+        case OP_ITER_NEXT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Every cached instruction keeps its cache index in its last two bytes
+static void collectCacheRows(ObjFunction *function, CacheRow **rows, int *count, int *capacity) {
+    Chunk *chunk = &function->chunk;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        if (!hasCache(chunk->code[offset])) continue;
+
+        int end = offset + instructionLength(chunk, offset);
+        InlineCache *cache = &chunk->caches[(chunk->code[end - 2] << 8) | chunk->code[end - 1]];
+        uint64_t uses = cache->hits + cache->misses;
+        if (uses == 0) continue;
+
+        if (*count + 1 > *capacity) {
+            *capacity = *capacity < 64 ? 64 : *capacity * 2;
+            *rows = realloc(*rows, sizeof(CacheRow) * *capacity);
+            if (*rows == NULL) exit(1);
+        }
+        (*rows)[(*count)++] = (CacheRow) {uses, function, offset, cache};
+    }
+}
+
+static void printCacheRows() {
+    CacheRow *rows = NULL;
+    int count = 0;
+    int capacity = 0;
+    for (Obj *object = vm.objects; object != NULL; object = object->next) {
+        if (object->type == OBJ_FUNCTION) collectCacheRows((ObjFunction *) object, &rows, &count, &capacity);
+    }
+    qsort(rows, count, sizeof(CacheRow), compareCacheRows);
+
+    fprintf(stderr, "== inline caches ==\n");
+    for (int i = 0; i < count && i < STATS_ROWS; i++) {
+        CacheRow *row = &rows[i];
+        Chunk *chunk = &row->function->chunk;
+        uint8_t instruction = chunk->code[row->offset];
+        const char *function = row->function->name == NULL ? "<script>" : row->function->name->chars;
+        fprintf(stderr, "%-20s line %-5d %-22s", function, getLine(chunk, row->offset), opcodeName(instruction));
+
+        // The property name, where the instruction has one
+        int constant = -1;
+        if (instruction == OP_GET_PROPERTY || instruction == OP_SET_PROPERTY || instruction == OP_INVOKE) {
+            constant = (chunk->code[row->offset + 1] << 8) | chunk->code[row->offset + 2];
+        } else if (instruction == OP_GET_LOCAL_PROPERTY) {
+            constant = (chunk->code[row->offset + 2] << 8) | chunk->code[row->offset + 3];
+        }
+        fprintf(stderr, " %-16s", constant >= 0 ? AS_CSTRING(chunk->constants.values[constant]) : "");
+
+        fprintf(stderr, " hits %12llu misses %10llu %6.2f%%\n",
+                (unsigned long long) row->cache->hits, (unsigned long long) row->cache->misses,
+                percentOf(row->cache->hits, row->uses));
+    }
+    free(rows);
+}
+
+void printOpcodeStats() {
+    uint64_t total = 0;
+    for (int i = 0; i < UINT8_COUNT; i++) total += instructionCounts[i];
+
+    printInstructionCounts(total);
+    printPairCounts(total);
+    printCacheRows();
+}
+#endif
@@ -5,5 +5,15 @@
 
 void disassembleChunk(Chunk* chunk, const char* name);
 int disassembleInstruction(Chunk* chunk, int offset);
+// "OP_ADD" for OP_ADD and so on, "OP_UNKNOWN" for a byte that isn't one
+const char* opcodeName(uint8_t instruction);
+
+#ifdef DEBUG_OPCODE_STATS
+// Counts instruction and the pair it makes with the one run before it
+void countInstruction(uint8_t instruction);
+// Prints the most run instructions and pairs, and how well the inline caches
+// of the functions still alive did, to stderr
+void printOpcodeStats();
+#endif
 
 #endif
\ No newline at end of file
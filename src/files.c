@@ -1,34 +1,97 @@
 #include "files.h"
 
 #include "common.h"
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Sources that were mapped rather than read, freeFile() unmaps them
+typedef struct MappedSource {
+    char *chars;
+    size_t length;
+    struct MappedSource *next;
+} MappedSource;
+
+static _Thread_local MappedSource *mappedSources = NULL;
 
 char *findModule(const char *relPath) {
     return relPath;
 }
 
-char *readFile(const char *path) {
-    FILE *file = fopen(path, "rb");
+// Maps the file straight from the page cache when the page its last byte
+// is on has room for the terminator, which the kernel zero fills
+static char *mapSource(int fd, size_t length) {
+    long pageSize = sysconf(_SC_PAGESIZE);
+    if (length == 0 || pageSize <= 0 || length % pageSize == 0) return NULL;
 
-    if (file == NULL) {
+    char *chars = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (chars == MAP_FAILED) return NULL;
+
+    MappedSource *source = malloc(sizeof(MappedSource));
+    if (source == NULL) {
+        munmap(chars, length);
+        return NULL;
+    }
+    source->chars = chars;
+    source->length = length;
+    source->next = mappedSources;
+    mappedSources = source;
+    return chars;
+}
+
+char *readFile(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
         fprintf(stderr, "Could not open file \"%s\".\n", path);
         exit(74);
     }
 
-    fseek(file, 0L, SEEK_END);
-    size_t fileSize = ftell(file);
-    rewind(file);
+    char *mapped = S_ISREG(info.st_mode) ? mapSource(fd, (size_t) info.st_size) : NULL;
+    if (mapped != NULL) {
+        close(fd);
+        return mapped;
+    }
+
+    size_t capacity = S_ISREG(info.st_mode) ? (size_t) info.st_size + 1 : 4096;
+    char *buffer = (char *) malloc(capacity);
+    size_t length = 0;
+    while (buffer != NULL) {
+        if (length + 1 == capacity) {
+            capacity *= 2;
+            char *grown = realloc(buffer, capacity);
+            if (grown == NULL) free(buffer);
+            buffer = grown;
+            if (buffer == NULL) break;
+        }
 
-    char *buffer = (char *) malloc(fileSize + 1);
+        ssize_t count = read(fd, buffer + length, capacity - length - 1);
+        if (count <= 0) break;
+        length += count;
+    }
     if (buffer == NULL) {
         fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
         exit(74);
     }
 
-    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-    buffer[bytesRead] = '\0';
-
-    fclose(file);
+    buffer[length] = '\0';
+    close(fd);
     return buffer;
-}
\ No newline at end of file
+}
+
+void freeFile(char *source) {
+    for (MappedSource **link = &mappedSources; *link != NULL; link = &(*link)->next) {
+        MappedSource *mapped = *link;
+        if (mapped->chars != source) continue;
+
+        munmap(mapped->chars, mapped->length);
+        *link = mapped->next;
+        free(mapped);
+        return;
+    }
+
+    free(source);
+}
@@ -2,6 +2,9 @@
 #define SAFFRON_FILES_H
 
 char *findModule(const char *relPath);
+// The file's contents followed by a terminator, exits if it can't be read.
+// Regular files are mapped rather than copied, free it with freeFile().
 char *readFile(const char *path);
+void freeFile(char *source);
 
 #endif //SAFFRON_FILES_H
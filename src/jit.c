@@ -0,0 +1,848 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "jit.h"
+#include "object.h"
+
+#ifdef JIT_ENABLED
+
+#include <math.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "vm.h"
+#include "memory.h"
+#include "profiler.h"
+#include "libc/list.h"
+
+// What compiled code reads when it is entered and writes back when it
+// leaves, the interpreter picks the frame up from here
+typedef struct {
+    Value *slots;
+    Value *stackTop;
+    Value *constants;
+    ObjModule *module;
+    // The offset of the instruction the interpreter runs next
+    uint32_t exit;
+} JitState;
+
+typedef void (*JitEntry)(JitState *state, uint8_t *target);
+
+struct JitCode {
+    uint8_t *memory;
+    size_t size;
+    // Where each instruction's code starts, -1 for those left to the
+    // interpreter and for offsets inside an instruction
+    int32_t *entries;
+};
+
+enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// Pinned for as long as compiled code runs, all of them callee saved so a
+// call out to C keeps them
+#define STATE RBX
+#define SLOTS R12
+#define TOP R13
+#define CONSTANTS R14
+#define MODULE R15
+
+// Condition codes for jcc and setcc
+enum {
+    CC_P = 0xA, CC_NP = 0xB, CC_E = 0x4, CC_NE = 0x5,
+    CC_AE = 0x3, CC_BE = 0x6, CC_A = 0x7
+};
+
+#define VALUE_SIZE ((int) sizeof(Value))
+// The stack slot n values below the top
+#define PEEK(n) (-VALUE_SIZE * ((n) + 1))
+
+// Where a number or object pointer sits inside a Value
+#ifdef NAN_BOXING
+#define PAYLOAD_OFFSET 0
+#define VALUE_SHIFT 3
+#else
+#define PAYLOAD_OFFSET ((int) offsetof(Value, as))
+#define VALUE_SHIFT 4
+#endif
+
+// A rel32 waiting for the code of a bytecode offset, or for its exit
+typedef struct {
+    int at;
+    int target;
+    bool exit;
+} Fixup;
+
+typedef struct {
+    Chunk *chunk;
+    // The instruction being translated
+    int offset;
+    uint8_t *code;
+    int count;
+    int capacity;
+    Fixup *fixups;
+    int fixupCount;
+    int fixupCapacity;
+    // Where the shared epilogue that leaves compiled code starts
+    int exitCode;
+    bool failed;
+} Assembler;
+
+static void emit(Assembler *as, uint8_t byte) {
+    if (as->count == as->capacity) {
+        int capacity = as->capacity < 256 ? 256 : as->capacity * 2;
+        uint8_t *code = realloc(as->code, capacity);
+        if (code == NULL) {
+            as->failed = true;
+            as->count = 0;
+            return;
+        }
+        as->code = code;
+        as->capacity = capacity;
+    }
+    as->code[as->count++] = byte;
+}
+
+static void emit32(Assembler *as, uint32_t value) {
+    for (int i = 0; i < 4; i++) emit(as, (value >> (8 * i)) & 0xff);
+}
+
+static void emit64(Assembler *as, uint64_t value) {
+    for (int i = 0; i < 8; i++) emit(as, (value >> (8 * i)) & 0xff);
+}
+
+static void patch32(Assembler *as, int at, int32_t value) {
+    if (as->failed) return;
+    for (int i = 0; i < 4; i++) as->code[at + i] = ((uint32_t) value >> (8 * i)) & 0xff;
+}
+
+static void emitRex(Assembler *as, bool wide, int reg, int rm) {
+    uint8_t rex = 0x40 | (wide ? 8 : 0) | (reg & 8 ? 4 : 0) | (rm & 8 ? 1 : 0);
+    if (rex != 0x40) emit(as, rex);
+}
+
+static void emitOpcode(Assembler *as, uint16_t opcode) {
+    if (opcode > 0xff) emit(as, opcode >> 8);
+    emit(as, opcode & 0xff);
+}
+
+// op reg, [base + disp], with an optional legacy prefix for the SSE forms
+static void emitMemory(Assembler *as, uint8_t prefix, bool wide, uint16_t opcode, int reg, int base, int32_t disp) {
+    if (prefix != 0) emit(as, prefix);
+    emitRex(as, wide, reg, base);
+    emitOpcode(as, opcode);
+    bool shortDisp = disp >= INT8_MIN && disp <= INT8_MAX;
+    emit(as, (shortDisp ? 0x40 : 0x80) | (reg & 7) << 3 | (base & 7));
+    // rsp and r12 can only be a base through a SIB byte
+    if ((base & 7) == RSP) emit(as, 0x24);
+    if (shortDisp) {
+        emit(as, (uint8_t) disp);
+    } else {
+        emit32(as, (uint32_t) disp);
+    }
+}
+
+// op rm, reg between registers
+static void emitRegister(Assembler *as, bool wide, uint16_t opcode, int reg, int rm) {
+    emitRex(as, wide, reg, rm);
+    emitOpcode(as, opcode);
+    emit(as, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+static void emitLoad64(Assembler *as, int reg, int base, int32_t disp) {
+    emitMemory(as, 0, true, 0x8b, reg, base, disp);
+}
+
+static void emitStore64(Assembler *as, int base, int32_t disp, int reg) {
+    emitMemory(as, 0, true, 0x89, reg, base, disp);
+}
+
+static void emitMoveImmediate(Assembler *as, int reg, uint64_t value) {
+    emitRex(as, true, 0, reg);
+    emit(as, 0xb8 + (reg & 7));
+    emit64(as, value);
+}
+
+static void emitAddImmediate(Assembler *as, int reg, int32_t value) {
+    emitRegister(as, true, 0x81, 0, reg);
+    emit32(as, (uint32_t) value);
+}
+
+static void emitMovsdLoad(Assembler *as, int xmm, int base, int32_t disp) {
+    emitMemory(as, 0xf2, false, 0x0f10, xmm, base, disp);
+}
+
+static void emitMovsdStore(Assembler *as, int base, int32_t disp, int xmm) {
+    emitMemory(as, 0xf2, false, 0x0f11, xmm, base, disp);
+}
+
+// Compares xmm0 with the number at [base + disp], unordered sets ZF, PF and CF
+static void emitUcomisd(Assembler *as, int base, int32_t disp) {
+    emitMemory(as, 0x66, false, 0x0f2e, 0, base, disp);
+}
+
+static void emitSetcc(Assembler *as, int cc, int reg) {
+    emit(as, 0x0f);
+    emit(as, 0x90 + cc);
+    emit(as, 0xc0 | reg);
+}
+
+static int emitShortJump(Assembler *as, int cc) {
+    emit(as, 0x70 + cc);
+    emit(as, 0);
+    return as->count;
+}
+
+static void patchShortJump(Assembler *as, int from) {
+    if (!as->failed) as->code[from - 1] = (uint8_t) (as->count - from);
+}
+
+// A jcc, or a jmp for a negative cc, to a bytecode offset's code or exit
+static void emitJump(Assembler *as, int cc, int target, bool exit) {
+    if (cc < 0) {
+        emit(as, 0xe9);
+    } else {
+        emit(as, 0x0f);
+        emit(as, 0x80 + cc);
+    }
+    if (as->fixupCount == as->fixupCapacity) {
+        int capacity = as->fixupCapacity < 16 ? 16 : as->fixupCapacity * 2;
+        Fixup *fixups = realloc(as->fixups, sizeof(Fixup) * capacity);
+        if (fixups == NULL) {
+            as->failed = true;
+            return;
+        }
+        as->fixups = fixups;
+        as->fixupCapacity = capacity;
+    }
+    as->fixups[as->fixupCount++] = (Fixup) {as->count, target, exit};
+    emit32(as, 0);
+}
+
+// Leaves compiled code before the current instruction when cc holds
+static void emitGuard(Assembler *as, int cc) {
+    emitJump(as, cc, as->offset, true);
+}
+
+// Hands the instruction at offset back to the interpreter
+static void emitExit(Assembler *as, int offset) {
+    emit(as, 0xb8);
+    emit32(as, (uint32_t) offset);
+    emit(as, 0xe9);
+    emit32(as, (uint32_t) (as->exitCode - (as->count + 4)));
+}
+
+// Values are moved and tagged a word at a time, a wider load of something
+// just stored in halves stalls rather than being forwarded from the store
+static void emitCopyValue(Assembler *as, int toBase, int32_t to, int fromBase, int32_t from) {
+    emitLoad64(as, RAX, fromBase, from);
+#ifndef NAN_BOXING
+    emitLoad64(as, RCX, fromBase, from + PAYLOAD_OFFSET);
+    emitStore64(as, toBase, to + PAYLOAD_OFFSET, RCX);
+#endif
+    emitStore64(as, toBase, to, RAX);
+}
+
+static void emitStoreImmediate(Assembler *as, int base, int32_t disp, Value value) {
+#ifdef NAN_BOXING
+    emitMoveImmediate(as, RAX, value);
+    emitStore64(as, base, disp, RAX);
+#else
+    emitMemory(as, 0, true, 0xc7, 0, base, disp);
+    emit32(as, value.type);
+    emitMemory(as, 0, true, 0xc7, 0, base, disp + PAYLOAD_OFFSET);
+    emit32(as, IS_BOOL(value) ? AS_BOOL(value) : 0);
+#endif
+}
+
+// Stores al as a bool
+static void emitStoreBool(Assembler *as, int base, int32_t disp) {
+    // movzx eax, al
+    emit(as, 0x0f);
+    emit(as, 0xb6);
+    emit(as, 0xc0);
+#ifdef NAN_BOXING
+    emitMoveImmediate(as, RCX, FALSE_VAL);
+    emitRegister(as, true, 0x01, RCX, RAX);
+    emitStore64(as, base, disp, RAX);
+#else
+    emitMemory(as, 0, true, 0xc7, 0, base, disp);
+    emit32(as, VAL_BOOL);
+    emitStore64(as, base, disp + PAYLOAD_OFFSET, RAX);
+#endif
+}
+
+// Stores xmm0 as a number
+static void emitStoreNumber(Assembler *as, int base, int32_t disp) {
+#ifndef NAN_BOXING
+    emitMemory(as, 0, true, 0xc7, 0, base, disp);
+    emit32(as, VAL_NUMBER);
+#endif
+    emitMovsdStore(as, base, disp + PAYLOAD_OFFSET, 0);
+}
+
+// Leaves unless [base + disp] is a number. An Int is turned into the double
+// of the same value where it is, which reads the same to the interpreter,
+// so the SSE2 templates only ever see doubles. Clobbers rax, rcx and xmm0.
+static void emitGuardNumber(Assembler *as, int base, int32_t disp) {
+#ifdef NAN_BOXING
+    emitLoad64(as, RAX, base, disp);
+    emitMoveImmediate(as, RCX, QNAN);
+    emitRegister(as, true, 0x21, RCX, RAX);
+    emitRegister(as, true, 0x39, RCX, RAX);
+    int isDouble = emitShortJump(as, CC_NE);
+    emitLoad64(as, RAX, base, disp);
+    emitMoveImmediate(as, RCX, SIGN_BIT | QNAN | TAG_INT);
+    emitRegister(as, true, 0x21, RCX, RAX);
+    emitMoveImmediate(as, RCX, QNAN | TAG_INT);
+    emitRegister(as, true, 0x39, RCX, RAX);
+    emitGuard(as, CC_NE);
+    // Sign extends the payload with shl rax, 16 and sar rax, 16
+    emitLoad64(as, RAX, base, disp);
+    emitRegister(as, true, 0xc1, 4, RAX);
+    emit(as, 16);
+    emitRegister(as, true, 0xc1, 7, RAX);
+    emit(as, 16);
+    // cvtsi2sd xmm0, rax
+    emit(as, 0xf2);
+    emitRegister(as, true, 0x0f2a, 0, RAX);
+    emitStoreNumber(as, base, disp);
+    patchShortJump(as, isDouble);
+#else
+    emitMemory(as, 0, false, 0x81, 7, base, disp);
+    emit32(as, VAL_NUMBER);
+    int isDouble = emitShortJump(as, CC_E);
+    emitMemory(as, 0, false, 0x81, 7, base, disp);
+    emit32(as, VAL_INT);
+    emitGuard(as, CC_NE);
+    // cvtsi2sd xmm0, the payload
+    emitMemory(as, 0xf2, true, 0x0f2a, 0, base, disp + PAYLOAD_OFFSET);
+    emitStoreNumber(as, base, disp);
+    patchShortJump(as, isDouble);
+#endif
+}
+
+static void emitGuardNumbers(Assembler *as) {
+    emitGuardNumber(as, TOP, PEEK(0));
+    emitGuardNumber(as, TOP, PEEK(1));
+}
+
+// Global slots hold UNDEFINED_VAL until their declaration runs
+static void emitGuardDefined(Assembler *as, int base, int32_t disp) {
+#ifdef NAN_BOXING
+    emitLoad64(as, RAX, base, disp);
+    emitMoveImmediate(as, RCX, UNDEFINED_VAL);
+    emitRegister(as, true, 0x39, RCX, RAX);
+    emitGuard(as, CC_E);
+#else
+    emitMemory(as, 0, false, 0x81, 7, base, disp);
+    emit32(as, VAL_OBJ);
+    int defined = emitShortJump(as, CC_NE);
+    emitMemory(as, 0, true, 0x81, 7, base, disp + PAYLOAD_OFFSET);
+    emit32(as, 0);
+    emitGuard(as, CC_E);
+    patchShortJump(as, defined);
+#endif
+}
+
+static void emitJumpIfFalsey(Assembler *as, int base, int32_t disp, int target) {
+#ifdef NAN_BOXING
+    emitLoad64(as, RAX, base, disp);
+    emitMoveImmediate(as, RCX, NIL_VAL);
+    emitRegister(as, true, 0x39, RCX, RAX);
+    emitJump(as, CC_E, target, false);
+    emitMoveImmediate(as, RCX, FALSE_VAL);
+    emitRegister(as, true, 0x39, RCX, RAX);
+    emitJump(as, CC_E, target, false);
+#else
+    emitMemory(as, 0, false, 0x81, 7, base, disp);
+    emit32(as, VAL_NIL);
+    emitJump(as, CC_E, target, false);
+    emitMemory(as, 0, false, 0x81, 7, base, disp);
+    emit32(as, VAL_BOOL);
+    int truthy = emitShortJump(as, CC_NE);
+    emitMemory(as, 0, false, 0x80, 7, base, disp + PAYLOAD_OFFSET);
+    emit(as, 0);
+    emitJump(as, CC_E, target, false);
+    patchShortJump(as, truthy);
+#endif
+}
+
+// The top two numbers combined with an SSE2 scalar op into one
+static void emitArithmetic(Assembler *as, uint16_t opcode) {
+    emitMovsdLoad(as, 0, TOP, PEEK(1) + PAYLOAD_OFFSET);
+    emitMemory(as, 0xf2, false, opcode, 0, TOP, PEEK(0) + PAYLOAD_OFFSET);
+    emitMovsdStore(as, TOP, PEEK(1) + PAYLOAD_OFFSET, 0);
+    emitAddImmediate(as, TOP, -VALUE_SIZE);
+}
+
+// a > b and a < b as ucomisd a, b and ucomisd b, a followed by seta, with
+// setbe for the negations so NaN compares like the interpreter
+static void emitCompareNumbers(Assembler *as, bool swap) {
+    emitMovsdLoad(as, 0, TOP, (swap ? PEEK(0) : PEEK(1)) + PAYLOAD_OFFSET);
+    emitUcomisd(as, TOP, (swap ? PEEK(1) : PEEK(0)) + PAYLOAD_OFFSET);
+}
+
+static void emitCompare(Assembler *as, bool swap, int cc) {
+    emitCompareNumbers(as, swap);
+    emitSetcc(as, cc, RAX);
+    emitStoreBool(as, TOP, PEEK(1));
+    emitAddImmediate(as, TOP, -VALUE_SIZE);
+}
+
+static void emitEquality(Assembler *as, bool equal) {
+    emitCompareNumbers(as, false);
+    // Equal is ZF without PF, a NaN is never equal to anything
+    emitSetcc(as, equal ? CC_E : CC_NE, RAX);
+    emitSetcc(as, equal ? CC_NP : CC_P, RCX);
+    emit(as, equal ? 0x20 : 0x08);
+    emit(as, 0xc8);
+    emitStoreBool(as, TOP, PEEK(1));
+    emitAddImmediate(as, TOP, -VALUE_SIZE);
+}
+
+// The SSE2 scalar op for a three-address instruction
+static uint16_t localsArithmetic(uint8_t op) {
+    switch (op) {
+        case OP_ADD_LOCALS: return 0x0f58;
+        case OP_SUBTRACT_LOCALS: return 0x0f5c;
+        case OP_MULTIPLY_LOCALS: return 0x0f59;
+        default: return 0x0f5e;
+    }
+}
+
+// An Int constant is pushed as the double of the same value, which its guard
+// would otherwise convert from every time the instruction ran
+static void emitPushConstant(Assembler *as, int index) {
+    Value constant = as->chunk->constants.values[index];
+    if (IS_INT(constant)) {
+        Value number = NUMBER_VAL((double) AS_INT(constant));
+#ifdef NAN_BOXING
+        emitMoveImmediate(as, RAX, number);
+#else
+        emitMemory(as, 0, true, 0xc7, 0, TOP, 0);
+        emit32(as, VAL_NUMBER);
+        uint64_t bits;
+        memcpy(&bits, &number.as.number, sizeof(bits));
+        emitMoveImmediate(as, RAX, bits);
+#endif
+        emitStore64(as, TOP, PAYLOAD_OFFSET, RAX);
+    } else {
+        emitCopyValue(as, TOP, 0, CONSTANTS, index * VALUE_SIZE);
+    }
+    emitAddImmediate(as, TOP, VALUE_SIZE);
+}
+
+static uint16_t readShort(Assembler *as, int at) {
+    return (uint16_t) (as->chunk->code[as->offset + at] << 8 | as->chunk->code[as->offset + at + 1]);
+}
+
+// Translates the current instruction, false if it has no template
+static bool compileInstruction(Assembler *as) {
+    uint8_t *code = &as->chunk->code[as->offset];
+    // Where a jump's operand says to go, relative to the next instruction
+    int next = as->offset + 3;
+
+    switch (code[0]) {
+        case OP_CONSTANT:
+            emitPushConstant(as, code[1]);
+            return true;
+        case OP_CONSTANT_LONG:
+            emitPushConstant(as, readShort(as, 1));
+            return true;
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+            emitStoreImmediate(as, TOP, 0, code[0] == OP_NIL ? NIL_VAL : BOOL_VAL(code[0] == OP_TRUE));
+            emitAddImmediate(as, TOP, VALUE_SIZE);
+            return true;
+        case OP_POP:
+            emitAddImmediate(as, TOP, -VALUE_SIZE);
+            return true;
+        case OP_GET_LOCAL:
+        case OP_GET_LOCAL_LONG: {
+            int slot = code[0] == OP_GET_LOCAL ? code[1] : readShort(as, 1);
+            emitCopyValue(as, TOP, 0, SLOTS, slot * VALUE_SIZE);
+            emitAddImmediate(as, TOP, VALUE_SIZE);
+            return true;
+        }
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_LONG: {
+            int slot = code[0] == OP_SET_LOCAL ? code[1] : readShort(as, 1);
+            emitCopyValue(as, SLOTS, slot * VALUE_SIZE, TOP, PEEK(0));
+            return true;
+        }
+        case OP_GET_GLOBAL_SLOT: {
+            int32_t slot = readShort(as, 1) * VALUE_SIZE;
+            // Reloaded every time, defining a global can move the array
+            emitLoad64(as, RDX, MODULE, (int32_t) (offsetof(ObjModule, globals) + offsetof(ValueArray, values)));
+            emitGuardDefined(as, RDX, slot);
+            emitCopyValue(as, TOP, 0, RDX, slot);
+            emitAddImmediate(as, TOP, VALUE_SIZE);
+            return true;
+        }
+        case OP_SET_GLOBAL_SLOT: {
+            int32_t slot = readShort(as, 1) * VALUE_SIZE;
+            emitLoad64(as, RDX, MODULE, (int32_t) (offsetof(ObjModule, globals) + offsetof(ValueArray, values)));
+            emitGuardDefined(as, RDX, slot);
+            // The write barrier is left to the interpreter. gcMarking is the
+            // compiling thread's, the code only ever runs on that thread's VM.
+            emitMoveImmediate(as, RAX, (uint64_t) (uintptr_t) &gcMarking);
+            emitMemory(as, 0, false, 0x80, 7, RAX, 0);
+            emit(as, 0);
+            emitGuard(as, CC_NE);
+            emitCopyValue(as, RDX, slot, TOP, PEEK(0));
+            emitMemory(as, 0, false, 0xc6, 0, MODULE, (int32_t) offsetof(ObjModule, globalsDirty));
+            emit(as, 1);
+            return true;
+        }
+        case OP_ADD:
+        case OP_ADD_NUM:
+            // Anything but two numbers, strings included, is the interpreter's.
+            // The _NUM forms are guarded too, their numbers can be Ints.
+            emitGuardNumbers(as);
+            emitArithmetic(as, 0x0f58);
+            return true;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_NUM:
+            emitGuardNumbers(as);
+            emitArithmetic(as, 0x0f5c);
+            return true;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NUM:
+            emitGuardNumbers(as);
+            emitArithmetic(as, 0x0f59);
+            return true;
+        case OP_DIVIDE:
+        case OP_DIVIDE_NUM:
+            emitGuardNumbers(as);
+            emitArithmetic(as, 0x0f5e);
+            return true;
+        case OP_MODULO:
+            emitGuardNumbers(as);
+            emitMovsdLoad(as, 0, TOP, PEEK(1) + PAYLOAD_OFFSET);
+            emitMovsdLoad(as, 1, TOP, PEEK(0) + PAYLOAD_OFFSET);
+            emitMoveImmediate(as, RAX, (uint64_t) (uintptr_t) &fmod);
+            // call rax, the stack is kept 16 byte aligned for it
+            emit(as, 0xff);
+            emit(as, 0xd0);
+            emitMovsdStore(as, TOP, PEEK(1) + PAYLOAD_OFFSET, 0);
+            emitAddImmediate(as, TOP, -VALUE_SIZE);
+            return true;
+        case OP_NEGATE:
+            emitGuardNumber(as, TOP, PEEK(0));
+            emitLoad64(as, RAX, TOP, PEEK(0) + PAYLOAD_OFFSET);
+            // btc rax, 63 flips the sign
+            emitRegister(as, true, 0x0fba, 7, RAX);
+            emit(as, 63);
+            emitStore64(as, TOP, PEEK(0) + PAYLOAD_OFFSET, RAX);
+            return true;
+        case OP_GREATER:
+        case OP_GREATER_NUM:
+            emitGuardNumbers(as);
+            emitCompare(as, false, CC_A);
+            return true;
+        case OP_LESS:
+        case OP_LESS_NUM:
+            emitGuardNumbers(as);
+            emitCompare(as, true, CC_A);
+            return true;
+        case OP_GREATER_EQUAL:
+            emitGuardNumbers(as);
+            emitCompare(as, true, CC_BE);
+            return true;
+        case OP_LESS_EQUAL:
+            emitGuardNumbers(as);
+            emitCompare(as, false, CC_BE);
+            return true;
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+            emitGuardNumbers(as);
+            emitEquality(as, code[0] == OP_EQUAL);
+            return true;
+        case OP_IN_PLACE_ADD:
+        case OP_IN_PLACE_SUBTRACT: {
+            int32_t slot = code[1] * VALUE_SIZE;
+            emitGuardNumber(as, SLOTS, slot);
+            emitGuardNumber(as, CONSTANTS, code[2] * VALUE_SIZE);
+            emitMovsdLoad(as, 0, SLOTS, slot + PAYLOAD_OFFSET);
+            emitMemory(as, 0xf2, false, code[0] == OP_IN_PLACE_ADD ? 0x0f58 : 0x0f5c,
+                       0, CONSTANTS, code[2] * VALUE_SIZE + PAYLOAD_OFFSET);
+            emitMovsdStore(as, SLOTS, slot + PAYLOAD_OFFSET, 0);
+            return true;
+        }
+        case OP_ADD_LOCALS:
+        case OP_SUBTRACT_LOCALS:
+        case OP_MULTIPLY_LOCALS:
+        case OP_DIVIDE_LOCALS: {
+            int32_t a = code[2] * VALUE_SIZE;
+            int32_t b = code[3] * VALUE_SIZE;
+            emitGuardNumber(as, SLOTS, a);
+            emitGuardNumber(as, SLOTS, b);
+            emitMovsdLoad(as, 0, SLOTS, a + PAYLOAD_OFFSET);
+            emitMemory(as, 0xf2, false, localsArithmetic(code[0]), 0, SLOTS, b + PAYLOAD_OFFSET);
+            emitStoreNumber(as, SLOTS, code[1] * VALUE_SIZE);
+            return true;
+        }
+        case OP_JUMP:
+            emitJump(as, -1, next + readShort(as, 1), false);
+            return true;
+        case OP_JUMP_IF_FALSE:
+            emitJumpIfFalsey(as, TOP, PEEK(0), next + readShort(as, 1));
+            return true;
+        case OP_POP_JUMP_IF_FALSE:
+            emitAddImmediate(as, TOP, -VALUE_SIZE);
+            emitJumpIfFalsey(as, TOP, 0, next + readShort(as, 1));
+            return true;
+        case OP_JUMP_UNLESS_EQUAL:
+        case OP_JUMP_UNLESS_NOT_EQUAL:
+        case OP_JUMP_UNLESS_GREATER:
+        case OP_JUMP_UNLESS_GREATER_EQUAL:
+        case OP_JUMP_UNLESS_LESS:
+        case OP_JUMP_UNLESS_LESS_EQUAL: {
+            int target = next + readShort(as, 1);
+            emitGuardNumbers(as);
+            // Both are popped first, the numbers stay where they were
+            emitAddImmediate(as, TOP, -2 * VALUE_SIZE);
+            bool swap = code[0] == OP_JUMP_UNLESS_LESS || code[0] == OP_JUMP_UNLESS_GREATER_EQUAL;
+            emitMovsdLoad(as, 0, TOP, (swap ? VALUE_SIZE : 0) + PAYLOAD_OFFSET);
+            emitUcomisd(as, TOP, (swap ? 0 : VALUE_SIZE) + PAYLOAD_OFFSET);
+            switch (code[0]) {
+                case OP_JUMP_UNLESS_EQUAL:
+                    emitJump(as, CC_NE, target, false);
+                    emitJump(as, CC_P, target, false);
+                    break;
+                case OP_JUMP_UNLESS_NOT_EQUAL: {
+                    int unordered = emitShortJump(as, CC_P);
+                    emitJump(as, CC_E, target, false);
+                    patchShortJump(as, unordered);
+                    break;
+                }
+                case OP_JUMP_UNLESS_GREATER:
+                case OP_JUMP_UNLESS_LESS:
+                    emitJump(as, CC_BE, target, false);
+                    break;
+                default:
+                    emitJump(as, CC_A, target, false);
+                    break;
+            }
+            return true;
+        }
+        case OP_LOOP:
+            // The back edge is a safe point, the interpreter takes it when due
+            emitMoveImmediate(as, RAX, (uint64_t) (uintptr_t) &gcStepDue);
+            emitMemory(as, 0, false, 0x80, 7, RAX, 0);
+            emit(as, 0);
+            emitGuard(as, CC_NE);
+            emitMoveImmediate(as, RAX, (uint64_t) (uintptr_t) &profileSampleDue);
+            emitMemory(as, 0, false, 0x81, 7, RAX, 0);
+            emit32(as, 0);
+            emitGuard(as, CC_NE);
+            emitJump(as, -1, next - readShort(as, 1), false);
+            return true;
+        case OP_GETITEM_LIST_NUM: {
+            // An Int index is used as it is
+#ifdef NAN_BOXING
+            emitLoad64(as, RCX, TOP, PEEK(0));
+            emitMoveImmediate(as, RAX, SIGN_BIT | QNAN | TAG_INT);
+            emitRegister(as, true, 0x21, RCX, RAX);
+            emitMoveImmediate(as, RDX, QNAN | TAG_INT);
+            emitRegister(as, true, 0x39, RDX, RAX);
+            int isDouble = emitShortJump(as, CC_NE);
+            emitRegister(as, true, 0xc1, 4, RCX);
+            emit(as, 16);
+            emitRegister(as, true, 0xc1, 7, RCX);
+            emit(as, 16);
+#else
+            emitMemory(as, 0, false, 0x81, 7, TOP, PEEK(0));
+            emit32(as, VAL_INT);
+            int isDouble = emitShortJump(as, CC_NE);
+            emitLoad64(as, RCX, TOP, PEEK(0) + PAYLOAD_OFFSET);
+#endif
+            // jmp over the conversion
+            emit(as, 0xeb);
+            emit(as, 0);
+            int converted = as->count;
+            patchShortJump(as, isDouble);
+            // cvttsd2si, NaN and out of range numbers come out negative
+            emitMemory(as, 0xf2, true, 0x0f2c, RCX, TOP, PEEK(0) + PAYLOAD_OFFSET);
+            patchShortJump(as, converted);
+            emitLoad64(as, RDX, TOP, PEEK(1) + PAYLOAD_OFFSET);
+#ifdef NAN_BOXING
+            emitMoveImmediate(as, RAX, ~(SIGN_BIT | QNAN));
+            emitRegister(as, true, 0x21, RAX, RDX);
+#endif
+            // movsxd, one unsigned compare checks both ends
+            emitMemory(as, 0, true, 0x63, RAX, RDX,
+                       (int32_t) (offsetof(ObjList, items) + offsetof(ValueArray, count)));
+            emitRegister(as, true, 0x39, RAX, RCX);
+            emitGuard(as, CC_AE);
+            emitLoad64(as, RDX, RDX, (int32_t) (offsetof(ObjList, items) + offsetof(ValueArray, values)));
+            emitRegister(as, true, 0xc1, 4, RCX);
+            emit(as, VALUE_SHIFT);
+            emitRegister(as, true, 0x01, RCX, RDX);
+            emitCopyValue(as, TOP, PEEK(1), RDX, 0);
+            emitAddImmediate(as, TOP, -VALUE_SIZE);
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+static const int savedRegisters[] = {RBX, RBP, R12, R13, R14, R15};
+#define SAVED_COUNT ((int) (sizeof(savedRegisters) / sizeof(savedRegisters[0])))
+
+// entry(state, target) saves the registers it pins and jumps to target,
+// every exit comes back through the epilogue after it
+static void emitPrologue(Assembler *as) {
+    for (int i = 0; i < SAVED_COUNT; i++) {
+        emitRex(as, false, 0, savedRegisters[i]);
+        emit(as, 0x50 + (savedRegisters[i] & 7));
+    }
+    // Six pushes and the return address, realigned for calls out to C
+    emitAddImmediate(as, RSP, -8);
+    emitRegister(as, true, 0x89, RDI, STATE);
+    emitLoad64(as, SLOTS, STATE, (int32_t) offsetof(JitState, slots));
+    emitLoad64(as, TOP, STATE, (int32_t) offsetof(JitState, stackTop));
+    emitLoad64(as, CONSTANTS, STATE, (int32_t) offsetof(JitState, constants));
+    emitLoad64(as, MODULE, STATE, (int32_t) offsetof(JitState, module));
+    // jmp rsi
+    emit(as, 0xff);
+    emit(as, 0xe6);
+
+    // Exits arrive with the offset to resume at in eax
+    as->exitCode = as->count;
+    emitMemory(as, 0, false, 0x89, RAX, STATE, (int32_t) offsetof(JitState, exit));
+    emitStore64(as, STATE, (int32_t) offsetof(JitState, stackTop), TOP);
+    emitAddImmediate(as, RSP, 8);
+    for (int i = SAVED_COUNT - 1; i >= 0; i--) {
+        emitRex(as, false, 0, savedRegisters[i]);
+        emit(as, 0x58 + (savedRegisters[i] & 7));
+    }
+    emit(as, 0xc3);
+}
+
+// Copies the code into pages of its own, never writable and executable
+// at the same time
+static uint8_t *install(Assembler *as, size_t *size) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    *size = ((size_t) as->count + page - 1) / page * page;
+    void *memory = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) return NULL;
+    memcpy(memory, as->code, as->count);
+    if (mprotect(memory, *size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, *size);
+        return NULL;
+    }
+    return memory;
+}
+
+bool jitCompile(ObjFunction *function) {
+    Chunk *chunk = &function->chunk;
+    Assembler as;
+    memset(&as, 0, sizeof(as));
+    as.chunk = chunk;
+
+    // Each offset's code, and the exit guards leave through
+    int32_t *labels = malloc(sizeof(int32_t) * chunk->count);
+    int32_t *exits = malloc(sizeof(int32_t) * chunk->count);
+    int32_t *entries = malloc(sizeof(int32_t) * chunk->count);
+    JitCode *jit = malloc(sizeof(JitCode));
+    bool compiled = false;
+    if (labels == NULL || exits == NULL || entries == NULL || jit == NULL) goto failed;
+    for (int i = 0; i < chunk->count; i++) {
+        labels[i] = -1;
+        exits[i] = -1;
+        entries[i] = -1;
+    }
+
+    emitPrologue(&as);
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        as.offset = offset;
+        labels[offset] = as.count;
+        if (compileInstruction(&as)) {
+            entries[offset] = labels[offset];
+            compiled = true;
+        } else {
+            // Jumps land here too, so it still has code, which just leaves
+            emitExit(&as, offset);
+        }
+    }
+    if (!compiled) goto failed;
+
+    for (int i = 0; i < as.fixupCount; i++) {
+        Fixup *fixup = &as.fixups[i];
+        int32_t target;
+        if (fixup->exit) {
+            if (exits[fixup->target] < 0) {
+                exits[fixup->target] = as.count;
+                emitExit(&as, fixup->target);
+            }
+            target = exits[fixup->target];
+        } else {
+            target = labels[fixup->target];
+        }
+        patch32(&as, fixup->at, target - (fixup->at + 4));
+    }
+    if (as.failed) goto failed;
+
+    jit->memory = install(&as, &jit->size);
+    if (jit->memory == NULL) goto failed;
+    jit->entries = entries;
+    function->jit = jit;
+
+    free(as.code);
+    free(as.fixups);
+    free(labels);
+    free(exits);
+    return true;
+
+failed:
+    free(as.code);
+    free(as.fixups);
+    free(labels);
+    free(exits);
+    free(entries);
+    free(jit);
+    return false;
+}
+
+uint8_t *jitRun(ObjFunction *function, uint8_t *ip, Value *slots) {
+    JitCode *jit = function->jit;
+    int32_t entry = jit->entries[ip - function->chunk.code];
+    if (entry < 0) return ip;
+
+    JitState state = {slots, vm.stackTop, function->chunk.constants.values, function->module, 0};
+    ((JitEntry) jit->memory)(&state, jit->memory + entry);
+    vm.stackTop = state.stackTop;
+    return function->chunk.code + state.exit;
+}
+
+void jitFree(JitCode *jit) {
+    if (jit == NULL) return;
+    munmap(jit->memory, jit->size);
+    free(jit->entries);
+    free(jit);
+}
+
+#else
+
+bool jitCompile(ObjFunction *function) {
+    (void) function;
+    return false;
+}
+
+uint8_t *jitRun(ObjFunction *function, uint8_t *ip, Value *slots) {
+    (void) function;
+    (void) slots;
+    return ip;
+}
+
+void jitFree(JitCode *jit) {
+    (void) jit;
+}
+
+#endif
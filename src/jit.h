@@ -0,0 +1,36 @@
+#ifndef saffron_jit_h
+#define saffron_jit_h
+
+#include "common.h"
+#include "value.h"
+
+// A baseline compiler for hot functions. Each instruction of a chunk is
+// translated into a fixed template of x86-64 machine code and the templates
+// are stitched together, so a compiled run of instructions has no dispatch
+// and no operand decoding. Only number arithmetic, comparisons, jumps,
+// locals, globals and constants have templates. Anything else, an operand
+// of the wrong type, or a pending GC step or profile sample, leaves the
+// frame to the interpreter at that instruction, which carries on from
+// there and enters the compiled code again after its next call or loop.
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__)) && \
+    !defined(DEBUG_TRACE_EXECUTION) && !defined(DEBUG_OPCODE_STATS) && !defined(NO_JIT)
+#define JIT_ENABLED
+#endif
+
+// Calls and loop iterations a function runs before it is compiled
+#define JIT_THRESHOLD 1000
+
+struct ObjFunction;
+typedef struct JitCode JitCode;
+
+// Translates the function's chunk, false if nothing in it can be compiled
+// or the platform has no backend, leaving function->jit NULL
+bool jitCompile(struct ObjFunction *function);
+
+// Runs the function's compiled code on the frame at slots, starting from
+// ip, and returns the ip of the instruction the interpreter should run next
+uint8_t *jitRun(struct ObjFunction *function, uint8_t *ip, Value *slots);
+
+void jitFree(JitCode *code);
+
+#endif
@@ -3,50 +3,516 @@
 #include "list.h"
 #include "time.h"
 #include "task.h"
-#include <sys/select.h>
+#include "worker.h"
+#include "../memory.h"
+#include "../output.h"
 #include <limits.h>
+#include <unistd.h>
 
-AsyncHandler asyncHandler;
+_Thread_local AsyncHandler asyncHandler;
 
-Value spawnNative(int argCount, Value *args) {
-    if (!IS_CLOSURE(args[0])) {
-        runtimeError("Invalid argument for parameter 0, expect a function");
-        return NIL_VAL;
+// Passed over this many times for higher priorities, the task waiting
+// longest in a queue moves up to the next one
+#define AGING_LIMIT 8
+
+static bool isPriority(Value value) {
+    return IS_NUMBER(value) && AS_NUMBER(value) >= 0 && AS_NUMBER(value) < PRIORITY_LEVELS &&
+           AS_NUMBER(value) == (int) AS_NUMBER(value);
+}
+
+static void pushRunQueue(RunQueue *queue, ObjCallFrame *task) {
+    if (queue->count == queue->capacity) {
+        int oldCapacity = queue->capacity;
+        int capacity = GROW_CAPACITY(oldCapacity);
+        queue->tasks = GROW_ARRAY(ObjCallFrame *, queue->tasks, oldCapacity, capacity);
+        // The part that had wrapped around goes after the rest
+        int wrapped = queue->head + queue->count - oldCapacity;
+        for (int i = 0; i < wrapped; i++) queue->tasks[oldCapacity + i] = queue->tasks[i];
+        queue->capacity = capacity;
+    }
+
+    queue->tasks[(queue->head + queue->count) % queue->capacity] = task;
+    queue->count++;
+}
+
+static ObjCallFrame *popRunQueue(RunQueue *queue) {
+    ObjCallFrame *task = queue->tasks[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    queue->skipped = 0;
+    return task;
+}
+
+// Makes task runnable, it gets its turn after the others of its priority
+void scheduleTask(ObjCallFrame *task) {
+    pushRunQueue(&vm.runQueues[task->priority], task);
+    vm.runnableCount++;
+}
+
+// Takes the task whose turn it is from the highest priority queue with any
+// in it. The tasks waiting below age, so a steady stream of higher priority
+// work can't starve them.
+static void runNextTask() {
+    for (int level = PRIORITY_LEVELS - 1; level >= 0; level--) {
+        RunQueue *queue = &vm.runQueues[level];
+        if (queue->count == 0) continue;
+
+        // Running keeps it reachable while a queue grows below
+        vm.runningTask = popRunQueue(queue);
+        vm.runnableCount--;
+        for (int lower = level - 1; lower >= 0; lower--) {
+            RunQueue *waiting = &vm.runQueues[lower];
+            if (waiting->count == 0 || ++waiting->skipped < AGING_LIMIT) continue;
+
+            // Queued above before it's taken off, so it's always reachable
+            pushRunQueue(&vm.runQueues[lower + 1], waiting->tasks[waiting->head]);
+            popRunQueue(waiting);
+        }
+        return;
     }
+}
 
-    ObjClosure *closure = AS_CLOSURE(args[0]);
+void clearRunQueues() {
+    for (int level = 0; level < PRIORITY_LEVELS; level++) {
+        vm.runQueues[level].head = 0;
+        vm.runQueues[level].count = 0;
+        vm.runQueues[level].skipped = 0;
+    }
+    vm.runnableCount = 0;
+    vm.runningTask = NULL;
+}
 
-    ObjCallFrame *frame = ALLOCATE_OBJ(ObjCallFrame, OBJ_CALL_FRAME);
-    writeValueArray(&vm.tasks, OBJ_VAL(frame));
+void freeRunQueues() {
+    for (int level = 0; level < PRIORITY_LEVELS; level++) {
+        FREE_ARRAY(ObjCallFrame *, vm.runQueues[level].tasks, vm.runQueues[level].capacity);
+        vm.runQueues[level].tasks = NULL;
+        vm.runQueues[level].capacity = 0;
+    }
+    clearRunQueues();
+}
+
+void markRunQueues() {
+    markObject((Obj *) vm.runningTask);
+    for (int level = 0; level < PRIORITY_LEVELS; level++) {
+        RunQueue *queue = &vm.runQueues[level];
+        for (int i = 0; i < queue->count; i++) {
+            markObject((Obj *) queue->tasks[(queue->head + i) % queue->capacity]);
+        }
+    }
+}
+
+// The running task has given up its turn. Timers and I/O are checked once
+// every round of the runnable tasks, and whenever none are left.
+void endTurn() {
+    vm.runningTask = NULL;
+    if (vm.runnableCount == 0 || --asyncHandler.turnsUntilPoll <= 0) {
+        getTasks();
+        asyncHandler.turnsUntilPoll = vm.runnableCount;
+    }
+}
+
+// A task that calls closure with no arguments when it first runs
+ObjCallFrame *newClosureTask(ObjClosure *closure) {
+    ObjCallFrame *task = newCallFrame(SPAWNED);
+    int size = frameSize(closure->function);
+    if (size > task->stackCapacity) {
+        // Kept on the stack so growing it can't collect the task
+        push(OBJ_VAL(task));
+        task->stack = GROW_ARRAY(Value, task->stack, task->stackCapacity, size);
+        task->stackTop = task->stack;
+        task->stackCapacity = size;
+        pop();
+    }
+
+    CallFrame *frame = &task->frames[task->frameCount++];
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
-    frame->slots = vm.stack;
-    frame->state = SPAWNED;
-    frame->stored = NIL_VAL;
+    frame->slots = task->stack;
 
-    initValueArray(&frame->stack);
-    writeValueArray(&frame->stack, args[0]);
+    *task->stackTop++ = OBJ_VAL(closure);
+    return task;
+}
 
-    frame->result = NIL_VAL;
-    frame->parent = NULL;
-    frame->index = currentFrame->index + 1;
+Value spawnNative(int argCount, Value *args) {
+    if (argCount < 1 || !IS_CLOSURE(args[0])) {
+        runtimeError("Invalid argument for parameter 0, expect a function");
+        return NIL_VAL;
+    }
+    if (argCount > 2 || (argCount == 2 && !isPriority(args[1]))) {
+        runtimeError("Expected a priority from 0 to %d.", PRIORITY_LEVELS - 1);
+        return NIL_VAL;
+    }
 
-    return OBJ_VAL(newTask(frame));
+    ObjCallFrame *task = newClosureTask(AS_CLOSURE(args[0]));
+    // Tasks run at the priority of the one that spawned them unless told
+    // otherwise
+    task->priority = argCount == 2 ? (int) AS_NUMBER(args[1]) : CURRENT_TASK->priority;
+    push(OBJ_VAL(task));
+    scheduleTask(task);
+    task->index = CURRENT_TASK->index + 1;
+
+    ObjTask *handle = newTask(task);
+    pop();
+    return OBJ_VAL(handle);
 }
 
 void initAsyncHandler() {
-    initValueArray(&asyncHandler.sleepers);
-    initValueArray(&asyncHandler.sleeper_times);
+    initPoller(&asyncHandler.poller);
+    asyncHandler.waiters = NULL;
+    asyncHandler.waiterCapacity = 0;
+    asyncHandler.ioWaitCount = 0;
+    asyncHandler.turnsUntilPoll = 0;
+
+    asyncHandler.sleepers = NULL;
+    asyncHandler.sleeperCount = 0;
+    asyncHandler.sleeperCapacity = 0;
+    asyncHandler.sleeperSequence = 0;
 }
 
 void freeAsyncHandler() {
-    freeValueArray(&asyncHandler.sleepers);
-    freeValueArray(&asyncHandler.sleeper_times);
+    freePoller(&asyncHandler.poller);
+    FREE_ARRAY(IoWaiter, asyncHandler.waiters, asyncHandler.waiterCapacity);
+    FREE_ARRAY(Sleeper, asyncHandler.sleepers, asyncHandler.sleeperCapacity);
+    initAsyncHandler();
 }
 
 void markAsyncRoots() {
-    markArray(&asyncHandler.sleepers);
-    markArray(&asyncHandler.sleeper_times);
+    markWorkers();
+    for (int i = 0; i < asyncHandler.sleeperCount; i++) {
+        markObject((Obj *) asyncHandler.sleepers[i].task);
+    }
+
+    if (!asyncHandler.ioWaitCount) return;
+    for (int fd = 0; fd < asyncHandler.waiterCapacity; fd++) {
+        IoWaiter *waiter = &asyncHandler.waiters[fd];
+        for (ObjCallFrame *task = waiter->readers; task != NULL; task = task->next) {
+            markObject((Obj *) task);
+        }
+        for (ObjCallFrame *task = waiter->writers; task != NULL; task = task->next) {
+            markObject((Obj *) task);
+        }
+    }
+}
+
+static bool sleeperBefore(Sleeper *a, Sleeper *b) {
+    if (a->time != b->time) return a->time < b->time;
+    return a->sequence < b->sequence;
+}
+
+static void pushSleeper(ObjCallFrame *task, double time) {
+    if (asyncHandler.sleeperCapacity < asyncHandler.sleeperCount + 1) {
+        int oldCapacity = asyncHandler.sleeperCapacity;
+        asyncHandler.sleeperCapacity = GROW_CAPACITY(oldCapacity);
+        asyncHandler.sleepers = GROW_ARRAY(Sleeper, asyncHandler.sleepers,
+                                           oldCapacity, asyncHandler.sleeperCapacity);
+    }
+
+    Sleeper sleeper = {task, time, asyncHandler.sleeperSequence++};
+    Sleeper *heap = asyncHandler.sleepers;
+    int i = asyncHandler.sleeperCount++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!sleeperBefore(&sleeper, &heap[parent])) break;
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = sleeper;
+}
+
+static ObjCallFrame *popSleeper() {
+    Sleeper *heap = asyncHandler.sleepers;
+    ObjCallFrame *task = heap[0].task;
+    Sleeper last = heap[--asyncHandler.sleeperCount];
+
+    int count = asyncHandler.sleeperCount;
+    int i = 0;
+    while (true) {
+        int child = 2 * i + 1;
+        if (child >= count) break;
+        if (child + 1 < count && sleeperBefore(&heap[child + 1], &heap[child])) child++;
+        if (!sleeperBefore(&heap[child], &last)) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    if (count > 0) heap[i] = last;
+
+    return task;
+}
+
+static IoWaiter *getWaiter(int fd) {
+    if (fd >= asyncHandler.waiterCapacity) {
+        int oldCapacity = asyncHandler.waiterCapacity;
+        int capacity = GROW_CAPACITY(oldCapacity);
+        while (capacity <= fd) capacity = GROW_CAPACITY(capacity);
+        asyncHandler.waiters = GROW_ARRAY(IoWaiter, asyncHandler.waiters, oldCapacity, capacity);
+        for (int i = oldCapacity; i < capacity; i++) {
+            asyncHandler.waiters[i].readers = NULL;
+            asyncHandler.waiters[i].writers = NULL;
+            asyncHandler.waiters[i].watching = 0;
+            asyncHandler.waiters[i].job = NULL;
+        }
+        asyncHandler.waiterCapacity = capacity;
+    }
+
+    return &asyncHandler.waiters[fd];
+}
+
+// Parks the current task until fd is ready for events, returns false if
+// the descriptor can't be polled and the task should just carry on.
+static bool waitForIo(int fd, int events) {
+    if (fd < 0) return false;
+
+    IoWaiter *waiter = getWaiter(fd);
+    if (!(waiter->watching & events)) {
+        if (!pollerSet(&asyncHandler.poller, fd, waiter->watching, waiter->watching | events)) {
+            return false;
+        }
+        waiter->watching |= events;
+    }
+
+    ObjCallFrame **queue = events == POLLER_READ ? &waiter->readers : &waiter->writers;
+    ObjCallFrame *task = CURRENT_TASK;
+    task->next = *queue;
+    *queue = task;
+    asyncHandler.ioWaitCount++;
+    return true;
+}
+
+// Called from natives: parks the running task on fd once the native
+// returns, it wakes up with what operation produces once that's done.
+// Takes over operation unless fd can't be polled.
+bool parkOnIo(int fd, int events, IoOperation *operation) {
+    if (!waitForIo(fd, events)) return false;
+
+    CURRENT_TASK->operation = operation;
+    vm.taskParked = true;
+    return true;
+}
+
+// Deregisters fd without touching the tasks parked on it
+static void unwatchIo(int fd) {
+    if (fd >= asyncHandler.waiterCapacity) return;
+
+    IoWaiter *waiter = &asyncHandler.waiters[fd];
+    if (waiter->watching) pollerSet(&asyncHandler.poller, fd, waiter->watching, 0);
+    waiter->watching = 0;
+}
+
+void freeIoOperation(IoOperation *operation) {
+    if (operation->source >= 0) {
+        unwatchIo(operation->source);
+        close(operation->source);
+    }
+    FREE(IoOperation, operation);
+}
+
+// Drops fd from the poller before it is closed, so a descriptor that gets
+// the number next is registered again. Tasks still parked on it wake up
+// with nil.
+void forgetIo(int fd) {
+    if (fd < 0 || fd >= asyncHandler.waiterCapacity) return;
+
+    IoWaiter *waiter = &asyncHandler.waiters[fd];
+    ObjCallFrame **queues[] = {&waiter->readers, &waiter->writers};
+    for (int i = 0; i < 2; i++) {
+        for (ObjCallFrame *task = *queues[i]; task != NULL; task = task->next) {
+            if (task->operation == NULL) continue;
+            freeIoOperation(task->operation);
+            task->operation = NULL;
+        }
+        asyncHandler.ioWaitCount -= wakeWaitQueue(queues[i], NIL_VAL);
+    }
+    unwatchIo(fd);
+}
+
+// Parks the current task until stdout can take more of what's buffered,
+// false if nothing else could run meanwhile or the task can't be parked
+bool waitForOutput() {
+    if (CURRENT_TASK == NULL || insideNativeCall()) return false;
+    if (vm.runnableCount == 0 && !asyncHandler.sleeperCount && !asyncHandler.ioWaitCount) return false;
+    if (!waitForIo(STDOUT_FILENO, POLLER_WRITE)) return false;
+
+    output.deferred = true;
+    vm.taskParked = true;
+    return true;
+}
+
+// Watches the read end of a worker's result pipe
+void watchWorker(int fd, struct WorkerJob *job) {
+    IoWaiter *waiter = getWaiter(fd);
+    waiter->job = job;
+    if (!(waiter->watching & POLLER_READ)) {
+        pollerSet(&asyncHandler.poller, fd, waiter->watching, waiter->watching | POLLER_READ);
+        waiter->watching |= POLLER_READ;
+    }
+}
+
+// Deregisters a worker's pipe before it is closed, later workers inherit
+// the descriptor so the kernel wouldn't drop it on close
+void unwatchWorker(int fd) {
+    IoWaiter *waiter = getWaiter(fd);
+    waiter->job = NULL;
+    pollerSet(&asyncHandler.poller, fd, waiter->watching, 0);
+    waiter->watching = 0;
+}
+
+// Called from natives: parks the running task once the native returns,
+// whatever keeps hold of it resumes it with wakeTask()
+ObjCallFrame *parkTask() {
+    ObjCallFrame *task = CURRENT_TASK;
+    // That may be all that references it once its turn ends
+    WRITE_BARRIER(OBJ_VAL(task));
+    vm.taskParked = true;
+    return task;
+}
+
+// Called from natives: parks the running task on queue once the native
+// returns. The task resumes with the value it is woken with.
+void parkOnQueue(ObjCallFrame **queue) {
+    ObjCallFrame *task = parkTask();
+    task->next = *queue;
+    *queue = task;
+}
+
+// Makes a parked task runnable, value is what the call it parked in returns
+void wakeTask(ObjCallFrame *task, Value value) {
+    task->stored = value;
+    WRITE_BARRIER(value);
+    scheduleTask(task);
+}
+
+static void reverseQueue(ObjCallFrame **queue) {
+    ObjCallFrame *reversed = NULL;
+    while (*queue != NULL) {
+        ObjCallFrame *task = *queue;
+        *queue = task->next;
+        task->next = reversed;
+        reversed = task;
+    }
+    *queue = reversed;
+}
+
+// Makes every task on queue runnable again in the order they parked,
+// returns how many there were
+int wakeWaitQueue(ObjCallFrame **queue, Value value) {
+    // Tasks are pushed onto the front, so reverse the list first
+    reverseQueue(queue);
+
+    int count = 0;
+    while (*queue != NULL) {
+        ObjCallFrame *task = *queue;
+        // Queue the task before unlinking it so it stays reachable
+        wakeTask(task, value);
+        *queue = task->next;
+        task->next = NULL;
+        count++;
+    }
+    return count;
+}
+
+// Marks task done and hands its result to everyone joining it, returns how
+// many tasks woke up
+int finishTask(ObjCallFrame *task, Value result) {
+    task->result = result;
+    WRITE_BARRIER(result);
+    task->state |= FINISHED;
+    checkWorkerDone(task, result);
+    return wakeWaitQueue(&task->joiners, result);
+}
+
+// Wakes the tasks parked on a ready descriptor in the order they parked. A
+// task finishing an operation only wakes once it's done, the others wake up
+// with true.
+static bool wakeQueue(ObjCallFrame **queue) {
+    reverseQueue(queue);
+
+    int count = 0;
+    ObjCallFrame **link = queue;
+    while (*link != NULL) {
+        ObjCallFrame *task = *link;
+        Value result = BOOL_VAL(true);
+        IoOperation *operation = task->operation;
+        if (operation != NULL) {
+            // Still queued while attempt() allocates, so the task and the
+            // operation's data stay reachable
+            if (!operation->attempt(operation, &result)) {
+                link = &task->next;
+                continue;
+            }
+            task->operation = NULL;
+            freeIoOperation(operation);
+        }
+
+        task->stored = result;
+        WRITE_BARRIER(result);
+        scheduleTask(task);
+        *link = task->next;
+        task->next = NULL;
+        count++;
+    }
+
+    // Whoever is left goes back to parking order
+    reverseQueue(queue);
+    asyncHandler.ioWaitCount -= count;
+    return count > 0;
+}
+
+static bool wakeIo(PollerEvent *event) {
+    if (event->fd >= asyncHandler.waiterCapacity) return false;
+
+    IoWaiter *waiter = &asyncHandler.waiters[event->fd];
+    bool woke = false;
+    if (waiter->job != NULL) {
+        if (event->events & POLLER_READ) woke |= readWorker(waiter->job);
+        return woke;
+    }
+    if (event->events & POLLER_READ) woke |= wakeQueue(&waiter->readers);
+    if (event->events & POLLER_WRITE) {
+        // Tasks printing wait on stdout for the buffer to go out
+        if (event->fd == STDOUT_FILENO) drainOutput();
+        woke |= wakeQueue(&waiter->writers);
+    }
+
+    // Only drop interest lazily, once the descriptor turns up with nobody
+    // waiting on it any more
+    int wanted = (waiter->readers ? POLLER_READ : 0) | (waiter->writers ? POLLER_WRITE : 0);
+    if (!woke && (waiter->watching & ~wanted)) {
+        pollerSet(&asyncHandler.poller, event->fd, waiter->watching, wanted);
+        waiter->watching = wanted;
+    }
+
+    return woke;
+}
+
+// The task is on a wait queue or the sleepers, it's out of the running
+static void parkCurrentTask() {
+    endTurn();
+}
+
+static bool wakeSleepers() {
+    bool found = false;
+    double now = getTime();
+    while (asyncHandler.sleeperCount && asyncHandler.sleepers[0].time <= now) {
+        // Queue the task before popping it so it stays reachable
+        ObjCallFrame *sleeper = asyncHandler.sleepers[0].task;
+        sleeper->stored = BOOL_VAL(true);
+        scheduleTask(sleeper);
+        popSleeper();
+        found = true;
+    }
+    return found;
+}
+
+// How long the poller may block: not at all while something can run,
+// otherwise until the next sleeper is due (-1 means no limit).
+static int pollTimeout(bool found) {
+    if (found || vm.runnableCount) return 0;
+    if (!asyncHandler.sleeperCount) return -1;
+
+    double wait = asyncHandler.sleepers[0].time - getTime();
+    if (wait <= 0) return 0;
+    double ms = ceil(wait * 1000);
+    return ms > INT_MAX ? INT_MAX : (int) ms;
 }
 
 void handle_yield_value(Value value) {
@@ -68,48 +534,25 @@ void handle_yield_value(Value value) {
 
                 double time = AS_NUMBER(timeArg);
 
-                writeValueArray(&asyncHandler.sleepers, OBJ_VAL(currentFrame));
-                writeValueArray(&asyncHandler.sleeper_times, NUMBER_VAL(getTime() + time));
-
-                popValueArray(&vm.tasks, vm.currentTask);
-                if (vm.currentTask >= vm.tasks.count) {
-                    getTasks();
-                }
-                vm.currentTask = vm.currentTask % vm.tasks.count;
-
-                break;
-            }
-            case WAIT_IO_READ: {
-                Value fdArg = getListItem(list, 1);
-                if (valuesEqual(arg, NIL_VAL) || !IS_NUMBER(fdArg)) {
-                    runtimeError("Yielded invalid type");
-                }
-
-                writeValueArray(&asyncHandler.readers, OBJ_VAL(currentFrame));
-                writeValueArray(&asyncHandler.reader_fds, fdArg);
-
-                popValueArray(&vm.tasks, vm.currentTask);
-                if (vm.currentTask >= vm.tasks.count) {
-                    getTasks();
-                }
-                vm.currentTask = vm.currentTask % vm.tasks.count;
+                pushSleeper(CURRENT_TASK, getTime() + time);
+                parkCurrentTask();
 
                 break;
             }
+            case WAIT_IO_READ:
             case WAIT_IO_WRITE: {
                 Value fdArg = getListItem(list, 1);
                 if (valuesEqual(arg, NIL_VAL) || !IS_NUMBER(fdArg)) {
                     runtimeError("Yielded invalid type");
                 }
 
-                writeValueArray(&asyncHandler.writers, OBJ_VAL(currentFrame));
-                writeValueArray(&asyncHandler.writer_fds, fdArg);
-
-                popValueArray(&vm.tasks, vm.currentTask);
-                if (vm.currentTask >= vm.tasks.count) {
-                    getTasks();
+                int fd = (int) trunc(AS_NUMBER(fdArg));
+                if (waitForIo(fd, op == WAIT_IO_READ ? POLLER_READ : POLLER_WRITE)) {
+                    parkCurrentTask();
+                } else {
+                    // Regular files and the like are always ready
+                    CURRENT_TASK->stored = BOOL_VAL(true);
                 }
-                vm.currentTask = vm.currentTask % vm.tasks.count;
 
                 break;
             }
@@ -118,94 +561,64 @@ void handle_yield_value(Value value) {
                 return;
         }
     } else {
-        if ((vm.currentTask + 1) >= vm.tasks.count) {
-            getTasks();
-        }
-        vm.currentTask = (vm.currentTask + 1) % vm.tasks.count;
+        // Back of the line, behind everything of the same priority
+        scheduleTask(CURRENT_TASK);
+        endTurn();
     }
 }
 
-// TODO: Make the queue a heapq
 int getTasks() {
-    if (!asyncHandler.sleepers.count) {
-        return 0;
-    } else {
-        int found = -1;
-        for (int i = 0; i < asyncHandler.sleepers.count; i++) {
-//            printf("Sleeper time: %f %f\n", AS_NUMBER(asyncHandler.sleeper_times.values[i]), getTime());
-            if (AS_NUMBER(asyncHandler.sleeper_times.values[i]) < getTime()) {
-                popValueArray(&asyncHandler.sleeper_times, i);
-                Value sleeper = asyncHandler.sleepers.values[i];
-                AS_CALL_FRAME(sleeper)->stored = BOOL_VAL(true);
-                writeValueArray(&vm.tasks, sleeper);
-                popValueArray(&asyncHandler.sleepers, i);
-                found = 1;
-                i--;
-            }
-        }
+    // A freshly forked worker only has its own task left to run
+    if (startWorkers(false)) return 1;
 
-        fd_set errfd;
-        FD_ZERO(&errfd);
+    if (!asyncHandler.sleeperCount && !asyncHandler.ioWaitCount) {
+        return 0;
+    }
 
-        int readStatus;
-        fd_set infd;
-        FD_ZERO(&infd);
-        for (int i = 0; i < asyncHandler.reader_fds.count; i++) {
-            FD_SET(trunc(AS_NUMBER(asyncHandler.reader_fds.values[i])), &infd);
-            FD_SET(trunc(AS_NUMBER(asyncHandler.reader_fds.values[i])), &errfd);
+    bool found = wakeSleepers();
+
+    int timeout = pollTimeout(found);
+    // What's been printed goes out before the process sleeps, unless tasks
+    // are already waiting for stdout to take it
+    if (timeout != 0 && !output.deferred) flushOutput();
+    if (asyncHandler.ioWaitCount || timeout != 0) {
+        PollerEvent events[POLLER_BATCH];
+        int count = pollerWait(&asyncHandler.poller, events, POLLER_BATCH, timeout);
+        for (int i = 0; i < count; i++) {
+            found |= wakeIo(&events[i]);
         }
 
-        fd_set outfd;
-        FD_ZERO(&outfd);
-        for (int i = 0; i < asyncHandler.writer_fds.count; i++) {
-            FD_SET(trunc(AS_NUMBER(asyncHandler.writer_fds.values[i])), &outfd);
-            FD_SET(trunc(AS_NUMBER(asyncHandler.writer_fds.values[i])), &errfd);
+        if (timeout != 0) {
+            found |= wakeSleepers();
         }
+    }
 
-        // create a time struct that will tell select to wait for 200ms
-        struct timeval time;
-        time.tv_sec = 0;
-        time.tv_usec = 200000;
-
-        readStatus = select(INT_MAX, &infd, &outfd, NULL, &time);
+    // Finished workers free up slots for queued ones
+    if (startWorkers(false)) return 1;
 
-        if (!readStatus) {
-            return 0;
-        }
-
-        for (int i = 0; i < asyncHandler.readers.count; i++) {
-//            printf("Sleeper time: %f %f\n", AS_NUMBER(asyncHandler.sleeper_times.values[i]), getTime());
-            if (FD_ISSET(trunc(AS_NUMBER(asyncHandler.reader_fds.values[i])), &infd)) {
-                popValueArray(&asyncHandler.reader_fds, i);
-                Value reader = asyncHandler.readers.values[i];
-                AS_CALL_FRAME(reader)->stored = BOOL_VAL(true);
-                writeValueArray(&vm.tasks, reader);
-                popValueArray(&asyncHandler.readers, i);
-                found = 1;
-                i--;
-            }
-        }
+    return found ? 1 : -1;
+}
 
-        for (int i = 0; i < asyncHandler.writers.count; i++) {
-            if (FD_ISSET(trunc(AS_NUMBER(asyncHandler.writer_fds.values[i])), &outfd)) {
-                popValueArray(&asyncHandler.writer_fds, i);
-                Value writer = asyncHandler.writers.values[i];
-                AS_CALL_FRAME(writer)->stored = BOOL_VAL(true);
-                writeValueArray(&vm.tasks, writer);
-                popValueArray(&asyncHandler.writers, i);
-                found = 1;
-                i--;
-            }
+// Blocks until at least one task is runnable and gives it the turn, returns
+// false once there is nothing left to wait for. getTasks() sleeps in the
+// poller until the next deadline or I/O event, so this only goes round again
+// on early wakeups.
+bool waitForTasks() {
+    while (!vm.runnableCount) {
+        if (getTasks() == 0) {
+            stopWorker();
+            return false;
         }
-
-        return found;
     }
+    runNextTask();
+    return true;
 }
 
 ObjModule *createTaskModule() {
     ObjModule *module = newModule("Task", "task", false);
     push(OBJ_VAL(module));
     defineModuleFunction(module, "spawn", spawnNative);
+    defineModuleFunction(module, "spawnWorker", spawnWorkerNative);
     pop();
     return module;
 }
@@ -215,6 +628,7 @@ SimpleType *createTaskModuleType() {
     FunctorType *callbackType = newFunctorType();
     callbackType->returnType = anyType;
     createBuiltinFunctorType(taskModule, "spawn", (Type *[]) {callbackType}, 1, NULL, 0, taskTypeDef);;
+    createBuiltinFunctorType(taskModule, "spawnWorker", (Type *[]) {callbackType}, 1, NULL, 0, taskTypeDef);;
     return taskModule;
 }
 
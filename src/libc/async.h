@@ -1,6 +1,7 @@
 #include "../value.h"
 #include "type.h"
 #include "module.h"
+#include "poller.h"
 
 #ifndef SAFFRON_ASYNC_H
 #define SAFFRON_ASYNC_H
@@ -14,30 +15,79 @@ typedef enum {
 typedef struct {
     ObjCallFrame *task;
     double time;
+    // Breaks ties between equal deadlines so they wake in the order they slept
+    unsigned long sequence;
 } Sleeper;
 
-#define AS_SLEEPER(value) ((Sleeper*)AS_OBJ(value))
-
 Value spawnNative(int argCount, Value* args);
+ObjCallFrame *newClosureTask(ObjClosure *closure);
 //Value sleepNative(int argCount, Value* args);
 
+// The tasks parked on one file descriptor
+typedef struct {
+    ObjCallFrame *readers;
+    ObjCallFrame *writers;
+    // Events the descriptor is registered for, left armed after a wakeup so
+    // a task that waits on it again doesn't cost a syscall
+    int watching;
+    // Set while the descriptor is a worker's result pipe
+    struct WorkerJob *job;
+} IoWaiter;
+
+// A socket operation a task is parked on. attempt() is run each time the
+// descriptor is ready, it returns false while the operation would still
+// block and otherwise sets the value the task wakes up with.
+typedef struct IoOperation {
+    bool (*attempt)(struct IoOperation *operation, Value *result);
+    int fd;
+    // A descriptor the operation owns and closes when it's done, or -1. It
+    // may be fd itself, when the operation failed and the socket is useless.
+    int source;
+    size_t done;
+    size_t count;
+    Value data;
+} IoOperation;
+
 typedef struct {
-    ValueArray readers;
-    ValueArray reader_fds;
-    ValueArray writers;
-    ValueArray writer_fds;
-    ValueArray sleepers;
-    ValueArray sleeper_times;
+    Poller poller;
+    // Indexed by file descriptor
+    IoWaiter *waiters;
+    int waiterCapacity;
+    int ioWaitCount;
+    // Binary min-heap ordered by deadline, sleepers[0] wakes first
+    Sleeper *sleepers;
+    int sleeperCount;
+    int sleeperCapacity;
+    unsigned long sleeperSequence;
+    // Turns left in the current round before the poller is checked again
+    int turnsUntilPoll;
 } AsyncHandler;
 
-extern AsyncHandler asyncHandler;
+extern _Thread_local AsyncHandler asyncHandler;
 
 void initAsyncHandler();
 void freeAsyncHandler();
 void markAsyncRoots();
+void scheduleTask(ObjCallFrame *task);
+void endTurn();
+void clearRunQueues();
+void freeRunQueues();
+void markRunQueues();
 void handle_yield_value(Value value);
 int getTasks();
+ObjCallFrame *parkTask();
+void parkOnQueue(ObjCallFrame **queue);
+void wakeTask(ObjCallFrame *task, Value value);
+int wakeWaitQueue(ObjCallFrame **queue, Value value);
+int finishTask(ObjCallFrame *task, Value result);
+void watchWorker(int fd, struct WorkerJob *job);
+void unwatchWorker(int fd);
+bool waitForTasks();
+bool waitForOutput();
+bool parkOnIo(int fd, int events, IoOperation *operation);
+void forgetIo(int fd);
+void freeIoOperation(IoOperation *operation);
 
-ModuleRegister taskModuleRegister;
+extern ModuleRegister taskModuleRegister;
 
 #endif //SAFFRON_ASYNC_H
\ No newline at end of file
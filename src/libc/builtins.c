@@ -1,36 +1,104 @@
+#include <string.h>
+
 #include "builtins.h"
 #include "../vm.h"
+#include "../types.h"
 #include "async.h"
 #include "io.h"
 #include "map.h"
+#include "stringbuilder.h"
 #include "list.h"
+#include "float64array.h"
 #include "task.h"
+#include "future.h"
+#include "channel.h"
 #include "time.h"
+#include "net.h"
+#include "fs.h"
+#include "gc.h"
 
-void initLib() { // TODO: Don't evaluate registered modules until accessed?
-    defineType("Module", OBJ_VAL(createModuleType()));
-    defineBuiltin("List", OBJ_VAL(createListType()));
-    defineBuiltin("Map", OBJ_VAL(createMapType()));
-    defineType("Task", OBJ_VAL(createTaskType()));
+// Modules are only built the first time they are imported or looked up as a
+// builtin global, until then the registry just holds their loaders
+static ModuleRegister *registry[] = {
+        &timeModuleRegister,
+        &ioModuleRegister,
+        &taskModuleRegister,
+        &gcModuleRegister,
+        &netModuleRegister,
+        &fsModuleRegister,
+};
+
+#define MODULE_COUNT ((int) (sizeof(registry) / sizeof(registry[0])))
+
+static _Thread_local ObjModule *loaded[MODULE_COUNT];
 
-    #define MODULE_COUNT 3
-    ModuleRegister registry[MODULE_COUNT] = {
-            timeModuleRegister,
-            ioModuleRegister,
-            taskModuleRegister,
-    };
+static ObjModule *loadRegisteredModule(int index) {
+    if (loaded[index] != NULL) return loaded[index];
 
+    ModuleRegister *reg = registry[index];
+    // Rooted through vm.modules by defineModule() before anything else
+    // allocates
+    ObjModule *module = reg->createModuleFn();
+    defineModule(reg->path, OBJ_VAL(module));
+    if (reg->builtin) {
+        defineBuiltin(reg->name, OBJ_VAL(module));
+    }
+    if (hasTypes()) {
+        defineBuiltinTypeDef(reg->path, reg->name, reg->createModuleTypeFn(), reg->builtin);
+    }
+
+    loaded[index] = module;
+    return module;
+}
+
+void defineLoadedTypeDefs() {
     for (int i = 0; i < MODULE_COUNT; i++) {
-        ModuleRegister reg = registry[i];
-        ObjModule* module = reg.createModuleFn();
-        defineModule(reg.path, OBJ_VAL(module));
-        if (reg.builtin){
-            defineBuiltin(reg.name, OBJ_VAL(module));
-        }
+        if (loaded[i] == NULL) continue;
+        ModuleRegister *reg = registry[i];
+        defineBuiltinTypeDef(reg->path, reg->name, reg->createModuleTypeFn(), reg->builtin);
+    }
+}
+
+static bool matches(const char *name, const char *chars, int length) {
+    return (int) strlen(name) == length && memcmp(name, chars, length) == 0;
+}
 
-        defineBuiltinTypeDef(reg.path, reg.name,reg.createModuleTypeFn(), reg.builtin);
+ObjModule *loadBuiltinModule(const char *path, int length) {
+    for (int i = 0; i < MODULE_COUNT; i++) {
+        if (matches(registry[i]->path, path, length)) return loadRegisteredModule(i);
+    }
+    return NULL;
+}
+
+bool isBuiltinModule(const char *path, int length) {
+    for (int i = 0; i < MODULE_COUNT; i++) {
+        if (matches(registry[i]->path, path, length)) return true;
     }
+    return false;
+}
+
+ObjModule *loadBuiltinGlobal(const char *name, int length) {
+    for (int i = 0; i < MODULE_COUNT; i++) {
+        if (registry[i]->builtin && matches(registry[i]->name, name, length)) {
+            return loadRegisteredModule(i);
+        }
+    }
+    return NULL;
+}
+
+void initLib() {
+    defineType("Module", OBJ_VAL(createModuleType()));
+    defineBuiltin("List", OBJ_VAL(createListType()));
+    defineBuiltin("Map", OBJ_VAL(createMapType()));
+    defineBuiltin("Float64Array", OBJ_VAL(createFloat64ArrayType()));
+    defineBuiltin("StringBuilder", OBJ_VAL(createStringBuilderType()));
+    defineType("Task", OBJ_VAL(createTaskType()));
+    defineType("FileReader", OBJ_VAL(createFileReaderType()));
+    defineType("MappedFile", OBJ_VAL(createMappedFileType()));
+    defineBuiltin("Future", OBJ_VAL(createFutureType()));
+    defineBuiltin("Channel", OBJ_VAL(createChannelType()));
 
+    for (int i = 0; i < MODULE_COUNT; i++) loaded[i] = NULL;
 
 //    defineNative("sleep", sleepNative);
-}
\ No newline at end of file
+}
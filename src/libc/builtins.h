@@ -1,6 +1,23 @@
 #ifndef SAFFRON_BUILTINS_H
 #define SAFFRON_BUILTINS_H
 
+#include "../vm.h"
+
 void initLib();
 
+// Builds the registered module imported as path the first time it's asked
+// for, NULL if there is none
+ObjModule *loadBuiltinModule(const char *path, int length);
+
+// Whether path is imported from the registry rather than from a file, without
+// building the module
+bool isBuiltinModule(const char *path, int length);
+
+// Same for the modules visible everywhere as a global, like IO
+ObjModule *loadBuiltinGlobal(const char *name, int length);
+
+// Defines the checker's types for the modules built so far, the ones built
+// after makeTypes() has run define their own
+void defineLoadedTypeDefs();
+
 #endif //SAFFRON_BUILTINS_H
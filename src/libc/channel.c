@@ -0,0 +1,297 @@
+#include <limits.h>
+#include <math.h>
+#include "channel.h"
+#include "async.h"
+#include "list.h"
+#include "../memory.h"
+#include "../output.h"
+
+_Thread_local ObjBuiltinType *channelType = NULL;
+
+ObjChannel *newChannel(int limit) {
+    ObjChannel *instance = ALLOCATE_OBJ(ObjChannel, OBJ_INSTANCE);
+    initInstance(&instance->obj, (ObjClass *) channelType);
+    instance->items = NULL;
+    instance->head = 0;
+    instance->count = 0;
+    instance->capacity = 0;
+    instance->limit = limit;
+    instance->closed = false;
+    instance->receivers.first = NULL;
+    instance->receivers.last = NULL;
+    instance->senders.first = NULL;
+    instance->senders.last = NULL;
+    return instance;
+}
+
+void freeChannel(ObjChannel *channel) {
+    FREE_ARRAY(Value, channel->items, channel->capacity);
+    FREE_OBJ(ObjChannel, channel);
+}
+
+static void markQueue(TaskQueue *queue) {
+    for (ObjCallFrame *task = queue->first; task != NULL; task = task->next) {
+        markObject((Obj *) task);
+    }
+}
+
+void markChannel(ObjChannel *channel) {
+    for (int i = 0; i < channel->count; i++) {
+        markValue(channel->items[(channel->head + i) % channel->capacity]);
+    }
+    markQueue(&channel->receivers);
+    markQueue(&channel->senders);
+}
+
+void printChannel(ObjChannel *channel) {
+    printOutput("<Channel %p>", channel);
+}
+
+static void enqueueTask(TaskQueue *queue, ObjCallFrame *task) {
+    task->next = NULL;
+    if (queue->last == NULL) {
+        queue->first = task;
+    } else {
+        queue->last->next = task;
+    }
+    queue->last = task;
+}
+
+// The task that has waited longest, or NULL
+static ObjCallFrame *dequeueTask(TaskQueue *queue) {
+    ObjCallFrame *task = queue->first;
+    if (task == NULL) return NULL;
+
+    queue->first = task->next;
+    if (queue->first == NULL) queue->last = NULL;
+    task->next = NULL;
+    return task;
+}
+
+static void pushItem(ObjChannel *channel, Value item) {
+    if (channel->count == channel->capacity) {
+        int oldCapacity = channel->capacity;
+        int capacity = GROW_CAPACITY(oldCapacity);
+        channel->items = GROW_ARRAY(Value, channel->items, oldCapacity, capacity);
+        // The part that had wrapped around goes after the rest
+        int wrapped = channel->head + channel->count - oldCapacity;
+        for (int i = 0; i < wrapped; i++) channel->items[oldCapacity + i] = channel->items[i];
+        channel->capacity = capacity;
+    }
+
+    channel->items[(channel->head + channel->count) % channel->capacity] = item;
+    channel->count++;
+    WRITE_BARRIER(item);
+}
+
+// Takes the oldest value, the sender that has waited longest for room gets
+// its value in behind the rest
+static Value takeItem(ObjChannel *channel) {
+    Value item = channel->items[channel->head];
+    channel->head = (channel->head + 1) % channel->capacity;
+    channel->count--;
+
+    ObjCallFrame *sender = dequeueTask(&channel->senders);
+    if (sender != NULL) {
+        pushItem(channel, sender->stored);
+        wakeTask(sender, BOOL_VAL(true));
+    }
+    return item;
+}
+
+static void parkOnChannel(TaskQueue *queue, Value stored) {
+    ObjCallFrame *task = parkTask();
+    task->stored = stored;
+    WRITE_BARRIER(stored);
+    enqueueTask(queue, task);
+}
+
+// A whole number from 1 to INT_MAX, NaN and the infinities fail the range
+// check before anything casts them
+static bool isCapacity(Value value) {
+    if (!IS_NUMBER(value)) return false;
+    double capacity = AS_NUMBER(value);
+    return capacity >= 1 && capacity <= INT_MAX && capacity == floor(capacity);
+}
+
+Value channelCall(int argCount, Value *args) {
+    if (argCount > 1 || (argCount == 1 && !isCapacity(args[0]))) {
+        runtimeError("Expected an optional capacity of at least 1.");
+        return NIL_VAL;
+    }
+    return OBJ_VAL(newChannel(argCount == 1 ? (int) AS_NUMBER(args[0]) : 0));
+}
+
+// Hands value straight to a parked receiver if there is one, parks the
+// sender while the channel is full. Returns false once it's closed.
+Value channelSend(ObjChannel *channel, int argCount, Value *args) {
+    if (argCount != 1) {
+        runtimeError("Expected 1 argument but got %d.", argCount);
+        return NIL_VAL;
+    }
+    if (channel->closed) return BOOL_VAL(false);
+
+    Value value = args[0];
+    ObjCallFrame *receiver = dequeueTask(&channel->receivers);
+    if (receiver != NULL) {
+        Value batch = receiver->stored;
+        if (IS_LIST(batch)) {
+            listPush(AS_LIST(batch), value);
+            WRITE_BARRIER(value);
+            wakeTask(receiver, batch);
+        } else {
+            wakeTask(receiver, value);
+        }
+        return BOOL_VAL(true);
+    }
+
+    if (channel->limit == 0 || channel->count < channel->limit) {
+        pushItem(channel, value);
+        return BOOL_VAL(true);
+    }
+
+    // Woken with true once a receiver makes room, or false if it's closed
+    parkOnChannel(&channel->senders, value);
+    return NIL_VAL;
+}
+
+// The oldest value sent, parks until there is one. Nil once the channel is
+// closed and empty.
+Value channelRecv(ObjChannel *channel, int argCount, Value *args) {
+    if (argCount != 0) {
+        runtimeError("Expected 0 arguments but got %d.", argCount);
+        return NIL_VAL;
+    }
+
+    if (channel->count > 0) return takeItem(channel);
+    if (channel->closed) return NIL_VAL;
+
+    parkOnChannel(&channel->receivers, NIL_VAL);
+    return NIL_VAL;
+}
+
+// Everything waiting in the channel as a list, at most max values of it.
+// Parks until there's at least one, nil once it is closed and empty.
+Value channelRecvMany(ObjChannel *channel, int argCount, Value *args) {
+    if (argCount > 1 || (argCount == 1 && (!IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 1))) {
+        runtimeError("Expected an optional maximum count.");
+        return NIL_VAL;
+    }
+
+    if (channel->count == 0 && channel->closed) return NIL_VAL;
+
+    ObjList *batch = newList();
+    if (channel->count == 0) {
+        // The sender that wakes it puts its value in the list
+        parkOnChannel(&channel->receivers, OBJ_VAL(batch));
+        return NIL_VAL;
+    }
+
+    push(OBJ_VAL(batch));
+    double max = argCount == 1 ? AS_NUMBER(args[0]) : INFINITY;
+    while (channel->count > 0 && batch->items.count < max) listPush(batch, takeItem(channel));
+    pop();
+    return OBJ_VAL(batch);
+}
+
+// Receivers still parked wake up with nil and senders with false, what was
+// already sent can still be received
+Value channelClose(ObjChannel *channel, int argCount, Value *args) {
+    channel->closed = true;
+    ObjCallFrame *task;
+    while ((task = dequeueTask(&channel->receivers)) != NULL) wakeTask(task, NIL_VAL);
+    while ((task = dequeueTask(&channel->senders)) != NULL) wakeTask(task, BOOL_VAL(false));
+    return NIL_VAL;
+}
+
+Value channelIsClosed(ObjChannel *channel, int argCount, Value *args) {
+    return BOOL_VAL(channel->closed);
+}
+
+Value channelLength(ObjChannel *channel, int argCount, Value *args) {
+    return INT_VAL(channel->count);
+}
+
+void channelInit(ObjBuiltinType *type) {
+    type->freeFn = (FreeFn) &freeChannel;
+    type->markFn = (MarkFn) &markChannel;
+    type->printFn = (PrintFn) &printChannel;
+    type->typeCallFn = (TypeCallFn) &channelCall;
+    type->typeDefFn = (GetTypeDefFn) &createChannelTypeDef;
+    defineBuiltinMethod(type, "send", (NativeMethodFn) channelSend);
+    defineBuiltinMethod(type, "recv", (NativeMethodFn) channelRecv);
+    defineBuiltinMethod(type, "recvMany", (NativeMethodFn) channelRecvMany);
+    defineBuiltinMethod(type, "close", (NativeMethodFn) channelClose);
+    defineBuiltinMethod(type, "isClosed", (NativeMethodFn) channelIsClosed);
+    defineBuiltinMethod(type, "length", (NativeMethodFn) channelLength);
+}
+
+ObjBuiltinType *createChannelType() {
+    channelType = newBuiltinType("Channel", channelInit);
+    return channelType;
+}
+
+SimpleType *createChannelTypeDef() {
+    // Class
+    SimpleType *channelTypeDef = newSimpleType();
+
+    // Methods
+    FunctorType *initType = newFunctorType();
+    initType->returnType = (Type *) channelTypeDef;
+    tableSet(
+            &channelTypeDef->methods,
+            copyString("init", 4),
+            OBJ_VAL(initType)
+    );
+
+    FunctorType *sendType = newFunctorType();
+    writeValueArray(&sendType->arguments, OBJ_VAL(anyType));
+    sendType->returnType = (Type *) boolType;
+    tableSet(
+            &channelTypeDef->methods,
+            copyString("send", 4),
+            OBJ_VAL(sendType)
+    );
+
+    FunctorType *recvType = newFunctorType();
+    recvType->returnType = (Type *) anyType;
+    tableSet(
+            &channelTypeDef->methods,
+            copyString("recv", 4),
+            OBJ_VAL(recvType)
+    );
+
+    FunctorType *recvManyType = newFunctorType();
+    recvManyType->returnType = (Type *) anyType;
+    tableSet(
+            &channelTypeDef->methods,
+            copyString("recvMany", 8),
+            OBJ_VAL(recvManyType)
+    );
+
+    FunctorType *closeType = newFunctorType();
+    closeType->returnType = (Type *) nilType;
+    tableSet(
+            &channelTypeDef->methods,
+            copyString("close", 5),
+            OBJ_VAL(closeType)
+    );
+
+    FunctorType *isClosedType = newFunctorType();
+    isClosedType->returnType = (Type *) boolType;
+    tableSet(
+            &channelTypeDef->methods,
+            copyString("isClosed", 8),
+            OBJ_VAL(isClosedType)
+    );
+
+    FunctorType *lengthType = newFunctorType();
+    lengthType->returnType = (Type *) numberType;
+    tableSet(
+            &channelTypeDef->methods,
+            copyString("length", 6),
+            OBJ_VAL(lengthType)
+    );
+
+    return channelTypeDef;
+}
@@ -0,0 +1,45 @@
+#ifndef SAFFRON_CHANNEL_H
+#define SAFFRON_CHANNEL_H
+
+#include "../object.h"
+#include "../vm.h"
+#include "type.h"
+
+// Parked tasks in the order they parked, linked through their next field
+typedef struct {
+    ObjCallFrame *first;
+    ObjCallFrame *last;
+} TaskQueue;
+
+// Passes values between tasks. A task that has to wait parks on the channel
+// and the task on the other end wakes it, nothing polls for it.
+typedef struct {
+    ObjInstance obj;
+    // Ring buffer of the values sent but not received yet
+    Value *items;
+    int head;
+    int count;
+    int capacity;
+    // How many values it holds before send() parks, 0 when unbounded
+    int limit;
+    bool closed;
+    // Parked in recv() or recvMany() until a value is sent, stored holds
+    // the list a recvMany() gets
+    TaskQueue receivers;
+    // Parked in send() until there's room, stored holds the value sent
+    TaskQueue senders;
+} ObjChannel;
+
+ObjChannel *newChannel(int limit);
+
+void freeChannel(ObjChannel *channel);
+
+void markChannel(ObjChannel *channel);
+
+void printChannel(ObjChannel *channel);
+
+ObjBuiltinType *createChannelType();
+
+SimpleType *createChannelTypeDef();
+
+#endif //SAFFRON_CHANNEL_H
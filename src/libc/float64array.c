@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "float64array.h"
+#include "list.h"
+#include "../memory.h"
+#include "../output.h"
+
+_Thread_local ObjBuiltinType *float64ArrayType = NULL;
+
+ObjFloat64Array *newFloat64Array(int length) {
+    // The values come first so a collection can't see a half built array
+    // An empty array has no values at all, ALLOCATE hands back NULL for it
+    double *values = NULL;
+    if (length > 0) {
+        values = ALLOCATE(double, length);
+        memset(values, 0, sizeof(double) * length);
+    }
+
+    ObjFloat64Array *array = ALLOCATE_OBJ(ObjFloat64Array, OBJ_FLOAT64_ARRAY);
+    initInstance(&array->obj, (ObjClass *) float64ArrayType);
+    array->values = values;
+    array->length = length;
+    array->owner = NULL;
+    return array;
+}
+
+// A view of length values of owner starting at start
+static ObjFloat64Array *newView(ObjFloat64Array *array, int start, int length) {
+    ObjFloat64Array *owner = array->owner != NULL ? array->owner : array;
+    ObjFloat64Array *view = ALLOCATE_OBJ(ObjFloat64Array, OBJ_FLOAT64_ARRAY);
+    initInstance(&view->obj, (ObjClass *) float64ArrayType);
+    view->values = length > 0 ? array->values + start : NULL;
+    view->length = length;
+    view->owner = owner;
+    return view;
+}
+
+void freeFloat64Array(ObjFloat64Array *array) {
+    if (array->owner == NULL) FREE_ARRAY(double, array->values, array->length);
+    FREE_OBJ(ObjFloat64Array, array);
+}
+
+void markFloat64Array(ObjFloat64Array *array) {
+    markObject((Obj *) array->owner);
+}
+
+void printFloat64Array(ObjFloat64Array *array) {
+    printOutput("<Float64Array [");
+    for (int i = 0; i < array->length; i++) {
+        printValue(NUMBER_VAL(array->values[i]));
+        if (i != array->length - 1) {
+            printOutput(", ");
+        }
+    }
+    printOutput("]>");
+}
+
+Value float64ArrayCall(int argCount, Value *args) {
+    if (argCount != 1) {
+        runtimeError("Expected a length, a list or a Float64Array.");
+        return NIL_VAL;
+    }
+
+    if (IS_NUMBER(args[0])) {
+        double length = AS_NUMBER(args[0]);
+        if (length < 0 || length != trunc(length) || length > INT32_MAX) {
+            runtimeError("Length must be a non-negative integer.");
+            return NIL_VAL;
+        }
+        return OBJ_VAL(newFloat64Array((int) length));
+    }
+
+    if (IS_FLOAT64_ARRAY(args[0])) {
+        ObjFloat64Array *source = AS_FLOAT64_ARRAY(args[0]);
+        ObjFloat64Array *array = newFloat64Array(source->length);
+        if (source->length > 0) {
+            memcpy(array->values, source->values, sizeof(double) * source->length);
+        }
+        return OBJ_VAL(array);
+    }
+
+    if (IS_LIST(args[0])) {
+        ValueArray *items = &AS_LIST(args[0])->items;
+        for (int i = 0; i < items->count; i++) {
+            if (!IS_NUMBER(items->values[i])) {
+                runtimeError("A Float64Array can only hold numbers.");
+                return NIL_VAL;
+            }
+        }
+
+        ObjFloat64Array *array = newFloat64Array(items->count);
+        for (int i = 0; i < items->count; i++) {
+            array->values[i] = AS_NUMBER(items->values[i]);
+        }
+        return OBJ_VAL(array);
+    }
+
+    runtimeError("Expected a length, a list or a Float64Array.");
+    return NIL_VAL;
+}
+
+Value float64ArrayLength(ObjFloat64Array *array, int argCount, Value *args) {
+    return INT_VAL(array->length);
+}
+
+// The kernels below are plain loops over restrict qualified buffers, which
+// the compiler is free to vectorise
+
+Value float64ArraySum(ObjFloat64Array *array, int argCount, Value *args) {
+    const double *restrict values = array->values;
+    int length = array->length;
+    // Independent partial sums so the additions don't wait on each other
+    double sums[4] = {0, 0, 0, 0};
+    int i = 0;
+    for (; i + 4 <= length; i += 4) {
+        sums[0] += values[i];
+        sums[1] += values[i + 1];
+        sums[2] += values[i + 2];
+        sums[3] += values[i + 3];
+    }
+    for (; i < length; i++) sums[0] += values[i];
+    return NUMBER_VAL((sums[0] + sums[1]) + (sums[2] + sums[3]));
+}
+
+Value float64ArrayMin(ObjFloat64Array *array, int argCount, Value *args) {
+    if (array->length == 0) return NIL_VAL;
+    const double *restrict values = array->values;
+    double result = values[0];
+    for (int i = 1; i < array->length; i++) result = values[i] < result ? values[i] : result;
+    return NUMBER_VAL(result);
+}
+
+Value float64ArrayMax(ObjFloat64Array *array, int argCount, Value *args) {
+    if (array->length == 0) return NIL_VAL;
+    const double *restrict values = array->values;
+    double result = values[0];
+    for (int i = 1; i < array->length; i++) result = values[i] > result ? values[i] : result;
+    return NUMBER_VAL(result);
+}
+
+// The other operand of a binary operation, an array of the same length
+static ObjFloat64Array *sameLengthArray(ObjFloat64Array *array, Value other) {
+    if (!IS_FLOAT64_ARRAY(other)) return NULL;
+    if (AS_FLOAT64_ARRAY(other)->length != array->length) {
+        runtimeError("Arrays must have the same length.");
+        return NULL;
+    }
+    return AS_FLOAT64_ARRAY(other);
+}
+
+Value float64ArrayDot(ObjFloat64Array *array, int argCount, Value *args) {
+    if (argCount != 1 || !IS_FLOAT64_ARRAY(args[0])) {
+        runtimeError("Expected a Float64Array.");
+        return NIL_VAL;
+    }
+    ObjFloat64Array *other = sameLengthArray(array, args[0]);
+    if (other == NULL) return NIL_VAL;
+
+    const double *restrict a = array->values;
+    const double *restrict b = other->values;
+    double sums[4] = {0, 0, 0, 0};
+    int i = 0;
+    for (; i + 4 <= array->length; i += 4) {
+        sums[0] += a[i] * b[i];
+        sums[1] += a[i + 1] * b[i + 1];
+        sums[2] += a[i + 2] * b[i + 2];
+        sums[3] += a[i + 3] * b[i + 3];
+    }
+    for (; i < array->length; i++) sums[0] += a[i] * b[i];
+    return NUMBER_VAL((sums[0] + sums[1]) + (sums[2] + sums[3]));
+}
+
+// Element-wise arithmetic into a new array, with either another array of the
+// same length or a number applied to every element
+#define ELEMENTWISE(name, op) \
+    Value name(ObjFloat64Array *array, int argCount, Value *args) { \
+        if (argCount != 1 || !(IS_NUMBER(args[0]) || IS_FLOAT64_ARRAY(args[0]))) { \
+            runtimeError("Expected a number or a Float64Array."); \
+            return NIL_VAL; \
+        } \
+        ObjFloat64Array *other = sameLengthArray(array, args[0]); \
+        if (IS_FLOAT64_ARRAY(args[0]) && other == NULL) return NIL_VAL; \
+        \
+        ObjFloat64Array *result = newFloat64Array(array->length); \
+        double *restrict out = result->values; \
+        const double *restrict a = array->values; \
+        int length = array->length; \
+        if (other != NULL) { \
+            const double *restrict b = other->values; \
+            for (int i = 0; i < length; i++) out[i] = a[i] op b[i]; \
+        } else { \
+            double b = AS_NUMBER(args[0]); \
+            for (int i = 0; i < length; i++) out[i] = a[i] op b; \
+        } \
+        return OBJ_VAL(result); \
+    }
+
+ELEMENTWISE(float64ArrayAdd, +)
+ELEMENTWISE(float64ArraySubtract, -)
+ELEMENTWISE(float64ArrayMultiply, *)
+ELEMENTWISE(float64ArrayDivide, /)
+
+#undef ELEMENTWISE
+
+Value float64ArrayFill(ObjFloat64Array *array, int argCount, Value *args) {
+    if (argCount != 1 || !IS_NUMBER(args[0])) {
+        runtimeError("Expected a number.");
+        return NIL_VAL;
+    }
+    double *restrict values = array->values;
+    double value = AS_NUMBER(args[0]);
+    for (int i = 0; i < array->length; i++) values[i] = value;
+    return NIL_VAL;
+}
+
+// Negative indexes count from the end, both are clamped to the array
+static int sliceIndex(Value index, int length) {
+    double n = trunc(AS_NUMBER(index));
+    if (n < 0) n += length;
+    return n < 0 ? 0 : n > length ? length : (int) n;
+}
+
+Value float64ArraySlice(ObjFloat64Array *array, int argCount, Value *args) {
+    if (argCount < 1 || argCount > 2 || !IS_NUMBER(args[0]) ||
+        (argCount == 2 && !IS_NUMBER(args[1]))) {
+        runtimeError("Expected a start and an optional end index.");
+        return NIL_VAL;
+    }
+
+    int start = sliceIndex(args[0], array->length);
+    int end = argCount == 2 ? sliceIndex(args[1], array->length) : array->length;
+    return OBJ_VAL(newView(array, start, end > start ? end - start : 0));
+}
+
+Value float64ArrayCopy(ObjFloat64Array *array, int argCount, Value *args) {
+    ObjFloat64Array *copy = newFloat64Array(array->length);
+    if (array->length > 0) {
+        memcpy(copy->values, array->values, sizeof(double) * array->length);
+    }
+    return OBJ_VAL(copy);
+}
+
+Value float64ArrayToList(ObjFloat64Array *array, int argCount, Value *args) {
+    ObjList *list = newList();
+    push(OBJ_VAL(list));
+    for (int i = 0; i < array->length; i++) {
+        writeValueArray(&list->items, NUMBER_VAL(array->values[i]));
+    }
+    return pop();
+}
+
+void float64ArrayInit(ObjBuiltinType *type) {
+    type->freeFn = (FreeFn) &freeFloat64Array;
+    type->markFn = (MarkFn) &markFloat64Array;
+    type->printFn = (PrintFn) &printFloat64Array;
+    type->typeCallFn = (TypeCallFn) &float64ArrayCall;
+    type->typeDefFn = (GetTypeDefFn) &createFloat64ArrayTypeDef;
+    defineBuiltinMethod(type, "length", (NativeMethodFn) float64ArrayLength);
+    defineBuiltinMethod(type, "sum", (NativeMethodFn) float64ArraySum);
+    defineBuiltinMethod(type, "min", (NativeMethodFn) float64ArrayMin);
+    defineBuiltinMethod(type, "max", (NativeMethodFn) float64ArrayMax);
+    defineBuiltinMethod(type, "dot", (NativeMethodFn) float64ArrayDot);
+    defineBuiltinMethod(type, "add", (NativeMethodFn) float64ArrayAdd);
+    defineBuiltinMethod(type, "subtract", (NativeMethodFn) float64ArraySubtract);
+    defineBuiltinMethod(type, "multiply", (NativeMethodFn) float64ArrayMultiply);
+    defineBuiltinMethod(type, "divide", (NativeMethodFn) float64ArrayDivide);
+    defineBuiltinMethod(type, "fill", (NativeMethodFn) float64ArrayFill);
+    defineBuiltinMethod(type, "slice", (NativeMethodFn) float64ArraySlice);
+    defineBuiltinMethod(type, "copy", (NativeMethodFn) float64ArrayCopy);
+    defineBuiltinMethod(type, "toList", (NativeMethodFn) float64ArrayToList);
+}
+
+ObjBuiltinType *createFloat64ArrayType() {
+    float64ArrayType = newBuiltinType("Float64Array", float64ArrayInit);
+    return float64ArrayType;
+}
+
+static void defineMethodType(SimpleType *typeDef, const char *name, Type *argument, Type *returnType) {
+    FunctorType *methodType = newFunctorType();
+    if (argument != NULL) writeValueArray(&methodType->arguments, OBJ_VAL(argument));
+    methodType->returnType = returnType;
+    tableSet(
+            &typeDef->methods,
+            copyString(name, (int) strlen(name)),
+            OBJ_VAL(methodType)
+    );
+}
+
+SimpleType *createFloat64ArrayTypeDef() {
+    // Class
+    SimpleType *arrayTypeDef = newSimpleType();
+
+    // Methods
+    defineMethodType(arrayTypeDef, "init", (Type *) anyType, (Type *) arrayTypeDef);
+    defineMethodType(arrayTypeDef, "length", NULL, (Type *) numberType);
+    defineMethodType(arrayTypeDef, "sum", NULL, (Type *) numberType);
+    defineMethodType(arrayTypeDef, "min", NULL, (Type *) numberType);
+    defineMethodType(arrayTypeDef, "max", NULL, (Type *) numberType);
+    defineMethodType(arrayTypeDef, "dot", (Type *) arrayTypeDef, (Type *) numberType);
+    defineMethodType(arrayTypeDef, "add", (Type *) anyType, (Type *) arrayTypeDef);
+    defineMethodType(arrayTypeDef, "subtract", (Type *) anyType, (Type *) arrayTypeDef);
+    defineMethodType(arrayTypeDef, "multiply", (Type *) anyType, (Type *) arrayTypeDef);
+    defineMethodType(arrayTypeDef, "divide", (Type *) anyType, (Type *) arrayTypeDef);
+    defineMethodType(arrayTypeDef, "fill", (Type *) numberType, (Type *) nilType);
+    defineMethodType(arrayTypeDef, "slice", (Type *) numberType, (Type *) arrayTypeDef);
+    defineMethodType(arrayTypeDef, "copy", NULL, (Type *) arrayTypeDef);
+    defineMethodType(arrayTypeDef, "toList", NULL, (Type *) anyType);
+
+    return arrayTypeDef;
+}
@@ -0,0 +1,33 @@
+#ifndef SAFFRON_FLOAT64ARRAY_H
+#define SAFFRON_FLOAT64ARRAY_H
+
+#include "../object.h"
+#include "../vm.h"
+#include "type.h"
+
+#define AS_FLOAT64_ARRAY(value) ((ObjFloat64Array *)AS_OBJ(value))
+#define IS_FLOAT64_ARRAY(value) isObjType(value, OBJ_FLOAT64_ARRAY)
+
+// A fixed length run of unboxed doubles. A slice is a view into the array it
+// was taken from, it shares that array's values and keeps it alive.
+typedef struct ObjFloat64Array {
+    ObjInstance obj;
+    double *values;
+    int length;
+    // The array that owns values, NULL if this one does
+    struct ObjFloat64Array *owner;
+} ObjFloat64Array;
+
+ObjFloat64Array *newFloat64Array(int length);
+
+void freeFloat64Array(ObjFloat64Array *array);
+
+void markFloat64Array(ObjFloat64Array *array);
+
+void printFloat64Array(ObjFloat64Array *array);
+
+ObjBuiltinType *createFloat64ArrayType();
+
+SimpleType *createFloat64ArrayTypeDef();
+
+#endif //SAFFRON_FLOAT64ARRAY_H
@@ -0,0 +1,520 @@
+// memmem()
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fs.h"
+#include "async.h"
+#include "../memory.h"
+#include "../output.h"
+
+// A reader's buffer starts this big and only grows for longer lines
+#define READER_CAPACITY (64 * 1024)
+
+_Thread_local ObjBuiltinType *fileReaderType = NULL;
+_Thread_local ObjBuiltinType *mappedFileType = NULL;
+
+static ObjString *textArgument(Value value) {
+    return IS_ROPE(value) ? flattenRope(AS_ROPE(value)) : AS_STRING(value);
+}
+
+// Strings are int sized, longer text is an error rather than a string cut
+// to the wrong length
+static bool fitsString(size_t length) {
+    if (length <= INT_MAX) return true;
+    runtimeError("Text of %zu bytes is too long for a string.", length);
+    return false;
+}
+
+// A line without its "\n" or "\r\n"
+static Value newLine(const char *chars, size_t length) {
+    if (length > 0 && chars[length - 1] == '\r') length--;
+    if (!fitsString(length)) return NIL_VAL;
+    return OBJ_VAL(copyString(chars, (int) length));
+}
+
+static ObjFileReader *newFileReader(int fd) {
+    // The buffer comes first so a collection can't see a half built reader
+    char *chars = ALLOCATE(char, READER_CAPACITY);
+
+    ObjFileReader *reader = ALLOCATE_OBJ(ObjFileReader, OBJ_INSTANCE);
+    initInstance(&reader->obj, (ObjClass *) fileReaderType);
+    reader->fd = fd;
+    reader->pollable = false;
+    reader->atEnd = false;
+    reader->chars = chars;
+    reader->start = 0;
+    reader->length = 0;
+    reader->capacity = READER_CAPACITY;
+    reader->line = NIL_VAL;
+    return reader;
+}
+
+static void closeReader(ObjFileReader *reader) {
+    if (reader->fd < 0) return;
+    if (reader->pollable) forgetIo(reader->fd);
+    close(reader->fd);
+    reader->fd = -1;
+    reader->atEnd = true;
+    reader->start = reader->length = 0;
+    reader->line = NIL_VAL;
+}
+
+void freeFileReader(ObjFileReader *reader) {
+    closeReader(reader);
+    FREE_ARRAY(char, reader->chars, reader->capacity);
+    FREE_OBJ(ObjFileReader, reader);
+}
+
+void markFileReader(ObjFileReader *reader) {
+    markValue(reader->line);
+}
+
+void printFileReader(ObjFileReader *reader) {
+    printOutput(reader->fd < 0 ? "<FileReader closed>" : "<FileReader %d>", reader->fd);
+}
+
+Value fileReaderCall(int argCount, Value *args) {
+    runtimeError("Files are opened with Fs.open().");
+    return NIL_VAL;
+}
+
+typedef enum {
+    FILL_READ,
+    FILL_END,
+    FILL_WAIT,
+} FillResult;
+
+// Reads more of the file in after what's buffered
+static FillResult fill(ObjFileReader *reader) {
+    if (reader->atEnd) return FILL_END;
+
+    if (reader->start > 0) {
+        memmove(reader->chars, reader->chars + reader->start, reader->length - reader->start);
+        reader->length -= reader->start;
+        reader->start = 0;
+    }
+    if (reader->length == reader->capacity) {
+        // Only a line that doesn't fit gets here
+        size_t capacity = reader->capacity * 2;
+        reader->chars = GROW_ARRAY(char, reader->chars, reader->capacity, capacity);
+        reader->capacity = capacity;
+    }
+
+    while (true) {
+        ssize_t count = read(reader->fd, reader->chars + reader->length, reader->capacity - reader->length);
+        if (count > 0) {
+            reader->length += count;
+            return FILL_READ;
+        }
+        if (count < 0 && errno == EINTR) continue;
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return FILL_WAIT;
+
+        // A read error ends the file as well
+        reader->atEnd = true;
+        return FILL_END;
+    }
+}
+
+// Takes the next line out of the buffer, nil at the end of the file. False
+// if the file has to be waited on first.
+static bool takeLine(ObjFileReader *reader, Value *line) {
+    // What's already been searched for the end of the line, from start
+    size_t searched = 0;
+    while (true) {
+        char *begin = reader->chars + reader->start;
+        size_t buffered = reader->length - reader->start;
+        char *end = memchr(begin + searched, '\n', buffered - searched);
+        if (end != NULL) {
+            *line = newLine(begin, end - begin);
+            reader->start += end - begin + 1;
+            return true;
+        }
+        searched = buffered;
+
+        FillResult result = fill(reader);
+        if (result == FILL_WAIT) return false;
+        if (result == FILL_END) {
+            // The last line need not end in one
+            *line = buffered == 0 ? NIL_VAL : newLine(reader->chars + reader->start, buffered);
+            reader->start = reader->length;
+            return true;
+        }
+    }
+}
+
+// Takes up to count buffered bytes, reading more if there are none
+static bool takeChunk(ObjFileReader *reader, size_t count, Value *chunk) {
+    if (reader->start == reader->length) {
+        FillResult result = fill(reader);
+        if (result == FILL_WAIT) return false;
+        if (result == FILL_END) {
+            *chunk = NIL_VAL;
+            return true;
+        }
+    }
+
+    size_t buffered = reader->length - reader->start;
+    if (count > buffered) count = buffered;
+    if (count > INT_MAX) count = INT_MAX;
+    *chunk = OBJ_VAL(copyString(reader->chars + reader->start, (int) count));
+    reader->start += count;
+    return true;
+}
+
+// The line next?() found waits in the reader for next()
+static bool takeNextLine(ObjFileReader *reader, Value *line) {
+    if (!IS_NIL(reader->line)) {
+        *line = reader->line;
+        reader->line = NIL_VAL;
+        return true;
+    }
+    return takeLine(reader, line);
+}
+
+static bool lineAttempt(IoOperation *operation, Value *result) {
+    return takeNextLine((ObjFileReader *) AS_OBJ(operation->data), result);
+}
+
+static bool hasLineAttempt(IoOperation *operation, Value *result) {
+    ObjFileReader *reader = (ObjFileReader *) AS_OBJ(operation->data);
+    if (IS_NIL(reader->line)) {
+        if (!takeLine(reader, &reader->line)) return false;
+        // The reader may have been marked already
+        WRITE_BARRIER(reader->line);
+    }
+    *result = BOOL_VAL(!IS_NIL(reader->line));
+    return true;
+}
+
+static bool chunkAttempt(IoOperation *operation, Value *result) {
+    return takeChunk((ObjFileReader *) AS_OBJ(operation->data), operation->count, result);
+}
+
+// Runs attempt now, and if the file has nothing yet parks the task until it
+// does. The parked task wakes up with the result in place of what this
+// returns.
+static Value readOrPark(ObjFileReader *reader, bool (*attempt)(IoOperation *, Value *), size_t count) {
+    IoOperation operation = {attempt, reader->fd, -1, 0, count, OBJ_VAL(reader)};
+    Value result = NIL_VAL;
+    while (!attempt(&operation, &result)) {
+        IoOperation *parked = ALLOCATE(IoOperation, 1);
+        *parked = operation;
+        if (parkOnIo(reader->fd, POLLER_READ, parked)) return NIL_VAL;
+        freeIoOperation(parked);
+
+        // Not something the poller takes, so wait for it right here
+        struct pollfd ready = {reader->fd, POLLIN, 0};
+        poll(&ready, 1, -1);
+    }
+    return result;
+}
+
+Value fileReaderRead(ObjFileReader *reader, int argCount, Value *args) {
+    if (argCount > 1 || (argCount == 1 && (!IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 1))) {
+        runtimeError("Expected an optional byte count.");
+        return NIL_VAL;
+    }
+
+    size_t count = argCount == 1 ? (size_t) AS_NUMBER(args[0]) : READER_CAPACITY;
+    return readOrPark(reader, chunkAttempt, count);
+}
+
+Value fileReaderReadLine(ObjFileReader *reader, int argCount, Value *args) {
+    return readOrPark(reader, lineAttempt, 0);
+}
+
+Value fileReaderIter(ObjFileReader *reader, int argCount, Value *args) {
+    return OBJ_VAL(reader);
+}
+
+Value fileReaderHasNext(ObjFileReader *reader, int argCount, Value *args) {
+    return readOrPark(reader, hasLineAttempt, 0);
+}
+
+Value fileReaderClose(ObjFileReader *reader, int argCount, Value *args) {
+    closeReader(reader);
+    return NIL_VAL;
+}
+
+static void defineMethodType(SimpleType *typeDef, const char *name, Type *argument, Type *returnType) {
+    FunctorType *methodType = newFunctorType();
+    if (argument != NULL) writeValueArray(&methodType->arguments, OBJ_VAL(argument));
+    methodType->returnType = returnType;
+    tableSet(
+            &typeDef->methods,
+            copyString(name, (int) strlen(name)),
+            OBJ_VAL(methodType)
+    );
+}
+
+SimpleType *createFileReaderTypeDef() {
+    SimpleType *readerTypeDef = newSimpleType();
+    defineMethodType(readerTypeDef, "read", (Type *) numberType, (Type *) anyType);
+    defineMethodType(readerTypeDef, "readLine", NULL, (Type *) anyType);
+    defineMethodType(readerTypeDef, "iter", NULL, (Type *) readerTypeDef);
+    defineMethodType(readerTypeDef, "next?", NULL, (Type *) boolType);
+    defineMethodType(readerTypeDef, "next", NULL, (Type *) anyType);
+    defineMethodType(readerTypeDef, "close", NULL, (Type *) nilType);
+    return readerTypeDef;
+}
+
+void fileReaderInit(ObjBuiltinType *type) {
+    type->freeFn = (FreeFn) &freeFileReader;
+    type->markFn = (MarkFn) &markFileReader;
+    type->printFn = (PrintFn) &printFileReader;
+    type->typeCallFn = (TypeCallFn) &fileReaderCall;
+    type->typeDefFn = (GetTypeDefFn) &createFileReaderTypeDef;
+    defineBuiltinMethod(type, "read", (NativeMethodFn) fileReaderRead);
+    defineBuiltinMethod(type, "readLine", (NativeMethodFn) fileReaderReadLine);
+    defineBuiltinMethod(type, "iter", (NativeMethodFn) fileReaderIter);
+    defineBuiltinMethod(type, "next?", (NativeMethodFn) fileReaderHasNext);
+    defineBuiltinMethod(type, "next", (NativeMethodFn) fileReaderReadLine);
+    defineBuiltinMethod(type, "close", (NativeMethodFn) fileReaderClose);
+}
+
+ObjBuiltinType *createFileReaderType() {
+    fileReaderType = newBuiltinType("FileReader", fileReaderInit);
+    return fileReaderType;
+}
+
+void freeMappedFile(ObjMappedFile *file) {
+    if (file->chars != NULL) munmap(file->chars, file->length);
+    FREE_OBJ(ObjMappedFile, file);
+}
+
+void markMappedFile(ObjMappedFile *file) {
+}
+
+void printMappedFile(ObjMappedFile *file) {
+    printOutput("<MappedFile %zu>", file->length);
+}
+
+Value mappedFileCall(int argCount, Value *args) {
+    runtimeError("Files are mapped with Fs.map().");
+    return NIL_VAL;
+}
+
+Value mappedFileLength(ObjMappedFile *file, int argCount, Value *args) {
+    return NUMBER_VAL((double) file->length);
+}
+
+static bool isOffset(Value value, size_t limit) {
+    return IS_NUMBER(value) && AS_NUMBER(value) >= 0 && AS_NUMBER(value) <= (double) limit &&
+           AS_NUMBER(value) == (double) (size_t) AS_NUMBER(value);
+}
+
+Value mappedFileByte(ObjMappedFile *file, int argCount, Value *args) {
+    if (argCount != 1 || file->length == 0 || !isOffset(args[0], file->length - 1)) {
+        runtimeError("Expected an index into the file.");
+        return NIL_VAL;
+    }
+    return NUMBER_VAL((unsigned char) file->chars[(size_t) AS_NUMBER(args[0])]);
+}
+
+Value mappedFileSlice(ObjMappedFile *file, int argCount, Value *args) {
+    if (argCount < 1 || argCount > 2 || !isOffset(args[0], file->length) ||
+        (argCount == 2 && (!isOffset(args[1], file->length) || AS_NUMBER(args[1]) < AS_NUMBER(args[0])))) {
+        runtimeError("Expected a start and an optional end index.");
+        return NIL_VAL;
+    }
+
+    size_t start = (size_t) AS_NUMBER(args[0]);
+    size_t end = argCount == 2 ? (size_t) AS_NUMBER(args[1]) : file->length;
+    if (!fitsString(end - start)) return NIL_VAL;
+    return OBJ_VAL(copyString(file->chars + start, (int) (end - start)));
+}
+
+Value mappedFileIndexOf(ObjMappedFile *file, int argCount, Value *args) {
+    if (argCount < 1 || argCount > 2 || !IS_TEXT(args[0]) || (argCount == 2 && !isOffset(args[1], file->length))) {
+        runtimeError("Expected a string and an optional start index.");
+        return NIL_VAL;
+    }
+
+    ObjString *text = textArgument(args[0]);
+    size_t from = argCount == 2 ? (size_t) AS_NUMBER(args[1]) : 0;
+    if (file->chars == NULL) return NUMBER_VAL(text->length == 0 ? 0 : -1);
+
+    char *found = memmem(file->chars + from, file->length - from, text->chars, text->length);
+    return NUMBER_VAL(found == NULL ? -1 : (double) (found - file->chars));
+}
+
+Value mappedFileIter(ObjMappedFile *file, int argCount, Value *args) {
+    file->position = 0;
+    return OBJ_VAL(file);
+}
+
+Value mappedFileHasNext(ObjMappedFile *file, int argCount, Value *args) {
+    return BOOL_VAL(file->position < file->length);
+}
+
+Value mappedFileNext(ObjMappedFile *file, int argCount, Value *args) {
+    if (file->position >= file->length) return NIL_VAL;
+
+    char *begin = file->chars + file->position;
+    size_t remaining = file->length - file->position;
+    char *end = memchr(begin, '\n', remaining);
+    size_t length = end == NULL ? remaining : (size_t) (end - begin);
+    file->position += end == NULL ? length : length + 1;
+    return newLine(begin, length);
+}
+
+Value mappedFileClose(ObjMappedFile *file, int argCount, Value *args) {
+    if (file->chars != NULL) munmap(file->chars, file->length);
+    file->chars = NULL;
+    file->length = 0;
+    file->position = 0;
+    return NIL_VAL;
+}
+
+SimpleType *createMappedFileTypeDef() {
+    SimpleType *fileTypeDef = newSimpleType();
+    defineMethodType(fileTypeDef, "length", NULL, (Type *) numberType);
+    defineMethodType(fileTypeDef, "byte", (Type *) numberType, (Type *) numberType);
+    defineMethodType(fileTypeDef, "slice", (Type *) numberType, (Type *) stringType);
+    defineMethodType(fileTypeDef, "indexOf", (Type *) stringType, (Type *) numberType);
+    defineMethodType(fileTypeDef, "iter", NULL, (Type *) fileTypeDef);
+    defineMethodType(fileTypeDef, "next?", NULL, (Type *) boolType);
+    defineMethodType(fileTypeDef, "next", NULL, (Type *) stringType);
+    defineMethodType(fileTypeDef, "close", NULL, (Type *) nilType);
+    return fileTypeDef;
+}
+
+void mappedFileInit(ObjBuiltinType *type) {
+    type->freeFn = (FreeFn) &freeMappedFile;
+    type->markFn = (MarkFn) &markMappedFile;
+    type->printFn = (PrintFn) &printMappedFile;
+    type->typeCallFn = (TypeCallFn) &mappedFileCall;
+    type->typeDefFn = (GetTypeDefFn) &createMappedFileTypeDef;
+    defineBuiltinMethod(type, "length", (NativeMethodFn) mappedFileLength);
+    defineBuiltinMethod(type, "byte", (NativeMethodFn) mappedFileByte);
+    defineBuiltinMethod(type, "slice", (NativeMethodFn) mappedFileSlice);
+    defineBuiltinMethod(type, "indexOf", (NativeMethodFn) mappedFileIndexOf);
+    defineBuiltinMethod(type, "iter", (NativeMethodFn) mappedFileIter);
+    defineBuiltinMethod(type, "next?", (NativeMethodFn) mappedFileHasNext);
+    defineBuiltinMethod(type, "next", (NativeMethodFn) mappedFileNext);
+    defineBuiltinMethod(type, "close", (NativeMethodFn) mappedFileClose);
+}
+
+ObjBuiltinType *createMappedFileType() {
+    mappedFileType = newBuiltinType("MappedFile", mappedFileInit);
+    return mappedFileType;
+}
+
+static bool checkPath(int argCount, Value *args) {
+    if (argCount != 1 || !IS_TEXT(args[0])) {
+        runtimeError("Expected a path.");
+        return false;
+    }
+    return true;
+}
+
+// Opens path for reading, nil if it can't be
+Value openNative(int argCount, Value *args) {
+    if (!checkPath(argCount, args)) return NIL_VAL;
+
+    int fd = open(textArgument(args[0])->chars, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd < 0) return NIL_VAL;
+    if (fstat(fd, &info) != 0 || S_ISDIR(info.st_mode)) {
+        close(fd);
+        return NIL_VAL;
+    }
+
+    ObjFileReader *reader = newFileReader(fd);
+    if (S_ISREG(info.st_mode)) {
+#ifdef POSIX_FADV_SEQUENTIAL
+        // Files are read front to back, so the kernel can read further ahead
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    } else {
+        int flags = fcntl(fd, F_GETFL);
+        reader->pollable = flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+    }
+    return OBJ_VAL(reader);
+}
+
+// Maps a regular file, nil if it can't be
+Value mapNative(int argCount, Value *args) {
+    if (!checkPath(argCount, args)) return NIL_VAL;
+
+    int fd = open(textArgument(args[0])->chars, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd < 0) return NIL_VAL;
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+        close(fd);
+        return NIL_VAL;
+    }
+
+    // An empty file has nothing to map
+    char *chars = NULL;
+    size_t length = (size_t) info.st_size;
+    if (length > 0) {
+        chars = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (chars == MAP_FAILED) {
+            close(fd);
+            return NIL_VAL;
+        }
+        madvise(chars, length, MADV_SEQUENTIAL);
+    }
+    // The mapping outlives the descriptor
+    close(fd);
+
+    ObjMappedFile *file = ALLOCATE_OBJ(ObjMappedFile, OBJ_INSTANCE);
+    initInstance(&file->obj, (ObjClass *) mappedFileType);
+    file->chars = chars;
+    file->length = length;
+    file->position = 0;
+    return OBJ_VAL(file);
+}
+
+// The whole of a regular file as a string, nil if it can't be read
+Value readFileNative(int argCount, Value *args) {
+    if (!checkPath(argCount, args)) return NIL_VAL;
+
+    Value file = mapNative(argCount, args);
+    if (IS_NIL(file)) return NIL_VAL;
+
+    push(file);
+    ObjMappedFile *mapped = (ObjMappedFile *) AS_OBJ(file);
+    Value text = NIL_VAL;
+    if (fitsString(mapped->length)) {
+        text = OBJ_VAL(copyString(mapped->chars == NULL ? "" : mapped->chars, (int) mapped->length));
+    }
+    mappedFileClose(mapped, 0, NULL);
+    pop();
+    return text;
+}
+
+ObjModule *createFsModule() {
+    ObjModule *module = newModule("Fs", "fs", false);
+    push(OBJ_VAL(module));
+    defineModuleFunction(module, "open", openNative);
+    defineModuleFunction(module, "map", mapNative);
+    defineModuleFunction(module, "readFile", readFileNative);
+    pop();
+    return module;
+}
+
+SimpleType *createFsModuleType() {
+    SimpleType *fsModule = newSimpleType();
+    createBuiltinFunctorType(fsModule, "open", (Type *[]) {stringType}, 1, NULL, 0, anyType);;
+    createBuiltinFunctorType(fsModule, "map", (Type *[]) {stringType}, 1, NULL, 0, anyType);;
+    createBuiltinFunctorType(fsModule, "readFile", (Type *[]) {stringType}, 1, NULL, 0, anyType);;
+    return fsModule;
+}
+
+ModuleRegister fsModuleRegister = {
+        createFsModule,
+        createFsModuleType,
+        "fs",
+        "Fs",
+        false
+};
@@ -0,0 +1,44 @@
+#ifndef SAFFRON_FS_H
+#define SAFFRON_FS_H
+
+#include "../object.h"
+#include "../vm.h"
+#include "type.h"
+#include "module.h"
+
+// Streams a file through a buffer, a chunk or a line at a time. Pipes and
+// terminals are read without blocking, a read that has to wait parks the
+// task on the poller so the others run.
+typedef struct {
+    ObjInstance obj;
+    // -1 once closed
+    int fd;
+    bool pollable;
+    bool atEnd;
+    // Bytes [start, length) have been read but not handed out yet
+    char *chars;
+    size_t start;
+    size_t length;
+    size_t capacity;
+    // The line next?() read ahead for next()
+    Value line;
+} ObjFileReader;
+
+// A read-only view of a whole file mapped into memory. Its bytes are read
+// straight from the page cache, truncating the file while it's mapped makes
+// reading past the new end fault.
+typedef struct {
+    ObjInstance obj;
+    char *chars;
+    size_t length;
+    // Where iterating over its lines has got to
+    size_t position;
+} ObjMappedFile;
+
+ObjBuiltinType *createFileReaderType();
+
+ObjBuiltinType *createMappedFileType();
+
+extern ModuleRegister fsModuleRegister;
+
+#endif //SAFFRON_FS_H
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include "future.h"
+#include "async.h"
+#include "../memory.h"
+#include "../output.h"
+
+_Thread_local ObjBuiltinType *futureType = NULL;
+
+ObjFuture *newFuture() {
+    ObjFuture *instance = ALLOCATE_OBJ(ObjFuture, OBJ_INSTANCE);
+    initInstance(&instance->obj, (ObjClass *) futureType);
+    instance->result = NIL_VAL;
+    instance->ready = false;
+    instance->waiters = NULL;
+    return instance;
+}
+
+void freeFuture(ObjFuture *future) {
+    FREE_OBJ(ObjFuture, future);
+}
+
+void markFuture(ObjFuture *future) {
+    markValue(future->result);
+    for (ObjCallFrame *waiter = future->waiters; waiter != NULL; waiter = waiter->next) {
+        markObject((Obj *) waiter);
+    }
+}
+
+void printFuture(ObjFuture *future) {
+    printOutput("<Future %p>", future);
+}
+
+Value futureCall(int argCount, Value *args) {
+    if (argCount != 0) {
+        runtimeError("Expected 0 arguments but got %d.", argCount);
+        return NIL_VAL;
+    }
+    return OBJ_VAL(newFuture());
+}
+
+Value futureSetResult(ObjFuture *future, int argCount, Value *args) {
+    if (argCount != 1) {
+        runtimeError("Expected 1 argument but got %d.", argCount);
+        return NIL_VAL;
+    }
+
+    future->result = args[0];
+    WRITE_BARRIER(future->result);
+    future->ready = true;
+    wakeWaitQueue(&future->waiters, future->result);
+    return NIL_VAL;
+}
+
+Value futureGetResult(ObjFuture *future, int argCount, Value *args) {
+    return future->result;
+}
+
+Value futureIsReady(ObjFuture *future, int argCount, Value *args) {
+    return BOOL_VAL(future->ready);
+}
+
+Value futureJoin(ObjFuture *future, int argCount, Value *args) {
+    if (future->ready) {
+        return future->result;
+    }
+
+    // Resumed with the result once setResult is called
+    parkOnQueue(&future->waiters);
+    return NIL_VAL;
+}
+
+void futureInit(ObjBuiltinType *type) {
+    type->freeFn = (FreeFn) &freeFuture;
+    type->markFn = (MarkFn) &markFuture;
+    type->printFn = (PrintFn) &printFuture;
+    type->typeCallFn = (TypeCallFn) &futureCall;
+    type->typeDefFn = (GetTypeDefFn) &createFutureTypeDef;
+    defineBuiltinMethod(type, "setResult", (NativeMethodFn) futureSetResult);
+    defineBuiltinMethod(type, "getResult", (NativeMethodFn) futureGetResult);
+    defineBuiltinMethod(type, "isReady", (NativeMethodFn) futureIsReady);
+    defineBuiltinMethod(type, "join", (NativeMethodFn) futureJoin);
+}
+
+ObjBuiltinType *createFutureType() {
+    futureType = newBuiltinType("Future", futureInit);
+    return futureType;
+}
+
+SimpleType *createFutureTypeDef() {
+    // Class
+    SimpleType *futureTypeDef = newSimpleType();
+
+    // Methods
+    FunctorType *initType = newFunctorType();
+    initType->returnType = (Type *) futureTypeDef;
+    tableSet(
+            &futureTypeDef->methods,
+            copyString("init", 4),
+            OBJ_VAL(initType)
+    );
+
+    FunctorType *setResultType = newFunctorType();
+    writeValueArray(&setResultType->arguments, OBJ_VAL(anyType));
+    setResultType->returnType = (Type *) nilType;
+    tableSet(
+            &futureTypeDef->methods,
+            copyString("setResult", 9),
+            OBJ_VAL(setResultType)
+    );
+
+    FunctorType *getResultType = newFunctorType();
+    getResultType->returnType = (Type *) anyType;
+    tableSet(
+            &futureTypeDef->methods,
+            copyString("getResult", 9),
+            OBJ_VAL(getResultType)
+    );
+
+    FunctorType *isReadyType = newFunctorType();
+    isReadyType->returnType = (Type *) boolType;
+    tableSet(
+            &futureTypeDef->methods,
+            copyString("isReady", 7),
+            OBJ_VAL(isReadyType)
+    );
+
+    FunctorType *joinType = newFunctorType();
+    joinType->returnType = (Type *) anyType;
+    tableSet(
+            &futureTypeDef->methods,
+            copyString("join", 4),
+            OBJ_VAL(joinType)
+    );
+
+    return futureTypeDef;
+}
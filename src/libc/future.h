@@ -0,0 +1,28 @@
+#ifndef SAFFRON_FUTURE_H
+#define SAFFRON_FUTURE_H
+
+#include "../object.h"
+#include "../vm.h"
+#include "type.h"
+
+typedef struct {
+    ObjInstance obj;
+    Value result;
+    bool ready;
+    // Tasks parked in join() until a result is set
+    ObjCallFrame *waiters;
+} ObjFuture;
+
+ObjFuture *newFuture();
+
+void freeFuture(ObjFuture *future);
+
+void markFuture(ObjFuture *future);
+
+void printFuture(ObjFuture *future);
+
+ObjBuiltinType *createFutureType();
+
+SimpleType *createFutureTypeDef();
+
+#endif //SAFFRON_FUTURE_H
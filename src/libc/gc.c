@@ -0,0 +1,140 @@
+#include <string.h>
+
+#include "gc.h"
+#include "list.h"
+#include "map.h"
+#include "../memory.h"
+
+static const char *objTypeNames[OBJ_TYPE_COUNT] = {
+        [OBJ_STRING] = "String",
+        [OBJ_ATOM] = "Atom",
+        [OBJ_ROPE] = "Rope",
+        [OBJ_FUNCTION] = "Function",
+        [OBJ_NATIVE] = "Native",
+        [OBJ_NATIVE_METHOD] = "NativeMethod",
+        [OBJ_CLOSURE] = "Closure",
+        [OBJ_UPVALUE] = "Upvalue",
+        [OBJ_CLASS] = "Class",
+        [OBJ_BUILTIN_TYPE] = "BuiltinType",
+        [OBJ_PARSE_TYPE] = "Type",
+        [OBJ_PARSE_FUNCTOR_TYPE] = "FunctorType",
+        [OBJ_PARSE_GENERIC_TYPE] = "GenericType",
+        [OBJ_PARSE_GENERIC_DEFINITION_TYPE] = "GenericDefinitionType",
+        [OBJ_PARSE_UNION_TYPE] = "UnionType",
+        [OBJ_PARSE_INTERFACE_TYPE] = "InterfaceType",
+        [OBJ_INSTANCE] = "Instance",
+        [OBJ_LIST] = "List",
+        [OBJ_MAP] = "Map",
+        [OBJ_FLOAT64_ARRAY] = "Float64Array",
+        [OBJ_BOUND_METHOD] = "BoundMethod",
+        [OBJ_CALL_FRAME] = "Task",
+        [OBJ_MODULE] = "Module",
+};
+
+// value has to be reachable already if it is an object
+static void setStat(ObjMap *map, const char *name, Value value) {
+    push(value);
+    push(OBJ_VAL(copyString(name, (int) strlen(name))));
+    valueTableSet(&map->values, peek(0), peek(1));
+    pop();
+    pop();
+}
+
+static Value statsNative(int argCount, Value *args) {
+    if (argCount != 0) {
+        runtimeError("Expected 0 arguments but got %d.", argCount);
+        return NIL_VAL;
+    }
+
+    // Building the result allocates, so it reports the counters from before
+    GCStats stats = gcStats;
+    size_t heapBytes = vm.bytesAllocated;
+    size_t nextCollection = vm.nextGC;
+
+    ObjMap *result = newMap();
+    push(OBJ_VAL(result));
+    setStat(result, "collections", NUMBER_VAL((double) stats.collections));
+    setStat(result, "steps", NUMBER_VAL((double) stats.steps));
+    setStat(result, "heapBytes", NUMBER_VAL((double) heapBytes));
+    setStat(result, "nextCollection", NUMBER_VAL((double) nextCollection));
+    setStat(result, "allocatedBytes", NUMBER_VAL((double) stats.bytesAllocated));
+    setStat(result, "freedBytes", NUMBER_VAL((double) stats.bytesFreed));
+    setStat(result, "growFactor", NUMBER_VAL(gcHeapGrowFactor));
+    setStat(result, "markSeconds", NUMBER_VAL(stats.markSeconds));
+    setStat(result, "sweepSeconds", NUMBER_VAL(stats.sweepSeconds));
+    setStat(result, "longestPause", NUMBER_VAL(stats.longestPause));
+
+    ObjMap *objects = newMap();
+    setStat(result, "objects", OBJ_VAL(objects));
+    for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+        if (stats.objects[type] > 0) {
+            setStat(objects, objTypeNames[type], NUMBER_VAL((double) stats.objects[type]));
+        }
+    }
+
+    // pauses[i] counts the pauses under 2^i microseconds
+    ObjList *pauses = newList();
+    setStat(result, "pauses", OBJ_VAL(pauses));
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        writeValueArray(&pauses->items, NUMBER_VAL((double) stats.pauses[i]));
+    }
+
+    pop();
+    return OBJ_VAL(result);
+}
+
+// Runs a whole collection now, returning the bytes it freed
+static Value collectNative(int argCount, Value *args) {
+    if (argCount != 0) {
+        runtimeError("Expected 0 arguments but got %d.", argCount);
+        return NIL_VAL;
+    }
+
+    size_t before = vm.bytesAllocated;
+    collectGarbage();
+    return NUMBER_VAL((double) (before - vm.bytesAllocated));
+}
+
+// Takes effect from the next collection, returns the previous factor
+static Value setGrowFactorNative(int argCount, Value *args) {
+    if (argCount != 1 || !IS_NUMBER(args[0])) {
+        runtimeError("Expected a number.");
+        return NIL_VAL;
+    }
+
+    double factor = AS_NUMBER(args[0]);
+    if (!(factor > 1)) {
+        runtimeError("The heap grow factor must be more than 1.");
+        return NIL_VAL;
+    }
+
+    double previous = gcHeapGrowFactor;
+    gcHeapGrowFactor = factor;
+    return NUMBER_VAL(previous);
+}
+
+ObjModule *createGCModule() {
+    ObjModule *module = newModule("GC", "gc", false);
+    push(OBJ_VAL(module));
+    defineModuleFunction(module, "stats", statsNative);
+    defineModuleFunction(module, "collect", collectNative);
+    defineModuleFunction(module, "setGrowFactor", setGrowFactorNative);
+    pop();
+    return module;
+}
+
+SimpleType *createGCModuleType() {
+    SimpleType *gcModule = newSimpleType();
+    createBuiltinFunctorType(gcModule, "stats", NULL, 0, NULL, 0, anyType);
+    createBuiltinFunctorType(gcModule, "collect", NULL, 0, NULL, 0, numberType);
+    createBuiltinFunctorType(gcModule, "setGrowFactor", (Type *[]) {numberType}, 1, NULL, 0, numberType);
+    return gcModule;
+}
+
+ModuleRegister gcModuleRegister = {
+        createGCModule,
+        createGCModuleType,
+        "gc",
+        "GC",
+        false
+};
@@ -0,0 +1,11 @@
+#ifndef SAFFRON_GC_H
+#define SAFFRON_GC_H
+
+#include "../value.h"
+#include "module.h"
+
+ObjModule *createGCModule();
+SimpleType *createGCModuleType();
+extern ModuleRegister gcModuleRegister;
+
+#endif //SAFFRON_GC_H
@@ -1,20 +1,34 @@
-#include <printf.h>
 #include "io.h"
+#include "async.h"
 #include "module.h"
+#include "../output.h"
 
-Value printNative(int argCount, Value *args) {
+// A terminal sees each line as it ends, anything else a buffer's worth at a
+// time. When stdout can't take that yet the task waits for it while the
+// others run, or blocks if nothing else could.
+static void finishPrint(bool endOfLine) {
+    if (!(endOfLine && output.interactive) && output.length - output.start < OUTPUT_HIGH_WATER) return;
+    if (drainOutput()) return;
+    if (!waitForOutput()) flushOutput();
+}
+
+static void printArguments(int argCount, Value *args) {
     for (int i = 0; i < argCount; i++) {
         printValue(args[i]);
-        if (i < argCount) {
-            printf(" ");
-        }
+        writeOutput(" ", 1);
     }
+}
+
+Value printNative(int argCount, Value *args) {
+    printArguments(argCount, args);
+    finishPrint(false);
     return NIL_VAL;
 }
 
 Value printlnNative(int argCount, Value *args) {
-    printNative(argCount, args);
-    printf("\n");
+    printArguments(argCount, args);
+    writeOutput("\n", 1);
+    finishPrint(true);
     return NIL_VAL;
 }
 
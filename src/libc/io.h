@@ -4,4 +4,4 @@
 Value printlnNative(int argCount, Value* args);
 Value printNative(int argCount, Value* args);
 
-ModuleRegister ioModuleRegister;
\ No newline at end of file
+extern ModuleRegister ioModuleRegister;
\ No newline at end of file
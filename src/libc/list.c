@@ -1,21 +1,82 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
 #include "list.h"
 #include "../memory.h"
+#include "../vm.h"
+#include "../output.h"
 
 
-ObjBuiltinType *listType = NULL;
+_Thread_local ObjBuiltinType *listType = NULL;
 
 ObjList *newList() {
     ObjList *instance = ALLOCATE_OBJ(ObjList, OBJ_LIST);
-    instance->obj.klass = (ObjClass *) listType;
-    initTable(&instance->obj.fields);
+    initInstance(&instance->obj, (ObjClass *) listType);
     initValueArray(&instance->items);
+    instance->shared = NULL;
     return instance;
 }
 
+static void releaseStorage(ListStorage *storage) {
+    if (--storage->refs > 0) return;
+    FREE_ARRAY(Value, storage->values, storage->capacity);
+    free(storage);
+}
+
 void freeList(ObjList *list) {
-//    freeValueArray(&list->items);
-    FREE(ObjList, list);
+    if (list->shared != NULL) {
+        releaseStorage(list->shared);
+    } else {
+        FREE_ARRAY(Value, list->items.values, list->items.capacity);
+    }
+    FREE_OBJ(ObjList, list);
+}
+
+// A new list reading count of list's items from start, without copying them
+static ObjList *shareItems(ObjList *list, int start, int count) {
+    ObjList *view = newList();
+    if (count == 0) return view;
+
+    if (list->shared == NULL) {
+        ListStorage *storage = malloc(sizeof(ListStorage));
+        storage->refs = 1;
+        storage->capacity = list->items.capacity;
+        storage->values = list->items.values;
+        list->shared = storage;
+        list->items.capacity = 0;
+    }
+    list->shared->refs++;
+    view->shared = list->shared;
+    view->items.values = list->items.values + start;
+    view->items.count = count;
+    // Its items came from another list, so the collector has to look at it
+    rescanObject((Obj *) view);
+    return view;
+}
+
+void listOwnItems(ObjList *list) {
+    ListStorage *storage = list->shared;
+    if (storage == NULL) return;
+
+    if (storage->refs == 1) {
+        // Nothing else reads the storage any more, so it's this list's
+        memmove(storage->values, list->items.values, sizeof(Value) * list->items.count);
+        list->items.values = storage->values;
+        list->items.capacity = storage->capacity;
+        list->shared = NULL;
+        free(storage);
+        return;
+    }
+
+    int capacity = list->items.count < 8 ? 8 : list->items.count;
+    Value *values = ALLOCATE(Value, capacity);
+    memcpy(values, list->items.values, sizeof(Value) * list->items.count);
+    list->items.values = values;
+    list->items.capacity = capacity;
+    list->shared = NULL;
+    // The others may have been freed while this allocated
+    releaseStorage(storage);
 }
 
 void markList(ObjList *list) {
@@ -23,21 +84,21 @@ void markList(ObjList *list) {
 }
 
 void printList(ObjList *list) {
-    printf("[");
+    printOutput("[");
     for (int i = 0; i < list->items.count; i++) {
         printValue(list->items.values[i]);
         if (i != list->items.count - 1) {
-            printf(", ");
+            printOutput(", ");
         }
     }
-    printf("]");
+    printOutput("]");
 }
 
 Value getLength(ObjList *list, int argCount, Value *args) {
     if (argCount > 0) {
         return NIL_VAL;
     } else {
-        return NUMBER_VAL(list->items.count);
+        return INT_VAL(list->items.count);
     }
 }
 
@@ -74,6 +135,7 @@ Value listCall(int argCount, Value *args) {
 }
 
 void listPush(ObjList *list, Value item) {
+    listOwnItems(list);
     writeValueArray(&list->items, item);
 }
 
@@ -81,6 +143,7 @@ void listPushBuiltin(ObjList *list, int argCount, Value *args) {
     if (argCount != 1) {
         return;
     }
+    listOwnItems(list);
     writeValueArray(&list->items, args[0]);
 }
 
@@ -89,6 +152,12 @@ Value listPopBuiltin(ObjList *list, int argCount) {
         return NIL_VAL;
     }
     Value poppedValue = list->items.values[0];
+    if (list->shared != NULL) {
+        // Nothing needs to change in shared storage to drop the first item
+        list->items.values++;
+        list->items.count--;
+        return poppedValue;
+    }
     popValueArray(&list->items, 0);
     return poppedValue;
 }
@@ -97,6 +166,7 @@ void listReverseBuiltin(ObjList *list, int argCount, Value *args) {
     if (argCount > 0) {
         return;
     }
+    listOwnItems(list);
     for (int i = 0; i < list->items.count / 2; i++) {
         Value tmp = list->items.values[i];
         list->items.values[i] = list->items.values[list->items.count-i-1];
@@ -108,81 +178,303 @@ Value listCopyBuiltin(ObjList *list, int argCount, Value *args) {
     if (argCount > 0) {
         return NIL_VAL;
     }
-    ObjList *copy = newList();
-    for (int i = 0; i < list->items.count; i++) {
-        writeValueArray(&copy->items, list->items.values[i]);
+    return OBJ_VAL(shareItems(list, 0, list->items.count));
+}
+
+// Sorting works on (key, item) pairs so sort() and sortBy() share it, plain
+// sort() uses each item as its own key
+typedef struct {
+    Value key;
+    Value item;
+} SortEntry;
+
+// Numbers before strings, each in their natural order. Anything else keeps
+// its place relative to its neighbours.
+static int compareKeys(Value a, Value b) {
+    if (IS_INT(a) && IS_INT(b)) return (AS_INT(a) > AS_INT(b)) - (AS_INT(a) < AS_INT(b));
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        double difference = AS_NUMBER(a) - AS_NUMBER(b);
+        return difference < 0 ? -1 : difference > 0;
+    }
+    if (IS_STRING(a) && IS_STRING(b)) {
+        ObjString *left = AS_STRING(a);
+        ObjString *right = AS_STRING(b);
+        int result = memcmp(left->chars, right->chars, MIN(left->length, right->length));
+        return result != 0 ? result : left->length - right->length;
     }
-    return OBJ_VAL(copy);
+    if (IS_NUMBER(a) && IS_STRING(b)) return -1;
+    if (IS_STRING(a) && IS_NUMBER(b)) return 1;
+    return 0;
 }
 
-void insertionSort(ObjList *list, int l, int r) {
+static void insertionSort(SortEntry *entries, int l, int r) {
     for (int i = l + 1; i <= r; i++) {
-        Value tmp = list->items.values[i];
+        SortEntry tmp = entries[i];
         int j = i - 1;
-        while (j >= l && valuesCmp(list->items.values[j], tmp) > 0) {
-            list->items.values[j+1] = list->items.values[j];
+        while (j >= l && compareKeys(entries[j].key, tmp.key) > 0) {
+            entries[j + 1] = entries[j];
             j--;
         }
-        list->items.values[j+1] = tmp;
+        entries[j + 1] = tmp;
     }
 }
 
-void merge(ObjList *list, int l, int  m, int r) {
+static void merge(SortEntry *entries, SortEntry *scratch, int l, int m, int r) {
     int len1 = m - l + 1;
-    int len2 = r - m;
+    memcpy(scratch, entries + l, sizeof(SortEntry) * len1);
 
-    ObjList *left = newList();
-    ObjList *right = newList();
-    for (int i = 0; i < len1; i++) {
-        writeValueArray(&left->items, list->items.values[l + i]);
-    }
-    for (int i = 0; i < len2; i++) {
-        writeValueArray(&right->items, list->items.values[m + 1 + i]);
-    }
-    int i = 0, j = 0, k = 0;
-    while (i < len1 && j < len2) {
-        if (valuesCmp(left->items.values[i], right->items.values[j]) <= 0) {
-            list->items.values[k] = left->items.values[i];
-            i++;
+    // Only the left run is copied out, the right one is read in place ahead
+    // of where the merged entries are written
+    int i = 0, j = m + 1, k = l;
+    while (i < len1 && j <= r) {
+        if (compareKeys(scratch[i].key, entries[j].key) <= 0) {
+            entries[k++] = scratch[i++];
         } else {
-            list->items.values[k] = right->items.values[j];
-            j++;
+            entries[k++] = entries[j++];
         }
-        k++;
     }
     while (i < len1) {
-        list->items.values[k] = left->items.values[i];
-        k++;
-        i++;
-    }
-    while (j < len2) {
-        list->items.values[k] = right->items.values[j];
-        k++;
-        j++;
+        entries[k++] = scratch[i++];
     }
 }
 
-void timSort(ObjList *list, int n) {
+static void timSort(SortEntry *entries, int n) {
     const int RUN = 32;
     for (int i = 0; i < n; i += RUN) {
-        insertionSort(list, i, MIN((i + RUN - 1), (n - 1)));
+        insertionSort(entries, i, MIN((i + RUN - 1), (n - 1)));
     }
+    if (n <= RUN) return;
+
+    SortEntry *scratch = malloc(sizeof(SortEntry) * n);
     for (int size = RUN; size < n; size = 2 * size) {
         for (int l = 0; l < n; l += 2 * size) {
             int m = l + size - 1;
             int r = MIN((l + 2 * size - 1), (n - 1));
             if (m < r) {
-                merge(list, l, m, r);
+                merge(entries, scratch, l, m, r);
             }
         }
     }
+    free(scratch);
+}
+
+// Sorts the list by keys, which holds one key per item. Sorting allocates
+// nothing the collector sees, so the keys only need to stay rooted.
+static void sortByKeys(ObjList *list, Value *keys) {
+    listOwnItems(list);
+    int count = list->items.count;
+    SortEntry *entries = malloc(sizeof(SortEntry) * count);
+    for (int i = 0; i < count; i++) {
+        entries[i].key = keys[i];
+        entries[i].item = list->items.values[i];
+    }
+    timSort(entries, count);
+    for (int i = 0; i < count; i++) {
+        list->items.values[i] = entries[i].item;
+    }
+    free(entries);
 }
 
 void listSortBuiltin(ObjList *list, int argCount, Value *args) {
     if (argCount > 0) {
         return;
     }
-    timSort(list, list->items.count);
+    listOwnItems(list);
+    sortByKeys(list, list->items.values);
+}
+
+Value listSortByBuiltin(ObjList *list, int argCount, Value *args) {
+    if (argCount != 1) {
+        runtimeError("Expected a key function.");
+        return NIL_VAL;
+    }
+
+    // The keys are kept in a list of their own so the collector can see them
+    ObjList *keys = newList();
+    push(OBJ_VAL(keys));
+    for (int i = 0; i < list->items.count; i++) {
+        Value key;
+        if (!callFromNative(args[0], 1, &list->items.values[i], &key)) return NIL_VAL;
+        if (IS_ROPE(key)) key = OBJ_VAL(flattenRope(AS_ROPE(key)));
+        if (!IS_NUMBER(key) && !IS_STRING(key)) {
+            runtimeError("Sort keys must be numbers or strings.");
+            return NIL_VAL;
+        }
+        writeValueArray(&keys->items, key);
+    }
+    if (keys->items.count != list->items.count) {
+        runtimeError("List changed size while sorting.");
+        return NIL_VAL;
+    }
+
+    sortByKeys(list, keys->items.values);
+    pop();
+    return NIL_VAL;
+}
+
+// Bulk operations check the whole list first so the loops over the items
+// are branch free and can be vectorised
+static bool allNumbers(ObjList *list) {
+    Value *values = list->items.values;
+    int count = list->items.count;
+    bool numbers = true;
+    for (int i = 0; i < count; i++) numbers &= IS_NUMBER(values[i]);
+    return numbers;
+}
+
+Value listSumBuiltin(ObjList *list, int argCount, Value *args) {
+    if (!allNumbers(list)) {
+        runtimeError("Can only sum a list of numbers.");
+        return NIL_VAL;
+    }
+
+    // Independent partial sums so the additions don't wait on each other
+    Value *values = list->items.values;
+    int count = list->items.count;
+    double sums[4] = {0, 0, 0, 0};
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        sums[0] += AS_NUMBER(values[i]);
+        sums[1] += AS_NUMBER(values[i + 1]);
+        sums[2] += AS_NUMBER(values[i + 2]);
+        sums[3] += AS_NUMBER(values[i + 3]);
+    }
+    for (; i < count; i++) sums[0] += AS_NUMBER(values[i]);
+    return NUMBER_VAL((sums[0] + sums[1]) + (sums[2] + sums[3]));
+}
+
+static Value listExtreme(ObjList *list, bool max) {
+    if (list->items.count == 0) return NIL_VAL;
+    if (!allNumbers(list)) {
+        runtimeError("Can only compare a list of numbers.");
+        return NIL_VAL;
+    }
+
+    Value *values = list->items.values;
+    int count = list->items.count;
+    double result = AS_NUMBER(values[0]);
+    if (max) {
+        for (int i = 1; i < count; i++) {
+            double n = AS_NUMBER(values[i]);
+            result = n > result ? n : result;
+        }
+    } else {
+        for (int i = 1; i < count; i++) {
+            double n = AS_NUMBER(values[i]);
+            result = n < result ? n : result;
+        }
+    }
+    return NUMBER_VAL(result);
+}
+
+Value listMinBuiltin(ObjList *list, int argCount, Value *args) {
+    return listExtreme(list, false);
+}
+
+Value listMaxBuiltin(ObjList *list, int argCount, Value *args) {
+    return listExtreme(list, true);
+}
+
+static int listIndexOf(ObjList *list, Value item) {
+    Value *values = list->items.values;
+    int count = list->items.count;
+    if (IS_NUMBER(item)) {
+        double n = AS_NUMBER(item);
+        for (int i = 0; i < count; i++) {
+            if (IS_NUMBER(values[i]) && AS_NUMBER(values[i]) == n) return i;
+        }
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (valuesEqual(values[i], item)) return i;
+    }
+    return -1;
+}
+
+Value listIndexOfBuiltin(ObjList *list, int argCount, Value *args) {
+    if (argCount != 1) {
+        runtimeError("Expected 1 argument but got %d.", argCount);
+        return NIL_VAL;
+    }
+    return INT_VAL(listIndexOf(list, args[0]));
+}
+
+Value listContainsBuiltin(ObjList *list, int argCount, Value *args) {
+    if (argCount != 1) {
+        runtimeError("Expected 1 argument but got %d.", argCount);
+        return NIL_VAL;
+    }
+    return BOOL_VAL(listIndexOf(list, args[0]) != -1);
+}
+
+Value listFillBuiltin(ObjList *list, int argCount, Value *args) {
+    if (argCount != 1) {
+        runtimeError("Expected 1 argument but got %d.", argCount);
+        return NIL_VAL;
+    }
+
+    listOwnItems(list);
+    Value *values = list->items.values;
+    int count = list->items.count;
+    for (int i = 0; i < count; i++) values[i] = args[0];
+    WRITE_BARRIER(args[0]);
+    return NIL_VAL;
+}
+
+// Makes room for count more items without changing the list's length
+static void reserveItems(ValueArray *items, int count) {
+    if (items->count + count <= items->capacity) return;
+
+    int oldCapacity = items->capacity;
+    int capacity = oldCapacity;
+    while (capacity < items->count + count) capacity = GROW_CAPACITY(capacity);
+    items->values = GROW_ARRAY(Value, items->values, oldCapacity, capacity);
+    items->capacity = capacity;
+}
+
+// Copies count items onto the end of list, the items came from another list
+// so the collector has to look at this one again
+static void appendItems(ObjList *list, Value *items, int count) {
+    if (count == 0) return;
+    reserveItems(&list->items, count);
+    memmove(list->items.values + list->items.count, items, sizeof(Value) * count);
+    list->items.count += count;
+    rescanObject((Obj *) list);
+}
+
+Value listExtendBuiltin(ObjList *list, int argCount, Value *args) {
+    if (argCount != 1 || !IS_LIST(args[0])) {
+        runtimeError("Expected a list to extend with.");
+        return NIL_VAL;
+    }
+
+    ObjList *other = AS_LIST(args[0]);
+    // Growing the list can move other's items when they are the same list
+    listOwnItems(list);
+    reserveItems(&list->items, other->items.count);
+    appendItems(list, other->items.values, other->items.count);
+    return NIL_VAL;
+}
+
+// Negative indexes count from the end, both are clamped to the list
+static int sliceIndex(Value index, int count) {
+    double n = trunc(AS_NUMBER(index));
+    if (n < 0) n += count;
+    return n < 0 ? 0 : n > count ? count : (int) n;
+}
+
+Value listSliceBuiltin(ObjList *list, int argCount, Value *args) {
+    if (argCount < 1 || argCount > 2 || !IS_NUMBER(args[0]) ||
+        (argCount == 2 && !IS_NUMBER(args[1]))) {
+        runtimeError("Expected a start and an optional end index.");
+        return NIL_VAL;
+    }
+
+    int count = list->items.count;
+    int start = sliceIndex(args[0], count);
+    int end = argCount == 2 ? sliceIndex(args[1], count) : count;
+
+    return OBJ_VAL(shareItems(list, start, end > start ? end - start : 0));
 }
 
 SimpleType* createListTypeDef() {
@@ -239,6 +531,72 @@ SimpleType* createListTypeDef() {
             OBJ_VAL(sortType)
     );
 
+    FunctorType *sortByType = newFunctorType();
+    writeValueArray(&sortByType->arguments, OBJ_VAL(anyType));
+    sortByType->returnType = nilType;
+    tableSet(
+            &listTypeDef->methods,
+            copyString("sortBy", 6),
+            OBJ_VAL(sortByType)
+    );
+
+    const char *aggregates[] = {"sum", "min", "max"};
+    for (int i = 0; i < 3; i++) {
+        FunctorType *aggregateType = newFunctorType();
+        aggregateType->returnType = (Type *) numberType;
+        tableSet(
+                &listTypeDef->methods,
+                copyString(aggregates[i], (int) strlen(aggregates[i])),
+                OBJ_VAL(aggregateType)
+        );
+    }
+
+    FunctorType *indexOfType = newFunctorType();
+    writeValueArray(&indexOfType->arguments, OBJ_VAL(anyType));
+    indexOfType->returnType = (Type *) numberType;
+    tableSet(
+            &listTypeDef->methods,
+            copyString("indexOf", 7),
+            OBJ_VAL(indexOfType)
+    );
+
+    FunctorType *containsType = newFunctorType();
+    writeValueArray(&containsType->arguments, OBJ_VAL(anyType));
+    containsType->returnType = (Type *) boolType;
+    tableSet(
+            &listTypeDef->methods,
+            copyString("contains", 8),
+            OBJ_VAL(containsType)
+    );
+
+    FunctorType *fillType = newFunctorType();
+    writeValueArray(&fillType->arguments, OBJ_VAL(anyType));
+    fillType->returnType = nilType;
+    tableSet(
+            &listTypeDef->methods,
+            copyString("fill", 4),
+            OBJ_VAL(fillType)
+    );
+
+    FunctorType *sliceType = newFunctorType();
+    writeValueArray(&sliceType->arguments, OBJ_VAL(numberType));
+    writeValueArray(&sliceType->arguments, OBJ_VAL(numberType));
+    sliceType->returnType = listType;
+    tableSet(
+            &listTypeDef->methods,
+            copyString("slice", 5),
+            OBJ_VAL(sliceType)
+    );
+
+    FunctorType *extendType = newFunctorType();
+    writeValueArray(&extendType->arguments, OBJ_VAL(listType));
+    extendType->returnType = nilType;
+    tableSet(
+            &listTypeDef->methods,
+            copyString("extend", 6),
+            OBJ_VAL(extendType)
+    );
+
     FunctorType *initType = newFunctorType();
     sortType->returnType = (Type *) listTypeDef;
     tableSet(
@@ -262,6 +620,15 @@ void listInit(ObjBuiltinType *type) {
     defineBuiltinMethod(type, "reverse", (NativeMethodFn) listReverseBuiltin);
     defineBuiltinMethod(type, "copy", (NativeMethodFn) listCopyBuiltin);
     defineBuiltinMethod(type, "sort", (NativeMethodFn) listSortBuiltin);
+    defineBuiltinMethod(type, "sortBy", (NativeMethodFn) listSortByBuiltin);
+    defineBuiltinMethod(type, "sum", (NativeMethodFn) listSumBuiltin);
+    defineBuiltinMethod(type, "min", (NativeMethodFn) listMinBuiltin);
+    defineBuiltinMethod(type, "max", (NativeMethodFn) listMaxBuiltin);
+    defineBuiltinMethod(type, "indexOf", (NativeMethodFn) listIndexOfBuiltin);
+    defineBuiltinMethod(type, "contains", (NativeMethodFn) listContainsBuiltin);
+    defineBuiltinMethod(type, "fill", (NativeMethodFn) listFillBuiltin);
+    defineBuiltinMethod(type, "slice", (NativeMethodFn) listSliceBuiltin);
+    defineBuiltinMethod(type, "extend", (NativeMethodFn) listExtendBuiltin);
 }
 
 ObjBuiltinType *createListType() {
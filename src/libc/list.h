@@ -9,13 +9,29 @@
 
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 
+// Item storage that copies and slices share with the list they came from.
+// Each of them reads its own range of it and copies that range out before
+// changing anything, the last one left takes the storage back.
+typedef struct {
+    int refs;
+    int capacity;
+    Value *values;
+} ListStorage;
+
 typedef struct {
     ObjInstance obj;
+    // While the storage is shared items.values points into it and
+    // items.capacity is 0
     ValueArray items;
+    ListStorage *shared;
 } ObjList;
 
 ObjList *newList();
 
+// Gives list storage of its own if it's sharing, anything that changes its
+// items calls this first
+void listOwnItems(ObjList *list);
+
 void freeList(ObjList *list);
 
 void markList(ObjList *list);
@@ -38,6 +54,24 @@ Value listCopyBuiltin(ObjList *list, int argCount, Value *args);
 
 void listSortBuiltin(ObjList *list, int argCount, Value *args);
 
+Value listSortByBuiltin(ObjList *list, int argCount, Value *args);
+
+Value listSumBuiltin(ObjList *list, int argCount, Value *args);
+
+Value listMinBuiltin(ObjList *list, int argCount, Value *args);
+
+Value listMaxBuiltin(ObjList *list, int argCount, Value *args);
+
+Value listIndexOfBuiltin(ObjList *list, int argCount, Value *args);
+
+Value listContainsBuiltin(ObjList *list, int argCount, Value *args);
+
+Value listFillBuiltin(ObjList *list, int argCount, Value *args);
+
+Value listSliceBuiltin(ObjList *list, int argCount, Value *args);
+
+Value listExtendBuiltin(ObjList *list, int argCount, Value *args);
+
 Value getLength(ObjList *list, int argCount, Value *args);
 
 Value getListItem(ObjList *list, int index);
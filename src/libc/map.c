@@ -1,14 +1,14 @@
-#include <printf.h>
+#include <stdio.h>
 #include "map.h"
 #include "list.h"
+#include "../output.h"
 
 
-ObjBuiltinType *mapType = NULL;
+_Thread_local ObjBuiltinType *mapType = NULL;
 
 void initMap(ObjMap *instance) {
-    instance->obj.klass = (ObjClass *) mapType;
+    initInstance(&instance->obj, (ObjClass *) mapType);
     initValueTable(&instance->values);
-    initTable(&instance->obj.fields);
 }
 
 ObjMap *newMap() {
@@ -18,23 +18,18 @@ ObjMap *newMap() {
 }
 
 void printMap(ObjMap *map) {
-    printf("{");
-    bool skipped = false;
-    for (int i = 0; i < map->values.capacity; i++) {
+    printOutput("{");
+    bool first = true;
+    for (int i = 0; i < map->values.entryCount; i++) {
         MapEntry *entry = &map->values.entries[i];
-        if (valuesEqual(entry->key, NIL_VAL)) {
-            skipped = true;
-            continue;
-        }
+        if (IS_NIL(entry->key)) continue;
+        if (!first) printOutput(", ");
+        first = false;
         printValue(entry->key);
-        printf(": ");
+        printOutput(": ");
         printValue(entry->value);
-        if (skipped && i != map->values.capacity - 1) {
-            printf(", ");
-            skipped = false;
-        }
     }
-    printf("}");
+    printOutput("}");
 }
 
 SimpleType *createMapTypeDef() {
@@ -72,57 +67,47 @@ SimpleType *createMapTypeDef() {
 
 
 Value getMapItem(ObjMap *map, Value key) {
-    if (map->values.count == 0) {
-        runtimeError("Accessing empty map. No value at the given key %s", AS_CSTRING(key));
+    Value value;
+    if (!valueTableGet(&map->values, key, &value)) {
+        runtimeError("No value at the given key.");
         return NIL_VAL;
     }
-
-    uint32_t keyHash = hash(key);
-    uint32_t index = keyHash & (map->values.capacity - 1);
-    for (;;) {
-        MapEntry *entry = &map->values.entries[index];
-        if (valuesEqual(entry->key, NIL_VAL)) {
-            if (IS_NIL(entry->value)) {
-                runtimeError("No value at the given key %s", AS_CSTRING(key));
-                return NIL_VAL;
-            }
-        } else if (entry->hash == keyHash) {
-            return entry->value;
-        }
-        index = (index + 1) & (map->values.capacity - 1);
-    }
+    return value;
 }
 
 Value mapKeysBuiltin(ObjMap *map, int argCount) {
     if (argCount > 0) return NIL_VAL;
     ObjList *keys = newList();
-    for (int i = 0; i < map->values.capacity; i++) {
+    push(OBJ_VAL(keys));
+    for (int i = 0; i < map->values.entryCount; i++) {
         MapEntry *entry = &map->values.entries[i];
-        if (!valuesEqual(entry->key, NIL_VAL)) {
+        if (!IS_NIL(entry->key)) {
             writeValueArray(&keys->items, entry->key);
         }
     }
-    return OBJ_VAL(keys);
+    return pop();
 }
 
 Value mapValuesBuiltin(ObjMap *map, int argCount) {
     if (argCount > 0) return NIL_VAL;
     ObjList *values = newList();
-    for (int i = 0; i < map->values.capacity; i++) {
+    push(OBJ_VAL(values));
+    for (int i = 0; i < map->values.entryCount; i++) {
         MapEntry *entry = &map->values.entries[i];
-        if (!valuesEqual(entry->key, NIL_VAL)) {
+        if (!IS_NIL(entry->key)) {
             writeValueArray(&values->items, entry->value);
         }
     }
-    return OBJ_VAL(values);
+    return pop();
 }
 
-void markMap(ValueTable *table) {
-    markValueTable(table);
+void markMap(ObjMap *map) {
+    markValueTable(&map->values);
 }
 
-void freeMap(ValueTable *table) {
-    freeValueTable(table);
+void freeMap(ObjMap *map) {
+    freeValueTable(&map->values);
+    FREE_OBJ(ObjMap, map);
 }
 
 void mapInit(ObjBuiltinType *type) {
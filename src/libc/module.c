@@ -1,16 +1,23 @@
 #include <printf.h>
 #include "module.h"
+#include "builtins.h"
+#include "../output.h"
 
 
-ObjBuiltinType *moduleType = NULL;
+_Thread_local ObjBuiltinType *moduleType = NULL;
 
 ObjModule *newModule(const char *name, const char *path, bool includeBuiltins) {
-//    printf("New module %s\n", name);
+//    printOutput("New module %s\n", name);
     ObjModule *instance = ALLOCATE_OBJ(ObjModule, OBJ_INSTANCE);
     push(OBJ_VAL(instance));
-    instance->obj.klass = (ObjClass *) moduleType;
-    initTable(&instance->obj.fields);
+    initInstance(&instance->obj, (ObjClass *) moduleType);
     instance->result = INTERPRET_OK;
+    instance->name = NULL;
+    instance->path = NULL;
+    initValueArray(&instance->globals);
+    initValueArray(&instance->globalNames);
+    initTable(&instance->globalSlots);
+    instance->globalsDirty = false;
     push(OBJ_VAL(copyString(name, (int) strlen(name))));
     push(OBJ_VAL(copyString(path, (int) strlen(path))));
 
@@ -27,22 +34,72 @@ ObjModule *newModule(const char *name, const char *path, bool includeBuiltins) {
 }
 
 void freeModule(ObjModule *module) {
-    FREE(ObjModule, module);
+    freeValueArray(&module->globals);
+    freeValueArray(&module->globalNames);
+    freeTable(&module->globalSlots);
+    FREE_OBJ(ObjModule, module);
 }
 
 void markModule(ObjModule *module) {
     markObject((Obj *) module->name);
     markObject((Obj *) module->path);
+    markArray(&module->globals);
+    markArray(&module->globalNames);
+    markTable(&module->globalSlots);
+}
+
+// The slot the compiler gave the global called name, creating it on first
+// use. A slot starts out with whatever the module already had under that
+// name, like the builtins, or undefined.
+int moduleGlobalSlot(ObjModule *module, ObjString *name) {
+    Value slot;
+    if (tableGet(&module->globalSlots, name, &slot)) return (int) AS_NUMBER(slot);
+
+    push(OBJ_VAL(name));
+    Value initial;
+    if (!tableGet(&module->obj.fields, name, &initial)) {
+        ObjModule *builtin = loadBuiltinGlobal(name->chars, name->length);
+        initial = builtin != NULL ? OBJ_VAL(builtin) : UNDEFINED_VAL;
+    }
+
+    int index = module->globals.count;
+    writeValueArray(&module->globals, initial);
+    writeValueArray(&module->globalNames, OBJ_VAL(name));
+    tableSet(&module->globalSlots, name, NUMBER_VAL(index));
+    pop();
+    return index;
+}
+
+// Copies globals written since the last call into obj.fields, where imports
+// and other modules look them up by name
+void flushModuleGlobals(ObjModule *module) {
+    if (!module->globalsDirty) return;
+    module->globalsDirty = false;
+
+    for (int i = 0; i < module->globals.count; i++) {
+        if (IS_UNDEFINED(module->globals.values[i])) continue;
+        tableSet(&module->obj.fields, AS_STRING(module->globalNames.values[i]),
+                 module->globals.values[i]);
+    }
+}
+
+// Writes made through the name table from outside the module
+void storeModuleGlobal(ObjModule *module, ObjString *name, Value value) {
+    Value slot;
+    if (tableGet(&module->globalSlots, name, &slot)) {
+        module->globals.values[(int) AS_NUMBER(slot)] = value;
+        WRITE_BARRIER(value);
+    }
 }
 
 void printModule(ObjModule *module) {
-    printf("<module ");
+    printOutput("<module ");
     if (module->path) {
         printValue(OBJ_VAL(module->path));
     } else {
-        printf("uninitialized");
+        printOutput("uninitialized");
     }
-    printf(">");
+    printOutput(">");
 }
 
 Value moduleCall(int argCount, Value *args) {
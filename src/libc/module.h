@@ -18,6 +18,14 @@ void printModule(ObjModule *module);
 
 ObjBuiltinType *createModuleType();
 
+int moduleGlobalSlot(ObjModule *module, ObjString *name);
+
+void flushModuleGlobals(ObjModule *module);
+
+void storeModuleGlobal(ObjModule *module, ObjString *name, Value value);
+
+extern _Thread_local ObjBuiltinType *moduleType;
+
 void defineModuleFunction(ObjModule *module, const char *name, NativeFn function);
 
 void defineModuleMember(ObjModule *module, const char *name, Value value);
@@ -0,0 +1,374 @@
+// accept4()
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "net.h"
+#include "async.h"
+#include "../memory.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// Sockets are descriptors, non-blocking from the start. An operation that
+// would block parks the task on the poller and is finished from there once
+// the socket is ready, so the task wakes up with its result and the others
+// run meanwhile.
+
+#define READ_CAPACITY (64 * 1024)
+
+// Every read lands here before it becomes a string, and sendFile() copies
+// through it where there's no sendfile(2)
+static _Thread_local char readBuffer[READ_CAPACITY];
+
+static bool setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0 && fcntl(fd, F_SETFD, FD_CLOEXEC) == 0;
+}
+
+static int openSocket(int family) {
+#ifdef __linux__
+    return socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+#else
+    int fd = socket(family, SOCK_STREAM, 0);
+    if (fd >= 0 && !setNonBlocking(fd)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+#endif
+}
+
+// Writes are whole messages, so small ones aren't held back waiting to fill
+// a segment
+static void configureConnection(int fd) {
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+#ifdef SO_NOSIGPIPE
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+}
+
+// Numeric addresses resolve without leaving the process, names are looked
+// up with getaddrinfo(3), which blocks
+static struct addrinfo *resolve(ObjString *host, int port, bool passive) {
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (passive) hints.ai_flags = AI_PASSIVE;
+
+    struct addrinfo *found = NULL;
+    if (getaddrinfo(host->chars, service, &hints, &found) != 0) return NULL;
+    return found;
+}
+
+static ObjString *textArgument(Value value) {
+    return IS_ROPE(value) ? flattenRope(AS_ROPE(value)) : AS_STRING(value);
+}
+
+static bool isSocket(Value value) {
+    return IS_NUMBER(value) && AS_NUMBER(value) >= 0 && AS_NUMBER(value) <= INT32_MAX;
+}
+
+// A failed call only finishes the operation, with nil, if retrying once the
+// socket is ready wouldn't help
+static bool failed(Value *result) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return false;
+    *result = NIL_VAL;
+    return true;
+}
+
+static IoOperation newOperation(bool (*attempt)(IoOperation *, Value *), int fd) {
+    IoOperation operation = {attempt, fd, -1, 0, 0, NIL_VAL};
+    return operation;
+}
+
+// Parks the task on the socket until operation can be finished, it wakes
+// up with the operation's result in place of what this returns
+static Value parkOperation(IoOperation operation, int events) {
+    // Anything operation.data refers to is still an argument on the stack
+    IoOperation *parked = ALLOCATE(IoOperation, 1);
+    *parked = operation;
+    if (!parkOnIo(operation.fd, events, parked)) freeIoOperation(parked);
+    return NIL_VAL;
+}
+
+// Finishes operation straight away when the socket is ready for it, and
+// only parks the task otherwise
+static Value runOperation(IoOperation operation, int events) {
+    Value result = NIL_VAL;
+    if (operation.attempt(&operation, &result)) {
+        if (operation.source >= 0) close(operation.source);
+        return result;
+    }
+    return parkOperation(operation, events);
+}
+
+static bool acceptAttempt(IoOperation *operation, Value *result) {
+#ifdef __linux__
+    int fd = accept4(operation->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int fd = accept(operation->fd, NULL, NULL);
+    if (fd >= 0 && !setNonBlocking(fd)) {
+        close(fd);
+        fd = -1;
+    }
+#endif
+    if (fd < 0) {
+        // The client gave up before we got to it, wait for the next one
+        if (errno == ECONNABORTED) return false;
+        return failed(result);
+    }
+
+    configureConnection(fd);
+    *result = NUMBER_VAL(fd);
+    return true;
+}
+
+static bool connectAttempt(IoOperation *operation, Value *result) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(operation->fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0) error = errno;
+
+    if (error != 0) {
+        // Nobody else knows the socket yet, it goes with the operation
+        operation->source = operation->fd;
+        *result = NIL_VAL;
+        return true;
+    }
+
+    configureConnection(operation->fd);
+    *result = NUMBER_VAL(operation->fd);
+    return true;
+}
+
+static bool readAttempt(IoOperation *operation, Value *result) {
+    ssize_t length = read(operation->fd, readBuffer, operation->count);
+    if (length < 0) return failed(result);
+
+    *result = length == 0 ? NIL_VAL : OBJ_VAL(copyString(readBuffer, (int) length));
+    return true;
+}
+
+static bool writeAttempt(IoOperation *operation, Value *result) {
+    ObjString *data = AS_STRING(operation->data);
+    while (operation->done < operation->count) {
+        ssize_t written = send(operation->fd, data->chars + operation->done,
+                               operation->count - operation->done, MSG_NOSIGNAL);
+        if (written < 0) return failed(result);
+        operation->done += written;
+    }
+
+    *result = NUMBER_VAL((double) operation->done);
+    return true;
+}
+
+// Copies the file in operation->source to the socket. On Linux the kernel
+// moves the pages itself, elsewhere they go through readBuffer.
+static bool sendFileAttempt(IoOperation *operation, Value *result) {
+    while (operation->done < operation->count) {
+        size_t remaining = operation->count - operation->done;
+#ifdef __linux__
+        off_t offset = (off_t) operation->done;
+        ssize_t sent = sendfile(operation->fd, operation->source, &offset, remaining);
+#else
+        if (remaining > READ_CAPACITY) remaining = READ_CAPACITY;
+        ssize_t sent = pread(operation->source, readBuffer, remaining, (off_t) operation->done);
+        if (sent > 0) sent = send(operation->fd, readBuffer, sent, MSG_NOSIGNAL);
+#endif
+        if (sent < 0) return failed(result);
+        // The file got shorter since it was opened
+        if (sent == 0) break;
+        operation->done += sent;
+    }
+
+    *result = NUMBER_VAL((double) operation->done);
+    return true;
+}
+
+Value listenNative(int argCount, Value *args) {
+    if (argCount != 2 || !IS_TEXT(args[0]) || !IS_NUMBER(args[1])) {
+        runtimeError("Expected a host and a port.");
+        return NIL_VAL;
+    }
+
+    struct addrinfo *address = resolve(textArgument(args[0]), (int) AS_NUMBER(args[1]), true);
+    if (address == NULL) return NIL_VAL;
+
+    int fd = openSocket(address->ai_family);
+    if (fd >= 0) {
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(fd, address->ai_addr, address->ai_addrlen) != 0 || listen(fd, SOMAXCONN) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    freeaddrinfo(address);
+    return fd < 0 ? NIL_VAL : NUMBER_VAL(fd);
+}
+
+Value acceptNative(int argCount, Value *args) {
+    if (argCount != 1 || !isSocket(args[0])) {
+        runtimeError("Expected a listening socket.");
+        return NIL_VAL;
+    }
+
+    return runOperation(newOperation(acceptAttempt, (int) AS_NUMBER(args[0])), POLLER_READ);
+}
+
+Value connectNative(int argCount, Value *args) {
+    if (argCount != 2 || !IS_TEXT(args[0]) || !IS_NUMBER(args[1])) {
+        runtimeError("Expected a host and a port.");
+        return NIL_VAL;
+    }
+
+    struct addrinfo *address = resolve(textArgument(args[0]), (int) AS_NUMBER(args[1]), false);
+    if (address == NULL) return NIL_VAL;
+
+    int fd = openSocket(address->ai_family);
+    int status = fd < 0 ? -1 : connect(fd, address->ai_addr, address->ai_addrlen);
+    freeaddrinfo(address);
+    if (fd < 0) return NIL_VAL;
+
+    if (status == 0) {
+        configureConnection(fd);
+        return NUMBER_VAL(fd);
+    }
+    if (errno != EINPROGRESS) {
+        close(fd);
+        return NIL_VAL;
+    }
+
+    // Connecting is done once the socket turns writable
+    return parkOperation(newOperation(connectAttempt, fd), POLLER_WRITE);
+}
+
+Value readNative(int argCount, Value *args) {
+    if (argCount < 1 || argCount > 2 || !isSocket(args[0]) ||
+        (argCount == 2 && (!IS_NUMBER(args[1]) || AS_NUMBER(args[1]) < 1))) {
+        runtimeError("Expected a socket and an optional byte count.");
+        return NIL_VAL;
+    }
+
+    IoOperation operation = newOperation(readAttempt, (int) AS_NUMBER(args[0]));
+    operation.count = READ_CAPACITY;
+    if (argCount == 2 && AS_NUMBER(args[1]) < READ_CAPACITY) operation.count = (size_t) AS_NUMBER(args[1]);
+    return runOperation(operation, POLLER_READ);
+}
+
+Value writeNative(int argCount, Value *args) {
+    if (argCount != 2 || !isSocket(args[0]) || !IS_TEXT(args[1])) {
+        runtimeError("Expected a socket and a string.");
+        return NIL_VAL;
+    }
+
+    ObjString *data = textArgument(args[1]);
+    IoOperation operation = newOperation(writeAttempt, (int) AS_NUMBER(args[0]));
+    operation.data = OBJ_VAL(data);
+    operation.count = data->length;
+    return runOperation(operation, POLLER_WRITE);
+}
+
+Value sendFileNative(int argCount, Value *args) {
+    if (argCount != 2 || !isSocket(args[0]) || !IS_TEXT(args[1])) {
+        runtimeError("Expected a socket and a path.");
+        return NIL_VAL;
+    }
+
+    int source = open(textArgument(args[1])->chars, O_RDONLY | O_CLOEXEC);
+    if (source < 0) return NIL_VAL;
+
+    struct stat info;
+    if (fstat(source, &info) != 0 || !S_ISREG(info.st_mode)) {
+        close(source);
+        return NIL_VAL;
+    }
+
+    IoOperation operation = newOperation(sendFileAttempt, (int) AS_NUMBER(args[0]));
+    operation.source = source;
+    operation.count = (size_t) info.st_size;
+    return runOperation(operation, POLLER_WRITE);
+}
+
+Value portNative(int argCount, Value *args) {
+    if (argCount != 1 || !isSocket(args[0])) {
+        runtimeError("Expected a socket.");
+        return NIL_VAL;
+    }
+
+    struct sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    if (getsockname((int) AS_NUMBER(args[0]), (struct sockaddr *) &address, &length) != 0) return NIL_VAL;
+
+    if (address.ss_family == AF_INET) return NUMBER_VAL(ntohs(((struct sockaddr_in *) &address)->sin_port));
+    if (address.ss_family == AF_INET6) return NUMBER_VAL(ntohs(((struct sockaddr_in6 *) &address)->sin6_port));
+    return NIL_VAL;
+}
+
+Value closeNative(int argCount, Value *args) {
+    if (argCount != 1 || !isSocket(args[0])) {
+        runtimeError("Expected a socket.");
+        return NIL_VAL;
+    }
+
+    int fd = (int) AS_NUMBER(args[0]);
+    // Tasks still waiting on it wake up with nil
+    forgetIo(fd);
+    return BOOL_VAL(close(fd) == 0);
+}
+
+ObjModule *createNetModule() {
+    ObjModule *module = newModule("Net", "net", false);
+    push(OBJ_VAL(module));
+    defineModuleFunction(module, "listen", listenNative);
+    defineModuleFunction(module, "accept", acceptNative);
+    defineModuleFunction(module, "connect", connectNative);
+    defineModuleFunction(module, "read", readNative);
+    defineModuleFunction(module, "write", writeNative);
+    defineModuleFunction(module, "sendFile", sendFileNative);
+    defineModuleFunction(module, "port", portNative);
+    defineModuleFunction(module, "close", closeNative);
+    pop();
+    return module;
+}
+
+SimpleType *createNetModuleType() {
+    SimpleType *netModule = newSimpleType();
+    createBuiltinFunctorType(netModule, "listen", (Type *[]) {stringType, numberType}, 2, NULL, 0, anyType);;
+    createBuiltinFunctorType(netModule, "accept", (Type *[]) {numberType}, 1, NULL, 0, anyType);;
+    createBuiltinFunctorType(netModule, "connect", (Type *[]) {stringType, numberType}, 2, NULL, 0, anyType);;
+    createBuiltinFunctorType(netModule, "read", (Type *[]) {numberType}, 1, NULL, 0, anyType);;
+    createBuiltinFunctorType(netModule, "write", (Type *[]) {numberType, stringType}, 2, NULL, 0, anyType);;
+    createBuiltinFunctorType(netModule, "sendFile", (Type *[]) {numberType, stringType}, 2, NULL, 0, anyType);;
+    createBuiltinFunctorType(netModule, "port", (Type *[]) {numberType}, 1, NULL, 0, anyType);;
+    createBuiltinFunctorType(netModule, "close", (Type *[]) {numberType}, 1, NULL, 0, boolType);;
+    return netModule;
+}
+
+ModuleRegister netModuleRegister = {
+        createNetModule,
+        createNetModuleType,
+        "net",
+        "Net",
+        false
+};
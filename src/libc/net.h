@@ -0,0 +1,11 @@
+#ifndef SAFFRON_NET_H
+#define SAFFRON_NET_H
+
+#include "../value.h"
+#include "module.h"
+
+ObjModule *createNetModule();
+SimpleType *createNetModuleType();
+extern ModuleRegister netModuleRegister;
+
+#endif //SAFFRON_NET_H
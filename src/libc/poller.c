@@ -0,0 +1,182 @@
+#include <errno.h>
+#include <unistd.h>
+#include "poller.h"
+#include "../memory.h"
+
+#if defined(POLLER_EPOLL)
+#include <sys/epoll.h>
+
+void initPoller(Poller *poller) {
+    poller->handle = epoll_create1(EPOLL_CLOEXEC);
+}
+
+void freePoller(Poller *poller) {
+    if (poller->handle >= 0) close(poller->handle);
+    poller->handle = -1;
+}
+
+bool pollerSet(Poller *poller, int fd, int oldEvents, int events) {
+    struct epoll_event event = {0};
+    event.data.fd = fd;
+    if (events & POLLER_READ) event.events |= EPOLLIN | EPOLLRDHUP;
+    if (events & POLLER_WRITE) event.events |= EPOLLOUT;
+
+    if (events == 0) {
+        if (epoll_ctl(poller->handle, EPOLL_CTL_DEL, fd, &event) == 0) return true;
+        return errno == ENOENT || errno == EBADF;
+    }
+
+    // The kernel drops registrations of closed descriptors behind our back,
+    // so fall back to the other operation if our bookkeeping is stale.
+    int op = oldEvents ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(poller->handle, op, fd, &event) == 0) return true;
+    if (errno == ENOENT) return epoll_ctl(poller->handle, EPOLL_CTL_ADD, fd, &event) == 0;
+    if (errno == EEXIST) return epoll_ctl(poller->handle, EPOLL_CTL_MOD, fd, &event) == 0;
+    return false;
+}
+
+int pollerWait(Poller *poller, PollerEvent *events, int maxEvents, int timeoutMs) {
+    struct epoll_event ready[POLLER_BATCH];
+    if (maxEvents > POLLER_BATCH) maxEvents = POLLER_BATCH;
+
+    int count = epoll_wait(poller->handle, ready, maxEvents, timeoutMs);
+    if (count < 0) return 0;
+
+    for (int i = 0; i < count; i++) {
+        events[i].fd = ready[i].data.fd;
+        events[i].events = 0;
+        if (ready[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) events[i].events |= POLLER_READ;
+        if (ready[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) events[i].events |= POLLER_WRITE;
+    }
+    return count;
+}
+
+#elif defined(POLLER_KQUEUE)
+#include <sys/event.h>
+
+void initPoller(Poller *poller) {
+    poller->handle = kqueue();
+}
+
+void freePoller(Poller *poller) {
+    if (poller->handle >= 0) close(poller->handle);
+    poller->handle = -1;
+}
+
+bool pollerSet(Poller *poller, int fd, int oldEvents, int events) {
+    struct kevent changes[2];
+    int count = 0;
+
+    // Filters are added once and then only enabled or disabled
+    if ((events ^ oldEvents) & POLLER_READ) {
+        EV_SET(&changes[count++], fd, EVFILT_READ,
+               events & POLLER_READ ? EV_ADD | EV_ENABLE : EV_DISABLE, 0, 0, NULL);
+    }
+    if ((events ^ oldEvents) & POLLER_WRITE) {
+        EV_SET(&changes[count++], fd, EVFILT_WRITE,
+               events & POLLER_WRITE ? EV_ADD | EV_ENABLE : EV_DISABLE, 0, 0, NULL);
+    }
+
+    if (count == 0) return true;
+    return kevent(poller->handle, changes, count, NULL, 0, NULL) == 0;
+}
+
+int pollerWait(Poller *poller, PollerEvent *events, int maxEvents, int timeoutMs) {
+    struct kevent ready[POLLER_BATCH];
+    if (maxEvents > POLLER_BATCH) maxEvents = POLLER_BATCH;
+
+    struct timespec timeout;
+    timeout.tv_sec = timeoutMs / 1000;
+    timeout.tv_nsec = (long) (timeoutMs % 1000) * 1000000;
+
+    int count = kevent(poller->handle, NULL, 0, ready, maxEvents, timeoutMs < 0 ? NULL : &timeout);
+    if (count < 0) return 0;
+
+    // kqueue reports each filter separately, so one fd may show up twice
+    for (int i = 0; i < count; i++) {
+        events[i].fd = (int) ready[i].ident;
+        events[i].events = ready[i].filter == EVFILT_READ ? POLLER_READ : POLLER_WRITE;
+        if (ready[i].flags & (EV_EOF | EV_ERROR)) events[i].events |= POLLER_READ | POLLER_WRITE;
+    }
+    return count;
+}
+
+#else
+
+void initPoller(Poller *poller) {
+    poller->fds = NULL;
+    poller->count = 0;
+    poller->capacity = 0;
+    poller->positions = NULL;
+    poller->positionCapacity = 0;
+}
+
+void freePoller(Poller *poller) {
+    FREE_ARRAY(struct pollfd, poller->fds, poller->capacity);
+    FREE_ARRAY(int, poller->positions, poller->positionCapacity);
+    initPoller(poller);
+}
+
+bool pollerSet(Poller *poller, int fd, int oldEvents, int events) {
+    if (fd < 0) return false;
+
+    if (fd >= poller->positionCapacity) {
+        int oldCapacity = poller->positionCapacity;
+        int capacity = GROW_CAPACITY(oldCapacity);
+        while (capacity <= fd) capacity = GROW_CAPACITY(capacity);
+        poller->positions = GROW_ARRAY(int, poller->positions, oldCapacity, capacity);
+        for (int i = oldCapacity; i < capacity; i++) poller->positions[i] = -1;
+        poller->positionCapacity = capacity;
+    }
+
+    int position = poller->positions[fd];
+    if (position < 0) {
+        if (events == 0) return true;
+        if (poller->capacity < poller->count + 1) {
+            int oldCapacity = poller->capacity;
+            poller->capacity = GROW_CAPACITY(oldCapacity);
+            poller->fds = GROW_ARRAY(struct pollfd, poller->fds, oldCapacity, poller->capacity);
+        }
+        position = poller->count++;
+        poller->positions[fd] = position;
+        poller->fds[position].fd = fd;
+    }
+
+    if (events == 0) {
+        // Swap the last descriptor into the hole
+        struct pollfd last = poller->fds[--poller->count];
+        poller->fds[position] = last;
+        poller->positions[last.fd] = position;
+        poller->positions[fd] = -1;
+        return true;
+    }
+
+    poller->fds[position].events = 0;
+    if (events & POLLER_READ) poller->fds[position].events |= POLLIN;
+    if (events & POLLER_WRITE) poller->fds[position].events |= POLLOUT;
+    poller->fds[position].revents = 0;
+    return true;
+}
+
+int pollerWait(Poller *poller, PollerEvent *events, int maxEvents, int timeoutMs) {
+    int ready = poll(poller->fds, (nfds_t) poller->count, timeoutMs);
+    if (ready <= 0) return 0;
+
+    int count = 0;
+    for (int i = 0; i < poller->count && count < maxEvents; i++) {
+        short revents = poller->fds[i].revents;
+        if (!revents) continue;
+
+        // A closed descriptor wakes up its waiters rather than hanging them
+        if (revents & POLLNVAL) revents = POLLERR;
+
+        events[count].fd = poller->fds[i].fd;
+        events[count].events = 0;
+        if (revents & (POLLIN | POLLHUP | POLLERR)) events[count].events |= POLLER_READ;
+        if (revents & (POLLOUT | POLLHUP | POLLERR)) events[count].events |= POLLER_WRITE;
+        count++;
+    }
+    return count;
+}
+
+#endif
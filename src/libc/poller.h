@@ -0,0 +1,56 @@
+#ifndef SAFFRON_POLLER_H
+#define SAFFRON_POLLER_H
+
+#include <stdbool.h>
+
+// Picks the readiness backend, define POLLER_USE_POLL to force poll(2)
+#if defined(__linux__) && !defined(POLLER_USE_POLL)
+#define POLLER_EPOLL
+#elif (defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)) && !defined(POLLER_USE_POLL)
+#define POLLER_KQUEUE
+#else
+#define POLLER_POLL
+#endif
+
+#ifdef POLLER_POLL
+#include <poll.h>
+#endif
+
+#define POLLER_READ 1
+#define POLLER_WRITE 2
+
+#define POLLER_BATCH 64
+
+typedef struct {
+    int fd;
+    int events;
+} PollerEvent;
+
+// Registrations persist between waits, callers only change the interest set
+// of a descriptor when it actually changes.
+typedef struct {
+#ifdef POLLER_POLL
+    struct pollfd *fds;
+    int count;
+    int capacity;
+    // Position of each descriptor in fds, -1 when it isn't registered
+    int *positions;
+    int positionCapacity;
+#else
+    int handle;
+#endif
+} Poller;
+
+void initPoller(Poller *poller);
+
+void freePoller(Poller *poller);
+
+// Changes the events fd is watched for from oldEvents to events. Returns
+// false if the descriptor can't be polled (e.g. a regular file).
+bool pollerSet(Poller *poller, int fd, int oldEvents, int events);
+
+// Waits up to timeoutMs (-1 for no limit) and fills in at most maxEvents
+// ready descriptors, returns how many there were.
+int pollerWait(Poller *poller, PollerEvent *events, int maxEvents, int timeoutMs);
+
+#endif //SAFFRON_POLLER_H
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <string.h>
+#include "stringbuilder.h"
+#include "../memory.h"
+#include "../output.h"
+
+_Thread_local ObjBuiltinType *stringBuilderType = NULL;
+
+ObjStringBuilder *newStringBuilder() {
+    ObjStringBuilder *instance = ALLOCATE_OBJ(ObjStringBuilder, OBJ_INSTANCE);
+    initInstance(&instance->obj, (ObjClass *) stringBuilderType);
+    instance->chars = NULL;
+    instance->length = 0;
+    instance->capacity = 0;
+    return instance;
+}
+
+void freeStringBuilder(ObjStringBuilder *builder) {
+    FREE_ARRAY(char, builder->chars, builder->capacity);
+    FREE_OBJ(ObjStringBuilder, builder);
+}
+
+void markStringBuilder(ObjStringBuilder *builder) {
+}
+
+void printStringBuilder(ObjStringBuilder *builder) {
+    printOutput("<StringBuilder %d>", builder->length);
+}
+
+Value stringBuilderCall(int argCount, Value *args) {
+    if (argCount != 0) {
+        runtimeError("Expected 0 arguments but got %d.", argCount);
+        return NIL_VAL;
+    }
+    return OBJ_VAL(newStringBuilder());
+}
+
+Value stringBuilderAppend(ObjStringBuilder *builder, int argCount, Value *args) {
+    if (argCount != 1 || !IS_STRING(args[0])) {
+        runtimeError("Expected a string to append.");
+        return NIL_VAL;
+    }
+
+    ObjString *string = AS_STRING(args[0]);
+    int length = builder->length + string->length;
+    if (length > builder->capacity) {
+        int capacity = builder->capacity;
+        while (capacity < length) capacity = GROW_CAPACITY(capacity);
+        builder->chars = GROW_ARRAY(char, builder->chars, builder->capacity, capacity);
+        builder->capacity = capacity;
+    }
+    memcpy(builder->chars + builder->length, string->chars, string->length);
+    builder->length = length;
+
+    // Returned so appends can be chained
+    return OBJ_VAL(builder);
+}
+
+Value stringBuilderLength(ObjStringBuilder *builder, int argCount, Value *args) {
+    return INT_VAL(builder->length);
+}
+
+Value stringBuilderClear(ObjStringBuilder *builder, int argCount, Value *args) {
+    builder->length = 0;
+    return NIL_VAL;
+}
+
+Value stringBuilderToString(ObjStringBuilder *builder, int argCount, Value *args) {
+    return OBJ_VAL(copyString(builder->length == 0 ? "" : builder->chars, builder->length));
+}
+
+void stringBuilderInit(ObjBuiltinType *type) {
+    type->freeFn = (FreeFn) &freeStringBuilder;
+    type->markFn = (MarkFn) &markStringBuilder;
+    type->printFn = (PrintFn) &printStringBuilder;
+    type->typeCallFn = (TypeCallFn) &stringBuilderCall;
+    type->typeDefFn = (GetTypeDefFn) &createStringBuilderTypeDef;
+    defineBuiltinMethod(type, "append", (NativeMethodFn) stringBuilderAppend);
+    defineBuiltinMethod(type, "length", (NativeMethodFn) stringBuilderLength);
+    defineBuiltinMethod(type, "clear", (NativeMethodFn) stringBuilderClear);
+    defineBuiltinMethod(type, "toString", (NativeMethodFn) stringBuilderToString);
+}
+
+ObjBuiltinType *createStringBuilderType() {
+    stringBuilderType = newBuiltinType("StringBuilder", stringBuilderInit);
+    return stringBuilderType;
+}
+
+SimpleType *createStringBuilderTypeDef() {
+    // Class
+    SimpleType *builderTypeDef = newSimpleType();
+
+    // Methods
+    FunctorType *initType = newFunctorType();
+    initType->returnType = (Type *) builderTypeDef;
+    tableSet(
+            &builderTypeDef->methods,
+            copyString("init", 4),
+            OBJ_VAL(initType)
+    );
+
+    FunctorType *appendType = newFunctorType();
+    writeValueArray(&appendType->arguments, OBJ_VAL(stringType));
+    appendType->returnType = (Type *) builderTypeDef;
+    tableSet(
+            &builderTypeDef->methods,
+            copyString("append", 6),
+            OBJ_VAL(appendType)
+    );
+
+    FunctorType *lengthType = newFunctorType();
+    lengthType->returnType = (Type *) numberType;
+    tableSet(
+            &builderTypeDef->methods,
+            copyString("length", 6),
+            OBJ_VAL(lengthType)
+    );
+
+    FunctorType *clearType = newFunctorType();
+    clearType->returnType = (Type *) nilType;
+    tableSet(
+            &builderTypeDef->methods,
+            copyString("clear", 5),
+            OBJ_VAL(clearType)
+    );
+
+    FunctorType *toStringType = newFunctorType();
+    toStringType->returnType = (Type *) stringType;
+    tableSet(
+            &builderTypeDef->methods,
+            copyString("toString", 8),
+            OBJ_VAL(toStringType)
+    );
+
+    return builderTypeDef;
+}
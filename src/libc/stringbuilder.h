@@ -0,0 +1,27 @@
+#ifndef SAFFRON_STRINGBUILDER_H
+#define SAFFRON_STRINGBUILDER_H
+
+#include "../object.h"
+#include "../vm.h"
+#include "type.h"
+
+// Collects appended strings in one growable buffer, only interning the text
+// when toString() is called
+typedef struct {
+    ObjInstance obj;
+    char *chars;
+    int length;
+    int capacity;
+} ObjStringBuilder;
+
+ObjStringBuilder *newStringBuilder();
+
+void freeStringBuilder(ObjStringBuilder *builder);
+
+void printStringBuilder(ObjStringBuilder *builder);
+
+ObjBuiltinType *createStringBuilderType();
+
+SimpleType *createStringBuilderTypeDef();
+
+#endif //SAFFRON_STRINGBUILDER_H
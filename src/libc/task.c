@@ -1,19 +1,20 @@
 
 #include <printf.h>
 #include "task.h"
+#include "async.h"
+#include "../output.h"
 
-ObjBuiltinType *taskType = NULL;
+_Thread_local ObjBuiltinType *taskType = NULL;
 
 ObjTask *newTask(ObjCallFrame *task) {
     ObjTask *instance = ALLOCATE_OBJ(ObjTask, OBJ_INSTANCE);
-    instance->obj.klass = (ObjClass *) taskType;
-    initTable(&instance->obj.fields);
+    initInstance(&instance->obj, (ObjClass *) taskType);
     instance->task = task;
     return instance;
 }
 
 void freeTask(ObjTask *task) {
-    FREE(ObjTask, task);
+    FREE_OBJ(ObjTask, task);
 }
 
 void markTask(ObjTask *task) {
@@ -21,7 +22,7 @@ void markTask(ObjTask *task) {
 }
 
 void printTask(ObjTask *task) {
-    printf("<Task %p>", task);
+    printOutput("<Task %p>", task);
 }
 
 Value taskCall(int argCount, Value *args) {
@@ -37,6 +38,22 @@ Value isReady(ObjTask *task, int argCount, Value *args) {
     return BOOL_VAL(!!(task->task->state & FINISHED));
 }
 
+Value join(ObjTask *task, int argCount, Value *args) {
+    ObjCallFrame *target = task->task;
+    if (target->state & FINISHED) {
+        return target->result;
+    }
+
+    if (target == CURRENT_TASK) {
+        runtimeError("A task can't join itself");
+        return NIL_VAL;
+    }
+
+    // Resumed with the result once the task returns
+    parkOnQueue(&target->joiners);
+    return NIL_VAL;
+}
+
 void taskInit(ObjBuiltinType *type) {
     type->freeFn = (FreeFn) &freeTask;
     type->markFn = (MarkFn) &markTask;
@@ -44,6 +61,7 @@ void taskInit(ObjBuiltinType *type) {
     type->typeCallFn = (TypeCallFn) &taskCall;
     defineBuiltinMethod(type, "getResult", (NativeMethodFn) getResult);
     defineBuiltinMethod(type, "isReady", (NativeMethodFn) isReady);
+    defineBuiltinMethod(type, "join", (NativeMethodFn) join);
 }
 
 ObjBuiltinType *createTaskType() {
@@ -72,5 +90,13 @@ SimpleType *createTaskTypeDef() {
             OBJ_VAL(isReadyType)
     );
 
+    FunctorType *joinType = newFunctorType();
+    joinType->returnType = (Type *) anyType;
+    tableSet(
+            &taskTypeDef->methods,
+            copyString("join", 4),
+            OBJ_VAL(joinType)
+    );
+
     return (Type *) taskTypeDef;
 }
@@ -11,6 +11,7 @@ void defineBuiltinMethod(ObjBuiltinType *type, const char *name, NativeMethodFn
     push(OBJ_VAL(copyString(name, (int) strlen(name))));
     push(OBJ_VAL(newNativeMethod(function)));
     tableSet(&type->obj.methods, AS_STRING(peek(1)), peek(0));
+    touchClass(&type->obj);
     pop();
     pop();
 }
@@ -20,7 +21,9 @@ ObjBuiltinType *newBuiltinType(const char *name, InitFn initFn) {
     ObjBuiltinType *klass = ALLOCATE_OBJ(ObjBuiltinType, OBJ_BUILTIN_TYPE);
     klass->obj.name = AS_STRING(peek(0));
     initTable(&klass->obj.methods);
-    initTable(&klass->obj.fields);
+    initTable(&klass->obj.layout);
+    initValueArray(&klass->obj.defaults);
+    touchClass(&klass->obj);
     push(OBJ_VAL(klass));
     klass->freeFn = NULL;
     klass->markFn = NULL;
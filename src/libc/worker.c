@@ -0,0 +1,449 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "worker.h"
+#include "async.h"
+#include "list.h"
+#include "map.h"
+#include "float64array.h"
+#include "task.h"
+#include "../memory.h"
+#include "../output.h"
+
+// Nested lists and maps deeper than this aren't sent back, decoding keeps
+// two values per level on the stand-in task's stack
+#define WORKER_MAX_DEPTH 64
+
+typedef struct {
+    // FIFO of jobs waiting for a free slot
+    WorkerJob *pending;
+    WorkerJob *pendingTail;
+    WorkerJob *running;
+    int runningCount;
+    int limit;
+    // Write end of the result pipe, only set inside a worker
+    int resultFd;
+    ObjCallFrame *workerTask;
+} WorkerPool;
+
+static _Thread_local WorkerPool pool = {NULL, NULL, NULL, 0, 0, -1, NULL};
+
+static int workerLimit() {
+    if (pool.limit == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        pool.limit = cpus > 0 ? (int) cpus : 1;
+    }
+    return pool.limit;
+}
+
+Value spawnWorkerNative(int argCount, Value *args) {
+    if (!IS_CLOSURE(args[0])) {
+        runtimeError("Invalid argument for parameter 0, expect a function");
+        return NIL_VAL;
+    }
+
+    ObjCallFrame *task = newCallFrame(SPAWNED);
+    push(OBJ_VAL(task));
+    ObjTask *handle = newTask(task);
+    push(OBJ_VAL(handle));
+
+    WorkerJob *job = ALLOCATE(WorkerJob, 1);
+    job->task = task;
+    job->closure = AS_CLOSURE(args[0]);
+    job->pid = -1;
+    job->fd = -1;
+    job->buffer = NULL;
+    job->length = 0;
+    job->capacity = 0;
+    job->next = NULL;
+
+    if (pool.pendingTail != NULL) {
+        pool.pendingTail->next = job;
+    } else {
+        pool.pending = job;
+    }
+    pool.pendingTail = job;
+    // Counted as waiting on I/O from the moment it's queued so the scheduler
+    // doesn't wind down before the result is in
+    asyncHandler.ioWaitCount++;
+
+    startWorkers(true);
+
+    pop();
+    pop();
+    return OBJ_VAL(handle);
+}
+
+static void freeJob(WorkerJob *job) {
+    FREE_ARRAY(char, job->buffer, job->capacity);
+    FREE(WorkerJob, job);
+}
+
+// Turns this process into the worker for job: the parent's tasks, timers and
+// jobs are dropped and the job's closure becomes the only task
+static void becomeWorker(WorkerJob *job, int resultFd, bool fromNative) {
+    ObjCallFrame *caller = fromNative ? CURRENT_TASK : NULL;
+
+    // Built while the job still roots the closure, the pool lists are dropped below
+    ObjCallFrame *task = newClosureTask(job->closure);
+    pool.workerTask = task;
+
+    for (WorkerJob *other = pool.running; other != NULL; other = other->next) {
+        close(other->fd);
+    }
+    pool.pending = NULL;
+    pool.pendingTail = NULL;
+    pool.running = NULL;
+    pool.runningCount = 0;
+    pool.resultFd = resultFd;
+
+    freeAsyncHandler();
+    clearRunQueues();
+    if (caller != NULL) {
+        // The native's caller is parked for good once spawnWorker returns
+        vm.runningTask = caller;
+        vm.taskParked = true;
+    }
+    scheduleTask(task);
+}
+
+static bool startJob(WorkerJob *job, bool fromNative) {
+    int fds[2];
+    if (pipe(fds) < 0) {
+        fprintf(stderr, "Couldn't start worker: %s\n", strerror(errno));
+        return false;
+    }
+
+    // Anything still buffered would otherwise be printed twice
+    flushOutput();
+    fflush(NULL);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "Couldn't start worker: %s\n", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+
+    if (pid == 0) {
+        close(fds[0]);
+        becomeWorker(job, fds[1], fromNative);
+        return true;
+    }
+
+    close(fds[1]);
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    job->pid = pid;
+    job->fd = fds[0];
+    watchWorker(job->fd, job);
+    return false;
+}
+
+bool startWorkers(bool fromNative) {
+    while (pool.pending != NULL && pool.runningCount < workerLimit()) {
+        WorkerJob *job = pool.pending;
+        pool.pending = job->next;
+        if (pool.pending == NULL) pool.pendingTail = NULL;
+
+        job->next = pool.running;
+        pool.running = job;
+        pool.runningCount++;
+
+        if (startJob(job, fromNative)) return true;
+
+        if (job->fd < 0) {
+            // Couldn't fork, the job finishes with nil straight away
+            pool.running = job->next;
+            pool.runningCount--;
+            asyncHandler.ioWaitCount--;
+            finishTask(job->task, NIL_VAL);
+            freeJob(job);
+        }
+    }
+    return false;
+}
+
+typedef struct {
+    char *bytes;
+    int length;
+    int capacity;
+} Buffer;
+
+static void writeBytes(Buffer *buffer, const void *bytes, int length) {
+    if (buffer->capacity < buffer->length + length) {
+        int oldCapacity = buffer->capacity;
+        int capacity = GROW_CAPACITY(oldCapacity);
+        while (capacity < buffer->length + length) capacity = GROW_CAPACITY(capacity);
+        buffer->bytes = GROW_ARRAY(char, buffer->bytes, oldCapacity, capacity);
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->bytes + buffer->length, bytes, length);
+    buffer->length += length;
+}
+
+static void writeTag(Buffer *buffer, char tag) {
+    writeBytes(buffer, &tag, 1);
+}
+
+static void writeCount(Buffer *buffer, uint32_t count) {
+    writeBytes(buffer, &count, sizeof(count));
+}
+
+// Only plain data survives the trip back to the parent
+static bool serializeValue(Buffer *buffer, Value value, int depth) {
+    if (depth > WORKER_MAX_DEPTH) return false;
+
+    if (IS_NIL(value)) {
+        writeTag(buffer, 'n');
+    } else if (IS_BOOL(value)) {
+        writeTag(buffer, AS_BOOL(value) ? 't' : 'f');
+    } else if (IS_INT(value)) {
+        int64_t integer = AS_INT(value);
+        writeTag(buffer, 'i');
+        writeBytes(buffer, &integer, sizeof(integer));
+    } else if (IS_NUMBER(value)) {
+        double number = AS_NUMBER(value);
+        writeTag(buffer, 'd');
+        writeBytes(buffer, &number, sizeof(number));
+    } else if (IS_STRING(value)) {
+        ObjString *string = AS_STRING(value);
+        writeTag(buffer, 's');
+        writeCount(buffer, string->length);
+        writeBytes(buffer, string->chars, string->length);
+    } else if (IS_ROPE(value)) {
+        ObjRope *rope = AS_ROPE(value);
+        writeTag(buffer, 's');
+        writeCount(buffer, rope->length);
+        writeBytes(buffer, rope->buffer->chars, rope->length);
+    } else if (IS_LIST(value)) {
+        ValueArray *items = &AS_LIST(value)->items;
+        writeTag(buffer, 'l');
+        writeCount(buffer, items->count);
+        for (int i = 0; i < items->count; i++) {
+            if (!serializeValue(buffer, items->values[i], depth + 1)) return false;
+        }
+    } else if (IS_FLOAT64_ARRAY(value)) {
+        ObjFloat64Array *array = AS_FLOAT64_ARRAY(value);
+        writeTag(buffer, 'a');
+        writeCount(buffer, array->length);
+        writeBytes(buffer, array->values, (int) sizeof(double) * array->length);
+    } else if (IS_MAP(value)) {
+        ValueTable *values = &AS_MAP(value)->values;
+        writeTag(buffer, 'm');
+        writeCount(buffer, values->count);
+        for (int i = 0; i < values->entryCount; i++) {
+            MapEntry *entry = &values->entries[i];
+            if (IS_NIL(entry->key)) continue;
+            if (!serializeValue(buffer, entry->key, depth + 1)) return false;
+            if (!serializeValue(buffer, entry->value, depth + 1)) return false;
+        }
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static void sendWorkerResult(Value result) {
+    Buffer buffer = {NULL, 0, 0};
+    if (!serializeValue(&buffer, result, 0)) {
+        fprintf(stderr, "Worker result can't be sent back, only nil, booleans, numbers, "
+                        "strings, lists and maps can.\n");
+        buffer.length = 0;
+        writeTag(&buffer, 'n');
+    }
+
+    for (int written = 0; written < buffer.length;) {
+        ssize_t count = write(pool.resultFd, buffer.bytes + written, buffer.length - written);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) break;
+        written += (int) count;
+    }
+
+    flushOutput();
+    fflush(NULL);
+    _exit(0);
+}
+
+void checkWorkerDone(ObjCallFrame *task, Value result) {
+    if (task == pool.workerTask) sendWorkerResult(result);
+}
+
+void stopWorker() {
+    if (pool.workerTask != NULL) sendWorkerResult(NIL_VAL);
+}
+
+typedef struct {
+    WorkerJob *job;
+    int offset;
+} Reader;
+
+static bool readBytes(Reader *reader, void *bytes, int length) {
+    if (reader->offset + length > reader->job->length) return false;
+    memcpy(bytes, reader->job->buffer + reader->offset, length);
+    reader->offset += length;
+    return true;
+}
+
+// Values under construction are kept on the stand-in task's stack, the
+// running stack may belong to a task that is already gone. The task may
+// have been marked already, so what it keeps is marked too.
+static void keep(Reader *reader, Value value) {
+    *reader->job->task->stackTop++ = value;
+    WRITE_BARRIER(value);
+}
+
+static void release(Reader *reader, int count) {
+    reader->job->task->stackTop -= count;
+}
+
+static bool deserializeValue(Reader *reader, Value *value) {
+    char tag;
+    uint32_t count;
+    if (!readBytes(reader, &tag, 1)) return false;
+
+    switch (tag) {
+        case 'n':
+            *value = NIL_VAL;
+            return true;
+        case 't':
+        case 'f':
+            *value = BOOL_VAL(tag == 't');
+            return true;
+        case 'i': {
+            int64_t integer;
+            if (!readBytes(reader, &integer, sizeof(integer)) || !fitsInt(integer)) return false;
+            *value = INT_VAL(integer);
+            return true;
+        }
+        case 'd': {
+            double number;
+            if (!readBytes(reader, &number, sizeof(number))) return false;
+            *value = NUMBER_VAL(number);
+            return true;
+        }
+        case 's':
+            if (!readBytes(reader, &count, sizeof(count))) return false;
+            if (reader->offset + (int) count > reader->job->length) return false;
+            *value = OBJ_VAL(copyString(reader->job->buffer + reader->offset, (int) count));
+            reader->offset += (int) count;
+            return true;
+        case 'l': {
+            if (!readBytes(reader, &count, sizeof(count))) return false;
+            ObjList *list = newList();
+            keep(reader, OBJ_VAL(list));
+            for (uint32_t i = 0; i < count; i++) {
+                Value item;
+                if (!deserializeValue(reader, &item)) {
+                    release(reader, 1);
+                    return false;
+                }
+                keep(reader, item);
+                writeValueArray(&list->items, item);
+                release(reader, 1);
+            }
+            release(reader, 1);
+            *value = OBJ_VAL(list);
+            return true;
+        }
+        case 'a': {
+            if (!readBytes(reader, &count, sizeof(count))) return false;
+            if (count > (uint32_t) (reader->job->length - reader->offset) / sizeof(double)) return false;
+            ObjFloat64Array *array = newFloat64Array((int) count);
+            *value = OBJ_VAL(array);
+            return readBytes(reader, array->values, (int) (sizeof(double) * count));
+        }
+        case 'm': {
+            if (!readBytes(reader, &count, sizeof(count))) return false;
+            ObjMap *map = newMap();
+            keep(reader, OBJ_VAL(map));
+            for (uint32_t i = 0; i < count; i++) {
+                Value key;
+                Value item;
+                if (!deserializeValue(reader, &key)) {
+                    release(reader, 1);
+                    return false;
+                }
+                keep(reader, key);
+                if (!deserializeValue(reader, &item)) {
+                    release(reader, 2);
+                    return false;
+                }
+                keep(reader, item);
+                valueTableSet(&map->values, key, item);
+                release(reader, 2);
+            }
+            release(reader, 1);
+            *value = OBJ_VAL(map);
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+static void unlinkRunning(WorkerJob *job) {
+    WorkerJob **link = &pool.running;
+    while (*link != job) link = &(*link)->next;
+    *link = job->next;
+    pool.runningCount--;
+}
+
+static bool finishJob(WorkerJob *job) {
+    unwatchWorker(job->fd);
+    close(job->fd);
+
+    int status;
+    while (waitpid(job->pid, &status, 0) < 0 && errno == EINTR);
+
+    // A worker that died before sending anything back finishes with nil
+    Value result = NIL_VAL;
+    Reader reader = {job, 0};
+    if (job->length > 0 && !deserializeValue(&reader, &result)) {
+        result = NIL_VAL;
+    }
+
+    unlinkRunning(job);
+    asyncHandler.ioWaitCount--;
+    int woken = finishTask(job->task, result);
+    freeJob(job);
+    return woken > 0;
+}
+
+bool readWorker(WorkerJob *job) {
+    char chunk[4096];
+    while (true) {
+        ssize_t count = read(job->fd, chunk, sizeof(chunk));
+        if (count > 0) {
+            if (job->capacity < job->length + count) {
+                int oldCapacity = job->capacity;
+                int capacity = GROW_CAPACITY(oldCapacity);
+                while (capacity < job->length + count) capacity = GROW_CAPACITY(capacity);
+                job->buffer = GROW_ARRAY(char, job->buffer, oldCapacity, capacity);
+                job->capacity = capacity;
+            }
+            memcpy(job->buffer + job->length, chunk, count);
+            job->length += (int) count;
+            continue;
+        }
+
+        if (count < 0 && errno == EINTR) continue;
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return false;
+        return finishJob(job);
+    }
+}
+
+void markWorkers() {
+    for (WorkerJob *job = pool.pending; job != NULL; job = job->next) {
+        markObject((Obj *) job->task);
+        markObject((Obj *) job->closure);
+    }
+    for (WorkerJob *job = pool.running; job != NULL; job = job->next) {
+        markObject((Obj *) job->task);
+        markObject((Obj *) job->closure);
+    }
+    markObject((Obj *) pool.workerTask);
+}
@@ -0,0 +1,42 @@
+#ifndef SAFFRON_WORKER_H
+#define SAFFRON_WORKER_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include "../object.h"
+#include "../vm.h"
+
+// A task run in a forked copy of the VM. The worker process has its own heap,
+// so the only thing that crosses back is the serialized result, which is
+// delivered to a stand-in task in the parent once the pipe reaches EOF.
+typedef struct WorkerJob {
+    // Stand-in for the remote task, its handle is what spawnWorker returns
+    ObjCallFrame *task;
+    ObjClosure *closure;
+    pid_t pid;
+    int fd;
+    char *buffer;
+    int length;
+    int capacity;
+    struct WorkerJob *next;
+} WorkerJob;
+
+Value spawnWorkerNative(int argCount, Value *args);
+
+// Forks queued jobs while there are free worker slots. Returns true only in a
+// freshly forked worker, whose scheduler now holds just the worker's task.
+bool startWorkers(bool fromNative);
+
+// Drains the job's pipe, returns true if finishing it woke any tasks
+bool readWorker(WorkerJob *job);
+
+// Called when a task finishes, never returns if it was this worker's task
+void checkWorkerDone(ObjCallFrame *task, Value result);
+
+// Called when the scheduler runs dry, a worker exits instead of falling
+// back into the script that forked it
+void stopWorker();
+
+void markWorkers();
+
+#endif //SAFFRON_WORKER_H
@@ -5,16 +5,26 @@
 #include "ast/astprint.h"
 #include "ast/astparse.h"
 #include "types.h"
+#include "bytecode.h"
+#include "profiler.h"
+#include "output.h"
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Samples a second taken by --profile
+#define PROFILE_HZ 1000
 
 static void repl() {
     char line[1024];
     for (;;) {
-        printf("> ");
+        printOutput("> ");
+        flushOutput();
 
         if (!fgets(line, sizeof(line), stdin)) {
-            printf("\n");
+            printOutput("\n");
             break;
         }
 
@@ -22,24 +32,76 @@ static void repl() {
     }
 }
 
-static void runFile(const char *path) {
+// Runs the script at path on the calling thread's VM, compiling what it
+// imports up front when precompile is set
+static InterpretResult runScript(const char *path, bool precompile) {
     char *source = readFile(path);
+    if (precompile) precompileImports(source);
     StmtArray *body = parseAST(source);
 //    evaluateTree(body);
 //    printTree(body);
 //    astUnparse(body);
     ObjModule *module = interpret(body, "<script>", path);
-    free(source);
+    freeFile(source);
+    return module->result;
+}
 
-    if (module->result == INTERPRET_COMPILE_ERROR) exit(65);
-    if (module->result == INTERPRET_RUNTIME_ERROR) exit(70);
+static void exitOnError(InterpretResult result) {
+    if (result == INTERPRET_COMPILE_ERROR) exit(65);
+    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+}
+
+static void runFile(const char *path) {
+    InterpretResult result = runScript(path, true);
+    stopProfiler();
+    exitOnError(result);
+}
+
+typedef struct {
+    const char *path;
+    pthread_t thread;
+    InterpretResult result;
+} Isolate;
+
+// Every thread has a VM of its own, heap, scheduler and all. Only the
+// bundle's bytecode is shared, its chunks point into the one mapping.
+static void *runIsolate(void *argument) {
+    Isolate *isolate = argument;
+    initVM();
+    isolate->result = runScript(isolate->path, false);
+    freeVM();
+    return NULL;
+}
+
+// Runs the script count times at once, one thread each, and fails the way
+// the first isolate that failed did
+static void runIsolates(const char *path, int count) {
+    Isolate *isolates = malloc(sizeof(Isolate) * count);
+    if (isolates == NULL) exit(1);
+
+    for (int i = 0; i < count; i++) {
+        isolates[i].path = path;
+        isolates[i].result = INTERPRET_OK;
+        if (pthread_create(&isolates[i].thread, NULL, runIsolate, &isolates[i]) != 0) {
+            fprintf(stderr, "Could not start isolate %d.\n", i);
+            exit(71);
+        }
+    }
+
+    InterpretResult result = INTERPRET_OK;
+    for (int i = 0; i < count; i++) {
+        pthread_join(isolates[i].thread, NULL);
+        if (result == INTERPRET_OK) result = isolates[i].result;
+    }
+    free(isolates);
+    exitOnError(result);
 }
 
 static void parseFile(const char *path) {
     char *source = readFile(path);
     StmtArray *body = parseAST(source);
     printTree(body);
-    free(source);
+    freeFile(source);
 
     if (body == NULL) exit(65);
 }
@@ -47,13 +109,35 @@ static void parseFile(const char *path) {
 
 int main(int argc, const char *argv[]) {
     initVM();
-    if (argc == 1) {
+    const char *bundle = getenv("SAFFRON_BUNDLE");
+    if (bundle != NULL && !openBundle(bundle)) {
+        fprintf(stderr, "Could not open bundle \"%s\".\n", bundle);
+    }
+
+    if (argc >= 3 && strcmp(argv[1], "--bundle") == 0) {
+        if (!writeBundle(argv[2], argv + 3, argc - 3)) exit(65);
+    } else if (argc == 1) {
         repl();
     } else if (argc == 2) {
         runFile(argv[1]);
 //        parseFile(argv[1]);
+    } else if (argc == 3 && strncmp(argv[1], "--profile", 9) == 0
+               && (argv[1][9] == '\0' || argv[1][9] == '=')) {
+        const char *output = argv[1][9] == '=' ? argv[1] + 10 : "saffron.folded";
+        if (!startProfiler(output, PROFILE_HZ)) {
+            fprintf(stderr, "Could not start the profiler.\n");
+        }
+        runFile(argv[2]);
+    } else if (argc == 3 && strncmp(argv[1], "--isolates", 10) == 0
+               && (argv[1][10] == '\0' || argv[1][10] == '=')) {
+        long count = argv[1][10] == '=' ? strtol(argv[1] + 11, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+        if (count < 1) count = 1;
+        runIsolates(argv[2], (int) count);
     } else {
-        fprintf(stderr, "Usage: saffron [path]\n");
+        fprintf(stderr, "Usage: saffron [path]\n"
+                        "       saffron --profile[=<output>] <path>\n"
+                        "       saffron --isolates[=<count>] <path>\n"
+                        "       saffron --bundle <output> <module>...\n");
         exit(64);
     }
 
@@ -1,3 +1,4 @@
+#include <limits.h>
 #include <stdlib.h>
 
 #include "memory.h"
@@ -8,6 +9,9 @@
 #include "libc/async.h"
 #include "libc/module.h"
 #include "ast/astparse.h"
+#include "libc/time.h"
+#include "jit.h"
+#include "output.h"
 
 #ifdef DEBUG_LOG_GC
 
@@ -16,18 +20,75 @@
 
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2
+// Bytes that may be allocated between two marking steps
+#define GC_STEP_SIZE (64 * 1024)
+// Gray objects traced by each step
+#define GC_STEP_WORK 2048
+// Objects looked at by each sweeping step
+#define GC_SWEEP_WORK 4096
+
+_Thread_local bool gcMarking = false;
+_Thread_local bool gcStepDue = false;
+_Thread_local GCStats gcStats;
+_Thread_local double gcHeapGrowFactor = GC_HEAP_GROW_FACTOR;
+// A collection that is still marking once the heap reaches this is finished
+// on the spot rather than at a safe point
+static _Thread_local size_t heapLimit = 0;
+
+// Once marking is done the heap is swept a step at a time too. Objects from
+// sweepCursor on still carry the marks of the collection that found them,
+// the ones before it are unmarked, sweepPrevious is the one linked to it.
+static _Thread_local bool gcSweeping = false;
+static _Thread_local Obj *sweepPrevious = NULL;
+static _Thread_local Obj *sweepCursor = NULL;
+
+static void sweepObjects(int work);
+
+// Objects up to SLAB_MAX_SIZE bytes are carved out of SLAB_SIZE blocks, with a
+// free list per SLAB_ALIGN sized class. Freed objects go back on their list.
+#define SLAB_ALIGN 16
+#define SLAB_MAX_SIZE 256
+#define SLAB_SIZE (64 * 1024)
+#define SIZE_CLASS(size) (((size) + SLAB_ALIGN - 1) / SLAB_ALIGN - 1)
+#define CLASS_SIZE(sizeClass) (((sizeClass) + 1) * SLAB_ALIGN)
+
+// ASan can only see use after free if objects go back to libc
+#if defined(__SANITIZE_ADDRESS__)
+#define SLAB_DISABLED
+#endif
 
-void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
+typedef struct FreeSlot {
+    struct FreeSlot *next;
+} FreeSlot;
+
+static _Thread_local FreeSlot *freeSlots[SLAB_MAX_SIZE / SLAB_ALIGN];
+
+static size_t grownHeap(size_t bytes) {
+    return (size_t) ((double) bytes * gcHeapGrowFactor);
+}
+
+static void trackAllocation(size_t oldSize, size_t newSize) {
     vm.bytesAllocated += newSize - oldSize;
-    if (newSize > oldSize) {
+    if (newSize < oldSize) {
+        gcStats.bytesFreed += oldSize - newSize;
+    } else if (newSize > oldSize) {
+        gcStats.bytesAllocated += newSize - oldSize;
 #ifdef DEBUG_STRESS_GC
         collectGarbage();
 #endif
         if (vm.bytesAllocated > vm.nextGC) {
-            collectGarbage();
+            size_t limit = gcMarking ? heapLimit : grownHeap(vm.nextGC);
+            if (vm.bytesAllocated > limit) {
+                collectGarbage();
+            } else {
+                gcStepDue = true;
+            }
         }
     }
+}
+
+void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
+    trackAllocation(oldSize, newSize);
 
     if (newSize == 0) {
         free(pointer);
@@ -39,55 +100,114 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
     return result;
 }
 
+static void refillSlots(int sizeClass) {
+    char *slab = malloc(SLAB_SIZE);
+    if (slab == NULL) exit(1);
+
+    size_t slotSize = CLASS_SIZE(sizeClass);
+    for (size_t offset = 0; offset + slotSize <= SLAB_SIZE; offset += slotSize) {
+        FreeSlot *slot = (FreeSlot *) (slab + offset);
+        slot->next = freeSlots[sizeClass];
+        freeSlots[sizeClass] = slot;
+    }
+}
+
+void *allocateObjectMemory(size_t size) {
+#ifndef SLAB_DISABLED
+    if (size <= SLAB_MAX_SIZE) {
+        int sizeClass = SIZE_CLASS(size);
+        trackAllocation(0, CLASS_SIZE(sizeClass));
+        // Garbage that is still to be swept may have a slot this size
+        if (freeSlots[sizeClass] == NULL && gcSweeping) sweepObjects(GC_SWEEP_WORK);
+        if (freeSlots[sizeClass] == NULL) refillSlots(sizeClass);
+
+        FreeSlot *slot = freeSlots[sizeClass];
+        freeSlots[sizeClass] = slot->next;
+        return slot;
+    }
+#endif
+
+    return reallocate(NULL, 0, size);
+}
+
+void freeObjectMemory(void *pointer, size_t size) {
+#ifndef SLAB_DISABLED
+    if (size <= SLAB_MAX_SIZE) {
+        int sizeClass = SIZE_CLASS(size);
+        trackAllocation(CLASS_SIZE(sizeClass), 0);
+
+        FreeSlot *slot = (FreeSlot *) pointer;
+        slot->next = freeSlots[sizeClass];
+        freeSlots[sizeClass] = slot;
+        return;
+    }
+#endif
+
+    reallocate(pointer, size, 0);
+}
+
 
 static void freeObject(Obj *object) {
 #ifdef DEBUG_LOG_GC
-    printf("%p free type %d\n", (void *) object, object->type);
+    printOutput("%p free type %d\n", (void *) object, object->type);
 #endif
+    gcStats.objects[object->type]--;
 
     switch (object->type) {
         case OBJ_FUNCTION: {
             ObjFunction *function = (ObjFunction *) object;
+            jitFree(function->jit);
             freeChunk(&function->chunk);
-            FREE(ObjFunction, object);
+            FREE_OBJ(ObjFunction, object);
             break;
         }
         case OBJ_ATOM:
         case OBJ_STRING: {
             ObjString *string = (ObjString *) object;
 #ifdef DEBUG_LOG_GC
-            printf(string->chars, strlen(string->chars));
-            printf("\n");
+            printOutput(string->chars, strlen(string->chars));
+            printOutput("\n");
 #endif
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+            freeObjectMemory(object, sizeof(ObjString) + string->length + 1);
+            break;
+        }
+        case OBJ_ROPE: {
+            RopeBuffer *buffer = ((ObjRope *) object)->buffer;
+            if (--buffer->refs == 0) {
+                FREE_ARRAY(char, buffer->chars, buffer->capacity);
+                FREE(RopeBuffer, buffer);
+            }
+            FREE_OBJ(ObjRope, object);
             break;
         }
         case OBJ_NATIVE_METHOD:
         case OBJ_NATIVE: {
-            FREE(ObjNative, object);
+            FREE_OBJ(ObjNative, object);
             break;
         }
         case OBJ_CLOSURE: {
             ObjClosure *closure = (ObjClosure *) object;
             FREE_ARRAY(ObjUpvalue*, closure->upvalues,
                        closure->upvalueCount);
-            FREE(ObjClosure, object);
+            FREE_OBJ(ObjClosure, object);
             break;
         }
         case OBJ_UPVALUE: {
-            FREE(ObjUpvalue, object);
+            FREE_OBJ(ObjUpvalue, object);
             break;
         }
         case OBJ_BUILTIN_TYPE:
         case OBJ_CLASS: {
             ObjClass *klass = (ObjClass *) object;
             freeTable(&klass->methods);
-            FREE(ObjClass, object);
+            freeTable(&klass->layout);
+            freeValueArray(&klass->defaults);
+            FREE_OBJ(ObjClass, object);
             break;
         }
         case OBJ_MAP:
         case OBJ_LIST:
+        case OBJ_FLOAT64_ARRAY:
         case OBJ_INSTANCE: {
             ObjInstance *instance = (ObjInstance *) object;
             ObjType objType = instance->klass->obj.type;
@@ -97,17 +217,21 @@ static void freeObject(Obj *object) {
                 ObjBuiltinType *type = (ObjBuiltinType *) instance->klass;
                 type->freeFn((Obj *) instance);
             } else {
-                FREE(ObjInstance, object);
+                freeObjectMemory(object, sizeof(ObjInstance) + sizeof(Value) * instance->slotCount);
             }
 
             break;
         }
         case OBJ_BOUND_METHOD:
-            FREE(ObjBoundMethod, object);
+            FREE_OBJ(ObjBoundMethod, object);
             break;
-        case OBJ_CALL_FRAME:
-            FREE(ObjCallFrame, object);
+        case OBJ_CALL_FRAME: {
+            ObjCallFrame *task = (ObjCallFrame *) object;
+            if (task->operation != NULL) freeIoOperation(task->operation);
+            FREE_ARRAY(Value, task->stack, task->stackCapacity);
+            FREE_OBJ(ObjCallFrame, object);
             break;
+        }
         case OBJ_MODULE:
             freeModule((ObjModule *) object);
             break;
@@ -133,16 +257,14 @@ void freeObjects() {
         previous = object;
         object = next;
     }
+    gcSweeping = false;
+    sweepPrevious = NULL;
+    sweepCursor = NULL;
     free(vm.grayStack);
 }
 
 void freeNodes() {
-    Node *node = parser.nodes;
-    while (node != NULL) {
-        Node *next = node->next;
-//        freeObject(object);
-        node = next;
-    }
+    freeArena(&parser.arena);
 }
 
 void markObject(Obj *object) {
@@ -150,9 +272,9 @@ void markObject(Obj *object) {
     if (object->isMarked) return;
 
 #ifdef DEBUG_LOG_GC
-    printf("%p mark ", (void *) object);
+    printOutput("%p mark ", (void *) object);
     printValue(OBJ_VAL(object));
-    printf("\n");
+    printOutput("\n");
 #endif
     object->isMarked = true;
 
@@ -170,6 +292,12 @@ void markValue(Value value) {
     if (IS_OBJ(value)) markObject(AS_OBJ(value));
 }
 
+void rescanObject(Obj *object) {
+    if (!gcMarking || !object->isMarked) return;
+    object->isMarked = false;
+    markObject(object);
+}
+
 static void markRoots() {
     VM* vm2 = &vm;
     for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
@@ -185,11 +313,16 @@ static void markRoots() {
     markTable(&vm.types);
     markTable(&vm.modules);
     markTable(&vm.builtins);
-    markArray(&vm.tasks);
+    markRunQueues();
+    markObject((Obj *) vm.mainTask);
+    markValue(vm.error);
     markCompilerRoots();
     markTypecheckerRoots();
     markAsyncRoots();
     markObject((Obj *) vm.initString);
+    markObject((Obj *) vm.iterString);
+    markObject((Obj *) vm.hasNextString);
+    markObject((Obj *) vm.nextString);
 }
 
 void markArray(ValueArray *array) {
@@ -200,9 +333,9 @@ void markArray(ValueArray *array) {
 
 static void blackenObject(Obj *object) {
 #ifdef DEBUG_LOG_GC
-    printf("%p blacken ", (void *) object);
+    printOutput("%p blacken ", (void *) object);
     printValue(OBJ_VAL(object));
-    printf("\n");
+    printOutput("\n");
 #endif
 
     switch (object->type) {
@@ -211,6 +344,9 @@ static void blackenObject(Obj *object) {
         case OBJ_ATOM:
         case OBJ_STRING:
             break;
+        case OBJ_ROPE:
+            markObject((Obj *) ((ObjRope *) object)->flat);
+            break;
         case OBJ_UPVALUE:
             markValue(((ObjUpvalue *) object)->closed);
             break;
@@ -225,6 +361,7 @@ static void blackenObject(Obj *object) {
         case OBJ_FUNCTION: {
             ObjFunction *function = (ObjFunction *) object;
             markObject((Obj *) function->name);
+            markObject((Obj *) function->module);
             markArray(&function->chunk.constants);
             break;
         }
@@ -233,15 +370,21 @@ static void blackenObject(Obj *object) {
             ObjClass *klass = (ObjClass *) object;
             markObject((Obj *) klass->name);
             markTable(&klass->methods);
+            markTable(&klass->layout);
+            markArray(&klass->defaults);
             break;
         }
         case OBJ_MODULE:
         case OBJ_MAP:
         case OBJ_LIST:
+        case OBJ_FLOAT64_ARRAY:
         case OBJ_INSTANCE: {
             ObjInstance *instance = (ObjInstance *) object;
             markObject((Obj *) instance->klass);
             markTable(&instance->fields);
+            for (int i = 0; i < instance->slotCount; i++) {
+                markValue(instance->slots[i]);
+            }
 
             ObjType objType = instance->klass->obj.type;
             if (objType == OBJ_BUILTIN_TYPE) {
@@ -257,11 +400,27 @@ static void blackenObject(Obj *object) {
             break;
         }
         case OBJ_CALL_FRAME: {
-            ObjCallFrame *frame = (ObjCallFrame *) object;
-            markObject((Obj *) frame->closure);
-            if (frame->parent) {
-                markObject((Obj *) frame->parent);
+            ObjCallFrame *task = (ObjCallFrame *) object;
+            for (int i = 0; i < task->frameCount; i++) {
+                markObject((Obj *) task->frames[i].closure);
             }
+            // The running task's top and upvalues only live in the VM
+            bool running = task->stack == vm.stack;
+            Value *stackTop = running ? vm.stackTop : task->stackTop;
+            for (Value *slot = task->stack; slot < stackTop; slot++) {
+                markValue(*slot);
+            }
+            for (ObjUpvalue *upvalue = running ? vm.openUpvalues : task->openUpvalues;
+                 upvalue != NULL;
+                 upvalue = upvalue->next) {
+                markObject((Obj *) upvalue);
+            }
+            for (ObjCallFrame *joiner = task->joiners; joiner != NULL; joiner = joiner->next) {
+                markObject((Obj *) joiner);
+            }
+            if (task->operation != NULL) markValue(task->operation->data);
+            markValue(task->stored);
+            markValue(task->result);
             break;
         }
         case OBJ_PARSE_TYPE:
@@ -283,19 +442,27 @@ static void traceReferences() {
     }
 }
 
-static void sweep() {
-    Obj *previous = NULL;
-    Obj *object = vm.objects;
-    while (object != NULL) {
+void linkObject(Obj *object) {
+    object->next = vm.objects;
+    vm.objects = object;
+    // The first object made while nothing before the sweep is left sits
+    // right in front of it
+    if (gcSweeping && sweepPrevious == NULL) sweepPrevious = object;
+}
+
+static void sweepObjects(int work) {
+    double start = getTime();
+    Obj *object = sweepCursor;
+    for (; object != NULL && work > 0; work--) {
         if (object->isMarked) {
             object->isMarked = false;
-            previous = object;
+            sweepPrevious = object;
             object = object->next;
         } else {
             Obj *unreached = object;
             object = object->next;
-            if (previous != NULL) {
-                previous->next = object;
+            if (sweepPrevious != NULL) {
+                sweepPrevious->next = object;
             } else {
                 vm.objects = object;
             }
@@ -303,26 +470,101 @@ static void sweep() {
             freeObject(unreached);
         }
     }
+    sweepCursor = object;
+    gcStats.sweepSeconds += getTime() - start;
+
+    if (object == NULL) {
+        gcSweeping = false;
+        sweepPrevious = NULL;
+        vm.nextGC = grownHeap(vm.bytesAllocated);
+    }
 }
 
-void collectGarbage() {
-#ifdef DEBUG_LOG_GC
-    printf("-- gc begin\n");
-    size_t before = vm.bytesAllocated;
-#endif
+// A sweep still under way has to finish before marking starts again, the
+// marks it hasn't cleared yet would stop the marker tracing those objects
+void finishSweep() {
+    if (gcSweeping) sweepObjects(INT_MAX);
+}
+
+static void recordPause(double start) {
+    double pause = getTime() - start;
+    if (pause > gcStats.longestPause) gcStats.longestPause = pause;
+
+    int bucket = 0;
+    for (double limit = 1e-6; pause >= limit && bucket < GC_PAUSE_BUCKETS - 1; limit *= 2) bucket++;
+    gcStats.pauses[bucket]++;
+}
 
+// The stack and the VM's tables aren't behind the write barrier, so the roots
+// are marked again here to pick up whatever they gained while marking. The
+// sweep then goes a step at a time like marking did, allocation sets off
+// the steps until it is done.
+static void finishMarking() {
+    double start = getTime();
     markRoots();
     traceReferences();
     tableRemoveWhite(&vm.strings);
     tableRemoveWhite(&vm.atoms);
-    sweep();
+    gcStats.markSeconds += getTime() - start;
+    gcStats.collections++;
+
+    gcMarking = false;
+    gcStepDue = false;
+    gcSweeping = true;
+    sweepPrevious = NULL;
+    sweepCursor = vm.objects;
+    vm.nextGC = vm.bytesAllocated + GC_STEP_SIZE;
+}
 
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+void collectGarbage() {
+#ifdef DEBUG_LOG_GC
+    printOutput("-- gc begin\n");
+    size_t before = vm.bytesAllocated;
+#endif
+
+    double start = getTime();
+    finishSweep();
+    finishMarking();
+    finishSweep();
+    recordPause(start);
 
 #ifdef DEBUG_LOG_GC
-    printf("-- gc end\n");
-    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+    printOutput("-- gc end\n");
+    printOutput("   collected %zu bytes (from %zu to %zu) next at %zu\n",
            before - vm.bytesAllocated, before, vm.bytesAllocated,
            vm.nextGC);
 #endif
-}
\ No newline at end of file
+}
+
+void gcStep() {
+    gcStepDue = false;
+    gcStats.steps++;
+    double start = getTime();
+    if (gcSweeping) {
+        sweepObjects(GC_SWEEP_WORK);
+        if (gcSweeping) vm.nextGC = vm.bytesAllocated + GC_STEP_SIZE;
+        recordPause(start);
+        return;
+    }
+
+    if (!gcMarking) {
+#ifdef DEBUG_LOG_GC
+        printOutput("-- gc mark begin\n");
+#endif
+        markRoots();
+        gcMarking = true;
+        heapLimit = grownHeap(vm.nextGC);
+    }
+
+    for (int work = 0; work < GC_STEP_WORK && vm.grayCount > 0; work++) {
+        blackenObject(vm.grayStack[--vm.grayCount]);
+    }
+    gcStats.markSeconds += getTime() - start;
+
+    if (vm.grayCount == 0) {
+        finishMarking();
+    } else {
+        vm.nextGC = vm.bytesAllocated + GC_STEP_SIZE;
+    }
+    recordPause(start);
+}
@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "value.h"
+#include "object.h"
 
 // Growth factor MUST be a power of 2 for optimized lookups
 #define GROW_CAPACITY(capacity) \
@@ -20,11 +21,64 @@
 
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
+// For memory that came from allocateObject()
+#define FREE_OBJ(type, pointer) freeObjectMemory(pointer, sizeof(type))
+
+// Marking is incremental, while it is running anything stored into an object
+// that may already have been traced must be shaded or it would be freed
+#define WRITE_BARRIER(value) \
+    do { if (gcMarking) markValue(value); } while (false)
+
+// True between the start of a collection and its sweep
+extern _Thread_local bool gcMarking;
+// Set once allocation has run past vm.nextGC, the VM calls gcStep() at its
+// next safe point
+extern _Thread_local bool gcStepDue;
+
+// The heap grows to this many times what survived a collection before the
+// next one starts
+#define GC_HEAP_GROW_FACTOR 2
+
+// Pauses are bucketed by powers of 2 microseconds, bucket i counts those
+// under 2^i us and the last bucket everything longer
+#define GC_PAUSE_BUCKETS 20
+
+// Always collected, a couple of counters per allocation and a clock read per
+// pause, for the gc module
+typedef struct {
+    size_t collections;
+    // Incremental marking and sweeping steps, including the ones finishing a
+    // collection
+    size_t steps;
+    size_t bytesAllocated;
+    size_t bytesFreed;
+    // Live objects by ObjType
+    size_t objects[OBJ_TYPE_COUNT];
+    double markSeconds;
+    double sweepSeconds;
+    double longestPause;
+    size_t pauses[GC_PAUSE_BUCKETS];
+} GCStats;
+
+extern _Thread_local GCStats gcStats;
+// GC_HEAP_GROW_FACTOR unless a script tuned it
+extern _Thread_local double gcHeapGrowFactor;
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+void *allocateObjectMemory(size_t size);
+void freeObjectMemory(void *pointer, size_t size);
 void markValue(Value value);
 void markArray(ValueArray *array);
 void markObject(Obj* object);
+// Traces an already marked object again, for objects that change without
+// going through WRITE_BARRIER
+void rescanObject(Obj *object);
+// Puts a new object on vm.objects, ahead of a sweep that is under way
+void linkObject(Obj *object);
 void collectGarbage();
+// Frees whatever the last collection left to be swept
+void finishSweep();
+void gcStep();
 void freeObjects();
 void freeNodes();
 
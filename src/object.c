@@ -5,55 +5,123 @@
 #include "object.h"
 #include "value.h"
 #include "vm.h"
+#include "output.h"
 #include "libc/list.h"
 
+// A wyhash-style hash, which takes the string 16 bytes at a time and folds
+// each pair of words together with one wide multiplication
+#define HASH_SEED 0xa0761d6478bd642full
+#define HASH_MIX 0xe7037ed1a0b428dbull
+
+static inline void multiply128(uint64_t *a, uint64_t *b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t product = (__uint128_t) *a * *b;
+    *a = (uint64_t) product;
+    *b = (uint64_t) (product >> 64);
+#else
+    uint64_t aHigh = *a >> 32, aLow = (uint32_t) *a;
+    uint64_t bHigh = *b >> 32, bLow = (uint32_t) *b;
+    uint64_t high = aHigh * bHigh, middle = aHigh * bLow, middle2 = aLow * bHigh, low = aLow * bLow;
+    uint64_t carry = (middle & 0xffffffff) + (middle2 & 0xffffffff) + (low >> 32);
+    *a = (carry << 32) | (uint32_t) low;
+    *b = high + (middle >> 32) + (middle2 >> 32) + (carry >> 32);
+#endif
+}
+
+static inline uint64_t mix(uint64_t a, uint64_t b) {
+    multiply128(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t read64(const char *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t read32(const char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
 static uint32_t hashString(const char *key, int length) {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; i++) {
-        hash ^= (uint8_t) key[i];
-        hash *= 16777619;
+    uint64_t seed = HASH_SEED ^ mix(HASH_SEED ^ HASH_MIX, (uint64_t) length);
+    uint64_t a, b;
+    if (length <= 16) {
+        if (length >= 4) {
+            // Two overlapping reads from each end cover every byte
+            int middle = (length >> 3) << 2;
+            a = (read32(key) << 32) | read32(key + middle);
+            b = (read32(key + length - 4) << 32) | read32(key + length - 4 - middle);
+        } else if (length > 0) {
+            a = ((uint64_t) (uint8_t) key[0] << 16) | ((uint64_t) (uint8_t) key[length >> 1] << 8) |
+                (uint8_t) key[length - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        int remaining = length;
+        const char *p = key;
+        while (remaining > 16) {
+            seed = mix(read64(p) ^ HASH_MIX, read64(p + 8) ^ seed);
+            p += 16;
+            remaining -= 16;
+        }
+        a = read64(p + remaining - 16);
+        b = read64(p + remaining - 8);
     }
-    return hash;
+
+    a ^= HASH_MIX;
+    b ^= seed;
+    multiply128(&a, &b);
+    uint64_t hash = mix(a ^ HASH_SEED ^ (uint64_t) length, b ^ HASH_MIX);
+    return (uint32_t) (hash ^ (hash >> 32));
 }
 
 Obj *allocateObject(size_t size, ObjType type) {
-    Obj *object = (Obj *) reallocate(NULL, 0, size);
+    Obj *object = (Obj *) allocateObjectMemory(size);
     object->type = type;
     object->isMarked = false;
-    object->next = vm.objects;
-    vm.objects = object;
+    linkObject(object);
+    gcStats.objects[type]++;
 
 #ifdef DEBUG_LOG_GC
-    printf("%p allocate %zu for object %d\n", (void *) object, size, type);
+    printOutput("%p allocate %zu for object %d\n", (void *) object, size, type);
 #endif
 
     return object;
 }
 
-static ObjString *allocateString(char *chars, int length,
-                                 uint32_t hash) {
-    ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+// One allocation for the header and the characters after it
+static ObjString *newStringObject(const char *chars, int length, uint32_t hash, ObjType type) {
+    ObjString *string = (ObjString *) allocateObject(sizeof(ObjString) + length + 1, type);
     string->length = length;
-    string->chars = chars;
     string->hash = hash;
+    memcpy(string->chars, chars, length);
+    string->chars[length] = '\0';
+    return string;
+}
+
+static ObjString *allocateString(const char *chars, int length,
+                                 uint32_t hash) {
+    ObjString *string = newStringObject(chars, length, hash, OBJ_STRING);
 
     push(OBJ_VAL(string));
     tableSet(&vm.strings, string, NIL_VAL);
     pop();
 
 #ifdef DEBUG_LOG_GC
-    printf("%p allocate string %s\n", string, chars);
+    printOutput("%p allocate string %s\n", string, chars);
 #endif
 
     return string;
 }
 
-static ObjAtom *allocateAtom(char *chars, int length,
-                                 uint32_t hash) {
-    ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_ATOM);
-    string->length = length;
-    string->chars = chars;
-    string->hash = hash;
+static ObjAtom *allocateAtom(const char *chars, int length,
+                             uint32_t hash) {
+    ObjString *string = newStringObject(chars, length, hash, OBJ_ATOM);
 
     push(OBJ_VAL(string));
     tableSet(&vm.atoms, string, NIL_VAL);
@@ -68,10 +136,7 @@ ObjString *copyString(const char *chars, int length) {
                                           hash);
     if (interned != NULL) return interned;
 
-    char *heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-    return allocateString(heapChars, length, hash);
+    return allocateString(chars, length, hash);
 }
 
 ObjAtom *copyAtom(const char *chars, int length) {
@@ -80,11 +145,7 @@ ObjAtom *copyAtom(const char *chars, int length) {
                                           hash);
     if (interned != NULL) return interned;
 
-    char *heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-
-    return allocateAtom(heapChars, length, hash);
+    return allocateAtom(chars, length, hash);
 }
 
 ObjUpvalue *newUpvalue(Value *slot) {
@@ -97,11 +158,11 @@ ObjUpvalue *newUpvalue(Value *slot) {
 
 static void printFunction(ObjFunction *function) {
     if (function->name == NULL) {
-        printf("<script>");
+        printOutput("<script>");
         return;
     }
 
-    printf("<fn %s>", function->name->chars);
+    printOutput("<fn %s>", function->name->chars);
 }
 
 void printObject(Value value) {
@@ -110,44 +171,49 @@ void printObject(Value value) {
             printFunction(AS_FUNCTION(value));
             break;
         case OBJ_STRING:
-            printf("%s", AS_CSTRING(value));
+            writeOutput(AS_CSTRING(value), AS_STRING(value)->length);
             break;
         case OBJ_ATOM:
-            printf(":%s", AS_CSTRING(value));
+            writeOutput(":", 1);
+            writeOutput(AS_CSTRING(value), AS_STRING(value)->length);
+            break;
+        case OBJ_ROPE:
+            writeOutput(AS_ROPE(value)->buffer->chars, AS_ROPE(value)->length);
             break;
         case OBJ_NATIVE_METHOD:
-            printf("<native method>");
+            printOutput("<native method>");
             break;
         case OBJ_NATIVE:
-            printf("<native fn %p>", AS_NATIVE(value));
+            printOutput("<native fn %p>", AS_NATIVE(value));
             break;
         case OBJ_CALL_FRAME:
-            printf("<callframe %p>", AS_CALL_FRAME(value));
+            printOutput("<callframe %p>", AS_CALL_FRAME(value));
             break;
         case OBJ_CLOSURE:
             printFunction(AS_CLOSURE(value)->function);
             break;
         case OBJ_UPVALUE:
-            printf("upvalue");
+            printOutput("upvalue");
             break;
         case OBJ_BUILTIN_TYPE: {
             ObjClass *klass = AS_CLASS(value);
-            printf("<builtin type ");
-            printf(klass->name->chars, strlen(klass->name->chars));
-            printf(">");
+            printOutput("<builtin type ");
+            printOutput(klass->name->chars, strlen(klass->name->chars));
+            printOutput(">");
             break;
         }
         case OBJ_CLASS:
-            printf("<type %s>", AS_CLASS(value)->name->chars);
+            printOutput("<type %s>", AS_CLASS(value)->name->chars);
             break;
         case OBJ_LIST:
         case OBJ_MAP:
+        case OBJ_FLOAT64_ARRAY:
         case OBJ_INSTANCE: {
             ObjInstance *instance = AS_INSTANCE(value);
             ObjType objType = instance->klass->obj.type;
             switch (objType) {
                 case OBJ_CLASS: {
-                    printf("<%s instance>",
+                    printOutput("<%s instance>",
                            AS_INSTANCE(value)->klass->name->chars);
                     break;
                 }
@@ -170,41 +236,129 @@ void printObject(Value value) {
                     printFunction(boundMethod->method->function);
                     break;
                 case OBJ_NATIVE_METHOD:
-                    printf("<builtin method>");
+                    printOutput("<builtin method>");
                     break;
             }
             break;
         }
         default: {
-            printf("<unknown %d>", OBJ_TYPE(value));
+            printOutput("<unknown %d>", OBJ_TYPE(value));
         }
     }
 }
 
 ObjString *takeString(char *chars, int length) {
-    uint32_t hash = hashString(chars, length);
-    ObjString *interned = tableFindString(&vm.strings, chars, length,
-                                          hash);
-    if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
-        return interned;
+    ObjString *string = copyString(chars, length);
+    FREE_ARRAY(char, chars, length + 1);
+    return string;
+}
+
+static const char *textChars(Value value) {
+    return IS_ROPE(value) ? AS_ROPE(value)->buffer->chars : AS_CSTRING(value);
+}
+
+static int textLength(Value value) {
+    return IS_ROPE(value) ? AS_ROPE(value)->length : AS_STRING(value)->length;
+}
+
+static void reserveRopeBuffer(RopeBuffer *buffer, int length) {
+    if (length <= buffer->capacity) return;
+    int capacity = buffer->capacity;
+    while (capacity < length) capacity = GROW_CAPACITY(capacity);
+    buffer->chars = GROW_ARRAY(char, buffer->chars, buffer->capacity, capacity);
+    buffer->capacity = capacity;
+}
+
+Value concatenateText(Value a, Value b) {
+    int aLength = textLength(a);
+    int bLength = textLength(b);
+    int length = aLength + bLength;
+
+    if (length < ROPE_MIN_LENGTH) {
+        char chars[ROPE_MIN_LENGTH];
+        memcpy(chars, textChars(a), aLength);
+        memcpy(chars + aLength, textChars(b), bLength);
+        return OBJ_VAL(copyString(chars, length));
     }
-    return allocateString(chars, length, hash);
+
+    RopeBuffer *buffer;
+    if (IS_ROPE(a) && AS_ROPE(a)->length == AS_ROPE(a)->buffer->length) {
+        // Nothing has been appended after a yet, so its buffer can be reused
+        buffer = AS_ROPE(a)->buffer;
+        reserveRopeBuffer(buffer, length);
+    } else {
+        buffer = ALLOCATE(RopeBuffer, 1);
+        buffer->refs = 0;
+        buffer->length = 0;
+        buffer->capacity = 0;
+        buffer->chars = NULL;
+        reserveRopeBuffer(buffer, length * 2);
+        memcpy(buffer->chars, textChars(a), aLength);
+    }
+    // b may be a rope on the same buffer, so copied after any move
+    memmove(buffer->chars + aLength, textChars(b), bLength);
+    buffer->length = length;
+    buffer->refs++;
+
+    ObjRope *rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+    rope->length = length;
+    rope->buffer = buffer;
+    rope->hash = 0;
+    rope->flat = NULL;
+    return OBJ_VAL(rope);
+}
+
+ObjString *flattenRope(ObjRope *rope) {
+    if (rope->flat == NULL) {
+        rope->flat = copyString(rope->buffer->chars, rope->length);
+        WRITE_BARRIER(OBJ_VAL(rope->flat));
+    }
+    return rope->flat;
+}
+
+uint32_t hashRope(ObjRope *rope) {
+    if (rope->hash == 0) rope->hash = hashString(rope->buffer->chars, rope->length);
+    return rope->hash;
+}
+
+bool textEqual(Value a, Value b) {
+    if (!(IS_ROPE(a) || IS_ROPE(b)) || !IS_TEXT(a) || !IS_TEXT(b)) return false;
+    int length = textLength(a);
+    return length == textLength(b) && memcmp(textChars(a), textChars(b), length) == 0;
 }
 
 ObjFunction *newFunction() {
     ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
+    function->maxSlots = 0;
     function->name = NULL;
+    function->module = NULL;
+    function->hotness = 0;
+    function->jit = NULL;
     initChunk(&function->chunk);
     return function;
 }
 
-ObjInstance *newInstance(ObjClass *klass) {
-    ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+// For instances without declared fields, including the builtin types that
+// embed ObjInstance
+void initInstance(ObjInstance *instance, ObjClass *klass) {
     instance->klass = klass;
-    copyTable(&klass->fields, &instance->fields);
+    initTable(&instance->fields);
+    instance->slotCount = 0;
+    instance->slots = NULL;
+}
+
+ObjInstance *newInstance(ObjClass *klass) {
+    int slotCount = klass->defaults.count;
+    ObjInstance *instance = (ObjInstance *) allocateObject(
+            sizeof(ObjInstance) + sizeof(Value) * slotCount, OBJ_INSTANCE);
+    initInstance(instance, klass);
+    instance->slotCount = slotCount;
+    instance->slots = (Value *) (instance + 1);
+    for (int i = 0; i < slotCount; i++) {
+        instance->slots[i] = klass->defaults.values[i];
+    }
 
     return instance;
 }
@@ -242,6 +396,16 @@ ObjClass *newClass(ObjString *name) {
     ObjClass *klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     klass->name = name;
     initTable(&klass->methods);
-    initTable(&klass->fields);
+    initTable(&klass->layout);
+    initValueArray(&klass->defaults);
+    touchClass(klass);
     return klass;
+}
+
+// Versions are handed out from one counter so a class freed and another
+// allocated in its place can't match a stale cache
+static _Thread_local uint32_t nextClassVersion = 1;
+
+void touchClass(ObjClass *klass) {
+    klass->version = nextClassVersion++;
 }
\ No newline at end of file
@@ -9,6 +9,9 @@
 #define OBJ_TYPE(value)        (AS_OBJ(value)->type)
 
 #define IS_STRING(value)       isObjType(value, OBJ_STRING)
+#define IS_ROPE(value)         isObjType(value, OBJ_ROPE)
+// Anything + concatenates
+#define IS_TEXT(value)         (IS_STRING(value) || IS_ROPE(value))
 #define IS_FUNCTION(value)     isObjType(value, OBJ_FUNCTION)
 #define IS_CLOSURE(value)      isObjType(value, OBJ_CLOSURE)
 #define IS_NATIVE(value)       isObjType(value, OBJ_NATIVE)
@@ -18,6 +21,7 @@
 
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)      (((ObjString*)AS_OBJ(value))->chars)
+#define AS_ROPE(value)         ((ObjRope*)AS_OBJ(value))
 #define AS_FUNCTION(value)     ((ObjFunction*)AS_OBJ(value))
 #define AS_NATIVE(value)       (((ObjNative*)AS_OBJ(value))->function)
 #define AS_CLOSURE(value)      ((ObjClosure*)AS_OBJ(value))
@@ -32,6 +36,7 @@
 typedef enum {
     OBJ_STRING,
     OBJ_ATOM,
+    OBJ_ROPE,
     OBJ_FUNCTION,
     OBJ_NATIVE,
     OBJ_NATIVE_METHOD,
@@ -48,23 +53,33 @@ typedef enum {
     OBJ_INSTANCE,
     OBJ_LIST,
     OBJ_MAP,
+    OBJ_FLOAT64_ARRAY,
     OBJ_BOUND_METHOD,
     OBJ_CALL_FRAME,
     OBJ_MODULE,
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_MODULE + 1)
+
 struct Obj {
     ObjType type;
     bool isMarked;
     struct Obj *next;
 };
 
-typedef struct {
+typedef struct ObjFunction {
     Obj obj;
     int arity;
     int upvalueCount;
+    // The most locals it has in scope at once, frames need room for them
+    int maxSlots;
     Chunk chunk;
     ObjString *name;
+    // Where the function's global slots live
+    struct ObjModule *module;
+    // Calls and loop iterations so far, it is compiled at JIT_THRESHOLD
+    int hotness;
+    struct JitCode *jit;
 } ObjFunction;
 
 typedef Value (*NativeFn)(int argCount, Value *args);
@@ -74,16 +89,38 @@ typedef struct {
     NativeFn function;
 } ObjNative;
 
+// The characters live in the same allocation, just past the header
 struct ObjString {
     Obj obj;
     int length;
-    char *chars;
     uint32_t hash;
+    char chars[];
 };
 
+typedef ObjString ObjAtom;
+
+// Concatenations shorter than this are interned straight away
+#define ROPE_MIN_LENGTH 64
+
+// Text shared by every rope that was appended to it, freed with the last one
 typedef struct {
-    ObjString obj;
-} ObjAtom;
+    int refs;
+    int length;
+    int capacity;
+    char *chars;
+} RopeBuffer;
+
+// The result of a long concatenation, kept out of vm.strings until a native
+// needs it as a string. A rope that still ends where its buffer does is
+// appended to in place, so building a string in a loop is linear.
+typedef struct {
+    Obj obj;
+    int length;
+    RopeBuffer *buffer;
+    uint32_t hash;
+    // The interned copy once flattenRope() has made one
+    ObjString *flat;
+} ObjRope;
 
 typedef struct ObjUpvalue {
     Obj obj;
@@ -103,13 +140,21 @@ typedef struct {
     Obj obj;
     ObjString *name;
     Table methods;
-    Table fields;
+    // Declared fields: name to slot index, and each slot's initial value
+    Table layout;
+    ValueArray defaults;
+    // Changes whenever methods or layout do, inline caches compare against it
+    uint32_t version;
 } ObjClass;
 
 typedef struct {
     Obj obj;
     ObjClass *klass;
+    // Only fields added at runtime, declared ones live in slots
     Table fields;
+    int slotCount;
+    // Points just past the instance, where its slots are allocated
+    Value *slots;
 } ObjInstance;
 
 typedef struct {
@@ -131,6 +176,10 @@ ObjNative *newNative(NativeFn function);
 
 ObjClass *newClass(ObjString *name);
 
+void initInstance(ObjInstance *instance, ObjClass *klass);
+
+void touchClass(ObjClass *klass);
+
 static inline bool isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
@@ -142,8 +191,21 @@ ObjUpvalue *newUpvalue(Value *slot);
 
 void printObject(Value value);
 
+// Like copyString(), but frees chars, which was allocated with length + 1
 ObjString *takeString(char *chars, int length);
 
+// Concatenates two strings or ropes, only interning the result if it's short
+Value concatenateText(Value a, Value b);
+
+ObjString *flattenRope(ObjRope *rope);
+
+// Same hash the rope's flattened string would have
+uint32_t hashRope(ObjRope *rope);
+
+// Compares by contents when a rope is involved, interned strings are only
+// ever equal to themselves
+bool textEqual(Value a, Value b);
+
 Obj *allocateObject(size_t size, ObjType type);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,185 @@
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "output.h"
+
+#define OUTPUT_CAPACITY (64 * 1024)
+
+_Thread_local OutputBuffer output;
+
+// Pipes, sockets and terminals can fill up, files and the like never do
+static _Thread_local bool canFill = false;
+
+static pthread_once_t flushAtExit = PTHREAD_ONCE_INIT;
+
+static void registerFlush() {
+    // exit() from anywhere still writes what the thread calling it printed,
+    // other threads' VMs write theirs in freeOutput()
+    atexit(flushOutput);
+}
+
+void initOutput() {
+    output.chars = malloc(OUTPUT_CAPACITY);
+    if (output.chars == NULL) exit(1);
+    output.start = 0;
+    output.length = 0;
+    output.capacity = OUTPUT_CAPACITY;
+    output.interactive = isatty(STDOUT_FILENO);
+    output.deferred = false;
+
+    struct stat info;
+    canFill = output.interactive ||
+              (fstat(STDOUT_FILENO, &info) == 0 && (S_ISFIFO(info.st_mode) || S_ISSOCK(info.st_mode)));
+
+    pthread_once(&flushAtExit, registerFlush);
+}
+
+void freeOutput() {
+    flushOutput();
+    free(output.chars);
+    output.chars = NULL;
+    output.capacity = 0;
+}
+
+static void resetOutput() {
+    output.start = 0;
+    output.length = 0;
+    output.deferred = false;
+}
+
+// Writes every part, waiting whenever stdout is full. Output to a stdout
+// that has gone away is dropped.
+static void writeAll(struct iovec *parts, int count) {
+    while (count > 0) {
+        ssize_t written = writev(STDOUT_FILENO, parts, count);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) {
+                struct pollfd ready = {STDOUT_FILENO, POLLOUT, 0};
+                poll(&ready, 1, -1);
+                continue;
+            }
+            return;
+        }
+
+        while (count > 0 && (size_t) written >= parts->iov_len) {
+            written -= (ssize_t) parts->iov_len;
+            parts++;
+            count--;
+        }
+        if (count > 0) {
+            parts->iov_base = (char *) parts->iov_base + written;
+            parts->iov_len -= written;
+        }
+    }
+}
+
+void flushOutput() {
+    if (!outputPending()) return;
+
+    struct iovec pending = {output.chars + output.start, output.length - output.start};
+    writeAll(&pending, 1);
+    resetOutput();
+}
+
+void writeOutput(const char *chars, size_t length) {
+    if (output.length + length > output.capacity && output.start > 0) {
+        memmove(output.chars, output.chars + output.start, output.length - output.start);
+        output.length -= output.start;
+        output.start = 0;
+    }
+
+    if (output.length + length > output.capacity) {
+        if (output.deferred) {
+            // Parked tasks are waiting on what's here, so hold on to more
+            while (output.length + length > output.capacity) output.capacity *= 2;
+            output.chars = realloc(output.chars, output.capacity);
+            if (output.chars == NULL) exit(1);
+        } else if (length >= output.capacity / 2) {
+            // Too big to be worth copying, it goes out with what's buffered
+            // in one write
+            struct iovec parts[] = {
+                    {output.chars, output.length},
+                    {(char *) chars, length},
+            };
+            writeAll(parts, 2);
+            resetOutput();
+            return;
+        } else {
+            flushOutput();
+        }
+    }
+
+    memcpy(output.chars + output.length, chars, length);
+    output.length += length;
+}
+
+void printOutput(const char *format, ...) {
+    if (strchr(format, '%') == NULL) {
+        writeOutput(format, strlen(format));
+        return;
+    }
+
+    char chars[256];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(chars, sizeof(chars), format, args);
+    va_end(args);
+    if (length < 0) return;
+
+    if ((size_t) length < sizeof(chars)) {
+        writeOutput(chars, length);
+        return;
+    }
+
+    char *large = malloc(length + 1);
+    if (large == NULL) exit(1);
+    va_start(args, format);
+    vsnprintf(large, length + 1, format, args);
+    va_end(args);
+    writeOutput(large, length);
+    free(large);
+}
+
+bool drainOutput() {
+    if (!canFill) {
+        flushOutput();
+        return true;
+    }
+
+    while (outputPending()) {
+        struct pollfd ready = {STDOUT_FILENO, POLLOUT, 0};
+        if (poll(&ready, 1, 0) <= 0) break;
+        if (ready.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+            // Nothing will read it any more
+            resetOutput();
+            break;
+        }
+
+        // A pipe that polls writable has room for PIPE_BUF bytes, so a write
+        // of at most that many can't block
+        size_t count = output.length - output.start;
+        if (count > PIPE_BUF) count = PIPE_BUF;
+        ssize_t written = write(STDOUT_FILENO, output.chars + output.start, count);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) break;
+            resetOutput();
+            break;
+        }
+        output.start += written;
+    }
+
+    if (outputPending()) return false;
+    resetOutput();
+    return true;
+}
@@ -0,0 +1,47 @@
+#ifndef SAFFRON_OUTPUT_H
+#define SAFFRON_OUTPUT_H
+
+#include <stddef.h>
+
+#include "common.h"
+
+// Everything the VM prints to standard output is collected here and written
+// a buffer at a time. On a terminal each line is written as it ends, and
+// anything left is written at exit.
+typedef struct {
+    char *chars;
+    // Bytes [start, length) are waiting to be written
+    size_t start;
+    size_t length;
+    size_t capacity;
+    bool interactive;
+    // Set while tasks are parked waiting for stdout to drain, the buffer
+    // grows instead of blocking until then
+    bool deferred;
+} OutputBuffer;
+
+extern _Thread_local OutputBuffer output;
+
+// Buffered bytes past which a print tries to write them out
+#define OUTPUT_HIGH_WATER (32 * 1024)
+
+void initOutput();
+
+// Writes what's left and frees the buffer
+void freeOutput();
+
+void writeOutput(const char *chars, size_t length);
+
+void printOutput(const char *format, ...);
+
+// Writes what stdout takes without blocking, true once nothing is left
+bool drainOutput();
+
+// Writes everything, blocking until stdout has taken it
+void flushOutput();
+
+static inline bool outputPending() {
+    return output.length > output.start;
+}
+
+#endif //SAFFRON_OUTPUT_H
@@ -0,0 +1,320 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "peephole.h"
+#include "object.h"
+
+// The longest sequence a pattern looks at
+#define LOOKAHEAD 5
+
+typedef struct {
+    Chunk *chunk;
+    // Per original offset: how many jumps land there, where the instruction
+    // before it starts, whether it was dropped and where it ended up
+    int *targets;
+    int *previous;
+    bool *dropped;
+    int *moved;
+    // The rewritten code, which is never longer than the original
+    uint8_t *code;
+    int count;
+    // Jumps in the rewritten code and the original offset each goes to
+    int *jumpAt;
+    int *jumpTo;
+    int jumpCount;
+} Peephole;
+
+static bool isJump(uint8_t op) {
+    switch (op) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_JUMP_UNLESS_EQUAL:
+        case OP_JUMP_UNLESS_NOT_EQUAL:
+        case OP_JUMP_UNLESS_GREATER:
+        case OP_JUMP_UNLESS_GREATER_EQUAL:
+        case OP_JUMP_UNLESS_LESS:
+        case OP_JUMP_UNLESS_LESS_EQUAL:
+        case OP_LOOP:
+        case OP_ITER_NEXT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static int jumpTarget(Chunk *chunk, int offset) {
+    int distance = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    return chunk->code[offset] == OP_LOOP ? offset + 3 - distance : offset + 3 + distance;
+}
+
+// The compare-and-jump instruction for a comparison, -1 if there is none
+static int compareJump(uint8_t op) {
+    switch (op) {
+        case OP_EQUAL: return OP_JUMP_UNLESS_EQUAL;
+        case OP_NOT_EQUAL: return OP_JUMP_UNLESS_NOT_EQUAL;
+        case OP_GREATER:
+        case OP_GREATER_NUM: return OP_JUMP_UNLESS_GREATER;
+        case OP_GREATER_EQUAL: return OP_JUMP_UNLESS_GREATER_EQUAL;
+        case OP_LESS:
+        case OP_LESS_NUM: return OP_JUMP_UNLESS_LESS;
+        case OP_LESS_EQUAL: return OP_JUMP_UNLESS_LESS_EQUAL;
+        default: return -1;
+    }
+}
+
+// The negation of a comparison, -1 if there is no instruction for it
+static int negatedCompare(uint8_t op) {
+    switch (op) {
+        case OP_EQUAL: return OP_NOT_EQUAL;
+        case OP_LESS:
+        case OP_LESS_NUM: return OP_GREATER_EQUAL;
+        case OP_GREATER:
+        case OP_GREATER_NUM: return OP_LESS_EQUAL;
+        default: return -1;
+    }
+}
+
+static bool isAddOrSubtract(uint8_t op) {
+    return op == OP_ADD || op == OP_ADD_NUM || op == OP_SUBTRACT || op == OP_SUBTRACT_NUM;
+}
+
+// The three-address form of an arithmetic instruction, -1 if it has none
+static int localsArithmetic(uint8_t op) {
+    switch (op) {
+        case OP_ADD:
+        case OP_ADD_NUM: return OP_ADD_LOCALS;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_NUM: return OP_SUBTRACT_LOCALS;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NUM: return OP_MULTIPLY_LOCALS;
+        case OP_DIVIDE:
+        case OP_DIVIDE_NUM: return OP_DIVIDE_LOCALS;
+        default: return -1;
+    }
+}
+
+static void emit(Peephole *peephole, uint8_t byte) {
+    peephole->code[peephole->count++] = byte;
+}
+
+static void emitJump(Peephole *peephole, uint8_t op, int target) {
+    peephole->jumpAt[peephole->jumpCount] = peephole->count;
+    peephole->jumpTo[peephole->jumpCount++] = target;
+    emit(peephole, op);
+    emit(peephole, 0xff);
+    emit(peephole, 0xff);
+}
+
+// A conditional jump whose condition is popped on both sides goes to the
+// instruction after the POP at its target instead. Nothing else reaches that
+// POP if no other jump lands on it and the code before it never falls through.
+static int skipTargetPop(Peephole *peephole, int target) {
+    Chunk *chunk = peephole->chunk;
+    peephole->targets[target]--;
+    peephole->targets[target + 1]++;
+
+    uint8_t before = chunk->code[peephole->previous[target]];
+    if (peephole->targets[target] == 0 &&
+        (before == OP_JUMP || before == OP_LOOP || before == OP_RETURN)) {
+        peephole->dropped[target] = true;
+    }
+    return target + 1;
+}
+
+// Offsets of the instruction at offset and those following it, -1 past the
+// end of the chunk
+static void lookAhead(Chunk *chunk, int offset, int next[LOOKAHEAD]) {
+    for (int i = 0; i < LOOKAHEAD; i++) {
+        next[i] = offset < chunk->count ? offset : -1;
+        if (offset < chunk->count) offset += instructionLength(chunk, offset);
+    }
+}
+
+// How many instructions from offset fuse into one, 0 if no pattern matches.
+// Instructions after the first must not be jump targets.
+static int fuse(Peephole *peephole, int offset) {
+    Chunk *chunk = peephole->chunk;
+    uint8_t *code = chunk->code;
+    int next[LOOKAHEAD];
+    lookAhead(chunk, offset, next);
+
+    uint8_t ops[LOOKAHEAD];
+    for (int i = 0; i < LOOKAHEAD; i++) ops[i] = next[i] == -1 ? 0xff : code[next[i]];
+    int plain = 1;
+    while (plain < LOOKAHEAD && next[plain] != -1 && peephole->targets[next[plain]] == 0) plain++;
+#define MATCHES(count) (plain >= (count))
+
+    // Conditions leave their value on the stack for a POP on either side
+    if (MATCHES(3) && compareJump(ops[0]) != -1 &&
+        ops[1] == OP_JUMP_IF_FALSE && ops[2] == OP_POP) {
+        int target = jumpTarget(chunk, next[1]);
+        if (target < chunk->count && code[target] == OP_POP) {
+            emitJump(peephole, compareJump(ops[0]), skipTargetPop(peephole, target));
+            return 3;
+        }
+    }
+    if (MATCHES(2) && ops[0] == OP_JUMP_IF_FALSE && ops[1] == OP_POP) {
+        int target = jumpTarget(chunk, next[0]);
+        if (target < chunk->count && code[target] == OP_POP) {
+            emitJump(peephole, OP_POP_JUMP_IF_FALSE, skipTargetPop(peephole, target));
+            return 2;
+        }
+    }
+
+    if (MATCHES(2) && ops[1] == OP_NOT && negatedCompare(ops[0]) != -1) {
+        emit(peephole, negatedCompare(ops[0]));
+        return 2;
+    }
+
+    // i++ and i-- on a local, with the new value kept unless it's popped
+    if (MATCHES(4) && ops[0] == OP_GET_LOCAL && ops[1] == OP_CONSTANT &&
+        isAddOrSubtract(ops[2]) && ops[3] == OP_SET_LOCAL &&
+        code[next[0] + 1] == code[next[3] + 1] &&
+        IS_NUMBER(chunk->constants.values[code[next[1] + 1]])) {
+        uint8_t slot = code[next[0] + 1];
+        bool add = ops[2] == OP_ADD || ops[2] == OP_ADD_NUM;
+        emit(peephole, add ? OP_IN_PLACE_ADD : OP_IN_PLACE_SUBTRACT);
+        emit(peephole, slot);
+        emit(peephole, code[next[1] + 1]);
+        if (MATCHES(5) && ops[4] == OP_POP) return 5;
+
+        emit(peephole, OP_GET_LOCAL);
+        emit(peephole, slot);
+        return 4;
+    }
+
+    // a = b op c between locals, again keeping the value unless it's popped
+    if (MATCHES(4) && ops[0] == OP_GET_LOCAL && ops[1] == OP_GET_LOCAL &&
+        localsArithmetic(ops[2]) != -1 && ops[3] == OP_SET_LOCAL) {
+        uint8_t slot = code[next[3] + 1];
+        emit(peephole, localsArithmetic(ops[2]));
+        emit(peephole, slot);
+        emit(peephole, code[next[0] + 1]);
+        emit(peephole, code[next[1] + 1]);
+        if (MATCHES(5) && ops[4] == OP_POP) return 5;
+
+        emit(peephole, OP_GET_LOCAL);
+        emit(peephole, slot);
+        return 4;
+    }
+
+    if (MATCHES(2) && ops[0] == OP_GET_LOCAL && ops[1] == OP_GET_PROPERTY) {
+        emit(peephole, OP_GET_LOCAL_PROPERTY);
+        emit(peephole, code[next[0] + 1]);
+        for (int i = 1; i < 5; i++) emit(peephole, code[next[1] + i]);
+        return 2;
+    }
+#undef MATCHES
+
+    return 0;
+}
+
+static void patchJumps(Peephole *peephole) {
+    for (int i = 0; i < peephole->jumpCount; i++) {
+        int at = peephole->jumpAt[i];
+        int target = peephole->moved[peephole->jumpTo[i]];
+        int distance = peephole->code[at] == OP_LOOP ? at + 3 - target : target - at - 3;
+        peephole->code[at + 1] = (distance >> 8) & 0xff;
+        peephole->code[at + 2] = distance & 0xff;
+    }
+}
+
+// Line starts follow their instructions, a fused instruction keeps the line
+// of its first part
+static void moveLines(Peephole *peephole) {
+    Chunk *chunk = peephole->chunk;
+    int lineCount = 0;
+    for (int i = 0; i < chunk->lineCount; i++) {
+        LineStart start = {peephole->moved[chunk->lines[i].offset], chunk->lines[i].line};
+        if (lineCount > 0 && chunk->lines[lineCount - 1].offset == start.offset) continue;
+        if (lineCount > 0 && chunk->lines[lineCount - 1].line == start.line) continue;
+        chunk->lines[lineCount++] = start;
+    }
+    chunk->lineCount = lineCount;
+}
+
+// Try blocks follow their code like line starts do
+static void moveHandlers(Peephole *peephole) {
+    Chunk *chunk = peephole->chunk;
+    for (int i = 0; i < chunk->handlerCount; i++) {
+        ExceptionHandler *handler = &chunk->handlers[i];
+        handler->start = peephole->moved[handler->start];
+        handler->end = peephole->moved[handler->end];
+        handler->handler = peephole->moved[handler->handler];
+    }
+}
+
+void optimizeChunk(Chunk *chunk) {
+    if (chunk->count == 0) return;
+
+    Peephole peephole;
+    peephole.chunk = chunk;
+    peephole.targets = calloc(chunk->count + 1, sizeof(int));
+    peephole.previous = calloc(chunk->count + 1, sizeof(int));
+    peephole.dropped = calloc(chunk->count + 1, sizeof(bool));
+    peephole.moved = calloc(chunk->count + 1, sizeof(int));
+    peephole.code = malloc(chunk->count);
+    peephole.count = 0;
+    peephole.jumpAt = malloc(sizeof(int) * chunk->count);
+    peephole.jumpTo = malloc(sizeof(int) * chunk->count);
+    peephole.jumpCount = 0;
+
+    int last = 0;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        peephole.previous[offset] = last;
+        last = offset;
+        if (isJump(chunk->code[offset])) peephole.targets[jumpTarget(chunk, offset)]++;
+    }
+    // Nothing fuses across the edges of a try block, and catch blocks are
+    // never dropped as unreachable
+    for (int i = 0; i < chunk->handlerCount; i++) {
+        peephole.targets[chunk->handlers[i].start]++;
+        peephole.targets[chunk->handlers[i].end]++;
+        peephole.targets[chunk->handlers[i].handler]++;
+    }
+
+    for (int offset = 0; offset < chunk->count;) {
+        peephole.moved[offset] = peephole.count;
+        if (peephole.dropped[offset]) {
+            offset += instructionLength(chunk, offset);
+            continue;
+        }
+
+        int fused = fuse(&peephole, offset);
+        if (fused > 0) {
+            // Instructions folded into this one map to its start
+            int start = peephole.moved[offset];
+            for (int i = 0; i < fused; i++) {
+                peephole.moved[offset] = start;
+                offset += instructionLength(chunk, offset);
+            }
+            continue;
+        }
+
+        int length = instructionLength(chunk, offset);
+        if (isJump(chunk->code[offset])) {
+            emitJump(&peephole, chunk->code[offset], jumpTarget(chunk, offset));
+            // Operands after the distance, the slot of OP_ITER_NEXT
+            for (int i = 3; i < length; i++) emit(&peephole, chunk->code[offset + i]);
+        } else {
+            for (int i = 0; i < length; i++) emit(&peephole, chunk->code[offset + i]);
+        }
+        offset += length;
+    }
+    peephole.moved[chunk->count] = peephole.count;
+
+    patchJumps(&peephole);
+    moveLines(&peephole);
+    moveHandlers(&peephole);
+    memcpy(chunk->code, peephole.code, peephole.count);
+    chunk->count = peephole.count;
+
+    free(peephole.targets);
+    free(peephole.previous);
+    free(peephole.dropped);
+    free(peephole.moved);
+    free(peephole.code);
+    free(peephole.jumpAt);
+    free(peephole.jumpTo);
+}
@@ -0,0 +1,10 @@
+#ifndef SAFFRON_PEEPHOLE_H
+#define SAFFRON_PEEPHOLE_H
+
+#include "chunk.h"
+
+// Rewrites common instruction sequences in a finished chunk into fused
+// instructions, fixing up jumps and line numbers to match
+void optimizeChunk(Chunk *chunk);
+
+#endif //SAFFRON_PEEPHOLE_H
@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "profiler.h"
+#include "vm.h"
+
+// How many of the hottest lines and functions the summary lists
+#define PROFILE_SUMMARY_ROWS 10
+
+volatile sig_atomic_t profileSampleDue = 0;
+
+// Samples counted by a key: a whole stack, a line or a function
+typedef struct {
+    char *key;
+    uint32_t hash;
+    long count;
+} ProfileCount;
+
+typedef struct {
+    ProfileCount *entries;
+    int count;
+    int capacity;
+} ProfileCounts;
+
+typedef struct {
+    const char *path;
+    bool running;
+    long samples;
+    ProfileCounts stacks;
+    ProfileCounts lines;
+    ProfileCounts functions;
+    // The folded stack of the sample being taken
+    char *stack;
+    size_t stackCapacity;
+} Profiler;
+
+// Lives outside the VM's heap, a profile shouldn't change when the GC runs.
+// There's one per process, for the VM of the thread that started it.
+static Profiler profiler;
+
+static _Thread_local bool ownsProfiler = false;
+
+static uint32_t hashKey(const char *key) {
+    uint32_t hash = 2166136261u;
+    for (; *key != '\0'; key++) {
+        hash ^= (uint8_t) *key;
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static void insertCount(ProfileCounts *counts, ProfileCount entry) {
+    uint32_t index = entry.hash & (counts->capacity - 1);
+    while (counts->entries[index].key != NULL) {
+        index = (index + 1) & (counts->capacity - 1);
+    }
+    counts->entries[index] = entry;
+}
+
+static void countKey(ProfileCounts *counts, const char *key) {
+    if (counts->count + 1 > counts->capacity / 2) {
+        ProfileCounts grown = {NULL, counts->count, counts->capacity < 64 ? 64 : counts->capacity * 2};
+        grown.entries = calloc(grown.capacity, sizeof(ProfileCount));
+        if (grown.entries == NULL) exit(1);
+        for (int i = 0; i < counts->capacity; i++) {
+            if (counts->entries[i].key != NULL) insertCount(&grown, counts->entries[i]);
+        }
+        free(counts->entries);
+        *counts = grown;
+    }
+
+    uint32_t hash = hashKey(key);
+    uint32_t index = hash & (counts->capacity - 1);
+    for (;;) {
+        ProfileCount *entry = &counts->entries[index];
+        if (entry->key == NULL) {
+            entry->key = strdup(key);
+            if (entry->key == NULL) exit(1);
+            entry->hash = hash;
+            entry->count = 1;
+            counts->count++;
+            return;
+        }
+        if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+            entry->count++;
+            return;
+        }
+        index = (index + 1) & (counts->capacity - 1);
+    }
+}
+
+static void freeCounts(ProfileCounts *counts) {
+    for (int i = 0; i < counts->capacity; i++) {
+        free(counts->entries[i].key);
+    }
+    free(counts->entries);
+    counts->entries = NULL;
+    counts->count = 0;
+    counts->capacity = 0;
+}
+
+// "name (path:line)", the line being the one frame is executing
+static void describeFrame(CallFrame *frame, char *label, size_t size, bool withLine) {
+    ObjFunction *function = frame->closure->function;
+    const char *name = function->name == NULL ? "<script>" : function->name->chars;
+    ObjModule *module = function->module;
+    const char *path = module != NULL && module->path != NULL ? module->path->chars : "?";
+    if (!withLine) {
+        snprintf(label, size, "%s (%s)", name, path);
+        return;
+    }
+
+    int instruction = (int) (frame->ip - function->chunk.code - 1);
+    snprintf(label, size, "%s (%s:%d)", name, path, getLine(&function->chunk, instruction));
+}
+
+static void appendFrame(size_t *length, const char *label) {
+    size_t labelLength = strlen(label);
+    size_t needed = *length + labelLength + 2;
+    if (needed > profiler.stackCapacity) {
+        profiler.stackCapacity = needed * 2;
+        profiler.stack = realloc(profiler.stack, profiler.stackCapacity);
+        if (profiler.stack == NULL) exit(1);
+    }
+
+    if (*length > 0) profiler.stack[(*length)++] = ';';
+    memcpy(profiler.stack + *length, label, labelLength + 1);
+    *length += labelLength;
+}
+
+static void onProfileSignal(int signal) {
+    (void) signal;
+    profileSampleDue = 1;
+}
+
+static bool setProfileTimer(int hz) {
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    if (hz > 0) {
+        timer.it_interval.tv_usec = 1000000 / hz;
+        timer.it_value = timer.it_interval;
+    }
+    return setitimer(ITIMER_PROF, &timer, NULL) == 0;
+}
+
+bool startProfiler(const char *path, int hz) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onProfileSignal;
+    // Reads and writes carry on rather than failing with EINTR
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL) != 0) return false;
+
+    profiler.path = path;
+    profiler.running = true;
+    ownsProfiler = true;
+    profiler.samples = 0;
+    if (!setProfileTimer(hz)) {
+        profiler.running = false;
+        ownsProfiler = false;
+        return false;
+    }
+    return true;
+}
+
+void takeProfileSample() {
+    // Other threads' VMs leave the sample to the one being profiled
+    if (!ownsProfiler) return;
+    profileSampleDue = 0;
+    if (!profiler.running || CURRENT_TASK == NULL) return;
+
+    // Stacks run from the task's first frame, so each spawned task is a
+    // root of its own
+    ObjCallFrame *task = CURRENT_TASK;
+    if (task->frameCount == 0) return;
+
+    char label[512];
+    size_t length = 0;
+    for (int i = 0; i < task->frameCount; i++) {
+        describeFrame(&task->frames[i], label, sizeof(label), true);
+        appendFrame(&length, label);
+    }
+    countKey(&profiler.stacks, profiler.stack);
+    countKey(&profiler.lines, label);
+
+    describeFrame(&task->frames[task->frameCount - 1], label, sizeof(label), false);
+    countKey(&profiler.functions, label);
+    profiler.samples++;
+}
+
+static int compareCounts(const void *a, const void *b) {
+    long left = ((const ProfileCount *) a)->count;
+    long right = ((const ProfileCount *) b)->count;
+    return (left < right) - (left > right);
+}
+
+static void printHottest(const char *title, ProfileCounts *counts) {
+    ProfileCount *sorted = malloc(sizeof(ProfileCount) * (counts->count + 1));
+    if (sorted == NULL) return;
+
+    int count = 0;
+    for (int i = 0; i < counts->capacity; i++) {
+        if (counts->entries[i].key != NULL) sorted[count++] = counts->entries[i];
+    }
+    qsort(sorted, count, sizeof(ProfileCount), compareCounts);
+
+    fprintf(stderr, "Hottest %s:\n", title);
+    for (int i = 0; i < count && i < PROFILE_SUMMARY_ROWS; i++) {
+        fprintf(stderr, "  %5.1f%% %8ld  %s\n",
+                100.0 * (double) sorted[i].count / (double) profiler.samples, sorted[i].count, sorted[i].key);
+    }
+    free(sorted);
+}
+
+void stopProfiler() {
+    if (!ownsProfiler) return;
+    setProfileTimer(0);
+    profiler.running = false;
+    ownsProfiler = false;
+    profileSampleDue = 0;
+
+    FILE *file = fopen(profiler.path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not write profile to \"%s\".\n", profiler.path);
+    } else {
+        for (int i = 0; i < profiler.stacks.capacity; i++) {
+            ProfileCount *entry = &profiler.stacks.entries[i];
+            if (entry->key != NULL) fprintf(file, "%s %ld\n", entry->key, entry->count);
+        }
+        fclose(file);
+        fprintf(stderr, "Profile: %ld samples written to %s\n", profiler.samples, profiler.path);
+    }
+
+    if (profiler.samples > 0) {
+        printHottest("lines", &profiler.lines);
+        printHottest("functions", &profiler.functions);
+    }
+
+    freeCounts(&profiler.stacks);
+    freeCounts(&profiler.lines);
+    freeCounts(&profiler.functions);
+    free(profiler.stack);
+    profiler.stack = NULL;
+    profiler.stackCapacity = 0;
+}
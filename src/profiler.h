@@ -0,0 +1,27 @@
+#ifndef SAFFRON_PROFILER_H
+#define SAFFRON_PROFILER_H
+
+#include <signal.h>
+
+#include "common.h"
+
+// A sampling profiler for --profile. The SIGPROF timer only raises
+// profileSampleDue, the interpreter takes the sample at its next safe point
+// (a call, a native returning or a loop back edge), where every frame's ip
+// is up to date, so time between safe points goes to the next one.
+extern volatile sig_atomic_t profileSampleDue;
+
+// Samples the CPU time of the process hz times a second until
+// stopProfiler(), false if the timer couldn't be set up. Only the calling
+// thread's VM is sampled.
+bool startProfiler(const char *path, int hz);
+
+// Counts the running task's call stack, called when profileSampleDue is set
+void takeProfileSample();
+
+// Writes the samples to the path given to startProfiler() as folded stacks,
+// one "frame;frame;frame count" line per distinct stack as flamegraph.pl
+// reads them, and prints the lines and functions with the most samples
+void stopProfiler();
+
+#endif //SAFFRON_PROFILER_H
@@ -12,7 +12,7 @@ typedef struct {
     int line;
 } Scanner;
 
-Scanner scanner;
+_Thread_local Scanner scanner;
 
 void initScanner(const char *source) {
     scanner.start = source;
@@ -154,7 +154,15 @@ static TokenType identifierType() {
             }
             break;
         case 'c':
-            return checkKeyword(1, 4, "lass", TOKEN_CLASS);
+            if (scanner.current - scanner.start > 1) {
+                switch (scanner.start[1]) {
+                    case 'a':
+                        return checkKeyword(2, 3, "tch", TOKEN_CATCH);
+                    case 'l':
+                        return checkKeyword(2, 3, "ass", TOKEN_CLASS);
+                }
+            }
+            break;
         case 'e':
             if (scanner.current - scanner.start > 1) {
                 switch (scanner.start[1]) {
@@ -215,8 +223,14 @@ static TokenType identifierType() {
             if (scanner.current - scanner.start > 1) {
                 switch (scanner.start[1]) {
                     case 'h':
+                        if (scanner.current - scanner.start > 2 && scanner.start[2] == 'r') {
+                            return checkKeyword(3, 2, "ow", TOKEN_THROW);
+                        }
                         return checkKeyword(2, 2, "is", TOKEN_THIS);
                     case 'r':
+                        if (scanner.current - scanner.start == 3) {
+                            return checkKeyword(2, 1, "y", TOKEN_TRY);
+                        }
                         return checkKeyword(2, 2, "ue", TOKEN_TRUE);
                     case 'y':
                         return checkKeyword(2, 2, "pe", TOKEN_TYPE);
@@ -319,6 +333,13 @@ Token scanToken() {
     return errorToken("Unexpected character.");
 }
 
+Token peekToken() {
+    Scanner saved = scanner;
+    Token token = scanToken();
+    scanner = saved;
+    return token;
+}
+
 void initTokenArray(TokenArray *tokenArray) {
     tokenArray->count = 0;
     tokenArray->capacity = 0;
@@ -27,6 +27,7 @@ typedef enum {
     TOKEN_RETURN, TOKEN_SUPER, TOKEN_THIS,
     TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE,
     TOKEN_YIELD, TOKEN_AWAIT, TOKEN_RESUME,
+    TOKEN_TRY, TOKEN_CATCH, TOKEN_THROW,
     TOKEN_ARROW, TOKEN_AS,
 
     // Types
@@ -62,6 +63,9 @@ void freeTokenArray(TokenArray * tokenArray);
 
 Token scanToken();
 
+// The token after the next one scanToken() returns, without consuming it
+Token peekToken();
+
 TokenArray tokenize();
 
 #endif
\ No newline at end of file
@@ -1,17 +1,63 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+// Groups tolerate a higher load than linear probing, a probe rarely needs
+// more than one or two of them
+#define TABLE_MAX_LOAD 0.875
+
+#define CONTROL_EMPTY 0x80
+#define CONTROL_DELETED 0xFE
+
+// The low bits pick the first group, the top 7 live in the control byte
+#define HASH_GROUP(hash) (hash)
+#define HASH_CONTROL(hash) ((uint8_t) ((hash) >> 25))
+
+// Bit i is set when control byte i of the group equals byte
+static inline uint32_t matchControl(const uint8_t *group, uint8_t byte) {
+#if defined(__SSE2__)
+    __m128i controls = _mm_loadu_si128((const __m128i *) group);
+    return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(controls, _mm_set1_epi8((char) byte)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+        mask |= (uint32_t) (group[i] == byte) << i;
+    }
+    return mask;
+#endif
+}
+
+// Bit i is set when slot i of the group is empty or deleted, both of which
+// are the only control bytes with the high bit set
+static inline uint32_t matchFree(const uint8_t *group) {
+#if defined(__SSE2__)
+    return (uint32_t) _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) group));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+        mask |= (uint32_t) (group[i] >> 7) << i;
+    }
+    return mask;
+#endif
+}
+
+static inline int lowestBit(uint32_t mask) {
+    return __builtin_ctz(mask);
+}
 
 void initTable(Table *table) {
     table->count = 0;
     table->capacity = 0;
     table->entries = NULL;
+    table->control = NULL;
 }
 
 void copyTable(Table *source, Table *dest) {
@@ -21,36 +67,49 @@ void copyTable(Table *source, Table *dest) {
 
 void freeTable(Table *table) {
     FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(uint8_t, table->control, table->capacity);
     initTable(table);
 }
 
-static Entry *findEntry(Entry *entries, int capacity,
-                        ObjString *key) {
-    // This works as long as capacity is a power of 2, otherwise key->hash % capacity
-    uint32_t index = key->hash & (capacity - 1);
-    Entry *tombstone = NULL;
+// Slot of key, -1 if it isn't in the table
+static int findEntry(Table *table, ObjString *key) {
+    // Capacity is a power of 2 and a multiple of the group width
+    uint32_t groupMask = (uint32_t) table->capacity / TABLE_GROUP_WIDTH - 1;
+    uint32_t group = HASH_GROUP(key->hash) & groupMask;
+    uint8_t control = HASH_CONTROL(key->hash);
 
     for (;;) {
-        Entry *entry = &entries[index];
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                // Empty entry.
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                // We found a tombstone.
-                if (tombstone == NULL) tombstone = entry;
-            }
-        } else if (entry->key == key) {
-            // We found the key.
-            return entry;
+        int base = (int) group * TABLE_GROUP_WIDTH;
+        const uint8_t *controls = &table->control[base];
+        for (uint32_t matches = matchControl(controls, control); matches != 0; matches &= matches - 1) {
+            int slot = base + lowestBit(matches);
+            if (table->entries[slot].key == key) return slot;
         }
+        // An empty slot ends the probe, the key would have gone there
+        if (matchControl(controls, CONTROL_EMPTY) != 0) return -1;
 
-        index = (index + 1) & (capacity - 1);
+        group = (group + 1) & groupMask;
+    }
+}
+
+// First empty or deleted slot on hash's probe sequence
+static int findFreeSlot(uint8_t *control, int capacity, uint32_t hash) {
+    uint32_t groupMask = (uint32_t) capacity / TABLE_GROUP_WIDTH - 1;
+    uint32_t group = HASH_GROUP(hash) & groupMask;
+
+    for (;;) {
+        int base = (int) group * TABLE_GROUP_WIDTH;
+        uint32_t free = matchFree(&control[base]);
+        if (free != 0) return base + lowestBit(free);
+
+        group = (group + 1) & groupMask;
     }
 }
 
 static void adjustCapacity(Table *table, int capacity) {
     Entry *entries = ALLOCATE(Entry, capacity);
+    uint8_t *control = ALLOCATE(uint8_t, capacity);
+    memset(control, CONTROL_EMPTY, capacity);
     for (int i = 0; i < capacity; i++) {
         entries[i].key = NULL;
         entries[i].value = NIL_VAL;
@@ -61,52 +120,70 @@ static void adjustCapacity(Table *table, int capacity) {
         Entry *entry = &table->entries[i];
         if (entry->key == NULL) continue;
 
-        Entry *dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
+        int slot = findFreeSlot(control, capacity, entry->key->hash);
+        control[slot] = HASH_CONTROL(entry->key->hash);
+        entries[slot] = *entry;
         table->count++;
     }
 
     FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(uint8_t, table->control, table->capacity);
     table->entries = entries;
+    table->control = control;
     table->capacity = capacity;
 }
 
 bool tableGet(Table *table, ObjString *key, Value *value) {
     if (table->count == 0) return false;
 
-    Entry *entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int slot = findEntry(table, key);
+    if (slot < 0) return false;
 
-    *value = entry->value;
+    *value = table->entries[slot].value;
     return true;
 }
 
+// Index of key's entry, stays valid until the table is resized or the key
+// deleted, callers check entries[slot].key before trusting it
+int tableFindSlot(Table *table, ObjString *key) {
+    if (table->count == 0) return -1;
+    return findEntry(table, key);
+}
+
 bool tableSet(Table *table, ObjString *key, Value value) {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
-    }
+    int slot = table->count == 0 ? -1 : findEntry(table, key);
+    bool isNewKey = slot < 0;
+
+    if (isNewKey) {
+        // Count includes deleted slots, so the table always keeps an empty
+        // slot to end probes
+        if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
+            int capacity = table->capacity < TABLE_GROUP_WIDTH ? TABLE_GROUP_WIDTH : table->capacity * 2;
+            adjustCapacity(table, capacity);
+        }
 
-    Entry *entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
-    if (isNewKey && IS_NIL(entry->value)) table->count++;
+        slot = findFreeSlot(table->control, table->capacity, key->hash);
+        if (table->control[slot] == CONTROL_EMPTY) table->count++;
+        table->control[slot] = HASH_CONTROL(key->hash);
+        table->entries[slot].key = key;
+    }
 
-    entry->key = key;
-    entry->value = value;
+    table->entries[slot].value = value;
+    WRITE_BARRIER(OBJ_VAL(key));
+    WRITE_BARRIER(value);
     return isNewKey;
 }
 
 bool tableDelete(Table *table, ObjString *key) {
     if (table->count == 0) return false;
 
-    // Find the entry.
-    Entry *entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int slot = findEntry(table, key);
+    if (slot < 0) return false;
 
-    // Place a tombstone in the entry.
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    // Keep probes going past the slot
+    table->control[slot] = CONTROL_DELETED;
+    table->entries[slot].key = NULL;
+    table->entries[slot].value = NIL_VAL;
     return true;
 }
 
@@ -123,20 +200,23 @@ ObjString* tableFindString(Table* table, const char* chars,
                            int length, uint32_t hash) {
     if (table->count == 0) return NULL;
 
-    uint32_t index = hash & (table->capacity - 1);
+    uint32_t groupMask = (uint32_t) table->capacity / TABLE_GROUP_WIDTH - 1;
+    uint32_t group = HASH_GROUP(hash) & groupMask;
+    uint8_t control = HASH_CONTROL(hash);
+
     for (;;) {
-        Entry* entry = &table->entries[index];
-        if (entry->key == NULL) {
-            // Stop if we find an empty non-tombstone entry.
-            if (IS_NIL(entry->value)) return NULL;
-        } else if (entry->key->length == length &&
-                   entry->key->hash == hash &&
-                   memcmp(entry->key->chars, chars, length) == 0) {
-            // We found it.
-            return entry->key;
+        int base = (int) group * TABLE_GROUP_WIDTH;
+        const uint8_t *controls = &table->control[base];
+        for (uint32_t matches = matchControl(controls, control); matches != 0; matches &= matches - 1) {
+            ObjString *key = table->entries[base + lowestBit(matches)].key;
+            if (key->length == length && key->hash == hash &&
+                memcmp(key->chars, chars, length) == 0) {
+                return key;
+            }
         }
+        if (matchControl(controls, CONTROL_EMPTY) != 0) return NULL;
 
-        index = (index + 1) & (table->capacity - 1);
+        group = (group + 1) & groupMask;
     }
 }
 
@@ -155,4 +235,4 @@ void tableRemoveWhite(Table* table) {
             tableDelete(table, entry->key);
         }
     }
-}
\ No newline at end of file
+}
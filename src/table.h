@@ -9,15 +9,23 @@ typedef struct {
     Value value;
 } Entry;
 
+// Open addressing over groups of TABLE_GROUP_WIDTH slots. Each slot has a
+// control byte, either CONTROL_EMPTY, CONTROL_DELETED or the top 7 bits of its
+// key's hash, so a probe compares a whole group of control bytes at once and
+// only touches the entries whose bits match.
+#define TABLE_GROUP_WIDTH 16
+
 typedef struct {
     int count;
     int capacity;
     Entry* entries;
+    uint8_t* control;
 } Table;
 
 void initTable(Table* table);
 void freeTable(Table* table);
 bool tableGet(Table* table, ObjString* key, Value* value);
+int tableFindSlot(Table* table, ObjString* key);
 bool tableSet(Table* table, ObjString* key, Value value);
 bool tableDelete(Table* table, ObjString* key);
 void tableAddAll(Table* from, Table* to);
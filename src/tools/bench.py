@@ -0,0 +1,109 @@
+"""Runs the benchmarks in test/profiling and compares them with a baseline.
+
+A benchmark is a script that prints "elapsed <seconds>" for the part it
+times. Scripts that print nothing like that are timed as a whole process,
+which is what startup.sf relies on.
+
+    bench.py --saffron _build/saffron --save baseline.json
+    bench.py --saffron _build/saffron --compare baseline.json
+"""
+import argparse
+import json
+import pathlib
+import re
+import statistics
+import subprocess
+import sys
+import time
+
+BENCHMARKS = pathlib.Path(__file__).resolve().parent.parent.parent / "test" / "profiling"
+ELAPSED = re.compile(r"^elapsed\s+(\S+)", re.MULTILINE)
+
+
+def run_once(saffron: pathlib.Path, script: pathlib.Path, timeout: float) -> float:
+    # Builtin modules such as lib/iter.sf are found next to the executable
+    start = time.perf_counter()
+    result = subprocess.run([str(saffron), str(script)], cwd=saffron.parent, capture_output=True,
+                            text=True, timeout=timeout)
+    wall = time.perf_counter() - start
+    if result.returncode != 0:
+        raise RuntimeError(f"{script.name} exited with {result.returncode}:\n{result.stderr.strip()}")
+
+    matches = ELAPSED.findall(result.stdout)
+    return float(matches[-1]) if matches else wall
+
+
+def measure(saffron: pathlib.Path, script: pathlib.Path, runs: int, timeout: float) -> dict:
+    # One unmeasured run first, so imports are compiled and cached
+    run_once(saffron, script, timeout)
+    samples = [run_once(saffron, script, timeout) for _ in range(runs)]
+    return {
+        "mean": statistics.mean(samples),
+        "stddev": statistics.stdev(samples) if len(samples) > 1 else 0.0,
+        "samples": samples,
+    }
+
+
+def is_regression(current: dict, baseline: dict, threshold: float) -> bool:
+    # Slower by more than the threshold and by more than the noise in both
+    difference = current["mean"] - baseline["mean"]
+    return (difference > baseline["mean"] * threshold
+            and difference > current["stddev"] + baseline["stddev"])
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("benchmarks", nargs="*", help="names or paths of benchmarks, all of them by default")
+    parser.add_argument("--saffron", required=True, type=pathlib.Path, help="the saffron executable")
+    parser.add_argument("--runs", type=int, default=5, help="measured runs per benchmark")
+    parser.add_argument("--timeout", type=float, default=120, help="seconds before a run is abandoned")
+    parser.add_argument("--save", type=pathlib.Path, help="write the results to this baseline file")
+    parser.add_argument("--compare", type=pathlib.Path, help="compare the results with this baseline file")
+    parser.add_argument("--threshold", type=float, default=10,
+                        help="percentage slowdown that counts as a regression")
+    args = parser.parse_args()
+
+    saffron = args.saffron.resolve()
+    if args.benchmarks:
+        scripts = [pathlib.Path(name) if name.endswith(".sf") else BENCHMARKS / f"{name}.sf"
+                   for name in args.benchmarks]
+    else:
+        scripts = sorted(BENCHMARKS.glob("*.sf"))
+
+    baseline = json.loads(args.compare.read_text()) if args.compare else {}
+    results = {}
+    regressions = []
+
+    print(f"{'benchmark':<16}{'mean':>12}{'stddev':>12}{'baseline':>12}{'change':>10}")
+    for script in scripts:
+        name = script.stem
+        try:
+            result = measure(saffron, script.resolve(), args.runs, args.timeout)
+        except (RuntimeError, subprocess.TimeoutExpired) as error:
+            print(f"{name:<16}failed: {error}")
+            regressions.append(name)
+            continue
+        results[name] = result
+
+        line = f"{name:<16}{result['mean']:>12.4f}{result['stddev']:>12.4f}"
+        if name in baseline:
+            old = baseline[name]
+            change = (result["mean"] - old["mean"]) / old["mean"] * 100 if old["mean"] else 0.0
+            line += f"{old['mean']:>12.4f}{change:>+9.1f}%"
+            if is_regression(result, old, args.threshold / 100):
+                line += "  slower"
+                regressions.append(name)
+        print(line, flush=True)
+
+    if args.save:
+        args.save.write_text(json.dumps(results, indent=2) + "\n")
+        print(f"Saved {len(results)} results to {args.save}")
+
+    if regressions:
+        print(f"Regressed or failed: {', '.join(regressions)}")
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
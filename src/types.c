@@ -1,4 +1,5 @@
 #include <printf.h>
+#include <stdio.h>
 #include "types.h"
 #include "object.h"
 #include "vm.h"
@@ -7,11 +8,13 @@
 #include "ast/astparse.h"
 #include "libc/map.h"
 #include "libc/task.h"
+#include "libc/future.h"
+#include "libc/builtins.h"
 
 
 Type *evaluateNode(Node *node);
 
-TypeEnvironment *currentEnv = NULL;
+_Thread_local TypeEnvironment *currentEnv = NULL;
 
 SimpleType *newSimpleType() {
     SimpleType *type = ALLOCATE_OBJ(SimpleType, OBJ_PARSE_TYPE);
@@ -67,8 +70,8 @@ GenericTypeDefinition *newGenericTypeDefinition() {
     return type;
 }
 
-static bool panicMode = false;
-static bool hadError = false;
+static _Thread_local bool panicMode = false;
+static _Thread_local bool hadError = false;
 
 static Token syntheticToken(const char *text) {
     Token token;
@@ -116,22 +119,163 @@ static void *defineLocalAndTypeDef(TypeEnvironment *typeEnvironment, const char
     return defineLocal(typeEnvironment, name, initType);
 }
 
-SimpleType *numberType;
-SimpleType *boolType;
-SimpleType *nilType;
-SimpleType *atomType;
-SimpleType *stringType;
-SimpleType *neverType;
-SimpleType *anyType;
-SimpleType *listTypeDef;
-SimpleType *mapTypeDef;
-SimpleType *taskTypeDef;
+_Thread_local SimpleType *numberType;
+_Thread_local SimpleType *intType;
+_Thread_local SimpleType *boolType;
+_Thread_local SimpleType *nilType;
+_Thread_local SimpleType *atomType;
+_Thread_local SimpleType *stringType;
+_Thread_local SimpleType *neverType;
+_Thread_local SimpleType *anyType;
+_Thread_local SimpleType *listTypeDef;
+_Thread_local SimpleType *mapTypeDef;
+_Thread_local SimpleType *taskTypeDef;
+_Thread_local SimpleType *futureTypeDef;
+
+_Thread_local Table modules;
+_Thread_local Table builtinModules;
+
+// isSubType() answers keyed by the pair of types asked about. Only answers
+// that can't change are kept, so not ones that read or bind the generic
+// resolutions in scope. A class or interface gains members while it's being
+// checked, so the cache is cleared once one is declared.
+typedef struct {
+    Type *subclass;
+    Type *superclass;
+    bool result;
+} SubtypeEntry;
+
+typedef struct {
+    SubtypeEntry *entries;
+    int count;
+    int capacity;
+} SubtypeCache;
+
+// Instantiated generics, one per target and type arguments, so List<Number>
+// is the same type everywhere it's written and compares by identity
+typedef struct {
+    GenericType **entries;
+    int count;
+    int capacity;
+} GenericCache;
+
+static _Thread_local SubtypeCache subtypes;
+static _Thread_local GenericCache generics;
+// Set by a subtype query whose answer isn't fixed yet
+static _Thread_local bool uncacheable = false;
+
+#define TYPE_CACHE_MAX_LOAD 0.75
+
+static uint32_t hashPointers(uint64_t seed, const void *pointer) {
+    uint64_t bits = seed * 0x9e3779b97f4a7c15ULL ^ (uint64_t) (uintptr_t) pointer;
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    return (uint32_t) bits;
+}
+
+static SubtypeEntry *findSubtype(SubtypeEntry *entries, int capacity, Type *subclass, Type *superclass) {
+    uint32_t index = hashPointers((uintptr_t) subclass, superclass) & (capacity - 1);
+    for (;;) {
+        SubtypeEntry *entry = &entries[index];
+        if (entry->subclass == NULL || (entry->subclass == subclass && entry->superclass == superclass)) {
+            return entry;
+        }
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+static void cacheSubtype(Type *subclass, Type *superclass, bool result) {
+    if (subtypes.count + 1 > subtypes.capacity * TYPE_CACHE_MAX_LOAD) {
+        int capacity = GROW_CAPACITY(subtypes.capacity);
+        SubtypeEntry *entries = ALLOCATE(SubtypeEntry, capacity);
+        for (int i = 0; i < capacity; i++) entries[i].subclass = NULL;
+        for (int i = 0; i < subtypes.capacity; i++) {
+            SubtypeEntry *entry = &subtypes.entries[i];
+            if (entry->subclass != NULL) *findSubtype(entries, capacity, entry->subclass, entry->superclass) = *entry;
+        }
+        FREE_ARRAY(SubtypeEntry, subtypes.entries, subtypes.capacity);
+        subtypes.entries = entries;
+        subtypes.capacity = capacity;
+    }
+
+    SubtypeEntry *entry = findSubtype(subtypes.entries, subtypes.capacity, subclass, superclass);
+    if (entry->subclass == NULL) subtypes.count++;
+    entry->subclass = subclass;
+    entry->superclass = superclass;
+    entry->result = result;
+}
+
+static void clearSubtypes() {
+    FREE_ARRAY(SubtypeEntry, subtypes.entries, subtypes.capacity);
+    subtypes.entries = NULL;
+    subtypes.count = 0;
+    subtypes.capacity = 0;
+}
+
+static uint32_t hashGeneric(Type *target, ValueArray *arguments) {
+    uint32_t hash = hashPointers(0, target);
+    for (int i = 0; i < arguments->count; i++) hash = hashPointers(hash, AS_OBJ(arguments->values[i]));
+    return hash;
+}
+
+static bool sameGeneric(GenericType *a, GenericType *b) {
+    if (a->target != b->target || a->generics.count != b->generics.count) return false;
+    for (int i = 0; i < a->generics.count; i++) {
+        if (AS_OBJ(a->generics.values[i]) != AS_OBJ(b->generics.values[i])) return false;
+    }
+    return true;
+}
+
+static GenericType **findGeneric(GenericType **entries, int capacity, GenericType *type) {
+    uint32_t index = hashGeneric(type->target, &type->generics) & (capacity - 1);
+    for (;;) {
+        GenericType **entry = &entries[index];
+        if (*entry == NULL || sameGeneric(*entry, type)) return entry;
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+// The instantiation equal to type, type itself the first time it's seen
+static GenericType *internGeneric(GenericType *type) {
+    if (generics.count + 1 > generics.capacity * TYPE_CACHE_MAX_LOAD) {
+        int capacity = GROW_CAPACITY(generics.capacity);
+        push(OBJ_VAL(type));
+        GenericType **entries = ALLOCATE(GenericType *, capacity);
+        pop();
+        for (int i = 0; i < capacity; i++) entries[i] = NULL;
+        for (int i = 0; i < generics.capacity; i++) {
+            if (generics.entries[i] != NULL) *findGeneric(entries, capacity, generics.entries[i]) = generics.entries[i];
+        }
+        FREE_ARRAY(GenericType *, generics.entries, generics.capacity);
+        generics.entries = entries;
+        generics.capacity = capacity;
+    }
+
+    GenericType **entry = findGeneric(generics.entries, generics.capacity, type);
+    if (*entry == NULL) {
+        *entry = type;
+        generics.count++;
+    }
+    return *entry;
+}
 
-Table modules;
-Table builtinModules;
+static _Thread_local bool typesMade = false;
+
+bool hasTypes() {
+    return typesMade;
+}
 
+// The interpreter never needs these, so they are only built the first time
+// something is type checked
 void makeTypes() {
+    if (typesMade) return;
+    typesMade = true;
+
     numberType = newSimpleType();
+    // Whole numbers, usable anywhere a Number is
+    intType = newSimpleType();
+    intType->superType = (Type *) numberType;
     nilType = newSimpleType();
     boolType = newSimpleType();
     atomType = newSimpleType();
@@ -141,9 +285,32 @@ void makeTypes() {
     listTypeDef = createListTypeDef();
     mapTypeDef = createMapTypeDef();
     taskTypeDef = createTaskTypeDef();
+    futureTypeDef = createFutureTypeDef();
 
     initTable(&modules);
     initTable(&builtinModules);
+    subtypes.entries = NULL;
+    subtypes.count = 0;
+    subtypes.capacity = 0;
+    generics.entries = NULL;
+    generics.count = 0;
+    generics.capacity = 0;
+
+    // Modules already imported get their types now, the rest when they load
+    defineLoadedTypeDefs();
+}
+
+void freeTypes() {
+    if (!typesMade) return;
+    typesMade = false;
+
+    freeTable(&modules);
+    freeTable(&builtinModules);
+    clearSubtypes();
+    FREE_ARRAY(GenericType *, generics.entries, generics.capacity);
+    generics.entries = NULL;
+    generics.count = 0;
+    generics.capacity = 0;
 }
 
 void defineBuiltinTypeDef(const char *path, const char *name, Type *type, bool builtin) {
@@ -158,6 +325,7 @@ void defineBuiltinTypeDef(const char *path, const char *name, Type *type, bool b
 
 void initGlobalEnvironment(TypeEnvironment *typeEnvironment) {
     defineTypeDef(typeEnvironment, "Number", (Type *) numberType);
+    defineTypeDef(typeEnvironment, "Int", (Type *) intType);
     defineTypeDef(typeEnvironment, "Nil", (Type *) nilType);
     defineTypeDef(typeEnvironment, "Bool", (Type *) boolType);
     defineTypeDef(typeEnvironment, "Atom", (Type *) atomType);
@@ -167,6 +335,7 @@ void initGlobalEnvironment(TypeEnvironment *typeEnvironment) {
     defineTypeDef(typeEnvironment, "Task", (Type *) taskTypeDef);
     defineLocalAndTypeDef(typeEnvironment, "List", listTypeDef);
     defineLocalAndTypeDef(typeEnvironment, "Map", mapTypeDef);
+    defineLocalAndTypeDef(typeEnvironment, "Future", futureTypeDef);
 }
 
 void initTypeEnvironment(TypeEnvironment *typeEnvironment, FunctionType type) {
@@ -233,7 +402,10 @@ static Type *getVariableType(Token name) {
     Value argValue;
     if (arg) {
         return arg;
-    } else if (tableGet(&builtinModules, copyString(name.start, name.length), &argValue)) {
+    }
+
+    loadBuiltinGlobal(name.start, name.length);
+    if (tableGet(&builtinModules, copyString(name.start, name.length), &argValue)) {
         return AS_OBJ(argValue);
     } else {
         errorAt(&name, "Undefined variable");
@@ -284,7 +456,30 @@ static Type* findGenericResolution(TypeEnvironment *typeEnvironment, Type *subcl
     return findGenericResolution(typeEnvironment->enclosing, subclass);
 }
 
+static bool checkSubType(Type *subclass, Type *superclass);
+
 static bool isSubType(Type *subclass, Type *superclass) {
+    if (subclass == superclass) {
+        return true;
+    }
+    if (subclass == NULL || superclass == NULL) {
+        return checkSubType(subclass, superclass);
+    }
+
+    if (subtypes.count > 0) {
+        SubtypeEntry *entry = findSubtype(subtypes.entries, subtypes.capacity, subclass, superclass);
+        if (entry->subclass != NULL) return entry->result;
+    }
+
+    bool enclosing = uncacheable;
+    uncacheable = false;
+    bool result = checkSubType(subclass, superclass);
+    if (!uncacheable) cacheSubtype(subclass, superclass, result);
+    uncacheable = uncacheable || enclosing;
+    return result;
+}
+
+static bool checkSubType(Type *subclass, Type *superclass) {
     // TODO: Make this actually work
     // TODO: Maybe this should actually be "isSubClass", left to right
     // If left is a subclass of right, then we can assign right to left
@@ -312,6 +507,7 @@ static bool isSubType(Type *subclass, Type *superclass) {
         }
         case (OBJ_PARSE_GENERIC_DEFINITION_TYPE): {
             GenericTypeDefinition *subclassType = (GenericTypeDefinition *) subclass;
+            uncacheable = true;
             Type* inner = findGenericResolution(currentEnv, subclass);
             if (inner) {
                 return isSubType(inner, superclass);
@@ -341,6 +537,10 @@ static bool isSubType(Type *subclass, Type *superclass) {
             }
 
             FunctorType *subclassType = (FunctorType *) subclass;
+            // A function's return type is only known once its body is checked
+            if (subclassType->returnType == NULL || superclassType->returnType == NULL) {
+                uncacheable = true;
+            }
 
             if (superclassType->arguments.count != subclassType->arguments.count) {
                 return false;
@@ -361,6 +561,7 @@ static bool isSubType(Type *subclass, Type *superclass) {
 
             if (superclassType->target->obj.type == OBJ_PARSE_INTERFACE_TYPE) {
                 InterfaceType *target = (InterfaceType *) superclassType->target;
+                uncacheable = true;
                 if (superclassType->generics.count != target->genericArgs.count) {
                     error("Type argument count mismatch in generic");
                     return false;
@@ -395,6 +596,7 @@ static bool isSubType(Type *subclass, Type *superclass) {
         }
         case (OBJ_PARSE_GENERIC_DEFINITION_TYPE): {
             GenericTypeDefinition *superclassType = (GenericTypeDefinition *) superclass;
+            uncacheable = true;
             if (!superclassType->extends || isSubType(subclass, superclassType->extends)) {
                 return resolveGenericArgument(currentEnv, subclass, superclass);
             }
@@ -412,7 +614,7 @@ static bool isSubType(Type *subclass, Type *superclass) {
                 return false;
             }
             InterfaceType *subclassType = (InterfaceType *) subclass;
-            for (int i = 0; i < superclassType->fields.count; i++) {
+            for (int i = 0; i < superclassType->fields.capacity; i++) {
                 Entry *entry = &superclassType->fields.entries[i];
                 if (entry->key != NULL) {
                     Type *fieldType = AS_OBJ(entry->value);
@@ -426,7 +628,7 @@ static bool isSubType(Type *subclass, Type *superclass) {
                     }
                 }
             }
-            for (int i = 0; i < superclassType->methods.count; i++) {
+            for (int i = 0; i < superclassType->methods.capacity; i++) {
                 Entry *entry = &superclassType->methods.entries[i];
                 if (entry->key != NULL) {
                     Type *methodType = AS_OBJ(entry->value);
@@ -449,39 +651,26 @@ static bool isSubType(Type *subclass, Type *superclass) {
 
 
 Type *getTypeOf(Value value) {
-#ifdef NAN_BOXING
     if (IS_BOOL(value)) {
-        printf(AS_BOOL(value) ? "true" : "false");
+        return boolType;
     } else if (IS_NIL(value)) {
-        printf("nil");
+        return nilType;
+    } else if (IS_INT(value)) {
+        return intType;
     } else if (IS_NUMBER(value)) {
-        printf("%g", AS_NUMBER(value));
+        return numberType;
     } else if (IS_OBJ(value)) {
-        printObject(value);
-    }
-#else
-    switch (value.type) {
-        case VAL_BOOL:
-            return boolType;
-        case VAL_NIL:
-            return nilType;
-        case VAL_NUMBER:
-            return numberType;
-        case VAL_OBJ: {
-            Obj *obj = AS_OBJ(value);
-            switch (obj->type) {
-                case OBJ_STRING: {
-                    return stringType;
-                }
-                case OBJ_ATOM: {
-                    return atomType;
-                }
+        Obj *obj = AS_OBJ(value);
+        switch (obj->type) {
+            case OBJ_STRING: {
+                return stringType;
+            }
+            case OBJ_ATOM: {
+                return atomType;
             }
         }
     }
 
-#endif
-
     return NULL;
 }
 
@@ -502,6 +691,7 @@ Type *evaluateBlock(StmtArray *statements) {
 }
 
 void evaluateTree(StmtArray *statements) {
+    makeTypes();
     TypeEnvironment typeEnv;
     initTypeEnvironment(&typeEnv, TYPE_SCRIPT);
     initGlobalEnvironment(&typeEnv);
@@ -516,11 +706,13 @@ void evaluateExprTypes(ExprArray *exprs) {
     }
 }
 
-Type *currentClassType = NULL;
-Type *currentAssignmentType = NULL;
-FunctorType *currentFuncType = NULL;
+_Thread_local Type *currentClassType = NULL;
+_Thread_local Type *currentAssignmentType = NULL;
+_Thread_local FunctorType *currentFuncType = NULL;
 
 Type *parseFile(const char *path, int length) {
+    makeTypes();
+    loadBuiltinModule(path, length);
     Value cached;
     if (tableGet(&modules, copyString(path, length), &cached)) {
         return AS_OBJ(cached);
@@ -552,9 +744,16 @@ Type *evaluateNode(Node *node) {
     switch (node->type) {
         case NODE_BINARY: {
             struct Binary *casted = (struct Binary *) node;
-            evaluateNode((Node *) casted->right);
-
-            return evaluateNode((Node *) casted->left);
+            Type *right = evaluateNode((Node *) casted->right);
+            Type *left = evaluateNode((Node *) casted->left);
+
+            // Only adding, subtracting, multiplying or taking the remainder
+            // of two Ints is sure to give a whole number
+            TokenType operator = casted->operator.type;
+            bool whole = operator == TOKEN_PLUS || operator == TOKEN_MINUS ||
+                         operator == TOKEN_STAR || operator == TOKEN_MODULO;
+            if (left == (Type *) intType && (right != (Type *) intType || !whole)) return (Type *) numberType;
+            return left;
         }
         case NODE_GROUPING: {
             struct Grouping *casted = (struct Grouping *) node;
@@ -679,6 +878,12 @@ Type *evaluateNode(Node *node) {
                 return (NULL);
             }
         }
+        case NODE_SETITEM: {
+            struct SetItem *casted = (struct SetItem *) node;
+            evaluateNode((Node *) casted->object);
+            evaluateNode((Node *) casted->index);
+            return evaluateNode((Node *) casted->value);
+        }
         case NODE_GET: {
             struct Get *casted = (struct Get *) node;
             Type *objectType = evaluateNode((Node *) casted->object);
@@ -843,6 +1048,7 @@ Type *evaluateNode(Node *node) {
                 }
                 writeValueArray(&type->generics, OBJ_VAL(itemType));
                 type->target = listTypeDef;
+                type = internGeneric(type);
             } else {
                 if (currentAssignmentType->obj.type != OBJ_PARSE_GENERIC_TYPE) {
                     errorAt(&casted->bracket, "Type mismatch");
@@ -874,7 +1080,6 @@ Type *evaluateNode(Node *node) {
             struct Map *casted = (struct Map *) node;
 
             GenericType *type = currentAssignmentType;
-            type->target = mapTypeDef;
 
             if (currentAssignmentType == NULL) {
                 type = newGenericType();
@@ -893,6 +1098,7 @@ Type *evaluateNode(Node *node) {
                 writeValueArray(&type->generics, OBJ_VAL(keyType));
                 writeValueArray(&type->generics, OBJ_VAL(valueType));
                 type->target = mapTypeDef;
+                type = internGeneric(type);
 
             } else {
                 if (currentAssignmentType->obj.type != OBJ_PARSE_GENERIC_TYPE) {
@@ -1162,6 +1368,7 @@ Type *evaluateNode(Node *node) {
             );
 
             currentClassType = oldClass;
+            clearSubtypes();
             return (Type *) classType;
         }
         case NODE_IF: {
@@ -1185,9 +1392,26 @@ Type *evaluateNode(Node *node) {
             evaluateNode((Node *) casted->body);
             return NULL;
         }
+        case NODE_FOR_IN: {
+            struct ForIn *casted = (struct ForIn *) node;
+            evaluateNode((Node *) casted->iterable);
+            evaluateNode((Node *) casted->body);
+            return NULL;
+        }
         case NODE_BREAK: {
             return NULL;
         }
+        case NODE_TRY: {
+            struct Try *casted = (struct Try *) node;
+            evaluateNode((Node *) casted->body);
+            evaluateNode((Node *) casted->handler);
+            return NULL;
+        }
+        case NODE_THROW: {
+            struct Throw *casted = (struct Throw *) node;
+            evaluateNode((Node *) casted->value);
+            return NULL;
+        }
         case NODE_RETURN: {
             struct Return *casted = (struct Return *) node;
             Type *value = evaluateNode((Node *) casted->value);
@@ -1266,7 +1490,7 @@ Type *evaluateNode(Node *node) {
                     Type *arg = evaluateNode(casted->generics.typeNodes[i]);
                     writeValueArray(&genericType->generics, OBJ_VAL(arg));
                 }
-                return genericType;
+                return (Type *) internGeneric(genericType);
             }
 
             return type;
@@ -1372,6 +1596,7 @@ Type *evaluateNode(Node *node) {
             }
 
             currentEnv = currentEnv->enclosing;
+            clearSubtypes();
 
             break;
         }
@@ -1427,19 +1652,19 @@ Type *evaluateNode(Node *node) {
 void freeType(Type *type) {
     switch (type->obj.type) {
         case OBJ_PARSE_FUNCTOR_TYPE:
-            FREE(FunctorType, type);
+            FREE_OBJ(FunctorType, type);
             break;
         case OBJ_PARSE_UNION_TYPE:
-            FREE(UnionType, type);
+            FREE_OBJ(UnionType, type);
             break;
         case OBJ_PARSE_INTERFACE_TYPE:
-            FREE(InterfaceType, type);
+            FREE_OBJ(InterfaceType, type);
             break;
         case OBJ_PARSE_TYPE:
-            FREE(SimpleType, type);
+            FREE_OBJ(SimpleType, type);
             break;
         case OBJ_PARSE_GENERIC_TYPE:
-            FREE(GenericType, type);
+            FREE_OBJ(GenericType, type);
             break;
     }
 }
@@ -1482,6 +1707,14 @@ void markType(Type *type) {
 
 void markTypecheckerRoots() {
     markTable(&modules);
+    for (int i = 0; i < subtypes.capacity; i++) {
+        if (subtypes.entries[i].subclass == NULL) continue;
+        markObject((Obj *) subtypes.entries[i].subclass);
+        markObject((Obj *) subtypes.entries[i].superclass);
+    }
+    for (int i = 0; i < generics.capacity; i++) {
+        markObject((Obj *) generics.entries[i]);
+    }
     TypeEnvironment *typeEnvironment = currentEnv;
     while (typeEnvironment != NULL) {
         markTable(&typeEnvironment->locals);
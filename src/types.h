@@ -97,19 +97,27 @@ InterfaceType *newInterfaceType();
 
 GenericType *newGenericType();
 
-SimpleType *numberType;
-SimpleType *anyType;
-SimpleType *boolType;
-SimpleType *nilType;
-SimpleType *atomType;
-SimpleType *stringType;
-SimpleType *neverType;
-SimpleType *listTypeDef;
-SimpleType *mapTypeDef;
-SimpleType *taskTypeDef;
+extern _Thread_local SimpleType *numberType;
+extern _Thread_local SimpleType *intType;
+extern _Thread_local SimpleType *anyType;
+extern _Thread_local SimpleType *boolType;
+extern _Thread_local SimpleType *nilType;
+extern _Thread_local SimpleType *atomType;
+extern _Thread_local SimpleType *stringType;
+extern _Thread_local SimpleType *neverType;
+extern _Thread_local SimpleType *listTypeDef;
+extern _Thread_local SimpleType *mapTypeDef;
+extern _Thread_local SimpleType *taskTypeDef;
+extern _Thread_local SimpleType *futureTypeDef;
 
 void makeTypes();
 
+// Whether makeTypes() has run on this thread
+bool hasTypes();
+
+// Drops what makeTypes() built, before the VM frees its objects
+void freeTypes();
+
 void defineBuiltinTypeDef(const char *path, const char *name, Type *type, bool builtin);
 
 void freeType(Type *type);
@@ -4,6 +4,7 @@
 #include "memory.h"
 #include "value.h"
 #include "object.h"
+#include "output.h"
 #include <math.h>
 
 void initValueArray(ValueArray *array) {
@@ -22,6 +23,7 @@ void writeValueArray(ValueArray *array, Value value) {
 
     array->values[array->count] = value;
     array->count++;
+    WRITE_BARRIER(value);
 }
 
 void freeValueArray(ValueArray *array) {
@@ -38,59 +40,61 @@ void popValueArray(ValueArray *array, int index) {
     array->count -= 1;
 }
 
+// Whole numbers %g would print in full are written out directly, they're
+// most of what gets printed
+static void printNumber(double number) {
+    if (!(number > -1e6 && number < 1e6) || number != (int) number || (number == 0 && signbit(number))) {
+        printOutput("%g", number);
+        return;
+    }
+
+    char digits[8];
+    int start = sizeof(digits);
+    int whole = (int) number;
+    unsigned int magnitude = whole < 0 ? -whole : whole;
+    do {
+        digits[--start] = (char) ('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude != 0);
+    if (whole < 0) digits[--start] = '-';
+    writeOutput(digits + start, sizeof(digits) - start);
+}
 
 void printValue(Value value) {
-#ifdef NAN_BOXING
     if (IS_BOOL(value)) {
-        printf(AS_BOOL(value) ? "true" : "false");
+        printOutput(AS_BOOL(value) ? "true" : "false");
     } else if (IS_NIL(value)) {
-        printf("nil");
+        printOutput("nil");
     } else if (IS_NUMBER(value)) {
-        printf("%g", AS_NUMBER(value));
+        printNumber(AS_NUMBER(value));
     } else if (IS_OBJ(value)) {
         printObject(value);
     }
-#else
-    switch (value.type) {
-        case VAL_BOOL:
-            printf(AS_BOOL(value) ? "true" : "false");
-            break;
-        case VAL_NIL:
-            printf("nil");
-            break;
-        case VAL_NUMBER:
-            printf("%g", AS_NUMBER(value));
-            break;
-        case VAL_OBJ: printObject(value); break;
-    }
-#endif
 }
 
 bool valuesEqual(Value a, Value b) {
+    if (IS_INT(a) && IS_INT(b)) return AS_INT(a) == AS_INT(b);
 #ifdef NAN_BOXING
     if (IS_NUMBER(a) && IS_NUMBER(b)) {
         return AS_NUMBER(a) == AS_NUMBER(b);
     }
-    return a == b;
+    return a == b || (IS_OBJ(a) && IS_OBJ(b) && textEqual(a, b));
 #else
+    // An Int equals the double of the same value
+    if (IS_NUMBER(a) && IS_NUMBER(b)) return AS_NUMBER(a) == AS_NUMBER(b);
     if (a.type != b.type) return false;
     switch (a.type) {
         case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NIL:    return true;
         case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-        case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
+        case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b) || textEqual(a, b);
         default:         return false; // Unreachable.
     }
 #endif
 }
 
 double valuesCmp(Value a, Value b) {
-    if (a.type != b.type) return NAN;
-    switch (a.type) {
-        case VAL_BOOL:   return NAN;
-        case VAL_NIL:    return NAN;
-        case VAL_NUMBER: return AS_NUMBER(a) - AS_NUMBER(b);
-        case VAL_OBJ:    return NAN;
-        default:         return NAN; // Unreachable.
-    }
+    if (IS_INT(a) && IS_INT(b)) return (double) (AS_INT(a) - AS_INT(b));
+    if (IS_NUMBER(a) && IS_NUMBER(b)) return AS_NUMBER(a) - AS_NUMBER(b);
+    return NAN;
 }
@@ -1,6 +1,7 @@
 #ifndef saffron_value_h
 #define saffron_value_h
 
+#include <math.h>
 #include <string.h>
 
 #include "common.h"
@@ -29,8 +30,12 @@ static inline double valueToNum(Value value) {
 #define TAG_NIL   1 // 01.
 #define TAG_FALSE 2 // 10.
 #define TAG_TRUE  3 // 11.
+// Ints keep their low 48 bits under QNAN with this bit set
+#define TAG_INT  ((uint64_t)0x0002000000000000)
+#define INT_PAYLOAD ((uint64_t)0x0000ffffffffffff)
 
 #define NUMBER_VAL(num) numToValue(num)
+#define INT_VAL(i)      ((Value)(QNAN | TAG_INT | ((uint64_t)(i) & INT_PAYLOAD)))
 #define NIL_VAL         ((Value)(uint64_t)(QNAN | TAG_NIL))
 #define FALSE_VAL       ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL        ((Value)(uint64_t)(QNAN | TAG_TRUE))
@@ -38,13 +43,17 @@ static inline double valueToNum(Value value) {
 #define OBJ_VAL(obj) \
     (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
 
-#define IS_NUMBER(value)    (((value) & QNAN) != QNAN)
+#define IS_DOUBLE(value)    (((value) & QNAN) != QNAN)
+#define IS_INT(value) \
+    (((value) & (SIGN_BIT | QNAN | TAG_INT)) == (QNAN | TAG_INT))
+#define IS_NUMBER(value)    (IS_DOUBLE(value) || IS_INT(value))
 #define IS_NIL(value)       ((value) == NIL_VAL)
 #define IS_BOOL(value)      (((value) | 1) == TRUE_VAL)
 #define IS_OBJ(value) \
     (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 
-#define AS_NUMBER(value)    valueToNum(value)
+#define AS_DOUBLE(value)    valueToNum(value)
+#define AS_INT(value)       ((int64_t)((value) << 16) >> 16)
 #define AS_BOOL(value)      ((value) == TRUE_VAL)
 #define AS_OBJ(value) \
     ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
@@ -55,7 +64,8 @@ typedef enum {
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
-    VAL_OBJ
+    VAL_OBJ,
+    VAL_INT
 } ValueType;
 
 typedef struct {
@@ -63,6 +73,7 @@ typedef struct {
     union {
         bool boolean;
         double number;
+        int64_t integer;
         Obj* obj;
     } as;
 } Value;
@@ -71,19 +82,53 @@ typedef struct {
 #define BOOL_VAL(value)   ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL           ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
+#define INT_VAL(value)    ((Value){VAL_INT, {.integer = value}})
 #define OBJ_VAL(object)   ((Value){VAL_OBJ, {.obj = (Obj*)object}})
 
 #define AS_BOOL(value)    ((value).as.boolean)
-#define AS_NUMBER(value)  ((value).as.number)
+#define AS_DOUBLE(value)  ((value).as.number)
+#define AS_INT(value)     ((value).as.integer)
 #define AS_OBJ(value)     ((value).as.obj)
 
 #define IS_BOOL(value)    ((value).type == VAL_BOOL)
 #define IS_NIL(value)     ((value).type == VAL_NIL)
-#define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
+#define IS_DOUBLE(value)  ((value).type == VAL_NUMBER)
+#define IS_INT(value)     ((value).type == VAL_INT)
+#define IS_NUMBER(value)  (IS_DOUBLE(value) || IS_INT(value))
 #define IS_OBJ(value)     ((value).type == VAL_OBJ)
 
 #endif
 
+// Whole numbers up to INT_LIMIT either way can be kept as an Int, which
+// adds, subtracts, multiplies, compares and indexes without going through
+// floating point. Every double in that range is exact, so an Int behaves
+// like the double of the same value anywhere the two meet: arithmetic that
+// leaves the range, or would give -0, gives a double instead.
+#define INT_LIMIT ((((int64_t) 1) << 47) - 1)
+
+static inline __attribute__((always_inline)) bool fitsInt(int64_t value) {
+    return value >= -INT_LIMIT && value <= INT_LIMIT;
+}
+
+// Ints read as the double of the same value. A statement expression rather
+// than an inline function so it costs no call in unoptimised builds, with
+// value evaluated once as AS_NUMBER(pop()) needs.
+#define AS_NUMBER(value) \
+    ({ Value number_ = (value); IS_INT(number_) ? (double) AS_INT(number_) : AS_DOUBLE(number_); })
+
+// An Int when the number is whole, fits and isn't -0
+static inline Value wholeNumberValue(double number) {
+    if (number > -INT_LIMIT - 1 && number < INT_LIMIT + 1 && number == (double) (int64_t) number &&
+        (number != 0 || !signbit(number))) {
+        return INT_VAL((int64_t) number);
+    }
+    return NUMBER_VAL(number);
+}
+
+// Fills global slots that haven't been defined yet, scripts never see it
+#define UNDEFINED_VAL       OBJ_VAL(NULL)
+#define IS_UNDEFINED(value) (IS_OBJ(value) && AS_OBJ(value) == NULL)
+
 typedef struct {
     int capacity;
     int count;
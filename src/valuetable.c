@@ -1,48 +1,78 @@
+#include <string.h>
+
 #include "valuetable.h"
 #include "memory.h"
 
+#define SLOT_EMPTY (-1)
+#define SLOT_DELETED (-2)
+
 void initValueTable(ValueTable* instance) {
     instance->count = 0;
-    instance->capacity = 0;
     instance->entries = NULL;
+    instance->entryCount = 0;
+    instance->entryCapacity = 0;
+    instance->slots = NULL;
+    instance->capacity = 0;
+}
+
+// Spreads every input bit over the result, so keys that only differ in
+// their high bits (like small integers stored as doubles) don't cluster
+static uint32_t mix(uint64_t bits) {
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    bits *= 0xc4ceb9fe1a85ec53ULL;
+    bits ^= bits >> 33;
+    return (uint32_t) bits;
 }
 
 uint32_t hash(Value key) {
-    switch (key.type) {
-        case VAL_BOOL:
-            return AS_BOOL(key);
-        case VAL_NIL:
-            return 0;
-        case VAL_NUMBER:
-            return AS_NUMBER(key);
-        case VAL_OBJ: {
-            Obj *obj = AS_OBJ(key);
-            switch (obj->type) {
-                case OBJ_STRING:
-                    return AS_STRING(key)->hash;
-                case OBJ_ATOM:
-                    return AS_STRING(key)->hash;
-                case OBJ_FUNCTION:
-                case OBJ_NATIVE:
-                case OBJ_NATIVE_METHOD:
-                case OBJ_CLOSURE:
-                case OBJ_CLASS:
-                case OBJ_BUILTIN_TYPE:
-                case OBJ_INSTANCE:
-                case OBJ_LIST:
-                case OBJ_MAP:
-                case OBJ_BOUND_METHOD:
-                case OBJ_CALL_FRAME:
-                case OBJ_MODULE:
-                    return (int) obj;
-            }
+    if (IS_BOOL(key)) {
+        return AS_BOOL(key) ? 2 : 1;
+    } else if (IS_NIL(key)) {
+        return 0;
+    } else if (IS_INT(key)) {
+        return mix((uint64_t) AS_INT(key));
+    } else if (IS_NUMBER(key)) {
+        // A whole double is an equal key to the Int of the same value, 0 and
+        // -0 included, so it needs the same hash
+        double number = AS_DOUBLE(key);
+        if (number >= -INT_LIMIT && number <= INT_LIMIT && number == (double) (int64_t) number) {
+            return mix((uint64_t) (int64_t) number);
+        }
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+        return mix(bits);
+    } else if (IS_OBJ(key)) {
+        Obj *obj = AS_OBJ(key);
+        switch (obj->type) {
+            case OBJ_STRING:
+                return AS_STRING(key)->hash;
+            case OBJ_ATOM:
+                return AS_STRING(key)->hash;
+            case OBJ_ROPE:
+                return hashRope(AS_ROPE(key));
+            case OBJ_FUNCTION:
+            case OBJ_NATIVE:
+            case OBJ_NATIVE_METHOD:
+            case OBJ_CLOSURE:
+            case OBJ_CLASS:
+            case OBJ_BUILTIN_TYPE:
+            case OBJ_INSTANCE:
+            case OBJ_LIST:
+            case OBJ_MAP:
+            case OBJ_FLOAT64_ARRAY:
+            case OBJ_BOUND_METHOD:
+            case OBJ_CALL_FRAME:
+            case OBJ_MODULE:
+                return mix((uint64_t) (uintptr_t) obj);
         }
     }
     return 1;
 }
 
 void markValueTable(ValueTable *table) {
-    for (int i = 0; i < table->capacity; i++) {
+    for (int i = 0; i < table->entryCount; i++) {
         MapEntry* entry = &table->entries[i];
         markValue(entry->key);
         markValue(entry->value);
@@ -50,90 +80,114 @@ void markValueTable(ValueTable *table) {
 }
 
 void freeValueTable(ValueTable *table) {
-    FREE_ARRAY(MapEntry, table->entries, table->capacity);
+    FREE_ARRAY(MapEntry, table->entries, table->entryCapacity);
+    FREE_ARRAY(int32_t, table->slots, table->capacity);
     initValueTable(table);
 }
 
-static MapEntry *findEntry(MapEntry *entries, int capacity, int hash) {
-    uint32_t index = hash & (capacity - 1);
-    MapEntry *tombstone = NULL;
+// The slot holding key, or if it isn't there the slot it should go in
+static int32_t *findSlot(ValueTable *table, Value key, uint32_t keyHash) {
+    uint32_t index = keyHash & (table->capacity - 1);
+    int32_t *tombstone = NULL;
 
     for (;;) {
-        MapEntry *entry = &entries[index];
-        if (valuesEqual(entry->key, NIL_VAL)) {
-            if (IS_NIL(entry->value)) {
-                return tombstone != NULL ? tombstone : entry;
-            } else if (tombstone == NULL) {
-                tombstone = entry;
-            }
-        } else if (entry->hash == hash) {
-            return entry;
+        int32_t *slot = &table->slots[index];
+        if (*slot == SLOT_EMPTY) {
+            return tombstone != NULL ? tombstone : slot;
+        } else if (*slot == SLOT_DELETED) {
+            if (tombstone == NULL) tombstone = slot;
+        } else {
+            MapEntry *entry = &table->entries[*slot];
+            if (entry->hash == keyHash && valuesEqual(entry->key, key)) return slot;
         }
-        index = (index + 1) & (capacity - 1);
+        index = (index + 1) & (table->capacity - 1);
     }
 }
 
-static void adjustCapacity(ValueTable *map, int capacity) {
-    MapEntry *entries = ALLOCATE(MapEntry, capacity);
-    for (int i = 0; i < capacity; i++) {
-        entries[i].key = NIL_VAL;
-        entries[i].value = NIL_VAL;
+// Drops deleted entries and rebuilds the index with capacity slots
+static void rebuild(ValueTable *table, int capacity) {
+    int live = 0;
+    for (int i = 0; i < table->entryCount; i++) {
+        if (IS_NIL(table->entries[i].key)) continue;
+        table->entries[live++] = table->entries[i];
+    }
+    table->entryCount = live;
+
+    FREE_ARRAY(int32_t, table->slots, table->capacity);
+    table->slots = ALLOCATE(int32_t, capacity);
+    table->capacity = capacity;
+    for (int i = 0; i < capacity; i++) table->slots[i] = SLOT_EMPTY;
+
+    for (int i = 0; i < live; i++) {
+        *findSlot(table, table->entries[i].key, table->entries[i].hash) = i;
     }
+}
 
-    map->count = 0;
-    for (int i = 0; i < map->capacity; i++) {
-        MapEntry *entry = &map->entries[i];
-        if (valuesEqual(entry->key, NIL_VAL)) continue;
+#define MAP_MAX_LOAD 0.75
 
-        MapEntry *dest = findEntry(entries, capacity, entry->hash);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        dest->hash = entry->hash;
-        map->count++;
+// Makes room for one more entry
+static void reserveEntry(ValueTable *table) {
+    // Deleted entries count against the load until a rebuild drops them, a
+    // table that is mostly deleted entries is compacted rather than grown
+    if (table->entryCount + 1 > table->capacity * MAP_MAX_LOAD) {
+        int capacity = table->capacity < 8 ? 8 : table->capacity;
+        if (table->count + 1 > capacity * MAP_MAX_LOAD / 2) capacity *= 2;
+        rebuild(table, capacity);
     }
 
-    FREE_ARRAY(MapEntry, map->entries, map->capacity);
-    map->entries = entries;
-    map->capacity = capacity;
+    if (table->entryCount + 1 > table->entryCapacity) {
+        int oldCapacity = table->entryCapacity;
+        table->entryCapacity = GROW_CAPACITY(oldCapacity);
+        table->entries = GROW_ARRAY(MapEntry, table->entries, oldCapacity, table->entryCapacity);
+    }
 }
 
 bool valueTableGet(ValueTable *map, Value key, Value *value) {
-    uint32_t h = hash(key);
-
     if (map->count == 0) return false;
 
-    MapEntry *entry = findEntry(map->entries, map->capacity, h);
-    if (valuesEqual(entry->key, NIL_VAL)) return false;
+    int32_t *slot = findSlot(map, key, hash(key));
+    if (*slot < 0) return false;
 
-    *value = entry->value;
+    *value = map->entries[*slot].value;
     return true;
 }
 
-#define MAP_MAX_LOAD 0.75
-
 bool valueTableSet(ValueTable *map, Value key, Value item) {
-    if (map->count + 1 > map->capacity * MAP_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(map->capacity);
-        adjustCapacity(map, capacity);
+    if (IS_NIL(key)) return false;
+
+    uint32_t keyHash = hash(key);
+    if (map->capacity > 0) {
+        int32_t *slot = findSlot(map, key, keyHash);
+        if (*slot >= 0) {
+            map->entries[*slot].value = item;
+            WRITE_BARRIER(item);
+            return false;
+        }
     }
 
-    MapEntry *entry = findEntry(map->entries, map->capacity, hash(key));
-    bool isNewKey = valuesEqual(entry->key, NIL_VAL);
-    if (isNewKey) map->count++;
-
+    reserveEntry(map);
+    int32_t *slot = findSlot(map, key, keyHash);
+    MapEntry *entry = &map->entries[map->entryCount];
     entry->key = key;
     entry->value = item;
-    entry->hash = hash(key);
-    return isNewKey;
+    entry->hash = keyHash;
+    *slot = map->entryCount++;
+    map->count++;
+    WRITE_BARRIER(key);
+    WRITE_BARRIER(item);
+    return true;
 }
 
-bool valueTableDelete(ValueTable *map, uint32_t hash) {
+bool valueTableDelete(ValueTable *map, Value key) {
     if (map->count == 0) return false;
 
-    MapEntry *entry = findEntry(map->entries, map->capacity, hash);
-    if (valuesEqual(entry->key, NIL_VAL)) return false;
+    int32_t *slot = findSlot(map, key, hash(key));
+    if (*slot < 0) return false;
 
+    MapEntry *entry = &map->entries[*slot];
     entry->key = NIL_VAL;
-    entry->value = BOOL_VAL(true);
+    entry->value = NIL_VAL;
+    *slot = SLOT_DELETED;
+    map->count--;
     return true;
-}
\ No newline at end of file
+}
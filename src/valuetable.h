@@ -11,10 +11,18 @@ typedef struct {
     Value value;
 } MapEntry;
 
+// Entries are kept densely in insertion order, with an open addressed index
+// of positions into them for lookups. A deleted entry keeps its place with a
+// nil key until the table is next rebuilt, so nil can't be a key.
 typedef struct {
+    // Live entries
     int count;
-    int capacity;
     MapEntry *entries;
+    int entryCount;
+    int entryCapacity;
+    // Positions in entries, or one of the SLOT_ markers in valuetable.c
+    int32_t *slots;
+    int capacity;
 } ValueTable;
 
 uint32_t hash(Value key);
@@ -23,7 +31,7 @@ bool valueTableGet(ValueTable *map, Value key, Value *value);
 
 bool valueTableSet(ValueTable *map, Value key, Value item);
 
-bool valueTableDelete(ValueTable *map, uint32_t hash);
+bool valueTableDelete(ValueTable *map, Value key);
 
 void initValueTable(ValueTable *instance);
 
@@ -31,4 +39,4 @@ void freeValueTable(ValueTable *map);
 
 void markValueTable(ValueTable *map);
 
-#endif //SAFFRON_VALUETABLE_H
\ No newline at end of file
+#endif //SAFFRON_VALUETABLE_H
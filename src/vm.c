@@ -12,25 +12,36 @@
 #include "libc/module.h"
 #include "libc/task.h"
 #include "files.h"
+#include "bytecode.h"
 #include "ast/astparse.h"
 #include "libc/map.h"
+#include "libc/float64array.h"
 #include "libc/builtins.h"
+#include "profiler.h"
+#include "jit.h"
+#include "output.h"
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
 #include <libgen.h>
-#include <unistd.h>
 
-VM vm;
+_Thread_local VM vm;
 
 static bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
 static void resetStack() {
+    if (vm.mainTask != NULL) {
+        vm.mainTask->frameCount = 0;
+        vm.mainTask->stackTop = vm.mainTask->stack;
+        vm.mainTask->openUpvalues = NULL;
+        vm.stack = vm.mainTask->stack;
+    }
     vm.stackTop = vm.stack;
-    initValueArray(&vm.tasks);
+    vm.openUpvalues = NULL;
+    clearRunQueues();
 }
 
 void defineNative(const char *name, NativeFn function) {
@@ -66,10 +77,12 @@ void defineBuiltin(const char *name, Value value) {
 }
 
 void initVM() {
+    vm.mainTask = NULL;
     resetStack();
     vm.vmReady = false;
+    vm.taskParked = false;
+    vm.error = NIL_VAL;
 
-    vm.currentTask = 0;
     vm.objects = NULL;
 
     vm.grayCount = 0;
@@ -83,25 +96,45 @@ void initVM() {
     initTable(&vm.builtins);
     initTable(&vm.strings);
 
+    // Everything before the first call runs on the main task's stack
+    vm.mainTask = newCallFrame(AWAITED | INITIATED);
+    resetStack();
+
     vm.initString = NULL;
+    vm.iterString = NULL;
+    vm.hasNextString = NULL;
+    vm.nextString = NULL;
     vm.initString = copyString("init", 4);
-    vm.openUpvalues = NULL;
+    vm.iterString = copyString("iter", 4);
+    vm.hasNextString = copyString("next?", 5);
+    vm.nextString = copyString("next", 4);
 
-    makeTypes();
     initLib();
     initAsyncHandler();
+    initOutput();
 }
 
 void freeVM() {
+#ifdef DEBUG_OPCODE_STATS
+    // Functions still waiting to be swept may point at freed objects
+    finishSweep();
+    printOpcodeStats();
+#endif
     freeAsyncHandler();
+    freeRunQueues();
 
     freeTable(&vm.types);
     freeTable(&vm.modules);
     freeTable(&vm.builtins);
     freeTable(&vm.strings);
     vm.initString = NULL;
+    vm.iterString = NULL;
+    vm.hasNextString = NULL;
+    vm.nextString = NULL;
     freeNodes();
+    freeTypes();
     freeObjects();
+    freeOutput();
 }
 
 Value peek(int distance) {
@@ -109,33 +142,121 @@ Value peek(int distance) {
 }
 
 static void concatenate() {
-    ObjString *b = AS_STRING(peek(0));
-    ObjString *a = AS_STRING(peek(1));
-
-    int length = a->length + b->length;
-    char *chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
-
-    ObjString *result = takeString(chars, length);
+    Value result = concatenateText(peek(1), peek(0));
     pop();
     pop();
-    push(OBJ_VAL(result));
+    push(result);
+}
+
+// Int arithmetic gives what the doubles would once the result leaves the Int
+// range or is -0. Operands are within INT_LIMIT, so sums can't overflow.
+// Always inlined, they sit on the hottest paths and the build is unoptimised.
+#define INT_HELPER static inline __attribute__((always_inline))
+
+INT_HELPER Value addInts(int64_t a, int64_t b) {
+    int64_t result = a + b;
+    return fitsInt(result) ? INT_VAL(result) : NUMBER_VAL((double) result);
 }
 
+INT_HELPER Value subtractInts(int64_t a, int64_t b) {
+    int64_t result = a - b;
+    return fitsInt(result) ? INT_VAL(result) : NUMBER_VAL((double) result);
+}
+
+INT_HELPER Value multiplyInts(int64_t a, int64_t b) {
+    int64_t result;
+    if (__builtin_mul_overflow(a, b, &result) || !fitsInt(result)) {
+        return NUMBER_VAL((double) a * (double) b);
+    }
+    if (result == 0 && (a < 0 || b < 0)) return NUMBER_VAL(-0.0);
+    return INT_VAL(result);
+}
+
+// Truncated like fmod(), the remainder takes the sign of a
+INT_HELPER Value moduloInts(int64_t a, int64_t b) {
+    if (b == 0) return NUMBER_VAL(fmod((double) a, (double) b));
+    int64_t result = a % b;
+    if (result == 0 && a < 0) return NUMBER_VAL(-0.0);
+    return INT_VAL(result);
+}
+
+// A list or array index, -1 for anything that can't be one
+INT_HELPER int64_t toIndex(Value index) {
+    if (IS_INT(index)) return AS_INT(index);
+    return IS_NUMBER(index) ? (int64_t) trunc(AS_NUMBER(index)) : -1;
+}
+
+// Set by runtimeError(), which has already reset the stack, so an
+// instruction whose native hit an error (directly or in a function it called
+// back into) fails too rather than carrying on with the stack it had
+static _Thread_local bool nativeCallFailed = false;
+
+static bool nativeSucceeded() {
+    // A sample that came due while the native ran goes to the line calling it
+    if (profileSampleDue) takeProfileSample();
+    if (!nativeCallFailed) return true;
+    nativeCallFailed = false;
+    return false;
+}
+
+// Natives only understand interned strings
+static void flattenArguments(int argCount) {
+    for (Value *arg = vm.stackTop - argCount; arg < vm.stackTop; arg++) {
+        if (IS_ROPE(*arg)) *arg = OBJ_VAL(flattenRope(AS_ROPE(*arg)));
+    }
+}
+
+// The innermost try block of frame's function covering the instruction the
+// frame is at, NULL if there is none
+static ExceptionHandler *findHandler(CallFrame *frame) {
+    Chunk *chunk = &frame->closure->function->chunk;
+    int instruction = (int) (frame->ip - chunk->code - 1);
+    for (int i = 0; i < chunk->handlerCount; i++) {
+        ExceptionHandler *handler = &chunk->handlers[i];
+        if (instruction >= handler->start && instruction < handler->end) return handler;
+    }
+    return NULL;
+}
+
+// Whether an error raised now is caught by the running task. Errors don't
+// leave the task they're raised in, or the top level of a module.
+static bool isCaught() {
+    ObjCallFrame *task = CURRENT_TASK;
+    for (int i = task ? task->frameCount - 1 : -1; i >= 0; i--) {
+        CallFrame *frame = &task->frames[i];
+        if (findHandler(frame) != NULL) return true;
+        if (frame->closure->function->name == NULL) return false;
+    }
+    return false;
+}
+
+// Fails the running native or instruction. When a catch block will take the
+// error its message is thrown as a string, otherwise it is reported with a
+// stack trace and every task is stopped.
 void runtimeError(const char *format, ...) {
+    char message[1024];
     va_list args;
     va_start(args, format);
-    vfprintf(stderr, format, args);
+    int length = vsnprintf(message, sizeof(message), format, args);
     va_end(args);
-    fputs("\n", stderr);
+    if (length < 0) length = 0;
+    if (length >= (int) sizeof(message)) length = (int) sizeof(message) - 1;
+    nativeCallFailed = true;
+
+    if (isCaught()) {
+        vm.error = OBJ_VAL(copyString(message, length));
+        return;
+    }
 
-    for (ObjCallFrame *frame = CURRENT_TASK; frame->parent != NULL; frame = frame->parent) {
+    fputs(message, stderr);
+    fputs("\n", stderr);
+    ObjCallFrame *task = CURRENT_TASK;
+    for (int i = task ? task->frameCount - 1 : -1; i >= 0; i--) {
+        CallFrame *frame = &task->frames[i];
         ObjFunction *function = frame->closure->function;
         size_t instruction = frame->ip - function->chunk.code - 1;
         fprintf(stderr, "[line %d] in ",
-                function->chunk.lines[instruction]);
+                getLine(&function->chunk, (int) instruction));
         if (function->name == NULL) {
             fprintf(stderr, "script\n");
         } else {
@@ -148,6 +269,52 @@ void runtimeError(const char *format, ...) {
 
 ObjModule *executeModule(ObjString *name);
 
+int frameSize(ObjFunction *function) {
+    // UINT8_COUNT covers any function whose locals all have one byte slots
+    return function->maxSlots > UINT8_MAX ? function->maxSlots + UINT8_COUNT : UINT8_COUNT;
+}
+
+// Makes sure a frame starting at slots has size values of room, growing the
+// task's stack and rebasing everything pointing into it if not.
+static Value *reserveFrame(ObjCallFrame *task, Value *slots, int size) {
+    if (slots + size <= task->stack + task->stackCapacity) {
+        return slots;
+    }
+
+    int needed = (int) (slots - task->stack) + size;
+    int oldCapacity = task->stackCapacity;
+    int capacity = oldCapacity;
+    while (capacity < needed) {
+        capacity = GROW_CAPACITY(capacity);
+    }
+    if (capacity > STACK_MAX) {
+        return NULL;
+    }
+
+    Value *oldStack = task->stack;
+    task->stack = GROW_ARRAY(Value, task->stack, oldCapacity, capacity);
+    task->stackCapacity = capacity;
+
+    for (int i = 0; i < task->frameCount; i++) {
+        task->frames[i].slots = task->stack + (task->frames[i].slots - oldStack);
+    }
+    for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+        upvalue->location = task->stack + (upvalue->location - oldStack);
+    }
+
+    vm.stackTop = task->stack + (vm.stackTop - oldStack);
+    vm.stack = task->stack;
+    return task->stack + (slots - oldStack);
+}
+
+#ifdef JIT_ENABLED
+static inline void warmUp(ObjFunction *function) {
+    if (function->jit == NULL && ++function->hotness == JIT_THRESHOLD) {
+        jitCompile(function);
+    }
+}
+#endif
+
 static bool call(ObjClosure *closure, int argCount) {
     switch (closure->obj.type) {
         case OBJ_CLOSURE: {
@@ -157,39 +324,39 @@ static bool call(ObjClosure *closure, int argCount) {
                 return false;
             }
 
-            if (vm.tasks.count == FRAMES_MAX) {
+            if (CURRENT_TASK == NULL) {
+                // The first call starts the main task
+                vm.runningTask = vm.mainTask;
+            }
+
+            ObjCallFrame *task = CURRENT_TASK;
+            Value *slots = task->frameCount == FRAMES_MAX
+                           ? NULL
+                           : reserveFrame(task, vm.stackTop - argCount - 1, frameSize(closure->function));
+            if (slots == NULL) {
                 runtimeError("Stack overflow.");
                 return false;
             }
 
-            ObjCallFrame *frame = ALLOCATE_OBJ(ObjCallFrame, OBJ_CALL_FRAME);
+            CallFrame *frame = &task->frames[task->frameCount++];
             frame->closure = closure;
             frame->ip = closure->function->chunk.code;
-            frame->slots = vm.stackTop - argCount - 1;
-            frame->state = AWAITED | INITIATED;
-            frame->stored = NIL_VAL;
-
-            initValueArray(&frame->stack);
-            frame->result = NIL_VAL;
-
-            if (vm.tasks.count == 0) {
-                frame->parent = NULL;
-                frame->index = 0;
-                writeValueArray(&vm.tasks, OBJ_VAL(frame));
-            } else {
-                frame->parent = CURRENT_TASK;
-                frame->index = frame->parent->index + 1;
-                vm.tasks.values[vm.currentTask] = OBJ_VAL(frame);
-            }
+            frame->slots = slots;
+#ifdef JIT_ENABLED
+            warmUp(closure->function);
+#endif
 
             return true;
         }
         case OBJ_NATIVE_METHOD: {
             ObjNativeMethod *nativeMethod = (ObjNativeMethod *) closure;
             NativeMethodFn native = nativeMethod->function;
+            flattenArguments(argCount);
             Value result = native(AS_OBJ(peek(argCount)), argCount, vm.stackTop - argCount);
+            if (!nativeSucceeded()) return false;
             vm.stackTop -= argCount + 1;
             push(result);
+            return true;
         }
     }
 }
@@ -201,7 +368,9 @@ static bool callValue(Value callee, int argCount) {
                 return call(AS_CLOSURE(callee), argCount);
             case OBJ_NATIVE: {
                 NativeFn native = AS_NATIVE(callee);
+                flattenArguments(argCount);
                 Value result = native(argCount, vm.stackTop - argCount);
+                if (!nativeSucceeded()) return false;
                 vm.stackTop -= argCount + 1;
                 push(result);
 
@@ -209,7 +378,9 @@ static bool callValue(Value callee, int argCount) {
             }
             case OBJ_BUILTIN_TYPE: {
                 ObjBuiltinType *type = AS_BUILTIN_TYPE(callee);
+                flattenArguments(argCount);
                 Value result = type->typeCallFn(argCount, vm.stackTop - argCount);
+                if (!nativeSucceeded()) return false;
                 vm.stackTop -= argCount + 1;
                 push(result);
                 return true;
@@ -240,7 +411,9 @@ static bool callValue(Value callee, int argCount) {
                     case OBJ_NATIVE_METHOD:
                         vm.stackTop[-argCount - 1] = bound->receiver;
                         NativeMethodFn native = ((ObjNativeMethod *) bound->method)->function;
+                        flattenArguments(argCount);
                         Value result = native(AS_OBJ(bound->receiver), argCount, vm.stackTop - argCount);
+                        if (!nativeSucceeded()) return false;
                         vm.stackTop -= argCount + 1;
                         push(result);
                         return true;
@@ -285,6 +458,7 @@ static void closeUpvalues(Value *last) {
         ObjUpvalue *upvalue = vm.openUpvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
+        WRITE_BARRIER(upvalue->closed);
         vm.openUpvalues = upvalue->next;
     }
 }
@@ -293,13 +467,25 @@ static void defineMethod(ObjString *name) {
     Value method = peek(0);
     ObjClass *klass = AS_CLASS(peek(1));
     tableSet(&klass->methods, name, method);
+    touchClass(klass);
     pop();
 }
 
 static void defineField(ObjString *name) {
-    Value method = peek(0);
+    Value initial = peek(0);
     ObjClass *klass = AS_CLASS(peek(1));
-    tableSet(&klass->fields, name, method);
+
+    // Redeclaring a field, e.g. one inherited from the superclass, only
+    // changes its initial value
+    Value slot;
+    if (tableGet(&klass->layout, name, &slot)) {
+        klass->defaults.values[(int) AS_NUMBER(slot)] = initial;
+        WRITE_BARRIER(initial);
+    } else {
+        tableSet(&klass->layout, name, NUMBER_VAL(klass->defaults.count));
+        writeValueArray(&klass->defaults, initial);
+        touchClass(klass);
+    }
     pop();
 }
 
@@ -329,59 +515,120 @@ static bool invokeFromClass(ObjClass *klass, ObjString *name,
     return call(AS_CLOSURE(method), argCount);
 }
 
-static bool invoke(ObjString *name, int argCount) {
+// Resolves name against klass's layout and methods unless the cache already
+// holds them for this version of the class
+static inline void refreshCache(ObjClass *klass, ObjString *name, InlineCache *cache) {
+#ifdef DEBUG_OPCODE_STATS
+    if (cache->version == klass->version) {
+        cache->hits++;
+        return;
+    }
+    cache->misses++;
+#else
+    if (cache->version == klass->version) return;
+#endif
+
+    Value value;
+    cache->slot = tableGet(&klass->layout, name, &value) ? (int) AS_NUMBER(value) : -1;
+    cache->method = tableGet(&klass->methods, name, &value) ? value : NIL_VAL;
+    cache->version = klass->version;
+}
+
+// Finds the field called name: a declared slot, or failing that one added at
+// runtime. Returns NULL if the instance has neither.
+static inline Value *findField(ObjInstance *instance, ObjString *name, InlineCache *cache) {
+    refreshCache(instance->klass, name, cache);
+    if (cache->slot >= 0 && cache->slot < instance->slotCount) {
+        return &instance->slots[cache->slot];
+    }
+
+    // A module's table only holds its globals once they're flushed
+    if (instance->klass == (ObjClass *) moduleType) {
+        flushModuleGlobals((ObjModule *) instance);
+    }
+
+    Table *fields = &instance->fields;
+    if (fields->count == 0) return NULL;
+
+    int slot = cache->tableSlot;
+    if (slot < 0 || slot >= fields->capacity || fields->entries[slot].key != name) {
+        slot = tableFindSlot(fields, name);
+        if (slot < 0) return NULL;
+        cache->tableSlot = slot;
+    }
+    return &fields->entries[slot].value;
+}
+
+// Only valid after findField has refreshed the cache for klass
+static inline bool findMethod(ObjString *name, InlineCache *cache) {
+    if (IS_NIL(cache->method)) {
+        runtimeError("Undefined property '%s'.", name->chars);
+        return false;
+    }
+    return true;
+}
+
+static bool invoke(ObjString *name, int argCount, InlineCache *cache) {
     Value receiver = peek(argCount);
 
-    if (!(IS_INSTANCE(receiver) || IS_LIST(receiver) || IS_MAP(receiver))) {
+    if (!(IS_INSTANCE(receiver) || IS_LIST(receiver) || IS_MAP(receiver) ||
+          IS_FLOAT64_ARRAY(receiver))) {
         runtimeError("Only instances have methods.");
         return false;
     }
 
     ObjInstance *instance = AS_INSTANCE(receiver);
 
-    Value value;
-    bool foundField = tableGet(&instance->fields, name, &value);
-    if (foundField) {
+    Value *field = findField(instance, name, cache);
+    if (field != NULL) {
+        Value value = *field;
         vm.stackTop[-argCount - 1] = value;
         return callValue(value, argCount);
     }
 
-    return invokeFromClass(instance->klass, name, argCount);
+    if (!findMethod(name, cache)) return false;
+    return call(AS_CLOSURE(cache->method), argCount);
 }
 
-ObjCallFrame *currentFrame;
+_Thread_local CallFrame *currentFrame;
+
+ObjCallFrame *newCallFrame(CallState state) {
+    // Allocate the stack first so a collection can't see a half built task
+    Value *stack = ALLOCATE(Value, UINT8_COUNT);
+
+    ObjCallFrame *task = ALLOCATE_OBJ(ObjCallFrame, OBJ_CALL_FRAME);
+    task->frameCount = 0;
+    task->index = 0;
+    task->state = state;
+    task->priority = DEFAULT_PRIORITY;
+    task->stack = stack;
+    task->stackTop = stack;
+    task->stackCapacity = UINT8_COUNT;
+    task->openUpvalues = NULL;
+    task->next = NULL;
+    task->joiners = NULL;
+    task->operation = NULL;
+    task->stored = NIL_VAL;
+    task->result = NIL_VAL;
+    return task;
+}
 
 static void save_current_frame() {
-    freeValueArray(&currentFrame->stack);
-    Value *stackBottom = vm.stack;
-//    printf("Saving into: ");
-//    printValue(OBJ_VAL(currentFrame));
-//    printf("\n");
-
-    while (stackBottom < vm.stackTop) {
-//        printf("Saving value: ");
-//        printValue(*stackBottom);
-//        printf("\n");
-        writeValueArray(&currentFrame->stack, *stackBottom);
-        stackBottom++;
-    }
+    ObjCallFrame *task = CURRENT_TASK;
+    task->stackTop = vm.stackTop;
+    task->openUpvalues = vm.openUpvalues;
+    // Stack writes skip the barrier, a task traced while it ran is traced again
+    rescanObject((Obj *) task);
 }
 
+static void switch_stack(ObjCallFrame *task) {
+    vm.stack = task->stack;
+    vm.stackTop = task->stackTop;
+    vm.openUpvalues = task->openUpvalues;
+}
 
 void load_new_frame() {
-    vm.stackTop = vm.stack;
-
-//    printf("Loading from: ");
-//    printValue(OBJ_VAL(CURRENT_TASK));
-//    printf("\n");
-    for (int i = 0; i < CURRENT_TASK->stack.count; i++) {
-//        printf("Loading value: ");
-//        printValue(CURRENT_TASK->stack.values[i]);
-//        printf("\n");
-        push(CURRENT_TASK->stack.values[i]);
-    }
-
-    freeValueArray(&CURRENT_TASK->stack);
+    switch_stack(CURRENT_TASK);
 
     // So the yield evaluates to an expression before popping
     if (CURRENT_TASK->state & INITIATED) {
@@ -390,472 +637,1204 @@ void load_new_frame() {
         CURRENT_TASK->state |= INITIATED;
     }
 
-    currentFrame = CURRENT_TASK;
+    currentFrame = CURRENT_FRAME;
 }
 
-static void pop_frame() {
-    popValueArray(&vm.tasks, vm.currentTask);
-    if (vm.currentTask >= vm.tasks.count) {
-        getTasks();
+// The scheduler's single entry point: switches to the next runnable task,
+// blocking in the poller until one is ready. Returns false once every task
+// is done, leaving the main task's stack in place.
+static bool resume_next_task() {
+    // A yield that didn't have to wait keeps its turn
+    if (CURRENT_TASK == NULL && !waitForTasks()) {
+        switch_stack(vm.mainTask);
+        return false;
     }
-    vm.currentTask = vm.tasks.count ? vm.currentTask % vm.tasks.count : 0;
 
-    if (CURRENT_TASK) {
-        load_new_frame();
-    }
+    load_new_frame();
+    if (gcStepDue) gcStep();
+    return true;
 }
 
-static void POP_CALL(Value result) {
-    CURRENT_TASK->result = result;
-    if (CURRENT_TASK->state & SPAWNED) {
-        pop_frame();
-    } else {
-        if (CURRENT_TASK->parent == NULL) {
-            pop_frame();
-        } else {
-            vm.tasks.values[vm.currentTask] = OBJ_VAL(CURRENT_TASK->parent);
-            vm.stackTop = currentFrame->slots;
-            push(result);
+static void pop_frame() {
+    endTurn();
+}
+
+_Thread_local ModuleContext moduleContext = MAIN;
+
+// The task and frame count a native was at when it called back in through
+// callFromNative(), the nested run() returns once the callee's frame does
+static _Thread_local ObjCallFrame *nativeCallTask = NULL;
+static _Thread_local int nativeCallBase = 0;
+
+// Unwinds the running task to the catch block taking vm.error, if one in
+// the frames this run() owns does. A callee of callFromNative() leaves the
+// rest to the run() below once the native returns.
+static bool catchError() {
+    ObjCallFrame *task = CURRENT_TASK;
+    int base = task == nativeCallTask ? nativeCallBase : 0;
+    for (int i = task ? task->frameCount - 1 : -1; i >= base; i--) {
+        CallFrame *frame = &task->frames[i];
+        ExceptionHandler *handler = findHandler(frame);
+        if (handler != NULL) {
+            Value *top = frame->slots + handler->depth;
+            closeUpvalues(top);
+            task->frameCount = i + 1;
+            vm.stackTop = top;
+            push(vm.error);
+            vm.error = NIL_VAL;
+            frame->ip = frame->closure->function->chunk.code + handler->handler;
+            nativeCallFailed = false;
+            return true;
         }
+        if (frame->closure->function->name == NULL) break;
     }
-
-    currentFrame = CURRENT_TASK;
+    return false;
 }
 
-ModuleContext moduleContext = MAIN;
+#ifdef DEBUG_TRACE_EXECUTION
+static void traceExecution() {
+    printOutput("          ");
+    for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
+        printOutput("[ ");
+        printValue(*slot);
+        printOutput(" ]");
+    }
+    printOutput("\n");
+
+    disassembleInstruction(&currentFrame->closure->function->chunk,
+                           (int) (currentFrame->ip - currentFrame->closure->function->chunk.code));
+}
+#endif
 
 static InterpretResult run(ObjModule *module) {
-    currentFrame = CURRENT_TASK;
+    currentFrame = CURRENT_FRAME;
+    // Left over from an error that already ended an earlier run
+    nativeCallFailed = false;
+
+    // The hot frame state lives in locals so the compiler can keep it in
+    // registers. It is only written back to currentFrame when something
+    // outside of this loop needs to see it (calls, yields, errors).
+    register uint8_t *ip;
+    register Value *slots;
+    register Value *constants;
+    InlineCache *caches;
+    ObjModule *globalModule;
+
+#define SAVE_FRAME() (currentFrame->ip = ip)
+
+// Incremental marking only runs between instructions, where nothing is half
+// built and every live object is on a stack or in the heap. Profile samples
+// are taken here too, once the frame's ip is saved.
+#define GC_SAFE_POINT() \
+    do { \
+        if (gcStepDue) gcStep(); \
+        if (profileSampleDue) { \
+            SAVE_FRAME(); \
+            takeProfileSample(); \
+        } \
+    } while (false)
+
+// Compiled code can take a frame over at any instruction, so it does
+// whenever the interpreter switches to one, and after each back edge
+#ifdef JIT_ENABLED
+#define RUN_COMPILED() \
+    do { \
+        if (currentFrame->closure->function->jit != NULL) { \
+            ip = jitRun(currentFrame->closure->function, ip, slots); \
+        } \
+    } while (false)
+#else
+#define RUN_COMPILED() ((void) 0)
+#endif
+
+#define LOAD_FRAME() \
+    do { \
+        ip = currentFrame->ip; \
+        slots = currentFrame->slots; \
+        constants = currentFrame->closure->function->chunk.constants.values; \
+        caches = currentFrame->closure->function->chunk.caches; \
+        globalModule = currentFrame->closure->function->module; \
+        RUN_COMPILED(); \
+    } while (false)
 
-#define READ_BYTE() (*currentFrame->ip++)
+#define READ_BYTE() (*ip++)
 
 #define READ_SHORT() \
-    (currentFrame->ip += 2, \
-    (uint16_t)((currentFrame->ip[-2] << 8) | currentFrame->ip[-1]))
+    (ip += 2, \
+    (uint16_t)((ip[-2] << 8) | ip[-1]))
 
 #define READ_CONSTANT() \
-    (currentFrame->closure->function->chunk.constants.values[READ_BYTE()])
+    (constants[READ_BYTE()])
+
+#define READ_CONSTANT_LONG() \
+    (constants[READ_SHORT()])
+
+#define READ_STRING() AS_STRING(READ_CONSTANT_LONG())
+
+#define GLOBAL_NAME(slot) AS_STRING(globalModule->globalNames.values[slot])
+
+// Hands the error to the catch block that takes it, or ends this run()
+#define THROW() goto throwError
+
+#define RUNTIME_ERROR(...) \
+    do { \
+        SAVE_FRAME(); \
+        runtimeError(__VA_ARGS__); \
+        THROW(); \
+    } while (false)
+
+// A native parked the task (e.g. Task.join), so the value it returned is
+// replaced by whatever the task is woken with
+#define PARK_IF_REQUESTED() \
+    do { \
+        if (vm.taskParked) { \
+            vm.taskParked = false; \
+            if (nativeCallTask != NULL) { \
+                RUNTIME_ERROR("Can't wait inside a function called by a native."); \
+            } \
+            pop(); \
+            save_current_frame(); \
+            pop_frame(); \
+            if (!resume_next_task()) { \
+                pop(); \
+                return INTERPRET_OK; \
+            } \
+        } \
+    } while (false)
 
-#define READ_STRING() AS_STRING(READ_CONSTANT())
 #define BINARY_OP(valueType, op) \
     do { \
       if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-        runtimeError("Operands must be numbers for binary op."); \
-        return INTERPRET_RUNTIME_ERROR; \
+        RUNTIME_ERROR("Operands must be numbers for binary op."); \
       } \
       double b = AS_NUMBER(pop()); \
       double a = AS_NUMBER(pop()); \
       push(valueType(a op b)); \
     } while (false)
+// intResult of a and b when both are Ints, otherwise the number op
+#define INT_OP(intResult, otherwise) \
+    do { \
+      Value *top = vm.stackTop; \
+      if (IS_INT(top[-1]) && IS_INT(top[-2])) { \
+        int64_t b = AS_INT(top[-1]); \
+        int64_t a = AS_INT(top[-2]); \
+        top[-2] = intResult; \
+        vm.stackTop = top - 1; \
+      } else { \
+        otherwise; \
+      } \
+    } while (false)
+#define NUMBER_OP(valueType, op) \
+    do { \
+      double b = AS_NUMBER(pop()); \
+      double a = AS_NUMBER(pop()); \
+      push(valueType(a op b)); \
+    } while (false)
+#define NEGATED_BINARY_OP(op) \
+    do { \
+      if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
+        RUNTIME_ERROR("Operands must be numbers for binary op."); \
+      } \
+      double b = AS_NUMBER(pop()); \
+      double a = AS_NUMBER(pop()); \
+      push(BOOL_VAL(!(a op b))); \
+    } while (false)
+#define LOCALS_OP(op) \
+    do { \
+      uint8_t dst = READ_BYTE(); \
+      Value a = slots[READ_BYTE()]; \
+      Value b = slots[READ_BYTE()]; \
+      if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+        RUNTIME_ERROR("Operands must be numbers for binary op."); \
+      } \
+      slots[dst] = NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(b)); \
+    } while (false)
+#define INT_LOCALS_OP(intOp, op) \
+    do { \
+      Value a = slots[ip[1]]; \
+      Value b = slots[ip[2]]; \
+      if (IS_INT(a) && IS_INT(b)) { \
+        slots[ip[0]] = intOp(AS_INT(a), AS_INT(b)); \
+        ip += 3; \
+      } else { \
+        LOCALS_OP(op); \
+      } \
+    } while (false)
+#define COMPARE_JUMP(test) \
+    do { \
+      uint16_t offset = READ_SHORT(); \
+      if (IS_INT(peek(0)) && IS_INT(peek(1))) { \
+        int64_t b = AS_INT(pop()); \
+        int64_t a = AS_INT(pop()); \
+        if (!(test)) ip += offset; \
+        break; \
+      } \
+      if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
+        RUNTIME_ERROR("Operands must be numbers for binary op."); \
+      } \
+      double b = AS_NUMBER(pop()); \
+      double a = AS_NUMBER(pop()); \
+      if (!(test)) ip += offset; \
+    } while (false)
 
-    for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
+#define TRACE_INSTRUCTION() (SAVE_FRAME(), traceExecution())
+#else
+#define TRACE_INSTRUCTION() ((void) 0)
+#endif
 
-        disassembleInstruction(&currentFrame->closure->function->chunk,
-                               (int) (currentFrame->ip - currentFrame->closure->function->chunk.code));
+#ifdef DEBUG_OPCODE_STATS
+#define COUNT_INSTRUCTION() countInstruction(instruction)
+#else
+#define COUNT_INSTRUCTION() ((void) 0)
 #endif
 
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
-            case OP_NOT:
-                push(BOOL_VAL(isFalsey(pop())));
-                break;
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
-                push(constant);
-                break;
+#ifdef COMPUTED_GOTO
+    // Labels-as-values dispatch, every handler jumps straight to the next one
+    // instead of going back through the switch. Unused opcodes fall into
+    // op_UNKNOWN so a corrupt chunk can't jump through a NULL entry.
+    static void *dispatchTable[UINT8_COUNT] = {
+            [0 ... UINT8_MAX] = &&op_UNKNOWN,
+            [OP_LIST] = &&op_OP_LIST,
+            [OP_LIST_EXTEND] = &&op_OP_LIST_EXTEND,
+            [OP_MAP] = &&op_OP_MAP,
+            [OP_MAP_EXTEND] = &&op_OP_MAP_EXTEND,
+            [OP_CONSTANT] = &&op_OP_CONSTANT,
+            [OP_CONSTANT_LONG] = &&op_OP_CONSTANT_LONG,
+            [OP_CLOSURE] = &&op_OP_CLOSURE,
+            [OP_NEGATE] = &&op_OP_NEGATE,
+            [OP_NIL] = &&op_OP_NIL,
+            [OP_TRUE] = &&op_OP_TRUE,
+            [OP_FALSE] = &&op_OP_FALSE,
+            [OP_ADD] = &&op_OP_ADD,
+            [OP_SUBTRACT] = &&op_OP_SUBTRACT,
+            [OP_MODULO] = &&op_OP_MODULO,
+            [OP_MULTIPLY] = &&op_OP_MULTIPLY,
+            [OP_DIVIDE] = &&op_OP_DIVIDE,
+            [OP_ADD_NUM] = &&op_OP_ADD_NUM,
+            [OP_SUBTRACT_NUM] = &&op_OP_SUBTRACT_NUM,
+            [OP_MULTIPLY_NUM] = &&op_OP_MULTIPLY_NUM,
+            [OP_DIVIDE_NUM] = &&op_OP_DIVIDE_NUM,
+            [OP_GREATER_NUM] = &&op_OP_GREATER_NUM,
+            [OP_LESS_NUM] = &&op_OP_LESS_NUM,
+            [OP_CONCAT_STR] = &&op_OP_CONCAT_STR,
+            [OP_NOT] = &&op_OP_NOT,
+            [OP_EQUAL] = &&op_OP_EQUAL,
+            [OP_NOT_EQUAL] = &&op_OP_NOT_EQUAL,
+            [OP_GREATER] = &&op_OP_GREATER,
+            [OP_GREATER_EQUAL] = &&op_OP_GREATER_EQUAL,
+            [OP_LESS] = &&op_OP_LESS,
+            [OP_LESS_EQUAL] = &&op_OP_LESS_EQUAL,
+            [OP_POP] = &&op_OP_POP,
+            [OP_CLOSE_UPVALUE] = &&op_OP_CLOSE_UPVALUE,
+            [OP_DEFINE_GLOBAL_SLOT] = &&op_OP_DEFINE_GLOBAL_SLOT,
+            [OP_GET_GLOBAL_SLOT] = &&op_OP_GET_GLOBAL_SLOT,
+            [OP_SET_GLOBAL_SLOT] = &&op_OP_SET_GLOBAL_SLOT,
+            [OP_GET_LOCAL] = &&op_OP_GET_LOCAL,
+            [OP_SET_LOCAL] = &&op_OP_SET_LOCAL,
+            [OP_GET_LOCAL_LONG] = &&op_OP_GET_LOCAL_LONG,
+            [OP_SET_LOCAL_LONG] = &&op_OP_SET_LOCAL_LONG,
+            [OP_IN_PLACE_ADD] = &&op_OP_IN_PLACE_ADD,
+            [OP_IN_PLACE_SUBTRACT] = &&op_OP_IN_PLACE_SUBTRACT,
+            [OP_ADD_LOCALS] = &&op_OP_ADD_LOCALS,
+            [OP_SUBTRACT_LOCALS] = &&op_OP_SUBTRACT_LOCALS,
+            [OP_MULTIPLY_LOCALS] = &&op_OP_MULTIPLY_LOCALS,
+            [OP_DIVIDE_LOCALS] = &&op_OP_DIVIDE_LOCALS,
+            [OP_JUMP] = &&op_OP_JUMP,
+            [OP_JUMP_IF_FALSE] = &&op_OP_JUMP_IF_FALSE,
+            [OP_POP_JUMP_IF_FALSE] = &&op_OP_POP_JUMP_IF_FALSE,
+            [OP_JUMP_UNLESS_EQUAL] = &&op_OP_JUMP_UNLESS_EQUAL,
+            [OP_JUMP_UNLESS_NOT_EQUAL] = &&op_OP_JUMP_UNLESS_NOT_EQUAL,
+            [OP_JUMP_UNLESS_GREATER] = &&op_OP_JUMP_UNLESS_GREATER,
+            [OP_JUMP_UNLESS_GREATER_EQUAL] = &&op_OP_JUMP_UNLESS_GREATER_EQUAL,
+            [OP_JUMP_UNLESS_LESS] = &&op_OP_JUMP_UNLESS_LESS,
+            [OP_JUMP_UNLESS_LESS_EQUAL] = &&op_OP_JUMP_UNLESS_LESS_EQUAL,
+            [OP_LOOP] = &&op_OP_LOOP,
+            [OP_ITER_INIT] = &&op_OP_ITER_INIT,
+            [OP_ITER_NEXT] = &&op_OP_ITER_NEXT,
+            [OP_CALL] = &&op_OP_CALL,
+            [OP_TAIL_CALL] = &&op_OP_TAIL_CALL,
+            [OP_GETITEM] = &&op_OP_GETITEM,
+            [OP_GETITEM_LIST_NUM] = &&op_OP_GETITEM_LIST_NUM,
+            [OP_SETITEM] = &&op_OP_SETITEM,
+            [OP_PIPE] = &&op_OP_PIPE,
+            [OP_GET_UPVALUE] = &&op_OP_GET_UPVALUE,
+            [OP_SET_UPVALUE] = &&op_OP_SET_UPVALUE,
+            [OP_GET_ENCLOSING] = &&op_OP_GET_ENCLOSING,
+            [OP_SET_ENCLOSING] = &&op_OP_SET_ENCLOSING,
+            [OP_GET_PROPERTY] = &&op_OP_GET_PROPERTY,
+            [OP_GET_LOCAL_PROPERTY] = &&op_OP_GET_LOCAL_PROPERTY,
+            [OP_SET_PROPERTY] = &&op_OP_SET_PROPERTY,
+            [OP_INVOKE] = &&op_OP_INVOKE,
+            [OP_GET_SUPER] = &&op_OP_GET_SUPER,
+            [OP_SUPER_INVOKE] = &&op_OP_SUPER_INVOKE,
+            [OP_METHOD] = &&op_OP_METHOD,
+            [OP_FIELD] = &&op_OP_FIELD,
+            [OP_CLASS] = &&op_OP_CLASS,
+            [OP_INHERIT] = &&op_OP_INHERIT,
+            [OP_YIELD] = &&op_OP_YIELD,
+            [OP_THROW] = &&op_OP_THROW,
+            [OP_RETURN] = &&op_OP_RETURN,
+            [OP_IMPORT] = &&op_OP_IMPORT,
+    };
+
+#define DISPATCH_LOOP DISPATCH();
+#define OPCODE(name) op_##name
+#define DEFAULT_OPCODE op_UNKNOWN
+#define DISPATCH() \
+    do { \
+        instruction = READ_BYTE(); \
+        COUNT_INSTRUCTION(); \
+        goto *dispatchTable[instruction]; \
+    } while (false)
+#else
+#define DISPATCH_LOOP for (;;) switch (TRACE_INSTRUCTION(), instruction = READ_BYTE(), COUNT_INSTRUCTION(), instruction)
+#define OPCODE(name) case name
+#define DEFAULT_OPCODE default
+#define DISPATCH() continue
+#endif
+
+    LOAD_FRAME();
+    uint8_t instruction;
+
+    DISPATCH_LOOP {
+        OPCODE(OP_NOT):
+            push(BOOL_VAL(isFalsey(pop())));
+            DISPATCH();
+        OPCODE(OP_CONSTANT): {
+            Value constant = READ_CONSTANT();
+            push(constant);
+            DISPATCH();
+        }
+        OPCODE(OP_CONSTANT_LONG):
+            push(READ_CONSTANT_LONG());
+            DISPATCH();
+        OPCODE(OP_NEGATE):
+            if (IS_INT(peek(0))) {
+                int64_t a = AS_INT(pop());
+                push(a == 0 ? NUMBER_VAL(-0.0) : INT_VAL(-a));
+                DISPATCH();
             }
-            case OP_NEGATE:
-                if (!IS_NUMBER(peek(0))) {
-                    runtimeError("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
-            case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
-                } else {
-                    runtimeError(
-                            "Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            if (!IS_NUMBER(peek(0))) {
+                RUNTIME_ERROR("Operand must be a number.");
             }
-            case OP_MODULO: {
-                if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
-                    runtimeError("Operands must be numbers for modulo.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+            push(NUMBER_VAL(-AS_NUMBER(pop())));
+            DISPATCH();
+        OPCODE(OP_ADD): {
+            if (IS_INT(peek(0)) && IS_INT(peek(1))) {
+                int64_t b = AS_INT(pop());
+                int64_t a = AS_INT(pop());
+                push(addInts(a, b));
+            } else if (IS_TEXT(peek(0)) && IS_TEXT(peek(1))) {
+                concatenate();
+            } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
                 double b = AS_NUMBER(pop());
                 double a = AS_NUMBER(pop());
-                push(NUMBER_VAL(fmod(a, b)));
-                break;
-            }
-            case OP_SUBTRACT:
-                BINARY_OP(NUMBER_VAL, -);
-                break;
-            case OP_MULTIPLY:
-                BINARY_OP(NUMBER_VAL, *);
-                break;
-            case OP_DIVIDE:
-                BINARY_OP(NUMBER_VAL, /);
-                break;
-            case OP_NIL:
-                push(NIL_VAL);
-                break;
-            case OP_TRUE:
-                push(BOOL_VAL(true));
-                break;
-            case OP_FALSE:
-                push(BOOL_VAL(false));
-                break;
-            case OP_GREATER:
-                BINARY_OP(BOOL_VAL, >);
-                break;
-            case OP_LESS:
-                BINARY_OP(BOOL_VAL, <);
-                break;
-            case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
+                push(NUMBER_VAL(a + b));
+            } else {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
             }
-            case OP_POP:
-                pop();
-                break;
-            case OP_DEFINE_GLOBAL: {
-                ObjString *name = READ_STRING();
-                tableSet(&module->obj.fields, name, peek(0));
-                pop();
-                break;
+            DISPATCH();
+        }
+        OPCODE(OP_MODULO): {
+            if (IS_INT(peek(0)) && IS_INT(peek(1))) {
+                int64_t b = AS_INT(pop());
+                int64_t a = AS_INT(pop());
+                push(moduloInts(a, b));
+                DISPATCH();
             }
-            case OP_GET_GLOBAL: {
-                ObjString *name = READ_STRING();
-                Value value;
-                if (!tableGet(&module->obj.fields, name, &value)) {
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(value);
-                break;
+            if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+                RUNTIME_ERROR("Operands must be numbers for modulo.");
             }
-            case OP_SET_GLOBAL: {
-                ObjString *name = READ_STRING();
-                if (tableSet(&module->obj.fields, name, peek(0))) {
-                    tableDelete(&module->obj.fields, name);
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            double b = AS_NUMBER(pop());
+            double a = AS_NUMBER(pop());
+            push(NUMBER_VAL(fmod(a, b)));
+            DISPATCH();
+        }
+        OPCODE(OP_SUBTRACT):
+            INT_OP(subtractInts(a, b), BINARY_OP(NUMBER_VAL, -));
+            DISPATCH();
+        OPCODE(OP_MULTIPLY):
+            INT_OP(multiplyInts(a, b), BINARY_OP(NUMBER_VAL, *));
+            DISPATCH();
+        OPCODE(OP_DIVIDE):
+            BINARY_OP(NUMBER_VAL, /);
+            DISPATCH();
+        OPCODE(OP_ADD_NUM):
+            INT_OP(addInts(a, b), NUMBER_OP(NUMBER_VAL, +));
+            DISPATCH();
+        OPCODE(OP_SUBTRACT_NUM):
+            INT_OP(subtractInts(a, b), NUMBER_OP(NUMBER_VAL, -));
+            DISPATCH();
+        OPCODE(OP_MULTIPLY_NUM):
+            INT_OP(multiplyInts(a, b), NUMBER_OP(NUMBER_VAL, *));
+            DISPATCH();
+        OPCODE(OP_DIVIDE_NUM):
+            NUMBER_OP(NUMBER_VAL, /);
+            DISPATCH();
+        OPCODE(OP_GREATER_NUM):
+            INT_OP(BOOL_VAL(a > b), NUMBER_OP(BOOL_VAL, >));
+            DISPATCH();
+        OPCODE(OP_LESS_NUM):
+            INT_OP(BOOL_VAL(a < b), NUMBER_OP(BOOL_VAL, <));
+            DISPATCH();
+        OPCODE(OP_CONCAT_STR):
+            concatenate();
+            DISPATCH();
+        OPCODE(OP_NIL):
+            push(NIL_VAL);
+            DISPATCH();
+        OPCODE(OP_TRUE):
+            push(BOOL_VAL(true));
+            DISPATCH();
+        OPCODE(OP_FALSE):
+            push(BOOL_VAL(false));
+            DISPATCH();
+        OPCODE(OP_GREATER):
+            INT_OP(BOOL_VAL(a > b), BINARY_OP(BOOL_VAL, >));
+            DISPATCH();
+        OPCODE(OP_LESS):
+            INT_OP(BOOL_VAL(a < b), BINARY_OP(BOOL_VAL, <));
+            DISPATCH();
+        // Negations of the opposite test, so comparisons with NaN give
+        // the same answer as !(a < b)
+        OPCODE(OP_GREATER_EQUAL):
+            INT_OP(BOOL_VAL(a >= b), NEGATED_BINARY_OP(<));
+            DISPATCH();
+        OPCODE(OP_LESS_EQUAL):
+            INT_OP(BOOL_VAL(a <= b), NEGATED_BINARY_OP(>));
+            DISPATCH();
+        OPCODE(OP_EQUAL): {
+            Value b = pop();
+            Value a = pop();
+            push(BOOL_VAL(valuesEqual(a, b)));
+            DISPATCH();
+        }
+        OPCODE(OP_NOT_EQUAL): {
+            Value b = pop();
+            Value a = pop();
+            push(BOOL_VAL(!valuesEqual(a, b)));
+            DISPATCH();
+        }
+        OPCODE(OP_POP):
+            pop();
+            DISPATCH();
+        OPCODE(OP_DEFINE_GLOBAL_SLOT): {
+            uint16_t slot = READ_SHORT();
+            globalModule->globals.values[slot] = pop();
+            globalModule->globalsDirty = true;
+            WRITE_BARRIER(globalModule->globals.values[slot]);
+            DISPATCH();
+        }
+        OPCODE(OP_GET_GLOBAL_SLOT): {
+            uint16_t slot = READ_SHORT();
+            Value value = globalModule->globals.values[slot];
+            if (IS_UNDEFINED(value)) {
+                RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot)->chars);
             }
-            case OP_GET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                push(currentFrame->slots[slot]);
-                break;
+            push(value);
+            DISPATCH();
+        }
+        OPCODE(OP_SET_GLOBAL_SLOT): {
+            uint16_t slot = READ_SHORT();
+            if (IS_UNDEFINED(globalModule->globals.values[slot])) {
+                RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot)->chars);
             }
-            case OP_SET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                currentFrame->slots[slot] = peek(0);
-                break;
+            globalModule->globals.values[slot] = peek(0);
+            globalModule->globalsDirty = true;
+            WRITE_BARRIER(peek(0));
+            DISPATCH();
+        }
+        OPCODE(OP_GET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            push(slots[slot]);
+            DISPATCH();
+        }
+        OPCODE(OP_SET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            slots[slot] = peek(0);
+            DISPATCH();
+        }
+        OPCODE(OP_GET_LOCAL_LONG):
+            push(slots[READ_SHORT()]);
+            DISPATCH();
+        OPCODE(OP_SET_LOCAL_LONG):
+            slots[READ_SHORT()] = peek(0);
+            DISPATCH();
+        OPCODE(OP_IN_PLACE_ADD): {
+            uint8_t slot = READ_BYTE();
+            Value amount = READ_CONSTANT();
+            if (IS_INT(slots[slot]) && IS_INT(amount)) {
+                slots[slot] = addInts(AS_INT(slots[slot]), AS_INT(amount));
+                DISPATCH();
             }
-            case OP_JUMP: {
-                uint16_t offset = READ_SHORT();
-                currentFrame->ip += offset;
-                break;
+            if (!IS_NUMBER(slots[slot])) {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
             }
-            case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
-                if (isFalsey(peek(0))) currentFrame->ip += offset;
-                break;
+            slots[slot] = NUMBER_VAL(AS_NUMBER(slots[slot]) + AS_NUMBER(amount));
+            DISPATCH();
+        }
+        OPCODE(OP_IN_PLACE_SUBTRACT): {
+            uint8_t slot = READ_BYTE();
+            Value amount = READ_CONSTANT();
+            if (IS_INT(slots[slot]) && IS_INT(amount)) {
+                slots[slot] = subtractInts(AS_INT(slots[slot]), AS_INT(amount));
+                DISPATCH();
             }
-            case OP_LOOP: {
-                uint16_t offset = READ_SHORT();
-                currentFrame->ip -= offset;
-                break;
+            if (!IS_NUMBER(slots[slot])) {
+                RUNTIME_ERROR("Operands must be numbers for binary op.");
             }
-            case OP_CALL: {
-                int argCount = READ_BYTE();
-                if (!callValue(peek(argCount), argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-
-                VM *localVM = &vm;
-                currentFrame = CURRENT_TASK;
-                break;
+            slots[slot] = NUMBER_VAL(AS_NUMBER(slots[slot]) - AS_NUMBER(amount));
+            DISPATCH();
+        }
+        OPCODE(OP_ADD_LOCALS): {
+            uint8_t dst = READ_BYTE();
+            Value a = slots[READ_BYTE()];
+            Value b = slots[READ_BYTE()];
+            if (IS_INT(a) && IS_INT(b)) {
+                slots[dst] = addInts(AS_INT(a), AS_INT(b));
+            } else if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                slots[dst] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+            } else if (IS_TEXT(a) && IS_TEXT(b)) {
+                push(a);
+                push(b);
+                concatenate();
+                slots[dst] = pop();
+            } else {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
             }
-            case OP_GETITEM: {
-                Value indexValue = pop();
-                Value value = pop();
-                if (isObjType(value, OBJ_LIST)) {
-                    int index = trunc(AS_NUMBER(indexValue));
-                    push(getListItem((ObjList *) AS_OBJ(value), index));
-                } else if (isObjType(value, OBJ_MAP)) {
-                    push(getMapItem((ObjMap *) AS_OBJ(value), indexValue));
-                }
-                break;
+            DISPATCH();
+        }
+        OPCODE(OP_SUBTRACT_LOCALS):
+            INT_LOCALS_OP(subtractInts, -);
+            DISPATCH();
+        OPCODE(OP_MULTIPLY_LOCALS):
+            INT_LOCALS_OP(multiplyInts, *);
+            DISPATCH();
+        OPCODE(OP_DIVIDE_LOCALS):
+            LOCALS_OP(/);
+            DISPATCH();
+        OPCODE(OP_JUMP): {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            DISPATCH();
+        }
+        OPCODE(OP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(peek(0))) ip += offset;
+            DISPATCH();
+        }
+        OPCODE(OP_POP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(pop())) ip += offset;
+            DISPATCH();
+        }
+        OPCODE(OP_JUMP_UNLESS_EQUAL): {
+            uint16_t offset = READ_SHORT();
+            Value b = pop();
+            Value a = pop();
+            if (!valuesEqual(a, b)) ip += offset;
+            DISPATCH();
+        }
+        OPCODE(OP_JUMP_UNLESS_NOT_EQUAL): {
+            uint16_t offset = READ_SHORT();
+            Value b = pop();
+            Value a = pop();
+            if (valuesEqual(a, b)) ip += offset;
+            DISPATCH();
+        }
+        OPCODE(OP_JUMP_UNLESS_GREATER):
+            COMPARE_JUMP(a > b);
+            DISPATCH();
+        OPCODE(OP_JUMP_UNLESS_GREATER_EQUAL):
+            COMPARE_JUMP(!(a < b));
+            DISPATCH();
+        OPCODE(OP_JUMP_UNLESS_LESS):
+            COMPARE_JUMP(a < b);
+            DISPATCH();
+        OPCODE(OP_JUMP_UNLESS_LESS_EQUAL):
+            COMPARE_JUMP(!(a > b));
+            DISPATCH();
+        OPCODE(OP_LOOP): {
+            uint16_t offset = READ_SHORT();
+            // Before jumping, so a sample lands on the loop and not the line before it
+            GC_SAFE_POINT();
+            ip -= offset;
+#ifdef JIT_ENABLED
+            warmUp(currentFrame->closure->function);
+#endif
+            RUN_COMPILED();
+            DISPATCH();
+        }
+        OPCODE(OP_ITER_INIT): {
+            InlineCache *cache = &caches[READ_SHORT()];
+            Value iterable = peek(0);
+            // Lists and maps are walked in place by OP_ITER_NEXT
+            if (IS_LIST(iterable) || IS_MAP(iterable) || IS_FLOAT64_ARRAY(iterable)) DISPATCH();
+            if (!IS_INSTANCE(iterable)) {
+                RUNTIME_ERROR("Can only iterate over lists, maps and iterables.");
             }
-            case OP_PIPE: {
-                Value callee = pop();
-                Value argument = pop();
-                push(callee);
-                push(argument);
 
-                if (!callValue(peek(1), 1)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-
-                currentFrame = CURRENT_TASK;
-                break;
+            // The iterator takes the iterable's place
+            SAVE_FRAME();
+            GC_SAFE_POINT();
+            if (!invoke(vm.iterString, 0, cache)) {
+                THROW();
             }
-            case OP_LIST: {
-                int argCount = READ_BYTE();
-                ObjList *list = newList();
-                push(OBJ_VAL(list));
-                for (int i = argCount; i > 0; i--) {
-                    listPush(list, peek(i));
-                }
-                for (int i = 0; i < argCount + 1; i++) {
-                    pop();
+            PARK_IF_REQUESTED();
+            currentFrame = CURRENT_FRAME;
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        OPCODE(OP_ITER_NEXT): {
+            uint8_t *start = ip - 1;
+            uint16_t offset = READ_SHORT();
+            uint8_t *exit = ip + offset;
+            uint16_t slot = READ_SHORT();
+            InlineCache *cache = &caches[READ_SHORT()];
+            Value *state = &slots[slot];
+            Value iterable = slots[slot + 1];
+
+            if (IS_LIST(iterable)) {
+                ObjList *list = AS_LIST(iterable);
+                int index = (int) AS_NUMBER(*state);
+                if (index >= list->items.count) {
+                    ip = exit;
+                    DISPATCH();
                 }
-                push(OBJ_VAL(list));
-                break;
+                *state = INT_VAL(index + 1);
+                push(list->items.values[index]);
+                DISPATCH();
             }
-            case OP_MAP: {
-                int argCount = READ_BYTE();
-                ObjMap *map = newMap();
-                push(OBJ_VAL(map));
-                for (int i = argCount; i > 0; i--) {
-                    valueTableSet(&map->values, peek(2 * i), peek(2 * i - 1));
+            if (IS_FLOAT64_ARRAY(iterable)) {
+                ObjFloat64Array *array = AS_FLOAT64_ARRAY(iterable);
+                int index = (int) AS_NUMBER(*state);
+                if (index >= array->length) {
+                    ip = exit;
+                    DISPATCH();
                 }
-                for (int i = 0; i < argCount + 1; i++) {
-                    pop();
-                    pop();
+                *state = INT_VAL(index + 1);
+                push(NUMBER_VAL(array->values[index]));
+                DISPATCH();
+            }
+            if (IS_MAP(iterable)) {
+                ValueTable *table = &AS_MAP(iterable)->values;
+                int index = (int) AS_NUMBER(*state);
+                while (index < table->entryCount && IS_NIL(table->entries[index].key)) index++;
+                if (index >= table->entryCount) {
+                    ip = exit;
+                    DISPATCH();
                 }
-                push(OBJ_VAL(map));
-                break;
+                *state = INT_VAL(index + 1);
+                push(table->entries[index].key);
+                DISPATCH();
             }
-            case OP_CLOSURE: {
-                ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
-                ObjClosure *closure = newClosure(function);
-                push(OBJ_VAL(closure));
-
-                for (int i = 0; i < closure->upvalueCount; i++) {
-                    uint8_t isLocal = READ_BYTE();
-                    uint8_t index = READ_BYTE();
-                    if (isLocal) {
-                        closure->upvalues[i] = captureUpvalue(currentFrame->slots + index);
-                    } else {
-                        closure->upvalues[i] = currentFrame->closure->upvalues[index];
+
+            // An iterator is asked next?() and then next(), this instruction
+            // runs again once each returns and the state says which it was
+            ObjString *method;
+            switch ((int) AS_NUMBER(*state)) {
+                case 0:
+                    method = vm.hasNextString;
+                    *state = INT_VAL(1);
+                    break;
+                case 1:
+                    if (isFalsey(pop())) {
+                        *state = INT_VAL(0);
+                        ip = exit;
+                        DISPATCH();
                     }
-                }
+                    method = vm.nextString;
+                    cache++;
+                    *state = INT_VAL(2);
+                    break;
+                default:
+                    // The item next() returned is on the stack
+                    *state = INT_VAL(0);
+                    DISPATCH();
+            }
 
-                break;
+            push(iterable);
+            ip = start;
+            SAVE_FRAME();
+            GC_SAFE_POINT();
+            if (!invoke(method, 0, cache)) {
+                THROW();
             }
-            case OP_GET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                push(*currentFrame->closure->upvalues[slot]->location);
-                break;
+            PARK_IF_REQUESTED();
+            currentFrame = CURRENT_FRAME;
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        OPCODE(OP_CALL): {
+            int argCount = READ_BYTE();
+            SAVE_FRAME();
+            GC_SAFE_POINT();
+            if (!callValue(peek(argCount), argCount)) {
+                THROW();
             }
-            case OP_SET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                *currentFrame->closure->upvalues[slot]->location = peek(0);
-                break;
+
+            PARK_IF_REQUESTED();
+            currentFrame = CURRENT_FRAME;
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        OPCODE(OP_TAIL_CALL): {
+            int argCount = READ_BYTE();
+            SAVE_FRAME();
+            GC_SAFE_POINT();
+            // A closure's frame takes the place of this one, which is done
+            // with. Anything else is an ordinary call, and the OP_RETURN
+            // after this returns its result.
+            Value callee = peek(argCount);
+            if (IS_CLOSURE(callee) && AS_CLOSURE(callee)->function->arity == argCount) {
+                closeUpvalues(slots);
+                memmove(slots, vm.stackTop - argCount - 1, sizeof(Value) * (argCount + 1));
+                vm.stackTop = slots + argCount + 1;
+                CURRENT_TASK->frameCount--;
+            }
+            if (!callValue(peek(argCount), argCount)) {
+                THROW();
+            }
+
+            PARK_IF_REQUESTED();
+            currentFrame = CURRENT_FRAME;
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        OPCODE(OP_GETITEM): {
+            Value indexValue = pop();
+            Value value = pop();
+            SAVE_FRAME();
+            if (isObjType(value, OBJ_LIST)) {
+                ObjList *list = (ObjList *) AS_OBJ(value);
+                int64_t index = toIndex(indexValue);
+                if (index < 0 || index >= list->items.count) RUNTIME_ERROR("Index out of bounds");
+                push(list->items.values[index]);
+            } else if (isObjType(value, OBJ_MAP)) {
+                push(getMapItem((ObjMap *) AS_OBJ(value), indexValue));
+            } else if (IS_FLOAT64_ARRAY(value)) {
+                ObjFloat64Array *array = AS_FLOAT64_ARRAY(value);
+                int64_t index = toIndex(indexValue);
+                if (index < 0 || index >= array->length) RUNTIME_ERROR("Index out of bounds");
+                push(NUMBER_VAL(array->values[index]));
+            } else {
+                RUNTIME_ERROR("Can only index lists, maps and arrays.");
+            }
+            DISPATCH();
+        }
+        OPCODE(OP_SETITEM): {
+            // Everything stays on the stack while a map's table may grow
+            Value item = peek(0);
+            Value indexValue = peek(1);
+            Value value = peek(2);
+            if (IS_LIST(value)) {
+                ObjList *list = AS_LIST(value);
+                int64_t index = toIndex(indexValue);
+                if (index < 0 || index >= list->items.count) RUNTIME_ERROR("Index out of bounds");
+                listOwnItems(list);
+                list->items.values[index] = item;
+                WRITE_BARRIER(item);
+            } else if (IS_MAP(value)) {
+                valueTableSet(&AS_MAP(value)->values, indexValue, item);
+                WRITE_BARRIER(indexValue);
+                WRITE_BARRIER(item);
+            } else if (IS_FLOAT64_ARRAY(value)) {
+                ObjFloat64Array *array = AS_FLOAT64_ARRAY(value);
+                int64_t index = toIndex(indexValue);
+                if (index < 0 || index >= array->length) RUNTIME_ERROR("Index out of bounds");
+                if (!IS_NUMBER(item)) RUNTIME_ERROR("A Float64Array can only hold numbers.");
+                array->values[index] = AS_NUMBER(item);
+            } else {
+                RUNTIME_ERROR("Can only index lists, maps and arrays.");
+            }
+            vm.stackTop -= 3;
+            // The assignment evaluates to the stored value
+            push(item);
+            DISPATCH();
+        }
+        OPCODE(OP_GETITEM_LIST_NUM): {
+            Value indexValue = pop();
+            ObjList *list = AS_LIST(pop());
+            int64_t index = toIndex(indexValue);
+            if (index < 0 || index >= list->items.count) RUNTIME_ERROR("Index out of bounds");
+            push(list->items.values[index]);
+            DISPATCH();
+        }
+        OPCODE(OP_PIPE): {
+            Value callee = pop();
+            Value argument = pop();
+            push(callee);
+            push(argument);
+
+            SAVE_FRAME();
+            if (!callValue(peek(1), 1)) {
+                THROW();
+            }
+
+            PARK_IF_REQUESTED();
+            currentFrame = CURRENT_FRAME;
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        OPCODE(OP_LIST): {
+            int argCount = READ_BYTE();
+            ObjList *list = newList();
+            push(OBJ_VAL(list));
+            for (int i = argCount; i > 0; i--) {
+                listPush(list, peek(i));
             }
-            case OP_CLOSE_UPVALUE:
-                closeUpvalues(vm.stackTop - 1);
+            for (int i = 0; i < argCount + 1; i++) {
                 pop();
-                break;
-            case OP_CLASS:
-                push(OBJ_VAL(newClass(READ_STRING())));
-                break;
-            case OP_GET_PROPERTY: {
-                if (!IS_INSTANCE(peek(0)) && !IS_LIST(peek(0))) {
-                    runtimeError("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
+            }
+            push(OBJ_VAL(list));
+            DISPATCH();
+        }
+        OPCODE(OP_LIST_EXTEND): {
+            int argCount = READ_BYTE();
+            ObjList *list = AS_LIST(peek(argCount));
+            // The list may have been traced while its items were computed
+            for (int i = argCount - 1; i >= 0; i--) {
+                listPush(list, peek(i));
+                WRITE_BARRIER(peek(i));
+            }
+            vm.stackTop -= argCount;
+            DISPATCH();
+        }
+        OPCODE(OP_MAP): {
+            int argCount = READ_BYTE();
+            ObjMap *map = newMap();
+            push(OBJ_VAL(map));
+            for (int i = argCount; i > 0; i--) {
+                valueTableSet(&map->values, peek(2 * i), peek(2 * i - 1));
+            }
+            vm.stackTop -= 2 * argCount + 1;
+            push(OBJ_VAL(map));
+            DISPATCH();
+        }
+        OPCODE(OP_MAP_EXTEND): {
+            int argCount = READ_BYTE();
+            ObjMap *map = AS_MAP(peek(2 * argCount));
+            for (int i = argCount; i > 0; i--) {
+                valueTableSet(&map->values, peek(2 * i - 1), peek(2 * i - 2));
+                WRITE_BARRIER(peek(2 * i - 1));
+                WRITE_BARRIER(peek(2 * i - 2));
+            }
+            vm.stackTop -= 2 * argCount;
+            DISPATCH();
+        }
+        OPCODE(OP_CLOSURE): {
+            ObjFunction *function = AS_FUNCTION(READ_CONSTANT_LONG());
+            ObjClosure *closure = newClosure(function);
+            push(OBJ_VAL(closure));
+
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                uint8_t isLocal = READ_BYTE();
+                uint16_t index = READ_SHORT();
+                if (isLocal) {
+                    closure->upvalues[i] = captureUpvalue(slots + index);
+                } else {
+                    closure->upvalues[i] = currentFrame->closure->upvalues[index];
                 }
+            }
 
-                ObjInstance *instance = AS_INSTANCE(peek(0));
-                ObjString *name = READ_STRING();
+            DISPATCH();
+        }
+        OPCODE(OP_GET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            push(*currentFrame->closure->upvalues[slot]->location);
+            DISPATCH();
+        }
+        OPCODE(OP_SET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            *currentFrame->closure->upvalues[slot]->location = peek(0);
+            WRITE_BARRIER(peek(0));
+            DISPATCH();
+        }
+        // The compiler only emits these in closures that are called
+        // directly by the frame that made them, which is the one below
+        OPCODE(OP_GET_ENCLOSING):
+            push(currentFrame[-1].slots[READ_SHORT()]);
+            DISPATCH();
+        OPCODE(OP_SET_ENCLOSING):
+            currentFrame[-1].slots[READ_SHORT()] = peek(0);
+            DISPATCH();
+        OPCODE(OP_CLOSE_UPVALUE):
+            closeUpvalues(vm.stackTop - 1);
+            pop();
+            DISPATCH();
+        OPCODE(OP_CLASS):
+            push(OBJ_VAL(newClass(READ_STRING())));
+            DISPATCH();
+        OPCODE(OP_GET_LOCAL_PROPERTY):
+            // Followed by the same operands as OP_GET_PROPERTY
+            push(slots[READ_BYTE()]);
+            goto getProperty;
+        OPCODE(OP_GET_PROPERTY):
+        getProperty: {
+            if (!IS_INSTANCE(peek(0)) && !IS_LIST(peek(0))) {
+                RUNTIME_ERROR("Only instances have properties.");
+            }
 
-                Value value;
-                if (tableGet(&instance->fields, name, &value)) {
-                    pop(); // Instance.
-                    push(value);
-                    break;
-                }
+            ObjInstance *instance = AS_INSTANCE(peek(0));
+            ObjString *name = READ_STRING();
+            InlineCache *cache = &caches[READ_SHORT()];
 
-                if (!bindMethod(instance->klass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            Value *field = findField(instance, name, cache);
+            if (field != NULL) {
+                pop(); // Instance.
+                push(*field);
+                DISPATCH();
             }
-            case OP_SET_PROPERTY: {
-                ObjInstance *instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_STRING(), peek(0));
-                Value value = pop();
-                pop();
-                push(value);
-                break;
+
+            SAVE_FRAME();
+            if (!findMethod(name, cache)) {
+                THROW();
             }
-            case OP_METHOD:
-                defineMethod(READ_STRING());
-                break;
-            case OP_FIELD:
-                defineField(READ_STRING());
-                break;
-            case OP_INVOKE: {
-                ObjString *method = READ_STRING();
-                int argCount = READ_BYTE();
-                if (!invoke(method, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                currentFrame = CURRENT_TASK;
-                break;
+            ObjBoundMethod *bound = newBoundMethod(peek(0), AS_CLOSURE(cache->method));
+            pop();
+            push(OBJ_VAL(bound));
+            DISPATCH();
+        }
+        OPCODE(OP_SET_PROPERTY): {
+            ObjInstance *instance = AS_INSTANCE(peek(1));
+            ObjString *name = READ_STRING();
+            InlineCache *cache = &caches[READ_SHORT()];
+
+            Value *field = findField(instance, name, cache);
+            if (field != NULL) {
+                *field = peek(0);
+                WRITE_BARRIER(peek(0));
+            } else {
+                tableSet(&instance->fields, name, peek(0));
+            }
+            if (instance->klass == (ObjClass *) moduleType) {
+                storeModuleGlobal((ObjModule *) instance, name, peek(0));
+            }
+            Value value = pop();
+            pop();
+            push(value);
+            DISPATCH();
+        }
+        OPCODE(OP_METHOD):
+            defineMethod(READ_STRING());
+            DISPATCH();
+        OPCODE(OP_FIELD):
+            defineField(READ_STRING());
+            DISPATCH();
+        OPCODE(OP_INVOKE): {
+            ObjString *method = READ_STRING();
+            int argCount = READ_BYTE();
+            InlineCache *cache = &caches[READ_SHORT()];
+            SAVE_FRAME();
+            GC_SAFE_POINT();
+            if (!invoke(method, argCount, cache)) {
+                THROW();
+            }
+            PARK_IF_REQUESTED();
+            currentFrame = CURRENT_FRAME;
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        OPCODE(OP_INHERIT): {
+            Value superclass = peek(1);
+            if (!IS_CLASS(superclass) && !IS_BUILTIN_TYPE(superclass)) {
+                RUNTIME_ERROR("Superclass must be a class.");
             }
-            case OP_INHERIT: {
-                Value superclass = peek(1);
-                if (!IS_CLASS(superclass) && !IS_BUILTIN_TYPE(superclass)) {
-                    runtimeError("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
 
-                ObjClass *subclass = AS_CLASS(peek(0));
-                tableAddAll(&AS_CLASS(superclass)->methods,
-                            &subclass->methods);
-                pop(); // Subclass.
-                break;
+            ObjClass *subclass = AS_CLASS(peek(0));
+            tableAddAll(&AS_CLASS(superclass)->methods,
+                        &subclass->methods);
+            // Inherited fields keep their slots so the subclass's own come after
+            tableAddAll(&AS_CLASS(superclass)->layout, &subclass->layout);
+            for (int i = 0; i < AS_CLASS(superclass)->defaults.count; i++) {
+                writeValueArray(&subclass->defaults, AS_CLASS(superclass)->defaults.values[i]);
             }
-            case OP_GET_SUPER: {
-                ObjString *name = READ_STRING();
-                ObjClass *superclass = AS_CLASS(pop());
+            touchClass(subclass);
+            pop(); // Subclass.
+            DISPATCH();
+        }
+        OPCODE(OP_GET_SUPER): {
+            ObjString *name = READ_STRING();
+            ObjClass *superclass = AS_CLASS(pop());
 
-                if (!bindMethod(superclass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            SAVE_FRAME();
+            if (!bindMethod(superclass, name)) {
+                THROW();
+            }
+            DISPATCH();
+        }
+        OPCODE(OP_SUPER_INVOKE): {
+            ObjString *method = READ_STRING();
+            int argCount = READ_BYTE();
+            ObjClass *superclass = AS_CLASS(pop());
+            SAVE_FRAME();
+            if (!invokeFromClass(superclass, method, argCount)) {
+                THROW();
             }
-            case OP_SUPER_INVOKE: {
-                ObjString *method = READ_STRING();
-                int argCount = READ_BYTE();
-                ObjClass *superclass = AS_CLASS(pop());
-                if (!invokeFromClass(superclass, method, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
 
-                currentFrame = CURRENT_TASK;
-                break;
+            PARK_IF_REQUESTED();
+            currentFrame = CURRENT_FRAME;
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        OPCODE(OP_YIELD): {
+            if (nativeCallTask != NULL) {
+                RUNTIME_ERROR("Can't yield inside a function called by a native.");
             }
-            case OP_YIELD: {
-                Value value = pop();
-                // I don't remember why this second pop was here
-                // Hope removing it doesn't mess anything up
-                // pop();
+            Value value = pop();
+            // I don't remember why this second pop was here
+            // Hope removing it doesn't mess anything up
+            // pop();
 
-                save_current_frame();
-                handle_yield_value(value);
+            SAVE_FRAME();
+            save_current_frame();
+            handle_yield_value(value);
 
-                if (vm.tasks.count) {
-                    load_new_frame();
-                } else {
-                    int status;
-                    while (true) {
-                        status = getTasks();
-                        switch (status) {
-                            case 0: {
-                                pop();
-                                return INTERPRET_OK;
-                            }
-                            case -1: {
-                                unsigned int utime = 10000;
-                                usleep(utime);
-                                // TODO: Sleep until a task is ready bit by bit
-                                continue;
-                            }
-                            case 1: {
-                                load_new_frame();
-                                break;
-                            }
-                        }
-                        break;
-                    }
-                }
-                currentFrame = CURRENT_TASK;
+            if (!resume_next_task()) {
+                pop();
+                return INTERPRET_OK;
+            }
+            currentFrame = CURRENT_FRAME;
+            LOAD_FRAME();
 
-                break;
+            DISPATCH();
+        }
+        OPCODE(OP_THROW): {
+            Value error = pop();
+            SAVE_FRAME();
+            if (!isCaught()) {
+                if (IS_ROPE(error)) error = OBJ_VAL(flattenRope(AS_ROPE(error)));
+                if (IS_STRING(error)) RUNTIME_ERROR("%s", AS_CSTRING(error));
+                RUNTIME_ERROR("Uncaught exception.");
             }
-            case OP_IMPORT: {
-                Value relPath = peek(0);
-                ObjModule *newModule = executeModule(AS_STRING(relPath));
-                push(OBJ_VAL(newModule));
-                break;
+            vm.error = error;
+            THROW();
+        }
+        OPCODE(OP_IMPORT): {
+            Value relPath = peek(0);
+            SAVE_FRAME();
+            ObjModule *newModule = executeModule(AS_STRING(relPath));
+            if (!nativeSucceeded()) THROW();
+            // The module takes the path's place
+            vm.stackTop[-1] = OBJ_VAL(newModule);
+            currentFrame = CURRENT_FRAME;
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        OPCODE(OP_RETURN): {
+            Value result = pop();
+            ObjCallFrame *task = CURRENT_TASK;
+            closeUpvalues(slots);
+            task->frameCount--;
+
+            if (task == nativeCallTask && task->frameCount == nativeCallBase) {
+                vm.stackTop = slots;
+                push(result);
+                currentFrame = CURRENT_FRAME;
+                return INTERPRET_OK;
             }
-            case OP_RETURN: {
-                Value result = pop();
-                currentFrame->state |= FINISHED;
-                closeUpvalues(currentFrame->slots);
-
-                if (currentFrame->closure->function->name == NULL && moduleContext == IMPORT) {
-                    vm.tasks.values[vm.currentTask] = OBJ_VAL(CURRENT_TASK->parent);
-                    vm.stackTop = currentFrame->slots;
-                    push(result);
-                    currentFrame = CURRENT_TASK;
-                    pop();
-                    return INTERPRET_OK;
-                }
 
-                POP_CALL(result);
-                if (currentFrame == NULL) {
-                    int status;
-                    while (true) {
-                        status = getTasks();
-                        switch (status) {
-                            case 0: {
-                                pop();
-                                return INTERPRET_OK;
-                            }
-                            case -1: {
-                                unsigned int utime = 10000;
-                                usleep(utime);
-                                continue;
-                            }
-                            case 1: {
-                                load_new_frame();
-                                break;
-                            }
-                        }
-                        break;
-                    }
-                }
+            if (currentFrame->closure->function->name == NULL && moduleContext == IMPORT) {
+                vm.stackTop = slots;
+                // The module may have been the task's only frame
+                if (task->frameCount > 0) currentFrame = CURRENT_FRAME;
+                return INTERPRET_OK;
+            }
 
-                break;
+            if (task->frameCount > 0) {
+                vm.stackTop = slots;
+                push(result);
+                currentFrame = CURRENT_FRAME;
+                LOAD_FRAME();
+                DISPATCH();
             }
+
+            // The outermost function of the task returned, so the task is done
+            finishTask(task, result);
+            save_current_frame();
+            pop_frame();
+            if (!resume_next_task()) {
+                pop();
+                return INTERPRET_OK;
+            }
+
+            currentFrame = CURRENT_FRAME;
+            LOAD_FRAME();
+            DISPATCH();
         }
+        throwError:
+            if (!catchError()) return INTERPRET_RUNTIME_ERROR;
+            currentFrame = CURRENT_FRAME;
+            LOAD_FRAME();
+            DISPATCH();
+        DEFAULT_OPCODE:
+            RUNTIME_ERROR("Unknown opcode %d.", instruction);
     }
 
+#undef SAVE_FRAME
+#undef GC_SAFE_POINT
+#undef RUN_COMPILED
+#undef LOAD_FRAME
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
+#undef READ_CONSTANT_LONG
 #undef READ_STRING
+#undef GLOBAL_NAME
+#undef THROW
+#undef RUNTIME_ERROR
+#undef PARK_IF_REQUESTED
 #undef BINARY_OP
+#undef NUMBER_OP
+#undef NEGATED_BINARY_OP
+#undef LOCALS_OP
+#undef INT_LOCALS_OP
+#undef INT_OP
+#undef COMPARE_JUMP
+#undef TRACE_INSTRUCTION
+#undef COUNT_INSTRUCTION
+#undef DISPATCH_LOOP
+#undef OPCODE
+#undef DEFAULT_OPCODE
+#undef DISPATCH
 }
 
-ObjModule *interpret(StmtArray *body, const char *name, const char *path) {
-    ObjModule *module = newModule(name, path, true);
-    push(OBJ_VAL(module));
-    ObjFunction *function = compile(body);
+bool insideNativeCall() {
+    return nativeCallTask != NULL;
+}
+
+bool callFromNative(Value callee, int argCount, Value *args, Value *result) {
+    ObjCallFrame *task = CURRENT_TASK;
+    int base = task->frameCount;
+    push(callee);
+    for (int i = 0; i < argCount; i++) push(args[i]);
+    if (!callValue(callee, argCount)) {
+        nativeCallFailed = true;
+        return false;
+    }
+
+    // Natives and builtin types already left their result, closures run now
+    if (task->frameCount > base) {
+        ObjCallFrame *outerTask = nativeCallTask;
+        int outerBase = nativeCallBase;
+        nativeCallTask = task;
+        nativeCallBase = base;
+        InterpretResult status = run(currentFrame->closure->function->module);
+        nativeCallTask = outerTask;
+        nativeCallBase = outerBase;
+        if (status != INTERPRET_OK) {
+            nativeCallFailed = true;
+            return false;
+        }
+    }
+
+    *result = pop();
+    return true;
+}
+
+// Runs the top level of module, which must be on top of the stack
+static ObjModule *runModule(ObjModule *module, ObjFunction *function) {
     if (function == NULL) {
         module->result = INTERPRET_COMPILE_ERROR;
         return module;
@@ -871,11 +1850,23 @@ ObjModule *interpret(StmtArray *body, const char *name, const char *path) {
     InterpretResult result = run(module);
 
     module->result = result;
+    flushModuleGlobals(module);
 
-    pop();
+    // A runtime error already reset the stack
+    if (result != INTERPRET_RUNTIME_ERROR) {
+        pop();
+    }
     return module;
 }
 
+ObjModule *interpret(StmtArray *body, const char *name, const char *path) {
+    ObjModule *module = newModule(name, path, true);
+    push(OBJ_VAL(module));
+    ObjFunction *function = compile(body, module);
+    freeNodes();
+    return runModule(module, function);
+}
+
 char *remove_n(char *dst, const char *filename, int n) {
     size_t len = strlen(filename);
     memcpy(dst, filename, len - n);
@@ -887,19 +1878,37 @@ ObjModule *executeModule(ObjString *relPath) {
     ModuleContext temp = moduleContext;
     moduleContext = IMPORT;
     char *path = findModule(relPath->chars);
+    loadBuiltinModule(path, (int) strlen(path));
 
     Value cachedModule;
     if (tableGet(&vm.modules, copyString(path, (int) strlen(path)), &cachedModule)) {
         return AS_MODULE(cachedModule);
     }
-    char *source = readFile(path);
     char chars[64];
     remove_n(chars, basename(relPath->chars), 4);
 
-    StmtArray *body = parseAST(source);
-//    evaluateTree(body);
-    ObjModule *module = interpret(body, chars, path);
-    free(source);
+    ObjModule *module = newModule(chars, path, true);
+    push(OBJ_VAL(module));
+    // Modules in the bundle are used without reading their source
+    char *source = NULL;
+    ObjFunction *function = loadBundledModule(path, module);
+    if (function == NULL) {
+        source = readFile(path);
+        function = loadBytecode(path, source, module);
+    }
+    if (function == NULL) {
+        StmtArray *body = parseAST(source);
+//        evaluateTree(body);
+        function = compile(body, module);
+        freeNodes();
+        if (body != NULL && function != NULL) {
+            push(OBJ_VAL(function));
+            saveBytecode(path, source, function, module);
+            pop();
+        }
+    }
+    runModule(module, function);
+    freeFile(source);
     moduleContext = temp;
     if (module->result == INTERPRET_COMPILE_ERROR) runtimeError("Compile error");
     if (module->result == INTERPRET_RUNTIME_ERROR) runtimeError("Runtime error");
@@ -22,31 +22,75 @@ typedef enum {
     IMPORT = 1,
 } ModuleContext;
 
-typedef struct ObjCallFrame {
-    Obj obj;
+typedef struct {
     ObjClosure *closure;
     uint8_t *ip;
-    int index;
     Value *slots;
-    struct ObjCallFrame *parent;
+} CallFrame;
+
+// Runnable tasks of a higher priority run first, Task.spawn() takes one from
+// 0 to PRIORITY_LEVELS - 1
+#define PRIORITY_LEVELS 4
+#define DEFAULT_PRIORITY 1
+
+// A task: the heap object holding a coroutine's call and value stacks.
+// Synchronous calls only push onto frames, a task is allocated once when it
+// is spawned. Each task owns its value stack so switching tasks only swaps
+// vm.stack over, the stack grows when a new frame doesn't fit.
+typedef struct ObjCallFrame {
+    Obj obj;
+    CallFrame frames[FRAMES_MAX];
+    int frameCount;
+    int index;
     CallState state;
+    int priority;
+
+    Value *stack;
+    Value *stackTop;
+    int stackCapacity;
+    ObjUpvalue *openUpvalues;
+
+    // Links the task into the wait queue it is parked on, if any
+    struct ObjCallFrame *next;
+    // Tasks parked in join() until this one finishes
+    struct ObjCallFrame *joiners;
+    // What the task finishes once the descriptor it's parked on is ready
+    struct IoOperation *operation;
 
     Value stored;
-    ValueArray stack;
     Value result;
 } ObjCallFrame;
 
-ObjCallFrame *currentFrame;
+extern _Thread_local CallFrame *currentFrame;
+
+#define CURRENT_TASK (vm.runningTask)
 
-#define CURRENT_TASK \
-    AS_CALL_FRAME(vm.tasks.values[vm.currentTask])
+#define CURRENT_FRAME \
+    (&CURRENT_TASK->frames[CURRENT_TASK->frameCount - 1])
 
+// A ring buffer of the runnable tasks of one priority
 typedef struct {
-    ValueArray tasks;
-    int currentTask;
+    ObjCallFrame **tasks;
+    int head;
+    int count;
+    int capacity;
+    // How often the task at the head was passed over for higher priorities
+    int skipped;
+} RunQueue;
 
-    Value stack[STACK_MAX];
+typedef struct {
+    // NULL between turns, the task that runs next is taken from the highest
+    // priority queue with any in it
+    ObjCallFrame *runningTask;
+    RunQueue runQueues[PRIORITY_LEVELS];
+    int runnableCount;
+
+    // The running task's stack, see load_new_frame()
+    Value *stack;
     Value *stackTop;
+    ObjUpvalue *openUpvalues;
+    ObjCallFrame *mainTask;
+
     Obj *objects;
 
     int grayCount;
@@ -56,6 +100,10 @@ typedef struct {
     size_t bytesAllocated;
     size_t nextGC;
     bool vmReady;
+    // Set by a native that parked the running task, see parkOnQueue()
+    bool taskParked;
+    // What is being thrown while frames unwind to the catch block taking it
+    Value error;
 
     Table types;
     Table modules;
@@ -63,7 +111,10 @@ typedef struct {
     Table strings;
     Table atoms;
     ObjString *initString;
-    ObjUpvalue *openUpvalues;
+    // The iterator protocol for-in loops use on instances
+    ObjString *iterString;
+    ObjString *hasNextString;
+    ObjString *nextString;
 } VM;
 
 typedef enum {
@@ -72,14 +123,20 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-typedef struct {
+typedef struct ObjModule {
     ObjInstance obj;
     ObjString *name;
     ObjString *path;
     InterpretResult result;
+    // Module level variables by the slot the compiler gave them. obj.fields
+    // keeps them by name for imports and is brought up to date lazily.
+    ValueArray globals;
+    ValueArray globalNames;
+    Table globalSlots;
+    bool globalsDirty;
 } ObjModule;
 
-extern VM vm;
+extern _Thread_local VM vm;
 
 void initVM();
 
@@ -105,6 +162,20 @@ void defineBuiltin(const char *name, Value value);
 
 void runtimeError(const char *format, ...);
 
+// Calls callee with args from inside a native and runs it to completion,
+// leaving its return value in result. False if it hit a runtime error.
+// The callee can't yield, there is no way back into the native afterwards.
+bool callFromNative(Value callee, int argCount, Value *args, Value *result);
+
+// True while a callee run by callFromNative() is on the stack, when the
+// task can't be parked
+bool insideNativeCall();
+
+ObjCallFrame *newCallFrame(CallState state);
+
+// Stack a frame of function needs, its locals and the values its code pushes
+int frameSize(ObjFunction *function);
+
 void load_new_frame();
 
 #endif
\ No newline at end of file